@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <syscallnum.h>
+
+/*
+* Compares the libc allocator against the simple bump allocator it replaced, on the
+* same workloads. For each one we report how long it took (in CPU timestamp ticks),
+* and how far the system break moved.
+*
+* The bump allocator never frees, so it starts again from the start of its memory for
+* each workload, and the workloads are kept small enough that it never needs more than
+* a few megabytes. Otherwise it would run the system out of memory and swap. Both
+* allocators reuse their memory from earlier workloads, so the break only moves by how
+* much more a workload needs than the ones before it.
+*/
+
+#define RING_SIZE               256
+#define SMALL_ITERATIONS        20000
+#define MIXED_ITERATIONS        1000
+#define REALLOC_ROUNDS          4
+
+static uint64_t read_timestamp(void) {
+    uint32_t low;
+    uint32_t high;
+    asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t) high << 32) | low;
+}
+
+static size_t get_system_break(void) {
+    size_t prev_break;
+    size_t current_break;
+    _system_call(SYSCALL_SBRK, 0, 0, (size_t) &prev_break, (size_t) &current_break);
+    return current_break;
+}
+
+/*
+* The old libc allocator: a bump pointer over sbrk that never frees.
+*/
+static size_t bump_start = 0;
+static size_t recent_sbrk = 0;
+static size_t allocation_position = 0;
+
+static void* bump_malloc(size_t size) {
+    size = size + (16 - (size % 16)) % 16;
+
+    if (allocation_position == 0 || allocation_position + size >= recent_sbrk) {
+        size_t prev_sbrk, current_sbrk;
+        int result = _system_call(SYSCALL_SBRK, (size_t) size * 2, 0, (size_t) &prev_sbrk, (size_t) &current_sbrk);
+        if (result != 0) {
+            return NULL;
+        }
+
+        /*
+        * If nothing else moved the break since last time, the new memory carries on
+        * from the old. Otherwise (e.g. the libc allocator moved it), the rest of the
+        * old memory gets thrown away and we start again from the new.
+        */
+        if (bump_start == 0 || prev_sbrk != recent_sbrk) {
+            bump_start = prev_sbrk;
+            allocation_position = prev_sbrk;
+        }
+        recent_sbrk = current_sbrk;
+    }
+
+    size_t result = allocation_position;
+    allocation_position += size;
+
+    return (void*) result;
+}
+
+static void bump_free(void* ptr) {
+    (void) ptr;
+}
+
+/*
+* Throws away everything that has been allocated, so the memory can be used again.
+*/
+static void bump_reset(void) {
+    allocation_position = bump_start;
+}
+
+static void* bump_realloc(void* ptr, size_t old_size, size_t new_size) {
+    void* new_ptr = bump_malloc(new_size);
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    bump_free(ptr);
+    return new_ptr;
+}
+
+static void* libc_realloc(void* ptr, size_t old_size, size_t new_size) {
+    (void) old_size;
+    return realloc(ptr, new_size);
+}
+
+struct allocator {
+    const char* name;
+    void* (*allocate)(size_t);
+    void (*release)(void*);
+    void* (*reallocate)(void*, size_t, size_t);
+    void (*reset)(void);                /* Called before each workload, if it isn't NULL */
+};
+
+static struct allocator allocators[] = {
+    {.name = "libc", .allocate = malloc, .release = free, .reallocate = libc_realloc},
+    {.name = "bump", .allocate = bump_malloc, .release = bump_free, .reallocate = bump_realloc, .reset = bump_reset},
+};
+
+static unsigned int next_random = 1;
+
+static unsigned int get_random(void) {
+    next_random = next_random * 1103515245 + 12345;
+    return (next_random >> 8) & 0xFFFFFF;
+}
+
+/*
+* Keeps a ring of live allocations, replacing a random one each iteration.
+*/
+static void run_ring(struct allocator* alloc, int iterations, size_t min_size, size_t max_size) {
+    static void* ring[RING_SIZE];
+    memset(ring, 0, sizeof(ring));
+    next_random = 1;
+
+    for (int i = 0; i < iterations; ++i) {
+        int slot = get_random() % RING_SIZE;
+        if (ring[slot] != NULL) {
+            alloc->release(ring[slot]);
+        }
+
+        size_t size = min_size + get_random() % (max_size - min_size + 1);
+        ring[slot] = alloc->allocate(size);
+        if (ring[slot] == NULL) {
+            printf("    out of memory!\n");
+            return;
+        }
+        memset(ring[slot], i, size);
+    }
+
+    for (int i = 0; i < RING_SIZE; ++i) {
+        if (ring[i] != NULL) {
+            alloc->release(ring[i]);
+        }
+    }
+}
+
+static void run_small(struct allocator* alloc) {
+    run_ring(alloc, SMALL_ITERATIONS, 1, 256);
+}
+
+static void run_mixed(struct allocator* alloc) {
+    run_ring(alloc, MIXED_ITERATIONS, 16, 8192);
+}
+
+/*
+* Grows buffers by a bit at a time, like building a string or an array.
+*/
+static void run_realloc(struct allocator* alloc) {
+    for (int i = 0; i < REALLOC_ROUNDS; ++i) {
+        size_t size = 16;
+        char* buffer = alloc->allocate(size);
+
+        while (size < 256 * 1024) {
+            size_t new_size = size + size / 4;
+            buffer = alloc->reallocate(buffer, size, new_size);
+            if (buffer == NULL) {
+                printf("    out of memory!\n");
+                return;
+            }
+            buffer[new_size - 1] = 0;
+            size = new_size;
+        }
+
+        alloc->release(buffer);
+    }
+}
+
+struct workload {
+    const char* name;
+    void (*run)(struct allocator*);
+};
+
+static struct workload workloads[] = {
+    {.name = "small churn (1-256 bytes)", .run = run_small},
+    {.name = "mixed churn (16-8192 bytes)", .run = run_mixed},
+    {.name = "realloc growth", .run = run_realloc},
+};
+
+int main(int argc, char** argv) {
+    (void) argc;
+    (void) argv;
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i) {
+        printf("%s:\n", workloads[i].name);
+
+        for (size_t j = 0; j < sizeof(allocators) / sizeof(allocators[0]); ++j) {
+            if (allocators[j].reset != NULL) {
+                allocators[j].reset();
+            }
+
+            size_t break_before = get_system_break();
+            uint64_t start = read_timestamp();
+
+            workloads[i].run(&allocators[j]);
+
+            uint64_t ticks = read_timestamp() - start;
+            size_t break_growth = get_system_break() - break_before;
+
+            printf("    %s: %llu ticks, heap grew by %u KB\n", allocators[j].name, (unsigned long long) ticks, break_growth / 1024);
+        }
+    }
+
+    return 0;
+}
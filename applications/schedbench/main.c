@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/schedstat.h>
+
+/*
+* Measures how the scheduler treats this program. First it sleeps for a millisecond many
+* times over, and shows how long it took to get back onto the CPU after each wakeup, both
+* as a normal thread and as a real-time (SCHED_FIFO) one. Then it spins for a while and
+* shows what share of the CPU it got while it was ready to run. Run it while other things
+* are busy to see how they affect it.
+*/
+
+#define NUM_SLEEPS          200
+#define SLEEP_NS            1000000
+#define SPIN_NS             2000000000ULL
+#define RT_PRIORITY         50
+
+static int test_wakeup_latency(void) {
+    struct schedstat before;
+    struct schedstat after;
+    struct timespec req = {.tv_sec = 0, .tv_nsec = SLEEP_NS};
+    uint64_t max_latency = 0;
+
+    schedstat(&before);
+    after = before;
+    for (int i = 0; i < NUM_SLEEPS; ++i) {
+        uint64_t previous_latency = after.wakeup_latency_ns;
+
+        if (nanosleep(&req, NULL) != 0) {
+            printf("schedbench: nanosleep failed\n");
+            return 1;
+        }
+
+        schedstat(&after);
+        if (after.wakeup_latency_ns - previous_latency > max_latency) {
+            max_latency = after.wakeup_latency_ns - previous_latency;
+        }
+    }
+
+    uint64_t wakeups = after.wakeups - before.wakeups;
+    if (wakeups == 0) {
+        printf("schedbench: no wakeups were recorded\n");
+        return 1;
+    }
+
+    printf("wakeups:           %llu\n", (unsigned long long) wakeups);
+    printf("average latency:   %llu us\n", (unsigned long long) ((after.wakeup_latency_ns - before.wakeup_latency_ns) / wakeups / 1000));
+    printf("max latency:       %llu us\n", (unsigned long long) (max_latency / 1000));
+    return 0;
+}
+
+static void test_cpu_share(void) {
+    struct schedstat before;
+    struct schedstat now;
+
+    schedstat(&before);
+    do {
+        for (volatile int i = 0; i < 100000; ++i) {
+            ;
+        }
+        schedstat(&now);
+    } while (now.runtime_ns - before.runtime_ns < SPIN_NS);
+
+    uint64_t runtime = now.runtime_ns - before.runtime_ns;
+    uint64_t waited = now.wait_ns - before.wait_ns;
+
+    printf("ran for:           %llu ms\n", (unsigned long long) (runtime / 1000000));
+    printf("waited for:        %llu ms\n", (unsigned long long) (waited / 1000000));
+    printf("cpu share:         %llu%%\n", (unsigned long long) (runtime * 100 / (runtime + waited)));
+    printf("switches:          %llu\n", (unsigned long long) (now.switches - before.switches));
+    printf("migrations:        %llu\n", (unsigned long long) (now.migrations - before.migrations));
+    printf("virtual runtime:   %llu ms\n", (unsigned long long) ((now.vruntime_ns - before.vruntime_ns) / 1000000));
+}
+
+int main(int argc, char** argv) {
+    (void) argc;
+    (void) argv;
+
+    struct schedstat stat;
+    if (schedstat(&stat) != 0) {
+        printf("schedbench: can't get scheduler statistics\n");
+        return 1;
+    }
+
+    printf("normal thread\n");
+    if (test_wakeup_latency() != 0) {
+        return 1;
+    }
+
+    struct sched_param param = {.sched_priority = RT_PRIORITY};
+    if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+        printf("schedbench: can't become a real-time thread\n");
+        return 1;
+    }
+
+    printf("\nreal-time thread\n");
+    if (test_wakeup_latency() != 0) {
+        return 1;
+    }
+
+    param.sched_priority = 0;
+    sched_setscheduler(0, SCHED_OTHER, &param);
+
+    printf("\n");
+    test_cpu_share();
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <syscallnum.h>
+#include <sys/faultstat.h>
+
+/*
+* Shows how many page faults, swaps and TLB flushes are happening across the whole system.
+* Each line covers one interval, and also shows the average time each type of fault took
+* to handle. There is no way to sleep yet, so intervals are measured in CPU timestamp
+* ticks (roughly a second on a 1GHz machine).
+*/
+
+#define NUM_INTERVALS       10
+#define INTERVAL_TICKS      1000000000ULL
+
+static uint64_t read_timestamp(void) {
+    uint32_t low;
+    uint32_t high;
+    asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t) high << 32) | low;
+}
+
+static void wait_for_interval(void) {
+    uint64_t start = read_timestamp();
+    while (read_timestamp() - start < INTERVAL_TICKS) {
+        _system_call(SYSCALL_YIELD, 0, 0, 0, 0);
+    }
+}
+
+/*
+* The average number of ticks a type of fault took during the interval, or 0 if there were none.
+*/
+static unsigned long long average_ticks(struct faultstat* before, struct faultstat* after, int type) {
+    uint64_t faults = after->faults[type] - before->faults[type];
+    if (faults == 0) {
+        return 0;
+    }
+    return (after->cycles[type] - before->cycles[type]) / faults;
+}
+
+int main(int argc, char** argv) {
+    (void) argc;
+    (void) argv;
+
+    struct faultstat before;
+    if (faultstat(&before, FAULTSTAT_SYSTEM) != 0) {
+        printf("vmstat: can't get page fault statistics\n");
+        return 1;
+    }
+
+    printf("  alloc  (ticks)    cow  (ticks)   swap  (ticks)  other   in  out  tlb flushes\n");
+
+    for (int i = 0; i < NUM_INTERVALS; ++i) {
+        wait_for_interval();
+
+        struct faultstat after;
+        faultstat(&after, FAULTSTAT_SYSTEM);
+
+        printf("%7llu %8llu %6llu %8llu %6llu %8llu %6llu %4llu %4llu %12llu\n",
+            (unsigned long long) (after.faults[FAULT_ALLOCATE_ON_ACCESS] - before.faults[FAULT_ALLOCATE_ON_ACCESS]),
+            average_ticks(&before, &after, FAULT_ALLOCATE_ON_ACCESS),
+            (unsigned long long) (after.faults[FAULT_COPY_ON_WRITE] - before.faults[FAULT_COPY_ON_WRITE]),
+            average_ticks(&before, &after, FAULT_COPY_ON_WRITE),
+            (unsigned long long) (after.faults[FAULT_SWAP_IN] - before.faults[FAULT_SWAP_IN]),
+            average_ticks(&before, &after, FAULT_SWAP_IN),
+            (unsigned long long) (after.faults[FAULT_OTHER] - before.faults[FAULT_OTHER]),
+            (unsigned long long) (after.swap_ins - before.swap_ins),
+            (unsigned long long) (after.swap_outs - before.swap_outs),
+            (unsigned long long) (after.tlb_flushes - before.tlb_flushes)
+        );
+
+        before = after;
+    }
+
+    return 0;
+}
@@ -233,7 +233,7 @@ void* AcpiOsMapMemory(ACPI_PHYSICAL_ADDRESS PhysicalAddress, ACPI_SIZE Length)
     size_t pages = virt_bytes_to_pages(Length);
 
     for (size_t i = 0; i < pages; ++i) {
-        vas_map(vas_get_current_vas(), (PhysicalAddress & ~0xFFF) + i * 4096, virt + i * 4096, VAS_FLAG_LOCKED);
+        vas_map(vas_get_current_vas(), (PhysicalAddress & ~0xFFF) + i * 4096, virt + i * 4096, VAS_FLAG_WRITABLE | VAS_FLAG_LOCKED);
     }
 
     vas_flush_tlb();
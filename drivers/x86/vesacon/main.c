@@ -331,7 +331,7 @@ void _driver_entry_point(void) {
     data->framebuffer_virtual = (uint8_t*) virt_allocate_unbacked_krnl_region(pages_needed * ARCH_PAGE_SIZE);
 
     for (size_t i = 0; i < pages_needed; ++i) {
-        vas_map(vas_get_current_vas(), data->framebuffer_physical + i * ARCH_PAGE_SIZE, (size_t) data->framebuffer_virtual + i * ARCH_PAGE_SIZE, VAS_FLAG_PRESENT | VAS_FLAG_LOCKED);
+        vas_map(vas_get_current_vas(), data->framebuffer_physical + i * ARCH_PAGE_SIZE, (size_t) data->framebuffer_virtual + i * ARCH_PAGE_SIZE, VAS_FLAG_PRESENT | VAS_FLAG_WRITABLE | VAS_FLAG_LOCKED);
     }
 
     dev.data = data;
@@ -6,6 +6,7 @@
 #include <virtual.h>
 #include <heap.h>
 #include <assert.h>
+#include <string.h>
 #include <spinlock.h>
 #include <loader.h>
 #include <machine/beeper.h>
@@ -19,6 +20,7 @@
 #include <machine/interrupt.h>
 #include <machine/pic.h>
 #include <machine/pit.h>
+#include <machine/lapic.h>
 #include <machine/floppy.h>
 #include <machine/ide.h>
 #include <machine/ps2keyboard.h>
@@ -32,6 +34,17 @@
 
 size_t x86_allow_interrupts = 0;
 
+/*
+* Set once the bootstrap CPU can use current_cpu (see machine/percpu.h). Other CPUs
+* load their GDT before they do anything that uses it.
+*/
+size_t x86_per_cpu_ready = 0;
+
+/*
+* Defined in x86/thread/spinlock.s
+*/
+extern size_t x86_boot_spinlocks_held;
+
 /*
 * Finds the devices on the system and adds them to the VFS.
 * The _no_fs function runs first, and doesn't have access to the filesystem
@@ -67,19 +80,27 @@ void arch_initialise_devices_with_fs(void) {
 *
 * Also initialise the current_cpu structure for this CPU.
 */
-void arch_cpu_initialise_bootstrap(void)
+void arch_cpu_initialise_bootstrap(struct cpu* cpu)
 {
+	struct x86_cpu_specific_data* data = malloc(sizeof(struct x86_cpu_specific_data));
+	memset(data, 0, sizeof(struct x86_cpu_specific_data));
+	cpu->platform_specific_data = data;
+
 	/*
-	* Also sets up the current_cpu structure.
+	* Once the GDT is loaded, current_cpu works, and so spinlocks can be counted
+	* per-CPU. Interrupts are still off, so nothing can take a spinlock halfway
+	* through switching over.
 	*/
-	x86_per_cpu_virt_initialise();
+	x86_gdt_initialise(cpu);
+	data->spinlocks_held = x86_boot_spinlocks_held;
+	x86_per_cpu_ready = 1;
 
-	struct x86_cpu_specific_data* data = malloc(sizeof(struct x86_cpu_specific_data));
+	/*
+	* Also sets up the current_vas.
+	*/
+	x86_per_cpu_virt_initialise(cpu);
+	vas_load(current_cpu->current_vas);
 
-	current_cpu->platform_specific_data = data;
-	current_cpu->current_thread = NULL;
-	
-	x86_gdt_initialise();
 	x86_idt_initialise();
 	x86_tss_initialise();
 
@@ -88,11 +109,52 @@ void arch_cpu_initialise_bootstrap(void)
 	pit_initialise(500);
 }
 
-void arch_all_cpus_are_done(void) {
+/*
+* The bootstrap CPU uses the PIT, which also keeps the time, and the others use their
+* local APIC timer.
+*/
+void arch_set_next_timer(uint64_t ns) {
+	if (current_cpu->cpu_number == 0) {
+		pit_set_next_timer(ns);
+	} else {
+		lapic_set_next_timer(ns);
+	}
+}
+
+uint64_t arch_get_time_since_timer(void) {
+	return pit_get_time_since_interrupt();
+}
+
+/*
+* The timestamp counter only exists if the CPUID feature bit for it is set. There's also
+* a bit for whether it counts at a steady rate, but virtual machines often don't set it,
+* so that is left to the checks against the timer.
+*/
+bool arch_timestamp_is_usable(void) {
+	uint32_t eax = 1, ebx, ecx, edx;
+	asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+	(void) ebx;
+	(void) ecx;
+	return edx & (1 << 4);
+}
+
+/*
+* Defined in x86/lowlevel/vdso.s
+*/
+extern uint8_t x86_vdso_start;
+extern uint8_t x86_vdso_end;
+
+const void* arch_get_vdso_code(size_t* size) {
+	*size = &x86_vdso_end - &x86_vdso_start;
+	return &x86_vdso_start;
+}
+
+void arch_bootstrap_cpu_is_done(void) {
 	/*
 	* Enable interrupts, and allow spinlocks to enable them too.
-	* This flag is global, so it is shared by all CPUs. Therefore,
-	* it can only be set once all CPUs are initialised.
+	* This flag is global, so it is shared by all CPUs. The other CPUs
+	* get started later on, and they load their IDT before taking any
+	* spinlocks, so they can have interrupts enabled this way too.
 	*/ 
 	x86_allow_interrupts = 1;
 	arch_enable_interrupts();
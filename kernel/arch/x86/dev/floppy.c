@@ -16,6 +16,8 @@
 #include <kprintf.h>
 #include <synch.h>
 #include <virtual.h>
+#include <physical.h>
+#include <callout.h>
 
 /*
 * x86/dev/floppy.c - Floppy Disk Driver
@@ -29,10 +31,21 @@
 */
 
 uint8_t* cylinder_buffer;
+size_t cylinder_buffer_phys;
 uint8_t* cylinder_zero;
 int stored_cylinder = -1;
 bool got_cylinder_zero = false;
 
+/*
+* The DMA controller can only reach the first 16MB of memory, and a transfer can't cross a
+* 64KB boundary. Aligning the buffer to 32KB keeps it (one cylinder, 0x4800 bytes) inside
+* one 64KB block.
+*/
+#define DMA_BUFFER_SIZE         0x4800
+#define DMA_BUFFER_PAGES        ((DMA_BUFFER_SIZE + ARCH_PAGE_SIZE - 1) / ARCH_PAGE_SIZE)
+#define DMA_BUFFER_ALIGNMENT    0x8000
+#define DMA_MAX_ADDRESS         0x1000000
+
 #define FLOPPY_DOR      2
 #define FLOPPY_MSR      4
 #define FLOPPY_FIFO     5
@@ -95,10 +108,13 @@ static void floppy_check_interrupt(int base, int* st0, int* cyl) {
 * don't need to keep turning it on and off for every command.
 *
 * The state can be 0 (off), 1 (on) or 2 (currently on, but will shortly be turned off).
+* The callout turns it off.
 */
 
+#define FLOPPY_MOTOR_OFF_DELAY_NS   1000000000ULL
+
 static volatile int floppy_motor_state = 0;
-static volatile int floppy_motor_ticks = 0;
+static struct callout floppy_motor_callout;
 
 /*
 * Start or stop using the floppy motor. The motor will stay on for a few moments after
@@ -110,6 +126,7 @@ static void floppy_motor(int base, bool state) {
         * Turn on the motor if it isn't already on, and put it into the on
         * state.
         */
+        callout_cancel(&floppy_motor_callout);
         if (!floppy_motor_state) {
             outb(base + FLOPPY_DOR, 0x1C);
             thread_nano_sleep(150000000);
@@ -121,7 +138,7 @@ static void floppy_motor(int base, bool state) {
         * Put it into the 'waiting to be turned off' state
         */
         floppy_motor_state = 2;
-        floppy_motor_ticks = 1000;
+        callout_schedule(&floppy_motor_callout, get_time_since_boot() + FLOPPY_MOTOR_OFF_DELAY_NS);
     }
 }
 
@@ -149,26 +166,15 @@ static int floppy_irq_handler(struct x86_regs* r) {
     return 0;
 }
 
-static void floppy_timer(void* arg) {
+/*
+* Called a while after the motor was last used, to actually turn it off.
+*/
+static void floppy_motor_off(void* arg) {
     (void) arg;
 
-    /*
-    * This runs in its own thread, and will turn off the floppy
-    * after it hasn't been used for 300ms.
-    */
-
-    while (1) {
-        thread_nano_sleep(50000000);
-        if (floppy_motor_state == 2) {
-            floppy_motor_ticks -= 50;
-            if (floppy_motor_ticks <= 0) {
-                /*
-                * Actually turn off the motor.
-                */
-                outb(0x3F0 + FLOPPY_DOR, 0x0C);
-                floppy_motor_state = 0;
-            }
-        }
+    if (floppy_motor_state == 2) {
+        outb(0x3F0 + FLOPPY_DOR, 0x0C);
+        floppy_motor_state = 0;
     }
 }
 
@@ -286,12 +292,9 @@ static int floppy_seek(int base, int cylinder, int head) {
 */
 static void floppy_dma_init(void) {
     /*
-    * Put the data at *physical address* 0x10000. The address can be anywhere 
-    * under 24MB that doesn't cross a 64KB boundary. We choose this location as 
-    * it should be unused as this is where the temporary copy of the kernel was
-    * stored during boot.
+    * Put the data in the cylinder buffer (see floppy_initialise).
     */
-    uint32_t addr = (uint32_t) 0x10000;
+    uint32_t addr = (uint32_t) cylinder_buffer_phys;
 
     /*
     * We must give the DMA the actual count minus 1.
@@ -510,6 +513,15 @@ next_sector:;
 void floppy_initialise(void) {
     static struct std_device_interface dev;
 
+    /*
+    * The cylinder buffer is what the DMA controller reads into, so it must be physically
+    * contiguous, and somewhere it can reach.
+    */
+    if (phys_allocate_contiguous(DMA_BUFFER_PAGES, DMA_BUFFER_ALIGNMENT, DMA_MAX_ADDRESS, &cylinder_buffer_phys) != 0) {
+        kprintf("floppy: couldn't allocate a DMA buffer\n");
+        return;
+    }
+
     cylinder_zero = malloc(0x4800);
 
     dev.data = NULL;
@@ -524,11 +536,11 @@ void floppy_initialise(void) {
 
     x86_register_interrupt_handler(PIC_IRQ_BASE + 6, floppy_irq_handler);
 
-    cylinder_buffer = (uint8_t*) virt_allocate_unbacked_krnl_region(0x4800);
-    for (int i = 0; i < 5; ++i) {
-        vas_map(current_cpu->current_vas, 0x10000 + i * 4096, (size_t) cylinder_buffer + i * 4096, VAS_FLAG_LOCKED | VAS_FLAG_WRITABLE);
+    cylinder_buffer = (uint8_t*) virt_allocate_unbacked_krnl_region(DMA_BUFFER_SIZE);
+    for (int i = 0; i < DMA_BUFFER_PAGES; ++i) {
+        vas_map(current_cpu->current_vas, cylinder_buffer_phys + i * ARCH_PAGE_SIZE, (size_t) cylinder_buffer + i * ARCH_PAGE_SIZE, VAS_FLAG_LOCKED | VAS_FLAG_WRITABLE);
     }
     
-    thread_create(floppy_timer, NULL, current_cpu->current_vas);
+    callout_init(&floppy_motor_callout, floppy_motor_off, NULL);
     floppy_reset(0x3F0);
 }
\ No newline at end of file
@@ -0,0 +1,216 @@
+#include <common.h>
+#include <virtual.h>
+#include <thread.h>
+#include <assert.h>
+#include <kprintf.h>
+#include <machine/config.h>
+#include <machine/lapic.h>
+#include <machine/interrupt.h>
+
+/*
+* x86/dev/lapic.c - Local APIC
+*
+* Each CPU has its own local APIC, which is used to send interrupts to other
+* CPUs (inter-processor interrupts, or IPIs), and has its own timer. The PIC
+* is still used for IRQs, and is connected to the bootstrap CPU's local APIC.
+*/
+
+#define LAPIC_REG_ID                0x20
+#define LAPIC_REG_TPR               0x80
+#define LAPIC_REG_EOI               0xB0
+#define LAPIC_REG_SVR               0xF0
+#define LAPIC_REG_ICR_LOW           0x300
+#define LAPIC_REG_ICR_HIGH          0x310
+#define LAPIC_REG_LVT_TIMER         0x320
+#define LAPIC_REG_LVT_LINT0         0x350
+#define LAPIC_REG_LVT_LINT1         0x360
+#define LAPIC_REG_LVT_ERROR         0x370
+#define LAPIC_REG_TIMER_INITIAL     0x380
+#define LAPIC_REG_TIMER_CURRENT     0x390
+#define LAPIC_REG_TIMER_DIVIDE      0x3E0
+
+#define LAPIC_SVR_ENABLE            0x100
+#define LAPIC_LVT_MASKED            0x10000
+#define LAPIC_LVT_EXTINT            0x700
+#define LAPIC_LVT_NMI               0x400
+#define LAPIC_TIMER_PERIODIC        0x20000
+#define LAPIC_TIMER_DIVIDE_BY_16    0x3
+
+#define LAPIC_ICR_INIT              0x500
+#define LAPIC_ICR_STARTUP           0x600
+#define LAPIC_ICR_ASSERT            0x4000
+#define LAPIC_ICR_PENDING           0x1000
+
+/*
+* How long the timer is measured for against the system timer.
+*/
+#define LAPIC_CALIBRATION_NS        50000000
+
+/*
+* All of the local APICs are at the same physical address (each CPU sees its own).
+*/
+static volatile uint32_t* lapic_registers = NULL;
+
+/*
+* How many times the timer counts down per millisecond. The timer isn't used by the
+* bootstrap CPU (it has the PIT), but it gets measured on it.
+*/
+static uint32_t lapic_ticks_per_ms = 0;
+
+/*
+* The count for regular ticks, which every CPU's timer goes back to after it has been
+* asked to go off once (see lapic_set_next_timer).
+*/
+static uint32_t lapic_timer_period = 0;
+
+/*
+* It won't be asked to go off any sooner than this, so that it doesn't keep interrupting.
+*/
+#define LAPIC_MIN_COUNT             32
+
+static uint32_t lapic_read(int reg) {
+    return lapic_registers[reg / 4];
+}
+
+static void lapic_write(int reg, uint32_t value) {
+    lapic_registers[reg / 4] = value;
+}
+
+static void lapic_start_periodic_timer(void) {
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_BY_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, lapic_timer_period);
+}
+
+static int lapic_timer_handler(struct x86_regs* r) {
+    (void) r;
+
+    if (!(lapic_read(LAPIC_REG_LVT_TIMER) & LAPIC_TIMER_PERIODIC)) {
+        lapic_start_periodic_timer();
+    }
+
+    thread_received_timer_interrupt();
+    return 0;
+}
+
+/*
+* Maps the local APIC's registers into memory. Must be done before anything else here.
+*/
+void lapic_map(size_t phys_addr) {
+    assert(phys_addr % ARCH_PAGE_SIZE == 0);
+
+    size_t virt = virt_allocate_unbacked_krnl_region(ARCH_PAGE_SIZE);
+    vas_map(vas_get_current_vas(), phys_addr, virt, VAS_FLAG_PRESENT | VAS_FLAG_WRITABLE | VAS_FLAG_LOCKED);
+    lapic_registers = (volatile uint32_t*) virt;
+
+    x86_register_interrupt_handler(LAPIC_TIMER_VECTOR, lapic_timer_handler);
+}
+
+/*
+* Enables the current CPU's local APIC. IRQs from the PIC come in through LINT0 on the
+* bootstrap CPU (as they did before the local APIC was enabled), and are masked on the
+* others.
+*/
+void lapic_initialise(bool bootstrap) {
+    assert(lapic_registers != NULL);
+
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_LVT_LINT0, bootstrap ? LAPIC_LVT_EXTINT : LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_LVT_LINT1, LAPIC_LVT_NMI);
+    lapic_write(LAPIC_REG_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_eoi();
+}
+
+int lapic_get_id(void) {
+    return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+static void lapic_send_command(int lapic_id, uint32_t command) {
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING) {
+        ;
+    }
+
+    lapic_write(LAPIC_REG_ICR_HIGH, (uint32_t) lapic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, command);
+}
+
+/*
+* Sends an interrupt to another CPU.
+*/
+void lapic_send_ipi(int lapic_id, int vector) {
+    lapic_send_command(lapic_id, LAPIC_ICR_ASSERT | vector);
+}
+
+/*
+* Resets another CPU, so that it waits for lapic_send_startup.
+*/
+void lapic_send_init(int lapic_id) {
+    lapic_send_command(lapic_id, LAPIC_ICR_ASSERT | LAPIC_ICR_INIT);
+}
+
+/*
+* Starts another CPU in real mode at the given address, which must be page aligned and
+* below 1MB.
+*/
+void lapic_send_startup(int lapic_id, size_t phys_addr) {
+    assert(phys_addr % ARCH_PAGE_SIZE == 0 && phys_addr < 0x100000);
+    lapic_send_command(lapic_id, LAPIC_ICR_ASSERT | LAPIC_ICR_STARTUP | (phys_addr / ARCH_PAGE_SIZE));
+}
+
+/*
+* Measures how fast the timer goes against the system timer. Interrupts must be on, so
+* the time since boot keeps going up.
+*/
+void lapic_calibrate_timer(void) {
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_BY_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+
+    uint64_t start = get_time_since_boot();
+    lapic_write(LAPIC_REG_TIMER_INITIAL, 0xFFFFFFFF);
+
+    while (get_time_since_boot() - start < LAPIC_CALIBRATION_NS) {
+        ;
+    }
+
+    uint32_t ticks = 0xFFFFFFFF - lapic_read(LAPIC_REG_TIMER_CURRENT);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, 0);
+
+    lapic_ticks_per_ms = ticks / (LAPIC_CALIBRATION_NS / 1000000);
+    kprintf("lapic: timer runs at %d ticks per ms\n", lapic_ticks_per_ms);
+}
+
+/*
+* Starts the current CPU's timer, which calls thread_received_timer_interrupt.
+*/
+void lapic_start_timer(int hertz) {
+    assert(lapic_ticks_per_ms != 0);
+
+    lapic_timer_period = (uint64_t) lapic_ticks_per_ms * 1000 / hertz;
+    lapic_start_periodic_timer();
+}
+
+/*
+* Makes the current CPU's next timer interrupt come after the given number of nanoseconds,
+* instead of on the next tick (or when it was last asked to). It goes back to ticking
+* after that. Interrupts must be off.
+*/
+void lapic_set_next_timer(uint64_t ns) {
+    if (lapic_timer_period == 0) {
+        return;
+    }
+
+    uint64_t max_ns = 0xFFFFFFFFULL * 1000000 / lapic_ticks_per_ms;
+    uint32_t count = ns >= max_ns ? 0xFFFFFFFF : ns * lapic_ticks_per_ms / 1000000;
+    if (count < LAPIC_MIN_COUNT) {
+        count = LAPIC_MIN_COUNT;
+    }
+
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, count);
+}
@@ -25,6 +25,7 @@
 #define PIC2_DATA       0xA1
 
 #define PIC_EOI         0x20
+#define PIC_REG_IRR     0x0A
 #define PIC_REG_ISR     0x0B
 
 #define ICW1_ICW4       0x01
@@ -79,6 +80,14 @@ bool pic_is_spurious(int num) {
     return false;
 }
 
+/*
+* Returns whether an IRQ (numbered from 0) has been raised, but hasn't been sent to the
+* CPU yet (e.g. as interrupts are off).
+*/
+bool pic_is_pending(int irq) {
+    return pic_read_reg(PIC_REG_IRR) & (1 << irq);
+}
+
 /*
 * Acknowledge the previous interrupt. We will not receive any interrupts of
 * the same type until we have acknowledged it.
@@ -1,9 +1,9 @@
-
 #include <machine/pic.h>
 #include <machine/pit.h>
 #include <machine/portio.h>
 #include <machine/interrupt.h>
 #include <thread.h>
+#include <spinlock.h>
 #include <assert.h>
 #include <common.h>
 #include <kprintf.h>
@@ -11,28 +11,181 @@
 /*
 * x86/dev/pit.c - Programmable Interval Timer
 *
-* A system timer which can generate an interrupt (on IRQ 0) at regular intervals.
+* A system timer which can generate an interrupt (on IRQ 0) at regular intervals, or
+* once after a given amount of time. It is also what keeps the time on the bootstrap
+* CPU, as its count can be read to see how far it is through the current interval.
+*
+* It ticks regularly, until it is asked to go off once (see pit_set_next_timer). After
+* that it goes back to ticking, unless it gets asked again.
+*/
+
+#define PIT_FREQUENCY       1193182ULL
+
+#define PIT_CHANNEL_0       0x40
+#define PIT_COMMAND         0x43
+
+#define PIT_LATCH_COUNT     0x00
+#define PIT_READ_BACK_0     0xE2
+#define PIT_MODE_ONE_SHOT   0x30
+#define PIT_MODE_PERIODIC   0x34
+
+#define PIT_STATUS_OUTPUT   0x80
+
+/*
+* The count is 16 bits, so it can't wait for more than about 55ms at once. It won't be
+* asked to go off any sooner than the minimum, so that it doesn't keep interrupting.
+*/
+#define PIT_MAX_COUNT       0xFFFF
+#define PIT_MIN_COUNT       32
+
+/*
+* The count it was started with, and the count for regular ticks. The ticks passed are
+* from intervals that were cut short by changing the count, and haven't been passed on
+* to thread_received_timer_interrupt_bsp yet. The lock must be held while accessing.
+*/
+static struct spinlock pit_lock;
+static uint32_t pit_count = 0;
+static uint32_t pit_period = 0;
+static uint32_t pit_ticks_passed = 0;
+static bool pit_one_shot = false;
+
+/*
+* The part of a nanosecond left over when converting ticks, so that it doesn't get lost
+* and make the time drift.
+*/
+static uint64_t pit_remainder = 0;
+
+static void pit_start(int mode, uint32_t count) {
+    outb(PIT_COMMAND, mode);
+    outb(PIT_CHANNEL_0, count & 0xFF);
+    outb(PIT_CHANNEL_0, count >> 8);
+
+    pit_count = count;
+    pit_one_shot = mode == PIT_MODE_ONE_SHOT;
+}
+
+static uint16_t pit_read_count(void) {
+    outb(PIT_COMMAND, PIT_LATCH_COUNT);
+    uint16_t low = inb(PIT_CHANNEL_0);
+    uint16_t high = inb(PIT_CHANNEL_0);
+    return (high << 8) | low;
+}
+
+/*
+* Once it has gone off in one-shot mode, the output stays high until it gets started
+* again.
+*/
+static bool pit_has_gone_off(void) {
+    outb(PIT_COMMAND, PIT_READ_BACK_0);
+    return inb(PIT_CHANNEL_0) & PIT_STATUS_OUTPUT;
+}
+
+/*
+* Returns how many ticks it has been since the current interval started. It doesn't go
+* past the end of the interval, as the ticks after that are counted when its interrupt
+* gets handled. The lock must be held.
 */
+static uint32_t pit_get_elapsed_ticks(void) {
+    uint16_t count = pit_read_count();
+    if (pit_one_shot && (count == 0 || count > pit_count)) {
+        return pit_count;
+    }
+    return pit_count - count;
+}
 
-uint64_t pit_hertz = 0;
+static uint64_t pit_ticks_to_ns(uint32_t ticks, uint64_t* remainder) {
+    uint64_t total = (uint64_t) ticks * 1000000000ULL + *remainder;
+    *remainder = total % PIT_FREQUENCY;
+    return total / PIT_FREQUENCY;
+}
 
 static int pit_handler(struct x86_regs* r) {
-    assert(pit_hertz != 0);
-	
-	(void) r;
+    (void) r;
+
+    spinlock_acquire(&pit_lock);
 
-	thread_received_timer_interrupt_bsp(1000000000ULL / pit_hertz);
-	thread_received_timer_interrupt();
+    /*
+    * If it got started again after it went off, but before the interrupt got handled,
+    * then the interrupt is for an interval that has already been counted.
+    */
+    if (pit_one_shot && !pit_has_gone_off()) {
+        spinlock_release(&pit_lock);
+        return 0;
+    }
+
+    uint32_t ticks = pit_ticks_passed + pit_count;
+    pit_ticks_passed = 0;
+
+    /*
+    * In one-shot mode, the count keeps going down (wrapping around) after it goes off,
+    * which tells us how long ago that was. A few ticks can still be lost while it gets
+    * started again.
+    */
+    if (pit_one_shot) {
+        ticks += (uint16_t) (0x10000 - pit_read_count());
+        pit_start(PIT_MODE_PERIODIC, pit_period);
+    }
+
+    uint64_t delta = pit_ticks_to_ns(ticks, &pit_remainder);
+    spinlock_release(&pit_lock);
+
+    thread_received_timer_interrupt_bsp(delta);
+    thread_received_timer_interrupt();
     return 0;
 }
 
-void pit_initialise(int hertz) { 
-	pit_hertz = (uint64_t) hertz;
+/*
+* Returns how many nanoseconds it has been since the PIT last called
+* thread_received_timer_interrupt_bsp. Interrupts must be off.
+*/
+uint64_t pit_get_time_since_interrupt(void) {
+    if (pit_period == 0) {
+        return 0;
+    }
+
+    spinlock_acquire(&pit_lock);
+    uint64_t remainder = pit_remainder;
+    uint64_t ns = pit_ticks_to_ns(pit_ticks_passed + pit_get_elapsed_ticks(), &remainder);
+    spinlock_release(&pit_lock);
+
+    return ns;
+}
+
+/*
+* Makes the next interrupt come after the given number of nanoseconds, instead of on the
+* next tick (or when it was last asked to). Interrupts must be off.
+*/
+void pit_set_next_timer(uint64_t ns) {
+    if (pit_period == 0) {
+        return;
+    }
+
+    uint64_t max_ns = PIT_MAX_COUNT * 1000000000ULL / PIT_FREQUENCY;
+    uint32_t count = ns >= max_ns ? PIT_MAX_COUNT : (ns * PIT_FREQUENCY + 999999999ULL) / 1000000000ULL;
+    if (count < PIT_MIN_COUNT) {
+        count = PIT_MIN_COUNT;
+    }
+
+    spinlock_acquire(&pit_lock);
+
+    /*
+    * The part of the current interval that has passed still needs to be counted. If a
+    * tick has gone off but hasn't been handled yet, it won't be (see pit_handler), so it
+    * gets counted here too.
+    */
+    pit_ticks_passed += pit_get_elapsed_ticks();
+    if (!pit_one_shot && pic_is_pending(0)) {
+        pit_ticks_passed += pit_period;
+    }
 
-	int divisor = 1193180 / hertz;
-	outb(0x43, 0x36);
-	outb(0x40, divisor & 0xFF);
-	outb(0x40, divisor >> 8);
+    pit_start(PIT_MODE_ONE_SHOT, count);
+    spinlock_release(&pit_lock);
+}
+
+void pit_initialise(int hertz) {
+    spinlock_init(&pit_lock, "pit lock");
+    pit_period = PIT_FREQUENCY / hertz;
+    pit_start(PIT_MODE_PERIODIC, pit_period);
 
     x86_register_interrupt_handler(PIC_IRQ_BASE + 0, pit_handler);
-}
\ No newline at end of file
+}
@@ -0,0 +1,120 @@
+#include <arch.h>
+#include <common.h>
+#include <machine/portio.h>
+
+/*
+* x86/dev/rtc.c - Real Time Clock
+*
+* The CMOS has a clock which keeps going while the computer is off. It is only read at
+* boot, to work out the wall clock time, as the other timers are used to keep the time
+* after that. It is assumed to be in UTC.
+*/
+
+#define CMOS_ADDRESS        0x70
+#define CMOS_DATA           0x71
+
+#define RTC_SECONDS         0x00
+#define RTC_MINUTES         0x02
+#define RTC_HOURS           0x04
+#define RTC_DAY             0x07
+#define RTC_MONTH           0x08
+#define RTC_YEAR            0x09
+#define RTC_STATUS_A        0x0A
+#define RTC_STATUS_B        0x0B
+
+#define RTC_UPDATING        0x80
+#define RTC_24_HOUR         0x02
+#define RTC_BINARY          0x04
+#define RTC_PM              0x80
+
+struct rtc_time {
+    int seconds;
+    int minutes;
+    int hours;
+    int day;
+    int month;
+    int year;
+};
+
+static int rtc_read(int reg) {
+    outb(CMOS_ADDRESS, reg);
+    return inb(CMOS_DATA);
+}
+
+static void rtc_read_time(struct rtc_time* time) {
+    while (rtc_read(RTC_STATUS_A) & RTC_UPDATING) {
+        ;
+    }
+
+    time->seconds = rtc_read(RTC_SECONDS);
+    time->minutes = rtc_read(RTC_MINUTES);
+    time->hours = rtc_read(RTC_HOURS);
+    time->day = rtc_read(RTC_DAY);
+    time->month = rtc_read(RTC_MONTH);
+    time->year = rtc_read(RTC_YEAR);
+}
+
+static int rtc_from_bcd(int value) {
+    return (value >> 4) * 10 + (value & 0xF);
+}
+
+/*
+* Returns the number of days from 1970 to a date.
+*/
+static int64_t rtc_days_since_epoch(int year, int month, int day) {
+    /*
+    * Count years from March, so that the leap day is at the end.
+    */
+    if (month <= 2) {
+        year -= 1;
+        month += 12;
+    }
+
+    int64_t days = 365 * (int64_t) year + year / 4 - year / 100 + year / 400;
+    days += (153 * (month - 3) + 2) / 5 + day - 1;
+    return days - 719468;
+}
+
+uint64_t arch_read_wall_clock(void) {
+    /*
+    * It might change halfway through being read, so keep reading it until we get the
+    * same thing twice.
+    */
+    struct rtc_time time;
+    struct rtc_time check;
+    rtc_read_time(&check);
+    do {
+        time = check;
+        rtc_read_time(&check);
+    } while (time.seconds != check.seconds || time.minutes != check.minutes || time.hours != check.hours ||
+            time.day != check.day || time.month != check.month || time.year != check.year);
+
+    int status = rtc_read(RTC_STATUS_B);
+    bool pm = time.hours & RTC_PM;
+    time.hours &= ~RTC_PM;
+
+    if (!(status & RTC_BINARY)) {
+        time.seconds = rtc_from_bcd(time.seconds);
+        time.minutes = rtc_from_bcd(time.minutes);
+        time.hours = rtc_from_bcd(time.hours);
+        time.day = rtc_from_bcd(time.day);
+        time.month = rtc_from_bcd(time.month);
+        time.year = rtc_from_bcd(time.year);
+    }
+
+    if (!(status & RTC_24_HOUR)) {
+        time.hours = time.hours % 12 + (pm ? 12 : 0);
+    }
+
+    /*
+    * The century register isn't always there, so guess it.
+    */
+    time.year += time.year < 70 ? 2000 : 1900;
+
+    if (time.month < 1 || time.month > 12 || time.day < 1) {
+        return 0;
+    }
+
+    int64_t days = rtc_days_since_epoch(time.year, time.month, time.day);
+    return days * 86400 + time.hours * 3600 + time.minutes * 60 + time.seconds;
+}
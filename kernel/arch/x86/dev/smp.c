@@ -0,0 +1,563 @@
+#include <common.h>
+#include <cpu.h>
+#include <arch.h>
+#include <heap.h>
+#include <string.h>
+#include <thread.h>
+#include <virtual.h>
+#include <physical.h>
+#include <spinlock.h>
+#include <assert.h>
+#include <kprintf.h>
+#include <machine/config.h>
+#include <machine/cpu.h>
+#include <machine/gdt.h>
+#include <machine/idt.h>
+#include <machine/tss.h>
+#include <machine/smp.h>
+#include <machine/lapic.h>
+#include <machine/interrupt.h>
+#include <machine/mem/virtual.h>
+
+/*
+* x86/dev/smp.c - Multiprocessor Support
+*
+* Finds the other CPUs on the system using the ACPI MADT (or the older MP tables if
+* there isn't one), and starts them. Other CPUs start off in real mode, so they go
+* through the code in x86/lowlevel/trampoline.s to get into the kernel.
+*
+* Also lets CPUs tell each other to reschedule, and to flush their TLBs (TLB
+* shootdowns).
+*/
+
+/*
+* Where the trampoline gets copied to. It must match x86/lowlevel/trampoline.s. Nothing
+* else uses the low 1MB of memory.
+*/
+#define X86_TRAMPOLINE_ADDRESS  0x8000
+
+/*
+* How long to wait for a CPU after resetting it, and then after starting it. If it doesn't
+* start the first time, it gets started again.
+*/
+#define INIT_DELAY_NS           10000000
+#define STARTUP_RETRY_NS        2000000
+#define STARTUP_TIMEOUT_NS      1000000000
+
+#define AP_STACK_PAGES          4
+
+/*
+* The other CPUs use their local APIC timer at the same rate as the PIT on the bootstrap CPU.
+*/
+#define AP_TIMER_HERTZ          500
+
+struct acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+
+} __attribute__((packed));
+
+struct acpi_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+
+} __attribute__((packed));
+
+struct acpi_madt {
+    struct acpi_header header;
+    uint32_t lapic_address;
+    uint32_t flags;
+
+} __attribute__((packed));
+
+#define MADT_TYPE_LAPIC         0
+#define MADT_LAPIC_ENABLED      1
+
+struct acpi_madt_lapic {
+    uint8_t type;
+    uint8_t length;
+    uint8_t processor_id;
+    uint8_t lapic_id;
+    uint32_t flags;
+
+} __attribute__((packed));
+
+struct mp_floating_pointer {
+    char signature[4];
+    uint32_t config_table;
+    uint8_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    uint8_t features[5];
+
+} __attribute__((packed));
+
+struct mp_config_table {
+    char signature[4];
+    uint16_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[8];
+    char product_id[12];
+    uint32_t oem_table;
+    uint16_t oem_table_size;
+    uint16_t entry_count;
+    uint32_t lapic_address;
+    uint16_t extended_length;
+    uint8_t extended_checksum;
+    uint8_t reserved;
+
+} __attribute__((packed));
+
+#define MP_TYPE_PROCESSOR       0
+#define MP_PROCESSOR_ENABLED    1
+#define MP_PROCESSOR_SIZE       20
+#define MP_OTHER_ENTRY_SIZE     8
+
+struct mp_processor {
+    uint8_t type;
+    uint8_t lapic_id;
+    uint8_t lapic_version;
+    uint8_t flags;
+    uint32_t signature;
+    uint32_t features;
+    uint32_t reserved[2];
+
+} __attribute__((packed));
+
+/*
+* Defined in x86/lowlevel/trampoline.s
+*/
+extern uint8_t x86_trampoline_start;
+extern uint8_t x86_trampoline_end;
+extern uint8_t x86_trampoline_cr3;
+extern uint8_t x86_trampoline_stack;
+extern uint8_t x86_trampoline_entry;
+
+/*
+* Defined in x86/lowlevel/misc.s
+*/
+extern void x86_flush_tlb(void);
+extern void x86_flush_tlb_entry(size_t virt_addr);
+
+/*
+* The local APIC IDs of every CPU (including the bootstrap one), and the next one to start.
+*/
+static int lapic_ids[ARCH_MAX_CPU_ALLOWED];
+static int num_cpus_found = 0;
+static int next_cpu_to_start = 0;
+static bool smp_initialised = false;
+
+/*
+* The CPU currently being started, and whether it has got far enough to be able to look
+* after itself.
+*/
+static struct cpu* volatile starting_cpu;
+static volatile bool starting_cpu_done;
+static size_t startup_page_directory;
+
+/*
+* The CPUs that can be sent TLB shootdowns. Only one shootdown can happen at a time, and
+* the lock must be held to use any of these.
+*/
+static struct spinlock shootdown_lock;
+static struct x86_cpu_specific_data* online_cpus[ARCH_MAX_CPU_ALLOWED];
+static volatile int num_online_cpus = 0;
+static volatile size_t shootdown_address;
+static volatile int shootdown_acknowledgements;
+
+/*
+* Used by x86/thread/spinlock.s, so that CPUs waiting on a spinlock still respond to
+* shootdowns.
+*/
+size_t x86_tlb_shootdowns_enabled = 0;
+
+static bool smp_checksum_is_valid(void* table, size_t length) {
+    uint8_t* bytes = (uint8_t*) table;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; ++i) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+/*
+* Maps in a table that the firmware left in memory. They might not be in the direct map,
+* as the memory they are in is usually marked as reserved. They are only read while
+* booting, so they never get unmapped.
+*/
+static void* smp_map_table(size_t phys_addr, size_t length) {
+    if (phys_addr + length <= 0x100000) {
+        return (void*) lowmem_physical_to_virtual(phys_addr);
+    }
+
+    size_t first_page = phys_addr & ~(ARCH_PAGE_SIZE - 1);
+    size_t num_pages = (phys_addr + length - first_page + ARCH_PAGE_SIZE - 1) / ARCH_PAGE_SIZE;
+    size_t virt = virt_allocate_unbacked_krnl_region(num_pages * ARCH_PAGE_SIZE);
+
+    for (size_t i = 0; i < num_pages; ++i) {
+        vas_map(vas_get_current_vas(), first_page + i * ARCH_PAGE_SIZE, virt + i * ARCH_PAGE_SIZE, VAS_FLAG_PRESENT | VAS_FLAG_LOCKED);
+    }
+
+    return (void*) (virt + phys_addr - first_page);
+}
+
+/*
+* Looks for a structure that starts on a 16 byte boundary in low memory.
+*/
+static void* smp_scan_for(const char* signature, size_t start, size_t length) {
+    for (size_t addr = start; addr < start + length; addr += 16) {
+        void* ptr = (void*) lowmem_physical_to_virtual(addr);
+        if (!memcmp(ptr, signature, strlen(signature))) {
+            return ptr;
+        }
+    }
+    return NULL;
+}
+
+/*
+* Firmware tables are either in the first 1KB of the extended BIOS data area, or in the
+* BIOS area from 0xE0000 to 0xFFFFF.
+*/
+static void* smp_find_in_bios_areas(const char* signature) {
+    size_t ebda = ((size_t) *((uint16_t*) lowmem_physical_to_virtual(0x40E))) << 4;
+
+    void* result = NULL;
+    if (ebda != 0 && ebda < 0x100000) {
+        result = smp_scan_for(signature, ebda, 1024);
+    }
+    if (result == NULL) {
+        result = smp_scan_for(signature, 0xE0000, 0x20000);
+    }
+    return result;
+}
+
+static void smp_add_cpu(int lapic_id) {
+    if (num_cpus_found < ARCH_MAX_CPU_ALLOWED) {
+        lapic_ids[num_cpus_found++] = lapic_id;
+    }
+}
+
+/*
+* Finds the CPUs from the ACPI MADT (which has the signature "APIC"). Returns false if
+* there isn't one.
+*/
+static bool smp_find_cpus_from_madt(size_t* lapic_address) {
+    struct acpi_rsdp* rsdp = smp_find_in_bios_areas("RSD PTR ");
+    if (rsdp == NULL || !smp_checksum_is_valid(rsdp, sizeof(struct acpi_rsdp))) {
+        return false;
+    }
+
+    struct acpi_header* rsdt = smp_map_table(rsdp->rsdt_address, sizeof(struct acpi_header));
+    rsdt = smp_map_table(rsdp->rsdt_address, rsdt->length);
+    if (memcmp(rsdt->signature, "RSDT", 4) || !smp_checksum_is_valid(rsdt, rsdt->length)) {
+        return false;
+    }
+
+    size_t num_tables = (rsdt->length - sizeof(struct acpi_header)) / sizeof(uint32_t);
+    uint8_t* table_addresses = (uint8_t*) rsdt + sizeof(struct acpi_header);
+
+    for (size_t i = 0; i < num_tables; ++i) {
+        uint32_t table_address;
+        memcpy(&table_address, table_addresses + i * sizeof(uint32_t), sizeof(uint32_t));
+
+        struct acpi_header* header = smp_map_table(table_address, sizeof(struct acpi_header));
+        if (memcmp(header->signature, "APIC", 4)) {
+            continue;
+        }
+
+        struct acpi_madt* madt = smp_map_table(table_address, header->length);
+        if (!smp_checksum_is_valid(madt, madt->header.length)) {
+            return false;
+        }
+
+        *lapic_address = madt->lapic_address;
+
+        uint8_t* entry = (uint8_t*) madt + sizeof(struct acpi_madt);
+        uint8_t* end = (uint8_t*) madt + madt->header.length;
+
+        while (entry + 2 <= end && entry[1] >= 2) {
+            if (entry[0] == MADT_TYPE_LAPIC) {
+                struct acpi_madt_lapic lapic;
+                memcpy(&lapic, entry, sizeof(struct acpi_madt_lapic));
+                if (lapic.flags & MADT_LAPIC_ENABLED) {
+                    smp_add_cpu(lapic.lapic_id);
+                }
+            }
+            entry += entry[1];
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+/*
+* Finds the CPUs from the MP tables, which older systems have instead of ACPI. Returns
+* false if there aren't any (or if it is one of the default configurations, which only
+* have one or two CPUs).
+*/
+static bool smp_find_cpus_from_mp_table(size_t* lapic_address) {
+    struct mp_floating_pointer* pointer = smp_find_in_bios_areas("_MP_");
+    if (pointer == NULL || pointer->config_table == 0 || pointer->features[0] != 0) {
+        return false;
+    }
+
+    struct mp_config_table* table = smp_map_table(pointer->config_table, sizeof(struct mp_config_table));
+    table = smp_map_table(pointer->config_table, table->length);
+    if (memcmp(table->signature, "PCMP", 4) || !smp_checksum_is_valid(table, table->length)) {
+        return false;
+    }
+
+    *lapic_address = table->lapic_address;
+
+    uint8_t* entry = (uint8_t*) table + sizeof(struct mp_config_table);
+    for (int i = 0; i < table->entry_count; ++i) {
+        if (entry[0] == MP_TYPE_PROCESSOR) {
+            struct mp_processor processor;
+            memcpy(&processor, entry, sizeof(struct mp_processor));
+            if (processor.flags & MP_PROCESSOR_ENABLED) {
+                smp_add_cpu(processor.lapic_id);
+            }
+            entry += MP_PROCESSOR_SIZE;
+
+        } else {
+            entry += MP_OTHER_ENTRY_SIZE;
+        }
+    }
+
+    return true;
+}
+
+static int smp_reschedule_handler(struct x86_regs* r) {
+    (void) r;
+    thread_received_reschedule_ipi();
+    return 0;
+}
+
+static int smp_tlb_shootdown_handler(struct x86_regs* r) {
+    (void) r;
+    x86_service_tlb_shootdown();
+    return 0;
+}
+
+/*
+* Lets the current CPU get sent TLB shootdowns.
+*/
+static void smp_add_online_cpu(void) {
+    spinlock_acquire(&shootdown_lock);
+    online_cpus[num_online_cpus++] = current_cpu->platform_specific_data;
+    spinlock_release(&shootdown_lock);
+
+    /*
+    * Anything that got changed before now wouldn't have been flushed.
+    */
+    x86_flush_tlb();
+}
+
+/*
+* Finds the other CPUs, and gets everything ready to start them. Returns false if there
+* aren't any.
+*/
+static bool smp_initialise(void) {
+    size_t lapic_address = 0;
+    if (!smp_find_cpus_from_madt(&lapic_address) && !smp_find_cpus_from_mp_table(&lapic_address)) {
+        return false;
+    }
+
+    kprintf("smp: found %d CPUs\n", num_cpus_found);
+    if (num_cpus_found < 2) {
+        return false;
+    }
+
+    struct x86_cpu_specific_data* data = current_cpu->platform_specific_data;
+
+    lapic_map(lapic_address);
+    lapic_initialise(true);
+    lapic_calibrate_timer();
+    data->lapic_id = lapic_get_id();
+
+    x86_register_interrupt_handler(LAPIC_RESCHEDULE_VECTOR, smp_reschedule_handler);
+    x86_register_interrupt_handler(LAPIC_TLB_SHOOTDOWN_VECTOR, smp_tlb_shootdown_handler);
+
+    spinlock_init(&shootdown_lock, "tlb shootdown lock");
+    smp_add_online_cpu();
+    x86_tlb_shootdowns_enabled = 1;
+
+    size_t trampoline_size = &x86_trampoline_end - &x86_trampoline_start;
+    assert(trampoline_size <= ARCH_PAGE_SIZE);
+    memcpy((void*) lowmem_physical_to_virtual(X86_TRAMPOLINE_ADDRESS), &x86_trampoline_start, trampoline_size);
+
+    startup_page_directory = x86_create_startup_page_directory();
+    return true;
+}
+
+/*
+* Fills in one of the slots at the end of the copy of the trampoline.
+*/
+static void smp_set_trampoline_slot(uint8_t* slot, size_t value) {
+    size_t* copy = (size_t*) lowmem_physical_to_virtual(X86_TRAMPOLINE_ADDRESS + (slot - &x86_trampoline_start));
+    *copy = value;
+}
+
+/*
+* Waits until the CPU being started is done, or until the timeout is up. Returns
+* whether it is done.
+*/
+static bool smp_wait_for_starting_cpu(uint64_t timeout) {
+    uint64_t start = get_time_since_boot();
+    while (!starting_cpu_done && get_time_since_boot() - start < timeout) {
+        arch_stall_processor();
+    }
+    return starting_cpu_done;
+}
+
+/*
+* Where other CPUs go once they get into the kernel. They have a stack, but interrupts
+* are off, and nothing else is set up. They can't take any spinlocks until their GDT is
+* loaded.
+*/
+void x86_ap_entry(void) {
+    struct cpu* cpu = starting_cpu;
+
+    x86_gdt_initialise(cpu);
+    x86_per_cpu_virt_initialise(cpu);
+    x86_idt_initialise();
+    vas_load(current_cpu->current_vas);
+    x86_tss_initialise();
+
+    lapic_initialise(false);
+    smp_add_online_cpu();
+    lapic_start_timer(AP_TIMER_HERTZ);
+
+    starting_cpu_done = true;
+    cpu_ap_main();
+}
+
+static bool smp_start_cpu(struct cpu* cpu, int lapic_id) {
+    struct x86_cpu_specific_data* data = malloc(sizeof(struct x86_cpu_specific_data));
+    memset(data, 0, sizeof(struct x86_cpu_specific_data));
+    data->lapic_id = lapic_id;
+    cpu->platform_specific_data = data;
+
+    size_t stack = virt_allocate_backed_pages(AP_STACK_PAGES, VAS_FLAG_WRITABLE | VAS_FLAG_LOCKED, PHYS_OWNER_KERNEL_STACK);
+
+    smp_set_trampoline_slot(&x86_trampoline_cr3, startup_page_directory);
+    smp_set_trampoline_slot(&x86_trampoline_stack, stack + AP_STACK_PAGES * ARCH_PAGE_SIZE);
+    smp_set_trampoline_slot(&x86_trampoline_entry, (size_t) x86_ap_entry);
+
+    starting_cpu = cpu;
+    starting_cpu_done = false;
+
+    /*
+    * A CPU ignores the second startup if it got the first one.
+    */
+    lapic_send_init(lapic_id);
+    smp_wait_for_starting_cpu(INIT_DELAY_NS);
+    lapic_send_startup(lapic_id, X86_TRAMPOLINE_ADDRESS);
+
+    if (!smp_wait_for_starting_cpu(STARTUP_RETRY_NS)) {
+        lapic_send_startup(lapic_id, X86_TRAMPOLINE_ADDRESS);
+    }
+
+    return smp_wait_for_starting_cpu(STARTUP_TIMEOUT_NS);
+}
+
+bool arch_start_next_cpu(struct cpu* cpu) {
+    if (!smp_initialised) {
+        smp_initialised = true;
+        if (!smp_initialise()) {
+            return false;
+        }
+    }
+
+    struct x86_cpu_specific_data* data = current_cpu->platform_specific_data;
+
+    while (next_cpu_to_start < num_cpus_found) {
+        int lapic_id = lapic_ids[next_cpu_to_start++];
+        if (lapic_id == data->lapic_id) {
+            continue;
+        }
+
+        if (smp_start_cpu(cpu, lapic_id)) {
+            return true;
+        }
+
+        /*
+        * It might still start later on, so we can't reuse anything it was given by
+        * starting any more.
+        */
+        kprintf("smp: CPU with local APIC ID %d didn't start\n", lapic_id);
+        next_cpu_to_start = num_cpus_found;
+    }
+
+    return false;
+}
+
+void arch_send_reschedule(struct cpu* cpu) {
+    struct x86_cpu_specific_data* data = cpu->platform_specific_data;
+    lapic_send_ipi(data->lapic_id, LAPIC_RESCHEDULE_VECTOR);
+}
+
+/*
+* Makes every other CPU flush a page (or everything) from their TLB, and waits until
+* they have all done it. The current CPU must flush its own.
+*/
+void x86_tlb_shootdown(size_t virt_addr) {
+    if (num_online_cpus < 2) {
+        return;
+    }
+
+    spinlock_acquire(&shootdown_lock);
+
+    struct x86_cpu_specific_data* self = current_cpu->platform_specific_data;
+    int num_to_acknowledge = 0;
+
+    shootdown_address = virt_addr;
+    shootdown_acknowledgements = 0;
+
+    for (int i = 0; i < num_online_cpus; ++i) {
+        if (online_cpus[i] != self) {
+            online_cpus[i]->tlb_flush_pending = 1;
+            lapic_send_ipi(online_cpus[i]->lapic_id, LAPIC_TLB_SHOOTDOWN_VECTOR);
+            ++num_to_acknowledge;
+        }
+    }
+
+    while (shootdown_acknowledgements < num_to_acknowledge) {
+        __builtin_ia32_pause();
+    }
+
+    spinlock_release(&shootdown_lock);
+}
+
+/*
+* Does a TLB shootdown if one has been sent to the current CPU. This is called by the
+* interrupt handler, but also while waiting on a spinlock (as interrupts are off then).
+*/
+void x86_service_tlb_shootdown(void) {
+    struct x86_cpu_specific_data* data = current_cpu->platform_specific_data;
+
+    if (!__atomic_exchange_n(&data->tlb_flush_pending, 0, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+
+    if (shootdown_address == X86_TLB_SHOOTDOWN_ALL) {
+        x86_flush_tlb();
+    } else {
+        x86_flush_tlb_entry(shootdown_address);
+    }
+
+    __atomic_fetch_add(&shootdown_acknowledgements, 1, __ATOMIC_SEQ_CST);
+}
@@ -8,6 +8,7 @@
 #include <virtual.h>
 #include <physical.h>
 #include <assert.h>
+#include <execcache.h>
 
 bool is_elf_valid(struct Elf32_Ehdr* header) {
     /*
@@ -27,7 +28,7 @@ static void* addToVoidPointer(void* p, size_t o) {
     return (void*) (((uint8_t*) p) + o);
 }
 
-static size_t elf_load_program_headers(void* data, size_t relocation_point, bool relocate) {
+static size_t elf_load_program_headers(void* data, size_t relocation_point, bool relocate, struct exec_image* image) {
 
     struct Elf32_Ehdr* elf_header = (struct Elf32_Ehdr*) data;
 	struct Elf32_Phdr* prog_headers = (struct Elf32_Phdr*) addToVoidPointer(data, elf_header->e_phoff);
@@ -49,13 +50,9 @@ static size_t elf_load_program_headers(void* data, size_t relocation_point, bool
                 assert(address % ARCH_PAGE_SIZE == 0);
 
                 size_t total_pages = virt_bytes_to_pages(size + num_zero_bytes);
+                int flags = ((prog_header->p_flags & PF_W) ? VAS_FLAG_WRITABLE : 0) | ((prog_header->p_flags & PF_X) ? VAS_FLAG_EXECUTABLE : 0);
 
-                for (size_t i = 0; i < total_pages; ++i) {
-                    vas_reflag(vas_get_current_vas(), address + (i * ARCH_PAGE_SIZE), VAS_FLAG_USER | VAS_FLAG_WRITABLE | VAS_FLAG_ALLOCATE_ON_ACCESS);
-                }
-                vas_flush_tlb();
-
-                memcpy((void*) address, (const void*) addToVoidPointer(data, offset), size);
+                exec_image_add_segment(image, address, (const void*) addToVoidPointer(data, offset), size, size + num_zero_bytes, flags);
 
                 if (address + total_pages * ARCH_PAGE_SIZE > sbrk_address) {
                     sbrk_address = address + total_pages * ARCH_PAGE_SIZE;
@@ -202,7 +199,7 @@ static bool elf_perform_relocations(void* data, size_t relocation_point) {
 	return true;
 }
 
-static size_t elf_load(void* data, size_t relocation_point, bool relocate, size_t* entry_point) {
+static size_t elf_load(void* data, size_t relocation_point, bool relocate, size_t* entry_point, struct exec_image* image) {
     struct Elf32_Ehdr* elf_header = (struct Elf32_Ehdr*) data;
 
     /*
@@ -229,7 +226,7 @@ static size_t elf_load(void* data, size_t relocation_point, bool relocate, size_
     /*
     * Load into memory.
     */
-    size_t result = elf_load_program_headers(data, relocation_point, relocate);
+    size_t result = elf_load_program_headers(data, relocation_point, relocate, image);
 
     if (relocate) {
         bool success = elf_perform_relocations(data, relocation_point);
@@ -250,7 +247,7 @@ size_t arch_load_driver(void* data, size_t data_size, size_t relocation_point) {
     (void) data_size;
 
     /* Zero is returned on error. */
-    return elf_load(data, relocation_point, true, 0);
+    return elf_load(data, relocation_point, true, 0, NULL);
 }
 
 int arch_start_driver(size_t driver, void* argument) {
@@ -268,14 +265,14 @@ int arch_start_driver(size_t driver, void* argument) {
     return 0;
 }
 
-int arch_exec(void* data, size_t data_size, size_t* entry_point, size_t* sbrk_point) {
+int arch_exec(void* data, size_t data_size, struct exec_image* image) {
     (void) data_size;
 
-    size_t result = elf_load(data, 0, false, entry_point);
+    size_t result = elf_load(data, 0, false, &image->entry_point, image);
     if (result == 0) {
         return EINVAL;
     }
 
-    *sbrk_point = result;
+    image->sbrk_point = result;
     return 0;
 }
\ No newline at end of file
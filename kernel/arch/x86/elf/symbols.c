@@ -161,4 +161,44 @@ size_t ksymbol_get_address_from_name(const char* name) {
     }
 
     return 0;
+}
+
+struct nearest_symbol_search {
+    size_t address;
+    size_t best_address;
+    const char* best_name;
+};
+
+static void check_nearest_symbol(void* key, void* value, void* context) {
+    struct nearest_symbol_search* search = context;
+    size_t symbol_address = (size_t) value;
+
+    if (symbol_address <= search->address && (search->best_name == NULL || symbol_address > search->best_address)) {
+        search->best_address = symbol_address;
+        search->best_name = key;
+    }
+}
+
+/*
+* Finds the symbol which an address is most likely to be in (i.e. the closest one at or
+* below the address). Returns NULL if there is no such symbol. This does a search over
+* every symbol, so should only be used for debugging output.
+*/
+const char* ksymbol_get_name_from_address(size_t address, size_t* offset_out) {
+    if (loaded_symbols == NULL) {
+        ksymbol_init();
+    }
+
+    struct nearest_symbol_search search;
+    search.address = address;
+    search.best_address = 0;
+    search.best_name = NULL;
+
+    adt_hashmap_for_each(loaded_symbols, check_nearest_symbol, &search);
+
+    if (offset_out != NULL) {
+        *offset_out = address - search.best_address;
+    }
+
+    return search.best_name;
 }
\ No newline at end of file
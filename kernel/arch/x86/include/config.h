@@ -22,4 +22,11 @@
 #define ARCH_KRNL_SBRK_BASE     0xC8000000
 #define ARCH_KRNL_SBRK_LIMIT    0xFF800000
 
+/*
+* Non-inclusive of ARCH_DIRECT_MAP_LIMIT. Physical memory is mapped here with the same
+* offset as the kernel itself, so this also covers the kernel.
+*/
+#define ARCH_DIRECT_MAP_BASE    0xC0000000
+#define ARCH_DIRECT_MAP_LIMIT   0xC8000000
+
 #define ARCH_MAX_CPU_ALLOWED    16
\ No newline at end of file
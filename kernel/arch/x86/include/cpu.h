@@ -9,8 +9,14 @@ struct x86_cpu_specific_data {
     /* Plz keep tss at the top, thread switching assembly needs it */
     struct tss* tss;
 
+    /* Must be second, it is used by the spinlock assembly */
+    size_t spinlocks_held;
+
+    volatile size_t tlb_flush_pending;  /* Set by x86_tlb_shootdown */
+    int lapic_id;
+
     struct gdt_entry gdt[16];
     struct idt_entry idt[256];
     struct gdt_ptr gdtr;
     struct idt_ptr idtr;
-};
\ No newline at end of file
+};
@@ -174,6 +174,13 @@ enum PH_Types
 	PHT_HIPROC = 0x7FFFFFFF
 };
 
+enum PH_Flags
+{
+	PF_X = 0x1,			// Executable
+	PF_W = 0x2,			// Writable
+	PF_R = 0x4			// Readable
+};
+
 #define ELF32_R_SYM(INFO)		((INFO) >> 8)
 #define ELF32_R_TYPE(INFO)		((uint8_t)(INFO))
 
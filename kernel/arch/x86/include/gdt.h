@@ -9,6 +9,7 @@
 #include <common.h>
 
 struct tss;
+struct cpu;
 
 /*
 * An entry in the GDT table. The layout of this structure is mandated by the CPU.
@@ -35,5 +36,5 @@ struct gdt_ptr
 	size_t location;
 } __attribute__((packed));
 
-void x86_gdt_initialise(void);
+void x86_gdt_initialise(struct cpu* cpu);
 uint16_t x86_gdt_add_tss(struct tss* tss);
\ No newline at end of file
@@ -0,0 +1,29 @@
+#pragma once
+
+/* x86/include/lapic.h - Local APIC
+*
+* 
+*/
+
+#include <common.h>
+
+/*
+* Interrupt vectors used by the local APIC. They are higher than anything else so that
+* they take priority.
+*/
+#define LAPIC_RESCHEDULE_VECTOR     0xF0
+#define LAPIC_TLB_SHOOTDOWN_VECTOR  0xF1
+#define LAPIC_TIMER_VECTOR          0xF2
+#define LAPIC_SPURIOUS_VECTOR       0xFF
+#define LAPIC_FIRST_VECTOR          LAPIC_RESCHEDULE_VECTOR
+
+void lapic_map(size_t phys_addr);
+void lapic_initialise(bool bootstrap);
+int lapic_get_id(void);
+void lapic_eoi(void);
+void lapic_send_ipi(int lapic_id, int vector);
+void lapic_send_init(int lapic_id);
+void lapic_send_startup(int lapic_id, size_t phys_addr);
+void lapic_calibrate_timer(void);
+void lapic_start_timer(int hertz);
+void lapic_set_next_timer(uint64_t ns);
@@ -0,0 +1,16 @@
+#pragma once
+
+/*
+* x86/include/percpu.h - Per-CPU Data
+*
+* Each CPU's GS segment starts at its own struct cpu, so current_cpu can be accessed
+* through GS. This means reading something from it is only a single instruction, which
+* can't be interrupted partway through by the thread moving to another CPU.
+*/
+
+/*
+* The GDT entry for the GS segment (it gets set up by x86_gdt_initialise).
+*/
+#define X86_PERCPU_SELECTOR     0x30
+
+#define ARCH_CURRENT_CPU        ((struct cpu __seg_gs*) 0)
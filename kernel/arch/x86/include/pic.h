@@ -6,4 +6,5 @@
 
 void pic_initialise(void);
 void pic_eoi(int num);
-bool pic_is_spurious(int num);
\ No newline at end of file
+bool pic_is_spurious(int num);
+bool pic_is_pending(int irq);
@@ -1,3 +1,7 @@
 #pragma once
 
-void pit_initialise(int hertz);
\ No newline at end of file
+#include <common.h>
+
+void pit_initialise(int hertz);
+void pit_set_next_timer(uint64_t ns);
+uint64_t pit_get_time_since_interrupt(void);
@@ -0,0 +1,16 @@
+#pragma once
+
+/* x86/include/smp.h - Multiprocessor Support
+*
+* 
+*/
+
+#include <common.h>
+
+/*
+* Pass this to x86_tlb_shootdown to flush everything instead of a single page.
+*/
+#define X86_TLB_SHOOTDOWN_ALL   ((size_t) -1)
+
+void x86_tlb_shootdown(size_t virt_addr);
+void x86_service_tlb_shootdown(void);
@@ -4,3 +4,5 @@
 
 size_t ksymbol_get_address_from_name(const char* name);
 void ksymbol_add_symbol(const char* name, size_t address);
+
+const char* ksymbol_get_name_from_address(size_t address, size_t* offset_out);
@@ -46,17 +46,25 @@ struct gdt_entry x86_gdt_create_entry(size_t base, size_t limit, uint8_t access,
 }
 
 /*
-* Initialises the GDT and loads it. 
+* Initialises the GDT and loads it. The GS segment gets pointed at the CPU's struct cpu
+* (see machine/percpu.h), so current_cpu can be used once this returns.
 */
-void x86_gdt_initialise(void)
+void x86_gdt_initialise(struct cpu* cpu)
 {
-	struct x86_cpu_specific_data* cpu_data = current_cpu->platform_specific_data;
+	struct x86_cpu_specific_data* cpu_data = cpu->platform_specific_data;
 
 	cpu_data->gdt[0] = x86_gdt_create_entry(0, 0, 0, 0);					// null segment
 	cpu_data->gdt[1] = x86_gdt_create_entry(0, 0xFFFFFFFF, 0x9A, 0xC);		// kernel code
 	cpu_data->gdt[2] = x86_gdt_create_entry(0, 0xFFFFFFFF, 0x92, 0xC);		// kernel data
 	cpu_data->gdt[3] = x86_gdt_create_entry(0, 0xFFFFFFFF, 0xFA, 0xC);		// user code
 	cpu_data->gdt[4] = x86_gdt_create_entry(0, 0xFFFFFFFF, 0xF2, 0xC);		// user data
+	cpu_data->gdt[6] = x86_gdt_create_entry((size_t) cpu, sizeof(struct cpu) - 1, 0x92, 0x4);	// per-CPU data
+
+	/*
+	* This segment never gets loaded. Its limit is the CPU number, which user mode can
+	* read with LSL (see x86/lowlevel/vdso.s).
+	*/
+	cpu_data->gdt[7] = x86_gdt_create_entry(0, cpu->cpu_number, 0xF2, 0x0);	// CPU number
 
 	cpu_data->gdtr.size = sizeof(cpu_data->gdt) - 1;
 	cpu_data->gdtr.location = (size_t) &cpu_data->gdt;
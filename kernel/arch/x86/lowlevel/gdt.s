@@ -24,7 +24,10 @@ x86_gdt_load:
 	mov ds, ax
 	mov es, ax
 	mov fs, ax
-	mov gs, ax
 	mov ss, ax
 
+	; Except for GS, which points to this CPU's struct cpu
+	mov ax, 0x30
+	mov gs, ax
+
 	ret
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include <common.h>
 #include <cpu.h>
 #include <machine/cpu.h>
+#include <machine/lapic.h>
 
 /*
 * x86/lowlevel/idt.c - Interrupt Descriptor Table
@@ -55,6 +56,10 @@ extern void irq12();
 extern void irq13();
 extern void irq14();
 extern void irq15();
+extern void isr240();
+extern void isr241();
+extern void isr242();
+extern void isr255();
 
 /*
 * Fill in an entry in the IDT. There are a number of 'types' of interrupt, determining
@@ -109,6 +114,14 @@ void x86_idt_initialise(void)
 	* this allows user code to directly invoke this interrupt.
 	*/
 	x86_idt_set_entry(96, (size_t) isr96, 0xEE);
+
+	/*
+	* Install handlers for interrupts from the local APIC (e.g. from other CPUs).
+	*/
+	x86_idt_set_entry(LAPIC_RESCHEDULE_VECTOR, (size_t) isr240, 0x8E);
+	x86_idt_set_entry(LAPIC_TLB_SHOOTDOWN_VECTOR, (size_t) isr241, 0x8E);
+	x86_idt_set_entry(LAPIC_TIMER_VECTOR, (size_t) isr242, 0x8E);
+	x86_idt_set_entry(LAPIC_SPURIOUS_VECTOR, (size_t) isr255, 0x8E);
 	
 	cpu_data->idtr.location = (size_t) &cpu_data->idt;
 	cpu_data->idtr.size = sizeof(cpu_data->idt) - 1;
@@ -2,6 +2,7 @@
 #include <common.h>
 #include <machine/interrupt.h>
 #include <machine/pic.h>
+#include <machine/lapic.h>
 #include <machine/mem/virtual.h>
 #include <errno.h>
 #include <arch.h>
@@ -95,7 +96,7 @@ static const char* get_fault_name(int num) {
 void x86_interrupt_handler(struct x86_regs* r) {
     int num = r->int_no;
 
-    if (pic_is_spurious(num)) {
+    if (pic_is_spurious(num) || num == LAPIC_SPURIOUS_VECTOR) {
         return;
     }
 
@@ -109,6 +110,8 @@ void x86_interrupt_handler(struct x86_regs* r) {
     */
     if (num >= PIC_IRQ_BASE && num < PIC_IRQ_BASE + 16) {
         pic_eoi(num);
+    } else if (num >= LAPIC_FIRST_VECTOR) {
+        lapic_eoi();
     }
 
     /*
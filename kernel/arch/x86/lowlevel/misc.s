@@ -10,7 +10,8 @@
 global arch_enable_interrupts
 global arch_disable_interrupts
 global arch_stall_processor
-global arch_flush_tlb
+global x86_flush_tlb
+global x86_flush_tlb_entry
 global arch_read_timestamp
 global x86_get_cr2
 global x86_are_irqs_on
@@ -31,11 +32,16 @@ arch_stall_processor:
 	hlt
 	ret
 
-arch_flush_tlb:
+x86_flush_tlb:
 	mov eax, cr3
 	mov cr3, eax
 	ret
 
+x86_flush_tlb_entry:
+	mov eax, [esp + 4]
+	invlpg [eax]
+	ret
+
 x86_get_cr2:
     mov eax, cr2
     ret
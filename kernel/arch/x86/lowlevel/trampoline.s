@@ -0,0 +1,88 @@
+;
+;
+; x86/lowlevel/trampoline.s - Starting Other CPUs
+;
+; Other CPUs start in real mode at a page-aligned address below 1MB. This code
+; gets copied to X86_TRAMPOLINE_ADDRESS (see x86/dev/smp.c), and gets the CPU
+; into protected mode with paging on, and then jumps into the kernel. It can't
+; use any absolute addresses, as it doesn't run where it was linked, so they
+; all get worked out from where the code starts.
+;
+; The CR3, stack and entry point slots get filled in on the copy before the
+; CPU is started.
+;
+
+global x86_trampoline_start
+global x86_trampoline_end
+global x86_trampoline_cr3
+global x86_trampoline_stack
+global x86_trampoline_entry
+
+TRAMPOLINE_ADDRESS equ 0x8000
+
+%define TRAMPOLINE(label) (TRAMPOLINE_ADDRESS + (label) - x86_trampoline_start)
+
+bits 16
+
+x86_trampoline_start:
+	cli
+	cld
+
+	; The CPU starts with CS set so that the code is at offset 0, but we want
+	; everything to be at its physical address.
+	xor ax, ax
+	mov ds, ax
+
+	lgdt [TRAMPOLINE(trampoline_gdtr)]
+
+	; Turn on protected mode
+	mov eax, cr0
+	or eax, 1
+	mov cr0, eax
+
+	jmp dword 0x08:TRAMPOLINE(trampoline_protected_mode)
+
+bits 32
+
+trampoline_protected_mode:
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+
+	; The page directory has the low memory identity mapped, so we can keep
+	; running here once paging is on.
+	mov eax, [TRAMPOLINE(x86_trampoline_cr3)]
+	mov cr3, eax
+
+	mov eax, cr0
+	or eax, (1 << 31)
+	mov cr0, eax
+
+	; Now we can get to the kernel. The entry point never returns.
+	mov esp, [TRAMPOLINE(x86_trampoline_stack)]
+	mov eax, [TRAMPOLINE(x86_trampoline_entry)]
+	call eax
+
+	cli
+	hlt
+
+; The kernel loads its own GDT, this one only needs to be flat.
+align 8
+trampoline_gdt:
+	dq 0
+	dq 0x00CF9A000000FFFF		; code
+	dq 0x00CF92000000FFFF		; data
+
+trampoline_gdtr:
+	dw 3 * 8 - 1
+	dd TRAMPOLINE(trampoline_gdt)
+
+align 4
+x86_trampoline_cr3 dd 0
+x86_trampoline_stack dd 0
+x86_trampoline_entry dd 0
+
+x86_trampoline_end:
@@ -48,6 +48,10 @@ global irq12
 global irq13
 global irq14
 global irq15
+global isr240
+global isr241
+global isr242
+global isr255
 
 
 ; We don't need to disable interrupts - they are automatically disabled when
@@ -248,12 +252,35 @@ irq15:
     push byte 0
     push byte 47
     jmp int_common_handler
+
+
+; Interrupts from the local APIC (see machine/lapic.h). These are too large to
+; push as a byte.
+isr240:
+    push byte 0
+    push dword 240
+    jmp int_common_handler
+
+isr241:
+    push byte 0
+    push dword 241
+    jmp int_common_handler
+
+isr242:
+    push byte 0
+    push dword 242
+    jmp int_common_handler
+
+isr255:
+    push byte 0
+    push dword 255
+    jmp int_common_handler
 	
 
 ; Our common interrupt handler
 extern x86_interrupt_handler
 extern signal_check
-extern current_cpu
+extern x86_per_cpu_ready
 int_common_handler:
     ; Save the registers and segments
     pushad
@@ -269,6 +296,13 @@ int_common_handler:
 	mov fs, ax
     mov gs, ax
 
+    ; GS points to the CPU's struct cpu, once we have one
+    cmp dword [x86_per_cpu_ready], 0
+    je .no_per_cpu
+    mov ax, 0x30
+    mov gs, ax
+
+.no_per_cpu:
     ; Allow nested interrupts
     sti
 	
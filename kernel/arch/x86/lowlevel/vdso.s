@@ -0,0 +1,120 @@
+;
+;
+; x86/lowlevel/vdso.s - vDSO Code
+;
+; This code gets copied into the vDSO's code page (see thread/vdso.c), and runs in
+; user mode. It starts with a jump to each function, at the addresses given in
+; sys/vdso.h. It can only use relative jumps within itself, as it doesn't run where
+; it was linked, but the data page is always at the same address.
+;
+; The offsets into the data page must match struct vdso_data in sys/vdso.h.
+;
+
+global x86_vdso_start
+global x86_vdso_end
+
+VDSO_DATA equ 0xBFFFE000
+
+DATA_SEQUENCE       equ VDSO_DATA + 0
+DATA_USE_TIMESTAMP  equ VDSO_DATA + 4
+DATA_BASE_TIMESTAMP equ VDSO_DATA + 8
+DATA_BASE_TIME      equ VDSO_DATA + 16
+DATA_MULTIPLIER     equ VDSO_DATA + 24
+DATA_SHIFT          equ VDSO_DATA + 32
+
+; Index 7 in the GDT (see x86/lowlevel/gdt.c), with a requested privilege level of 3
+CPU_NUMBER_SELECTOR equ 0x3B
+
+x86_vdso_start:
+	jmp vdso_get_time_since_boot
+	align 8
+	jmp vdso_get_cpu
+	align 8
+
+; uint64_t get_time_since_boot(void)
+vdso_get_time_since_boot:
+	push ebx
+	push esi
+	push edi
+
+	; The base time and multiplier get kept on the stack
+	sub esp, 16
+
+.retry:
+	mov ecx, [DATA_SEQUENCE]
+	test ecx, 1
+	jnz .busy
+
+	cmp dword [DATA_USE_TIMESTAMP], 0
+	je .unavailable
+
+	mov eax, [DATA_BASE_TIME]
+	mov [esp], eax
+	mov eax, [DATA_BASE_TIME + 4]
+	mov [esp + 4], eax
+	mov eax, [DATA_MULTIPLIER]
+	mov [esp + 8], eax
+	mov eax, [DATA_MULTIPLIER + 4]
+	mov [esp + 12], eax
+	mov esi, [DATA_BASE_TIMESTAMP]
+	mov edi, [DATA_BASE_TIMESTAMP + 4]
+	mov ebx, [DATA_SHIFT]
+
+	; Loads don't get reordered with other loads, so if it still matches, all of the
+	; above came from the same update.
+	cmp ecx, [DATA_SEQUENCE]
+	jne .retry
+
+	; Other CPUs' timestamps might be a little behind the one that set the base.
+	rdtsc
+	sub eax, esi
+	sbb edx, edi
+	jc .behind
+
+	; The low 64 bits of the difference times the multiplier go in EDI:ESI
+	mov esi, eax
+	mov edi, edx
+	mul dword [esp + 8]
+	imul edi, [esp + 8]
+	add edx, edi
+	imul esi, [esp + 12]
+	add edx, esi
+
+	; Then shifted down, and added to the base time
+	mov ecx, ebx
+	shrd eax, edx, cl
+	shr edx, cl
+	add eax, [esp]
+	adc edx, [esp + 4]
+	jmp .done
+
+.behind:
+	mov eax, [esp]
+	mov edx, [esp + 4]
+	jmp .done
+
+.busy:
+	pause
+	jmp .retry
+
+.unavailable:
+	xor eax, eax
+	xor edx, edx
+
+.done:
+	add esp, 16
+	pop edi
+	pop esi
+	pop ebx
+	ret
+
+; int get_cpu(void)
+vdso_get_cpu:
+	mov ecx, CPU_NUMBER_SELECTOR
+	lsl eax, ecx
+	jz .done
+	xor eax, eax
+.done:
+	ret
+
+x86_vdso_end:
@@ -12,6 +12,8 @@
 #include <spinlock.h>
 #include <errno.h>
 #include <kprintf.h>
+#include <rmap.h>
+#include <machine/smp.h>
 
 /*
 * x86/mem/virtual.c - x86 Virtual Memory 
@@ -72,6 +74,7 @@
 #define x86_PAGE_WRITABLE				(1 << 1)
 #define x86_PAGE_USER					(1 << 2)
 #define x86_PAGE_LOCKED					(1 << 8)
+#define x86_PAGE_SWAPPED				(1 << 9)
 #define x86_PAGE_ALLOCATE_ON_ACCESS		(1 << 10)
 #define x86_PAGE_COPY_ON_WRITE			(1 << 11)
 
@@ -93,6 +96,11 @@
 */
 extern void x86_set_cr3(size_t);
 
+/*
+* Makes read-only pages read-only for the kernel too. Defined in x86/mem/virtual.s
+*/
+extern void x86_enable_write_protect(void);
+
 /*
 * We need to keep track of the page directory's physical address so we can
 * tell the CPU about it (by loading CR3), and the virtual address so we can
@@ -108,10 +116,10 @@ struct x86_vas
 };
 
 /*
-* To initialise page directories/tables were need to write them, but doing
-* so requires them to be mapped into virtual memory. Using the virtual memory
-* manager's allocation features creates a catch-22, so we need to use virtual 
-* memory that is already mapped (e.g. the kernel data).
+* To initialise the page tables for the direct map we need to write them, but doing
+* so requires them to be mapped into virtual memory. Using the direct map to do it
+* creates a catch-22, so we need to use virtual memory that is already mapped (e.g. the
+* kernel data). Everything else can use the direct map.
 */
 size_t temp_virtual_page[1024] __attribute__((aligned(PAGE_SIZE)));
 
@@ -123,8 +131,11 @@ size_t temp_virtual_page[1024] __attribute__((aligned(PAGE_SIZE)));
 size_t kernel_page_directory[1024] __attribute__((aligned(PAGE_SIZE)));
 size_t first_page_table[1024] __attribute__((aligned(PAGE_SIZE)));
 
-struct virtual_address_space kernel_vas[ARCH_MAX_CPU_ALLOWED];
-struct x86_vas kernel_vas_x86[ARCH_MAX_CPU_ALLOWED];
+/*
+* Every CPU shares the same kernel address space.
+*/
+struct virtual_address_space kernel_vas;
+struct x86_vas kernel_vas_x86;
 
 /*
 * Converts a physical address guaranteed to be less than 4MB to its
@@ -146,47 +157,64 @@ static void allocate_page_table(struct virtual_address_space* vas, size_t* page_
     assert(entry_num >= 0 || entry_num < 1024);
     assert(spinlock_is_held(&vas->lock));
 
-	size_t p_addr = phys_allocate_page();
-	size_t v_addr = (size_t) temp_virtual_page;
-    
+	size_t p_addr = phys_allocate_page(PHYS_OWNER_PAGE_TABLE);
+	memset((void*) phys_to_virt(p_addr), 0, 4096);
+
 	/*
-	* In order to clear the page, we need to temporarily map it into memory.
+	* Add it to the page directory. The entry wasn't present before, so there is nothing
+	* in the TLB to flush.
 	*/
-    arch_vas_set_entry(vas, v_addr, p_addr, VAS_FLAG_WRITABLE | VAS_FLAG_PRESENT | VAS_FLAG_LOCKED);
-
-    vas_flush_tlb();
-    memset((void*) v_addr, 0, 4096);
-    arch_vas_set_entry(vas, v_addr, p_addr, 0);
-
-	// Add it to the page directory
 	page_dir[entry_num] = p_addr | x86_PAGE_PRESENT | x86_PAGE_LOCKED | x86_PAGE_WRITABLE | (entry_num < 768 ? x86_PAGE_USER : 0);
-    vas_flush_tlb();
-}
 
-static void setup_current_cpu() {
-	/*
-	* We also need to setup the current_cpu structure. The virtual address
-	* should be the same regardless of the CPU, but it should be mapped to
-	* different physical addresses on each CPU
-	*/
-	
-	assert(sizeof(struct cpu) <= ARCH_PAGE_SIZE);
-	
-	/*
-	* Choose the 'global' virtual address. Only should be done the first
-	* time, as they should share it.
-	*/
-	if (cpu_get_count() == 0) {
-		current_cpu = (struct cpu*) virt_allocate_unbacked_krnl_region(sizeof(struct cpu));
+	if (entry_num < 768) {
+		++vas->page_table_pages;
 	}
+}
 
-	/*
-	* Map in a 'local' physical address
-	*/
-	vas_map(&kernel_vas[cpu_get_count()], phys_allocate_page(), (size_t) current_cpu, VAS_FLAG_WRITABLE | VAS_FLAG_LOCKED);
+/*
+* Maps all of physical memory from ARCH_DIRECT_MAP_BASE (see phys_to_virt). This uses the same
+* offset as the kernel, so the kernel's page table gets filled in around the kernel, and the rest
+* get created. They are shared by every address space like the other kernel page tables. Pages
+* are locked so they never get swapped out, and memory that doesn't exist is left unmapped.
+*
+* 4MB pages would need fewer TLB entries, but everything that walks the page tables expects
+* every page directory entry to point to a page table.
+*/
+static void x86_create_direct_map(void) {
+	assert(ARCH_DIRECT_MAP_BASE == KERNEL_VIRT_ADDR);
+
+	size_t first_table_num = ARCH_DIRECT_MAP_BASE / 0x400000;
+	size_t temp_entry_num = ((size_t) temp_virtual_page - KERNEL_VIRT_ADDR) / PAGE_SIZE;
+	size_t temp_entry = first_page_table[temp_entry_num];
+
+	for (size_t table_num = first_table_num; table_num < ARCH_DIRECT_MAP_LIMIT / 0x400000; ++table_num) {
+		size_t* page_table = first_page_table;
 
-	current_cpu->current_vas = &kernel_vas[cpu_get_count()];
-	current_cpu->cpu_number = cpu_get_count();
+		if (table_num != first_table_num) {
+			size_t table_phys = phys_allocate_page(PHYS_OWNER_PAGE_TABLE);
+			first_page_table[temp_entry_num] = table_phys | x86_PAGE_PRESENT | x86_PAGE_WRITABLE | x86_PAGE_LOCKED;
+			arch_flush_tlb_entry((size_t) temp_virtual_page);
+
+			page_table = temp_virtual_page;
+			kernel_page_directory[table_num] = table_phys | x86_PAGE_PRESENT | x86_PAGE_WRITABLE | x86_PAGE_LOCKED;
+		}
+
+		for (size_t page_num = 0; page_num < 1024; ++page_num) {
+			size_t phys = (table_num - first_table_num) * 0x400000 + page_num * PAGE_SIZE;
+
+			/*
+			* Don't touch the kernel.
+			*/
+			if (page_table == first_page_table && (page_table[page_num] & x86_PAGE_PRESENT)) {
+				continue;
+			}
+
+			page_table[page_num] = phys_page_exists(phys) ? (phys | x86_PAGE_PRESENT | x86_PAGE_WRITABLE | x86_PAGE_LOCKED) : x86_PAGE_LOCKED;
+		}
+	}
+
+	first_page_table[temp_entry_num] = temp_entry;
+	arch_flush_tlb_entry((size_t) temp_virtual_page);
 }
 
 /*
@@ -198,9 +226,19 @@ static void setup_current_cpu() {
 *
 * Note that all kernel virtual address spaces shares the same page directory.
 * This is so that we have a consistent kernel state in all processes.
+*
+* The bootstrap CPU creates the kernel's address space, and the others just load it.
 */
-void x86_per_cpu_virt_initialise(void)
+void x86_per_cpu_virt_initialise(struct cpu* cpu)
 {
+	cpu->current_vas = &kernel_vas;
+
+	if (cpu->cpu_number != 0) {
+		arch_vas_load(&kernel_vas_x86);
+		x86_enable_write_protect();
+		return;
+	}
+
 	memset(kernel_page_directory, 0, PAGE_SIZE);
 
     extern size_t _kernel_end;
@@ -225,16 +263,17 @@ void x86_per_cpu_virt_initialise(void)
 	kernel_page_directory[768] = ((size_t) first_page_table - KERNEL_VIRT_ADDR) | x86_PAGE_PRESENT | x86_PAGE_WRITABLE | x86_PAGE_USER | x86_PAGE_LOCKED;
 	/* <= is required to make it match kernel_entry.s */
     for (size_t i = 0; i < num_pages; ++i) {
-		first_page_table[i] = (i * PAGE_SIZE) | x86_PAGE_PRESENT | x86_PAGE_LOCKED;
+		first_page_table[i] = (i * PAGE_SIZE) | x86_PAGE_PRESENT | x86_PAGE_WRITABLE | x86_PAGE_LOCKED;
 	}
     for (size_t i = num_pages + 1; i < 1024; ++i) {
 		first_page_table[i] = x86_PAGE_LOCKED;
 	}
 
 	/*
-	* Set up recursive mapping by mapping the 1024th page table to
-	* the page directory. See arch_vas_set_entry for an explaination of why we do this.
-    * "Locking" this page directory entry is the only we can lock the final page of virtual
+	* Set up recursive mapping by mapping the 1024th page table to the page directory,
+	* which maps the current address space's page tables into the last 4MB of memory.
+	* Page tables get accessed through the direct map instead, but this is useful when
+	* debugging. "Locking" this page directory entry is the only we can lock the final page of virtual
     * memory, due to the recursive nature of this entry.
 	*/
 	kernel_page_directory[1023] = ((size_t) kernel_page_directory - KERNEL_VIRT_ADDR) | x86_PAGE_PRESENT | x86_PAGE_WRITABLE | x86_PAGE_LOCKED;
@@ -242,19 +281,23 @@ void x86_per_cpu_virt_initialise(void)
 	/*
 	* Setup the virtual_address_space* structure correctly.
 	*/
-	spinlock_init(&kernel_vas[cpu_get_count()].lock, "kernel vas lock");
+	spinlock_init(&kernel_vas.lock, "kernel vas lock");
 
-	kernel_vas[cpu_get_count()].data = &kernel_vas_x86[cpu_get_count()];
-	kernel_vas_x86[cpu_get_count()].page_dir_phys = (size_t) kernel_page_directory - KERNEL_VIRT_ADDR;
-	kernel_vas_x86[cpu_get_count()].page_dir_virt = (size_t) kernel_page_directory;
+	kernel_vas.data = &kernel_vas_x86;
+	kernel_vas_x86.page_dir_phys = virt_to_phys((size_t) kernel_page_directory);
+	kernel_vas_x86.page_dir_virt = (size_t) kernel_page_directory;
     
 	/*
-	* Load the virtual address space.
-	*
-	* We can't call vas_load(...) as it will try to set current_cpu->current_vas,
-	* but current_cpu isn't mapped until later in this function.
+	* Load the virtual address space. The caller uses vas_load(...) afterwards, which
+	* does things that arch_vas_load doesn't do (and flushes the TLB).
+	*/
+	arch_vas_load(&kernel_vas_x86);
+
+	/*
+	* Copy on write (and the shared zero page) rely on the kernel not being able to
+	* write to read-only pages either.
 	*/
-	arch_vas_load(&kernel_vas_x86[cpu_get_count()]);
+	x86_enable_write_protect();
 	
 	/* 
 	* The virtual memory manager is now initialised, so we can fill in 
@@ -263,21 +306,29 @@ void x86_per_cpu_virt_initialise(void)
 	* them all now so new address spaces can copy from us.
 	*/
 	
-	for (int i = 769; i < 1023; ++i) {
-        spinlock_acquire(&kernel_vas[cpu_get_count()].lock);
-		allocate_page_table(&kernel_vas[cpu_get_count()], kernel_page_directory, i);
-        spinlock_release(&kernel_vas[cpu_get_count()].lock);
+	x86_create_direct_map();
+
+	for (int i = ARCH_DIRECT_MAP_LIMIT / 0x400000; i < 1023; ++i) {
+        spinlock_acquire(&kernel_vas.lock);
+		allocate_page_table(&kernel_vas, kernel_page_directory, i);
+        spinlock_release(&kernel_vas.lock);
 	}
-	
-	setup_current_cpu();
+}
 
-	/*
-	* Two reasons why we do this:
-	*		- we need to flush the TLB
-	*		- vas_load may do things that arch_vas_load doesn't do, so it is probably
-	*		  important to call vas_load before we do much else
-	*/
-	vas_load(current_cpu->current_vas);
+/*
+* Creates a page directory for starting up other CPUs. It has the kernel mapped like
+* normal, but also has the low 4MB identity mapped, so the CPU can turn paging on
+* before it jumps into the kernel. Returns its physical address.
+*/
+size_t x86_create_startup_page_directory(void)
+{
+	size_t phys = phys_allocate_page(PHYS_OWNER_PAGE_TABLE);
+	size_t* page_dir = (size_t*) phys_to_virt(phys);
+
+	memcpy(page_dir, kernel_page_directory, PAGE_SIZE);
+	page_dir[0] = kernel_page_directory[KERNEL_VIRT_ADDR / 0x400000];
+
+	return phys;
 }
 
 /*
@@ -288,14 +339,9 @@ void arch_vas_create(struct virtual_address_space* vas)
 	vas->data = malloc(sizeof(struct x86_vas));
 
 	struct x86_vas* data = (struct x86_vas*) (vas->data);
-    data->page_dir_phys = phys_allocate_page();
-    data->page_dir_virt = virt_allocate_unbacked_krnl_region(4096);
-
-    /*
-    * Map in the page directory.
-    * Paging out the page directory would be a catastrophe, so lock it.
-    */
-    arch_vas_set_entry(vas_get_current_vas(), data->page_dir_virt, data->page_dir_phys, VAS_FLAG_PRESENT | VAS_FLAG_LOCKED | VAS_FLAG_USER | VAS_FLAG_WRITABLE);
+    data->page_dir_phys = phys_allocate_page(PHYS_OWNER_PAGE_TABLE);
+    data->page_dir_virt = phys_to_virt(data->page_dir_phys);
+    vas->page_table_pages = 1;
 
 	size_t* page_dir_entries = (size_t*) data->page_dir_virt;
 
@@ -311,7 +357,7 @@ void arch_vas_create(struct virtual_address_space* vas)
 	}
 
 	/*
-	* Set up recursive mapping (see arch_vas_set_entry)
+	* Set up recursive mapping (see x86_per_cpu_virt_initialise)
 	*/
 	page_dir_entries[1023] = data->page_dir_phys | x86_PAGE_PRESENT | x86_PAGE_LOCKED | x86_PAGE_WRITABLE;
 }
@@ -321,11 +367,37 @@ void arch_vas_create(struct virtual_address_space* vas)
 * Destory an address space. We must free any non-kernel physical pages that
 * are still pointed to, and deallocate the memory used to store the address space.
 */
-void arch_vas_destroy(void* vas)
+void arch_vas_destroy(struct virtual_address_space* vas)
 {
-	// TODO: free physical memory
+	struct x86_vas* data = (struct x86_vas*) vas->data;
+	size_t* page_dir = (size_t*) data->page_dir_virt;
+
+	for (size_t table_num = 0; table_num < 768; ++table_num) {
+		if (!(page_dir[table_num] & x86_PAGE_PRESENT)) {
+			continue;
+		}
+
+		for (size_t page_num = 0; page_num < 1024; ++page_num) {
+			size_t virt_addr = table_num * 0x400000 + page_num * PAGE_SIZE;
+			size_t phys;
+			int flags;
+			arch_vas_get_entry(vas, virt_addr, &phys, &flags);
+
+			if ((flags & VAS_FLAG_PRESENT) && phys != vas_get_zero_page()) {
+				rmap_remove(phys, vas, virt_addr);
+				phys_free_page(phys);
+
+			} else if (!(flags & VAS_FLAG_PRESENT) && (flags & VAS_FLAG_SWAPPED)) {
+				swapfile_free(phys / PAGE_SIZE);
+			}
+		}
 
-	free(vas);
+		phys_free_page(page_dir[table_num] & ~0xFFF);
+	}
+
+	phys_free_page(data->page_dir_phys);
+
+	free(data);
 }
 
 
@@ -364,20 +436,26 @@ void arch_vas_copy(struct virtual_address_space* in, struct virtual_address_spac
 		if (in_page_dir[table_num] & x86_PAGE_PRESENT) {
 			int flags = in_page_dir[table_num] & 0xFFF;
 
-			size_t new_phys = phys_allocate_page();
-			size_t new_virt = virt_allocate_unbacked_krnl_region(4096);
-			arch_vas_set_entry(vas_get_current_vas(), new_virt, new_phys, VAS_FLAG_PRESENT | VAS_FLAG_WRITABLE | VAS_FLAG_LOCKED);
+			size_t new_phys = phys_allocate_page(PHYS_OWNER_PAGE_TABLE);
 
 			out_page_dir[table_num] = new_phys | flags;
+			++out->page_table_pages;
 
-			size_t* old_page_table = (size_t*) (RECURSIVE_MAPPING_ADDR + table_num * PAGE_SIZE);
-			size_t* new_page_table = (size_t*) new_virt;
+			size_t* old_page_table = (size_t*) phys_to_virt(in_page_dir[table_num] & ~0xFFF);
+			size_t* new_page_table = (size_t*) phys_to_virt(new_phys);
 
 			for (int page_num = 0; page_num < 1024; ++page_num) { 
 				size_t old_entry = old_page_table[page_num];
 
 				new_page_table[page_num] = old_entry;
 
+				/*
+				* Locked pages in user memory are locked by mlock, which isn't inherited.
+				*/
+				if (old_entry & x86_PAGE_PRESENT) {
+					new_page_table[page_num] &= ~x86_PAGE_LOCKED;
+				}
+
 				/*
 				* Only mark writable pages as copy on write. Therefore, when we get a fault
 				* related to COW, we know that we can set the page back to writable. Read-only
@@ -392,9 +470,33 @@ void arch_vas_copy(struct virtual_address_space* in, struct virtual_address_spac
 					old_page_table[page_num] |= x86_PAGE_COPY_ON_WRITE;
 					old_page_table[page_num] &= ~x86_PAGE_WRITABLE;
 				}
-			}
 
-			arch_vas_set_entry(vas_get_current_vas(), new_virt, 0, 0);
+				/*
+				* Both address spaces now map the page, so it must not be freed until
+				* both are done with it. (The zero page is never freed anyway.)
+				*/
+				if ((old_entry & x86_PAGE_PRESENT) && (old_entry & ~0xFFF) != vas_get_zero_page()) {
+					phys_share_page(old_entry & ~0xFFF);
+					rmap_add(old_entry & ~0xFFF, out, table_num * 0x400000 + page_num * PAGE_SIZE);
+				}
+
+				/*
+				* Likewise for pages on the disk, which must stay there until both have
+				* either freed them or read them back in.
+				*/
+				if (!(old_entry & x86_PAGE_PRESENT) && (old_entry & x86_PAGE_SWAPPED)) {
+					swapfile_share(old_entry >> 12);
+
+					/*
+					* The child now has a share of the page, so it counts towards its use
+					* of the swapfile, the same as shared pages in memory count towards
+					* each address space's resident pages.
+					*/
+					if (table_num * 0x400000 >= ARCH_USER_AREA_BASE) {
+						++out->swapped_pages;
+					}
+				}
+			}
 
 		} else {
 			out_page_dir[table_num] = in_page_dir[table_num];
@@ -415,6 +517,7 @@ static int x86_generic_flags_to_real(int flags)
 	if (flags & VAS_FLAG_LOCKED)		        out |= x86_PAGE_LOCKED;
 	if (flags & VAS_FLAG_COPY_ON_WRITE)	        out |= x86_PAGE_COPY_ON_WRITE;
 	if (flags & VAS_FLAG_ALLOCATE_ON_ACCESS)	out |= x86_PAGE_ALLOCATE_ON_ACCESS;
+	if (flags & VAS_FLAG_SWAPPED)	            out |= x86_PAGE_SWAPPED;
 
 	return out;
 }
@@ -428,13 +531,14 @@ static int x86_real_flags_to_generic(int flags) {
 	if (flags & x86_PAGE_LOCKED)		        out |= VAS_FLAG_LOCKED;
 	if (flags & x86_PAGE_COPY_ON_WRITE)	        out |= VAS_FLAG_COPY_ON_WRITE;
 	if (flags & x86_PAGE_ALLOCATE_ON_ACCESS)	out |= VAS_FLAG_ALLOCATE_ON_ACCESS;
+	if (flags & x86_PAGE_SWAPPED)	            out |= VAS_FLAG_SWAPPED;
 
 	return out;
 }
 
 /*
-* TODO: usage of page 1022 is a bit sketchy without a lock to protect it from
-*       being changed...
+* Returns a pointer to the page table entry for a virtual address, or NULL if there is no
+* page table for it and allow_allocation is false.
 */
 size_t* x86_get_entry(struct virtual_address_space* vas_, size_t virt_addr, bool allow_allocation) {
 	struct x86_vas* vas = (struct x86_vas*) vas_->data;
@@ -466,108 +570,139 @@ size_t* x86_get_entry(struct virtual_address_space* vas_, size_t virt_addr, bool
 	size_t page_num = (virt_addr % 0x400000) / PAGE_SIZE;
 
 	/*
-	* Use the recursive mapping of the page directory to map the page.
-	*
-	* What's going on here? On x86, page tables and the page directory
-	* share the same structure. Therefore, the page directory can act
-	* as a page table. This is why it is valid for it to be the 1024th 
-	* page table entry. This us useful as it allows us to access page tables
-	* without needing to explicitly map them in. You work this through
-	* until you are satisfied that it works, but essentially what happens
-	* is that the 1024 page tables pointed to by the page directory are
-	* mapped into the last 4MB of RAM.
-	*
-	* For example, if we wanted to read page table 1023, we would look at the
-	* final page of memory. Page table 1022 is mapped in 2nd last page of memory.
-	* And thus page 0 is mapped in the 1024th last page of memory.
-	*
-	* A more in-depth explaination can be found here:
-	* 		https://web.archive.org/web/20220422111405/https://wiki.osdev.org/User:Neon/Recursive_Paging
-	*
-	* This only works for the current address space, but can be adapted to work in
-	* non-current address spaces. We can use the page directory address as the
-	* 1022th kernel page table. This lets us access the page tables of some other 
-	* address space by using the memory at 0xFF800000.
-	* 
-	* Note that because the kernel page tables are shared between all address
-	* spaces, we can treat any pages above KERNEL_VIRT_ADDR to be always 'current'.
+	* Page tables are in the direct map like any other page, so we can get to the page
+	* tables of any address space (not just the current one) without mapping them in.
 	*/
-	
-	size_t current_vas_base = vas->page_dir_phys;
+	size_t* page_table = (size_t*) phys_to_virt(page_dir[table_num] & ~0xFFF);
+	return page_table + page_num;
+}
 
-	size_t* page_table;
-	size_t recursive_base_addr = RECURSIVE_MAPPING_ADDR;
+static void x86_perform_copy_on_write(size_t virt_addr) {
+	size_t* entry = x86_get_entry(current_cpu->current_vas, virt_addr, false);
+	assert(entry != NULL);
+	assert((*entry) & x86_PAGE_COPY_ON_WRITE);
+
+	size_t old_phys = *entry & ~0xFFF;
 
 	/*
-	* Map a page not in the current address space.
+	* If no one else is using the page anymore (e.g. the other side of a fork has since
+	* copied it, or exited), we can just take it. The zero page must stay shared.
 	*/
-	if (virt_addr < KERNEL_VIRT_ADDR && current_vas_base != vas->page_dir_phys) {
-        kprintf("weirdo mapping\n");
-        kernel_page_directory[1022] = current_vas_base | x86_PAGE_PRESENT | x86_PAGE_WRITABLE | x86_PAGE_LOCKED;
-		vas_flush_tlb();
+	if (old_phys != vas_get_zero_page() && phys_get_share_count(old_phys) == 0) {
+		*entry |= x86_PAGE_WRITABLE;
+		*entry &= ~x86_PAGE_COPY_ON_WRITE;
+		arch_flush_tlb_entry(virt_addr & ~0xFFF);
+		return;
+	}
 
-		recursive_base_addr = RECURSIVE_MAPPING_ALT_ADDR;
+	/*
+	* Fill in a new physical page through the direct map before the page gets switched
+	* over. Writing to the zero page just needs a fresh page of zeros.
+	*/
+	size_t new_phys = vas_allocate_user_page(current_cpu->current_vas);
+	if (old_phys == vas_get_zero_page()) {
+		memset((void*) phys_to_virt(new_phys), 0, PAGE_SIZE);
+	} else {
+		memcpy((void*) phys_to_virt(new_phys), (const void*) phys_to_virt(old_phys), PAGE_SIZE);
 	}
 
-	page_table = (size_t*) (recursive_base_addr + table_num * PAGE_SIZE);
-    
-    assert(((size_t) page_table) + page_num * sizeof(size_t) >= RECURSIVE_MAPPING_ADDR);
-    return page_table + page_num;
-}
+	*entry &= 0xFFF & ~x86_PAGE_COPY_ON_WRITE;
+	*entry |= new_phys | x86_PAGE_WRITABLE;
+	arch_flush_tlb_entry(virt_addr & ~0xFFF);
 
-static void x86_unmark_copy_on_write(struct virtual_address_space* vas, size_t virt_addr) {
-	size_t* entry = x86_get_entry(vas, virt_addr, false);
-	assert(entry != NULL);
-	assert((*entry) & x86_PAGE_COPY_ON_WRITE);
+	/*
+	* We no longer use the old page, so drop our share of it.
+	*/
+	if (old_phys != vas_get_zero_page()) {
+		rmap_remove(old_phys, current_cpu->current_vas, virt_addr);
+		phys_free_page(old_phys);
+	}
+	rmap_add(new_phys, current_cpu->current_vas, virt_addr);
+}
 
-	*entry |= x86_PAGE_WRITABLE;
-	*entry &= ~x86_PAGE_COPY_ON_WRITE;
+/*
+* Maps the shared zero page in for a read of a page that is yet to be allocated. If the page
+* is meant to be writable, it gets marked as copy on write so that it gets a page of its own
+* if it is ever written to.
+*/
+static void x86_map_zero_page(size_t* entry) {
+	size_t flags = *entry & 0xFFF & ~x86_PAGE_ALLOCATE_ON_ACCESS;
 
-	if (vas->copied_from != NULL) {
-		x86_unmark_copy_on_write(vas->copied_from, virt_addr);
+	if (flags & x86_PAGE_WRITABLE) {
+		flags &= ~x86_PAGE_WRITABLE;
+		flags |= x86_PAGE_COPY_ON_WRITE;
 	}
+
+	*entry = vas_get_zero_page() | flags | x86_PAGE_PRESENT;
 }
 
-static void x86_perform_copy_on_write(size_t virt_addr) {
-	size_t* entry = x86_get_entry(current_cpu->current_vas, virt_addr, false);
-	assert(entry != NULL);
-	assert((*entry) & x86_PAGE_COPY_ON_WRITE);
-	
-	/*
-	* Store a copy of the data in the page.
-	*/
-	uint8_t page_data[PAGE_SIZE];
-	memcpy(page_data, (const void*) (virt_addr & ~0xFFF), PAGE_SIZE);
+/*
+* Allocates the pages around an allocate on access page that was just accessed. Rather
+* than taking one fault for every page when memory is accessed sequentially, we fill in
+* a small aligned window of neighbouring pages at once (see vas_get_fault_around_pages).
+*
+* Reading from a user page before it has ever been written is common (e.g. large arrays
+* in the BSS, or fresh memory from sbrk), so for reads we share the zero page until the
+* pages actually get written to. Kernel pages always get pages of their own.
+*/
+static void x86_allocate_on_access(struct virtual_address_space* vas, size_t virt_addr, bool write) {
+	size_t fault_page = virt_addr & ~0xFFF;
+	size_t window_pages = vas_get_fault_around_pages(vas, fault_page);
+	size_t window_start = fault_page & ~(window_pages * PAGE_SIZE - 1);
 
 	/*
-	* Create a new physical page for the data to go in.
+	* The window is aligned to its size, and is much smaller than a page table, so
+	* it can't cross into another page table, or into kernel memory.
 	*/
-	size_t new_phys = phys_allocate_page();
+	assert(window_pages <= VAS_FAULT_AROUND_MAX_PAGES);
+	assert(window_start / 0x400000 == fault_page / 0x400000);
 
-	/*
-	* Set the virtual page to the new physical page.
-	*/
-	*entry &= ~0xFFF;
-	*entry |= new_phys;
-	vas_flush_tlb();
+	bool share_zero_page = !write && fault_page < KERNEL_VIRT_ADDR;
 
 	/*
-	* Copy the old data to the new physical page.
+	* The faulting page goes first, as its allocation is the only one that is allowed
+	* to cause a page replacement (the neighbours are only filled in if there is plenty
+	* of free memory).
 	*/
-	memcpy((void*) (virt_addr & ~0xFFF), page_data, PAGE_SIZE);
+	for (size_t i = 0; i <= window_pages; ++i) {
+		size_t page = i == 0 ? fault_page : window_start + (i - 1) * PAGE_SIZE;
+		if (i != 0 && page == fault_page) {
+			continue;
+		}
 
-	*entry |= x86_PAGE_WRITABLE;
-	*entry &= ~x86_PAGE_COPY_ON_WRITE;
+		size_t* entry = x86_get_entry(vas, page, false);
+		assert(entry != NULL);
 
-	x86_unmark_copy_on_write(current_cpu->current_vas, virt_addr);
-}
+		if (!(*entry & x86_PAGE_ALLOCATE_ON_ACCESS) || (*entry & x86_PAGE_PRESENT)) {
+			continue;
+		}
 
+		if (share_zero_page && (*entry & x86_PAGE_USER)) {
+			x86_map_zero_page(entry);
+			continue;
+		}
 
-extern size_t x86_get_cr2(void);
+		/*
+		* Zero the memory (through the direct map, so it doesn't matter if the page is read
+		* only), as one purpose to use allocate on access is for the BSS.
+		*/
+		size_t phys = page < KERNEL_VIRT_ADDR ? vas_allocate_user_page(vas) : phys_allocate_page(PHYS_OWNER_KERNEL_HEAP);
+		memset((void*) phys_to_virt(phys), 0, PAGE_SIZE);
 
-int x86_handle_page_fault(struct x86_regs* regs) {
-    size_t virt_addr = x86_get_cr2();
+		*entry = (*entry & 0xFFF & ~x86_PAGE_ALLOCATE_ON_ACCESS) | phys | x86_PAGE_PRESENT;
+		rmap_add(phys, vas, page);
+	}
+
+	/*
+	* None of the pages were present before, so there is nothing in the TLB to flush.
+	*/
+}
 
+/*
+* Does the work of handling a page fault in the current address space. Returns 0 if the
+* faulting access can now be retried, or EFAULT if it was invalid.
+*/
+static int x86_resolve_page_fault_of_type(size_t virt_addr, bool write, bool user, int* type) {
     spinlock_acquire(&current_cpu->current_vas->lock);
 
 	size_t* entry = x86_get_entry(current_cpu->current_vas, virt_addr, false);
@@ -576,8 +711,6 @@ int x86_handle_page_fault(struct x86_regs* regs) {
 	* The page table doesn't exist for this address.
 	*/
 	if (entry == NULL) {
-        kprintf("entry == NULL (cr2 = 0x%X, eip = 0x%X, err = 0x%X)\n", virt_addr, regs->eip, regs->err_code);
-
 		/*
 		 * Still need to release so we can properly call thread_terminate().
 		 */
@@ -586,16 +719,8 @@ int x86_handle_page_fault(struct x86_regs* regs) {
 	}
 
     if ((*entry & x86_PAGE_ALLOCATE_ON_ACCESS) && !(*entry & x86_PAGE_PRESENT)) {
-        size_t page = phys_allocate_page();
-        *entry &= ~x86_PAGE_ALLOCATE_ON_ACCESS;
-        *entry |= x86_PAGE_PRESENT;
-        *entry |= page;
-        arch_flush_tlb();
-
-		/*
-		 * Zero the memory, as one purpose to use allocate on access is for the BSS. 
-		 */
-		memset((void*) (virt_addr & ~0xFFF), 0, 4096);
+		*type = FAULT_ALLOCATE_ON_ACCESS;
+		x86_allocate_on_access(current_cpu->current_vas, virt_addr, write);
         spinlock_release(&current_cpu->current_vas->lock);
         return 0;
     }
@@ -603,14 +728,29 @@ int x86_handle_page_fault(struct x86_regs* regs) {
 	if ((*entry & x86_PAGE_COPY_ON_WRITE) && (*entry & x86_PAGE_PRESENT)) {
 		assert(!(*entry & x86_PAGE_WRITABLE));
 	
-		x86_perform_copy_on_write(virt_addr);
+		if (write) {
+			*type = FAULT_COPY_ON_WRITE;
+			x86_perform_copy_on_write(virt_addr);
+		}
         spinlock_release(&current_cpu->current_vas->lock);
         return 0;
 	} 
 
-    kprintf("PF (cr2 = 0x%X, eip = 0x%X, err = 0x%X)\n", virt_addr, regs->eip, regs->err_code);
+	/*
+	* The page is there, and it isn't copy on write, so the access must have broken
+	* the page's protection (unless the access is actually allowed, in which case
+	* the page must have been fixed up after the fault happened).
+	*/
+	if (*entry & x86_PAGE_PRESENT) {
+		bool allowed = (!write || (*entry & x86_PAGE_WRITABLE)) && (!user || (*entry & x86_PAGE_USER));
+		spinlock_release(&current_cpu->current_vas->lock);
+		return allowed ? 0 : EFAULT;
+	}
 
-    if (*entry & x86_PAGE_LOCKED) {
+    /*
+    * Anything else that isn't on disk was never mapped in the first place.
+    */
+    if ((*entry & x86_PAGE_LOCKED) || !(*entry & x86_PAGE_SWAPPED)) {
 		/*
 		 * Still need to release so we can properly call thread_terminate().
 		 */
@@ -619,9 +759,12 @@ int x86_handle_page_fault(struct x86_regs* regs) {
     }
 
     /*
-    * Reload the page from the swapfile.
+    * Reload the page from the swapfile. The entry still has the flags the page had
+    * before it was swapped out.
     */
+    *type = FAULT_SWAP_IN;
     size_t id = (*entry) >> 12;
+    int flags = x86_real_flags_to_generic(*entry & 0xFFF) & ~VAS_FLAG_SWAPPED;
 
     /*
     * Need to release the lock, as phys_allocate_page() may cause a page to be
@@ -629,20 +772,79 @@ int x86_handle_page_fault(struct x86_regs* regs) {
     */
     spinlock_release(&current_cpu->current_vas->lock);
 
-    size_t phys_page = phys_allocate_page();
+    size_t phys_page = virt_addr < KERNEL_VIRT_ADDR ? vas_allocate_user_page(vas_get_current_vas()) : phys_allocate_page(PHYS_OWNER_KERNEL);
 
     spinlock_acquire(&current_cpu->current_vas->lock);
 
-    arch_vas_set_entry(vas_get_current_vas(), virt_addr & ~0xFFF, phys_page, VAS_FLAG_LOCKED | VAS_FLAG_PRESENT);
-    swapfile_read((uint8_t*) (virt_addr & ~0xFFF), id);
+    /*
+    * Read it in through the direct map, so it only needs to be mapped in once it's ready.
+    */
+    swapfile_read((uint8_t*) phys_to_virt(phys_page), id);
+    swapfile_free(id);
+    arch_vas_set_entry(vas_get_current_vas(), virt_addr & ~0xFFF, phys_page, flags | VAS_FLAG_PRESENT);
+    rmap_add(phys_page, vas_get_current_vas(), virt_addr & ~0xFFF);
+    vas_count_swap(vas_get_current_vas(), true);
+    if (virt_addr >= ARCH_USER_AREA_BASE && virt_addr < ARCH_USER_AREA_LIMIT) {
+        --vas_get_current_vas()->swapped_pages;
+    }
 
     spinlock_release(&current_cpu->current_vas->lock);
 
-    arch_flush_tlb();
-
 	return 0;
 }
 
+/*
+* Handles a page fault in the current address space, keeping track of what type of fault it
+* was and how long it took.
+*/
+static int x86_resolve_page_fault(size_t virt_addr, bool write, bool user) {
+	struct virtual_address_space* vas = current_cpu->current_vas;
+	uint64_t start_time = arch_read_timestamp();
+	uint64_t start_flushes = vas_get_tlb_flush_count();
+
+	int type = FAULT_OTHER;
+	int status = x86_resolve_page_fault_of_type(virt_addr, write, user, &type);
+
+	vas_count_fault(vas, type, arch_read_timestamp() - start_time, vas_get_tlb_flush_count() - start_flushes);
+	return status;
+}
+
+int arch_resolve_page_fault(size_t virt_addr, bool write) {
+	return x86_resolve_page_fault(virt_addr, write, true);
+}
+
+extern size_t x86_get_cr2(void);
+
+int x86_handle_page_fault(struct x86_regs* regs) {
+    size_t virt_addr = x86_get_cr2();
+
+	/*
+	* Bit 1 of the error code is set if the fault was caused by a write, and bit 2
+	* is set if it happened in usermode.
+	*/
+	int status = x86_resolve_page_fault(virt_addr, regs->err_code & 2, regs->err_code & 4);
+	if (status != 0) {
+	    kprintf("PF (cr2 = 0x%X, eip = 0x%X, err = 0x%X)\n", virt_addr, regs->eip, regs->err_code);
+	}
+
+	return status;
+}
+
+
+extern void x86_flush_tlb(void);
+extern void x86_flush_tlb_entry(size_t virt_addr);
+
+void arch_flush_tlb(void) {
+	vas_count_tlb_flush();
+	x86_flush_tlb();
+	x86_tlb_shootdown(X86_TLB_SHOOTDOWN_ALL);
+}
+
+void arch_flush_tlb_entry(size_t virt_addr) {
+	vas_count_tlb_flush();
+	x86_flush_tlb_entry(virt_addr);
+	x86_tlb_shootdown(virt_addr);
+}
 
 /*
 * Map a page of virtual memory to a physical memory page. This has to be done
@@ -666,19 +868,53 @@ void arch_vas_get_entry(struct virtual_address_space* vas, size_t virt_addr, siz
     *phys_addr_out = *page_entry & ~0xFFF;
 }
 
-size_t arch_find_page_replacement_virt_address(struct virtual_address_space* vas) {
-    /*
-    * TODO: keep track of the position so next time we don't start from the start again
-    */
+bool arch_vas_try_get_entry(struct virtual_address_space* vas, size_t virt_addr, size_t* phys_addr_out, int* flags_out) {
+	size_t* page_entry = x86_get_entry(vas, virt_addr, false);
+	if (page_entry == NULL) {
+		return false;
+	}
+
+    *flags_out = x86_real_flags_to_generic(*page_entry & 0xFFF);
+    *phys_addr_out = *page_entry & ~0xFFF;
+	return true;
+}
+
+size_t arch_find_next_present_page(struct virtual_address_space* vas, size_t start, size_t limit) {
+	assert(limit <= KERNEL_VIRT_ADDR);
+
+	for (size_t i = start & ~0xFFF; i < limit; i += ARCH_PAGE_SIZE) {
+		size_t* page_entry = x86_get_entry(vas, i, false);
+
+		if (page_entry == NULL) {
+			/*
+			* No page table, so skip to the next one.
+			*/
+			i = ((i + 0x400000) & ~0x3FFFFF) - ARCH_PAGE_SIZE;
+
+		} else if (*page_entry & x86_PAGE_PRESENT) {
+			return i;
+		}
+	}
+
+	return limit;
+}
+
+size_t arch_find_page_replacement_virt_address_in_range(struct virtual_address_space* vas, size_t start, size_t limit) {
+    assert(limit <= RECURSIVE_MAPPING_ALT_ADDR);
 
-    for (size_t i = 0x00000000U; i < 0xFF800000U; i += ARCH_PAGE_SIZE) {
+    for (size_t i = start & ~0xFFF; i < limit; i += ARCH_PAGE_SIZE) {
         /* 
         * We definitely don't want to allocate page tables if we're already out of memory.
         */
         size_t* page_entry = x86_get_entry(vas, i, false);
 
         if (page_entry != NULL) {
-            if ((*page_entry & x86_PAGE_PRESENT) && !(*page_entry & x86_PAGE_LOCKED)) {
+            /*
+            * Copy on write pages (and the zero page) are shared with other address spaces,
+            * so we can't swap them out from under the others. Nor can read-only pages that
+            * are shared (e.g. after a fork, or by the executable cache).
+            */
+            if ((*page_entry & x86_PAGE_PRESENT) && !(*page_entry & (x86_PAGE_LOCKED | x86_PAGE_COPY_ON_WRITE)) && (*page_entry & ~0xFFF) != vas_get_zero_page() && phys_get_share_count(*page_entry & ~0xFFF) == 0) {
                 return i;
             }
 
@@ -696,6 +932,17 @@ size_t arch_find_page_replacement_virt_address(struct virtual_address_space* vas
         }
     }
 
-    panic("out of memory");
-    return 0;
-} 
\ No newline at end of file
+    return limit;
+}
+
+size_t arch_find_page_replacement_virt_address(struct virtual_address_space* vas) {
+    /*
+    * TODO: keep track of the position so next time we don't start from the start again
+    */
+    size_t virt_addr = arch_find_page_replacement_virt_address_in_range(vas, 0x00000000U, RECURSIVE_MAPPING_ALT_ADDR);
+    if (virt_addr == RECURSIVE_MAPPING_ALT_ADDR) {
+        panic("out of memory");
+    }
+
+    return virt_addr;
+} 
@@ -16,4 +16,7 @@
 int x86_handle_page_fault(struct x86_regs* addr);
 
 size_t lowmem_physical_to_virtual(size_t physical);
-void x86_per_cpu_virt_initialise(void);
\ No newline at end of file
+struct cpu;
+
+void x86_per_cpu_virt_initialise(struct cpu* cpu);
+size_t x86_create_startup_page_directory(void);
\ No newline at end of file
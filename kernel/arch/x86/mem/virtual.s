@@ -9,8 +9,17 @@
 ;
 
 global x86_set_cr3
+global x86_enable_write_protect
 
 x86_set_cr3:
 	mov eax, [esp + 4]
 	mov cr3, eax
 	ret
+
+; Sets the WP bit in CR0, so that the kernel also faults when writing to
+; read-only pages (otherwise it would write straight into shared pages).
+x86_enable_write_protect:
+	mov eax, cr0
+	or eax, (1 << 16)
+	mov cr0, eax
+	ret
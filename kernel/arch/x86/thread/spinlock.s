@@ -1,4 +1,3 @@
-
 ;
 ;
 ; x86/thread/spinlock.s - Spinlocks
@@ -11,10 +10,17 @@
 
 global arch_irq_spinlock_acquire
 global arch_irq_spinlock_release
+global arch_irq_spinlock_try_acquire
+global x86_boot_spinlocks_held
 
 extern x86_allow_interrupts
+extern x86_per_cpu_ready
+extern x86_tlb_shootdowns_enabled
+extern x86_service_tlb_shootdown
 
-x86_spinlocks_held dd 0
+; Until the CPU has its per-CPU data set up (see machine/percpu.h), we count
+; the spinlocks held here instead.
+x86_boot_spinlocks_held dd 0
 
 arch_irq_spinlock_acquire:
 	; We can deadlock if the spinlock is interrupted as it is held,
@@ -31,8 +37,18 @@ arch_irq_spinlock_acquire:
 
 	; Lock was acquired.
 	; Keep track of how many times we have disabled interrupts, so we
-	; only enable them again after that many spinlock releases.
-	inc dword [x86_spinlocks_held]
+	; only enable them again after that many spinlock releases. This is
+	; per-CPU, and is the second entry in the CPU specific data (which
+	; is the third entry in current_cpu).
+	cmp [x86_per_cpu_ready], dword 0
+	je .boot_acquire
+
+	mov ecx, [gs:8]
+	inc dword [ecx + 4]
+	ret
+
+.boot_acquire:
+	inc dword [x86_boot_spinlocks_held]
 	ret
 
 .spin_wait:
@@ -41,10 +57,21 @@ arch_irq_spinlock_acquire:
 	; Hint to the CPU that we are spinning
 	pause
 
+	; Interrupts are off, so we won't see a TLB shootdown request from
+	; another CPU. It might be holding the lock we want while it waits for
+	; us, so we need to check for it here.
+	cmp [x86_tlb_shootdowns_enabled], dword 0
+	je .no_shootdown
+
+	push eax
+	call x86_service_tlb_shootdown
+	pop eax
+
+.no_shootdown:
 	; No point trying to acquire it until it is free
 	test dword [eax], 1
 	jnz .spin_wait
-	
+
 	; Now that it is free, we can attempt to atomically acquire it again
 	jmp .try_acquire
 
@@ -53,14 +80,71 @@ arch_irq_spinlock_release:
 	; The address of the lock is passed in as an argument
 	mov eax, [esp + 4]
 
-	dec dword [x86_spinlocks_held]
+	cmp [x86_per_cpu_ready], dword 0
+	je .boot_release
+
+	mov ecx, [gs:8]
+	dec dword [ecx + 4]
+	jmp .check_count
+
+.boot_release:
+	dec dword [x86_boot_spinlocks_held]
+
+.check_count:
 	jnz .noEnableIRQ
-	
+
 	cmp [x86_allow_interrupts], dword 0
 	je .noEnableIRQ
-	
+
 	sti
 
 .noEnableIRQ:
 	lock btr dword [eax], 0
 	ret
+
+; Tries to acquire the lock once, without spinning. Returns 1 if it was acquired,
+; or 0 if it was already held.
+arch_irq_spinlock_try_acquire:
+	cli
+	mov eax, [esp + 4]
+
+	lock bts dword [eax], 0
+	jc .failed
+
+	; Acquired, so count it like arch_irq_spinlock_acquire does
+	cmp [x86_per_cpu_ready], dword 0
+	je .boot_acquire
+
+	mov ecx, [gs:8]
+	inc dword [ecx + 4]
+	mov eax, 1
+	ret
+
+.boot_acquire:
+	inc dword [x86_boot_spinlocks_held]
+	mov eax, 1
+	ret
+
+.failed:
+	; Interrupts only go back on if no other spinlocks are held
+	cmp [x86_per_cpu_ready], dword 0
+	je .boot_failed
+
+	mov ecx, [gs:8]
+	cmp [ecx + 4], dword 0
+	jmp .check_count
+
+.boot_failed:
+	cmp [x86_boot_spinlocks_held], dword 0
+
+.check_count:
+	jnz .no_enable_irq
+
+	cmp [x86_allow_interrupts], dword 0
+	je .no_enable_irq
+
+	sti
+
+.no_enable_irq:
+	xor eax, eax
+	ret
@@ -11,7 +11,6 @@ global arch_switch_thread
 global arch_prepare_stack
 
 extern thread_startup_handler
-extern current_cpu
 
 arch_prepare_stack:
 	; We need to put 5 things on the stack - dummy values for EBX, ESI,
@@ -48,13 +47,9 @@ arch_switch_thread:
 	; We are now free to trash the general purpose registers (except ESP),
 	; so we can now load the current task using the current_cpu structure.
 	
-	; Find the actual address of the current_cpu structure. (current_cpu stores
-	; a pointer, it isn't the actual structure).
-	mov edi, [current_cpu]
-
-	; The first entry in current_cpu is guaranteed to be the current thread's
-	; structure.
-	mov edi, [edi + 0]
+	; The GS segment starts at this CPU's current_cpu structure, and the first
+	; entry in it is guaranteed to be the current thread's structure.
+	mov edi, [gs:0]
 
 	; The third entry in a thread structure is guaranteed to be the stack pointer.
 	; Save our stack there.
@@ -68,8 +63,7 @@ arch_switch_thread:
 	mov esi, [esp + (4 + 1) * 4]
 	
 	; Update the currently running thread in the current_cpu structure.
-	mov edi, [current_cpu]
-	mov [edi + 0], esi
+	mov [gs:0], esi
 
 	; Reload the new thread stack
 	mov esp, [esi + 8]
@@ -79,7 +73,7 @@ arch_switch_thread:
 	mov ebx, [esi + 4]
 	
 	; The third entry in current_cpu is a pointer to CPU specific data.
-	mov ecx, [edi + 8]
+	mov ecx, [gs:8]
 
 	; The first entry in the CPU specific data is the TSS pointer
 	mov ecx, [ecx + 0]
@@ -13,6 +13,8 @@
 #include <termios.h>
 #include <beeper.h>
 #include <cpu.h>
+#include <callout.h>
+#include <thread.h>
 
 
 /*
@@ -76,25 +78,23 @@ static void console_flush_line_buffer(void) {
 }
 
 
-static void console_beep_thread(void* arg) {
-    (void) arg;
+/*
+* Stops the beep after half a second, without needing a thread to sleep until then.
+*/
+static struct callout beep_callout;
 
-    /*
-    * Play A4 (440Hz) for half a second. Note that if a second beep were to start
-    * before the first one finishes, the second beep will be cut off.
-    */
-    beeper_start(440);
-    thread_nano_sleep(500 * 1000 * 1000);
+static void console_stop_beep(void* arg) {
+    (void) arg;
     beeper_stop();
-    thread_terminate();
 }
 
 static void console_make_beep(void) {
     /*
-    * We need to create a new thread for this so that it can beep and sleep without
-    * blocking the rest of the console.
+    * Play A4 (440Hz) for half a second. If another beep starts before then, it just
+    * makes the first one last longer.
     */
-    thread_create(console_beep_thread, NULL, current_cpu->current_vas);
+    beeper_start(440);
+    callout_schedule(&beep_callout, get_time_since_boot() + 500 * 1000 * 1000);
 }
 
 
@@ -277,6 +277,7 @@ static int console_io(struct std_device_interface* dev, struct uio* io) {
 
 void console_init(void) {
     spinlock_init(&console_driver_lock, "console driver lock");
+    callout_init(&beep_callout, console_stop_beep, NULL);
 
     console_device.data = NULL;
     console_device.block_size = 0;
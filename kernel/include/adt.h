@@ -69,6 +69,7 @@ bool adt_hashmap_contains(struct adt_hashmap* map, void* key);
 void adt_hashmap_add(struct adt_hashmap* map, void* key, void* value);
 void* adt_hashmap_get(struct adt_hashmap* map, void* key);
 int adt_hashmap_size(struct adt_hashmap* map);
+void adt_hashmap_for_each(struct adt_hashmap* map, void (*callback)(void* key, void* value, void* context), void* context);
 
 uint32_t adt_hashmap_null_terminated_string_hash_function(void* arg);
 bool adt_hashmap_null_terminated_string_equality_function(void* s1, void* s2);
\ No newline at end of file
@@ -20,6 +20,8 @@
  			 or ARCH_KRNL_SBRK_LIMIT may equal ARCH_USER_AREA_BASE)
 *	- the user stack area, via ARCH_USER_STACK_BASE and ARCH_USER_STACK_LIMIT
 *       	(may overlap with ARCH_USER_AREA_BASE and ARCH_USER_AREA_LIMIT)
+*	- the direct map of physical memory, via ARCH_DIRECT_MAP_BASE and ARCH_DIRECT_MAP_LIMIT
+*			(physical address 0 is at ARCH_DIRECT_MAP_BASE, and it must not overlap with the other areas)
 */
 
 
@@ -42,19 +44,50 @@ struct arch_memory_range
 
 struct virtual_address_space;
 struct thread;
+struct exec_image;
 
 struct arch_driver_t;
+struct cpu;
 
 /*
 * Needs to setup any CPU specific structures, set up virtual memory for the system
-* and get the current_cpu structure sorted out.
+* and make the given structure become current_cpu.
 */
-void arch_cpu_initialise_bootstrap(void); 
+void arch_cpu_initialise_bootstrap(struct cpu* cpu); 
 
 /*
-* Called once after all CPUs are initialised.
+* Called once the bootstrap CPU is initialised. The other CPUs get started later on
+* (see cpu_start_others).
 */
-void arch_all_cpus_are_done(void);
+void arch_bootstrap_cpu_is_done(void);
+
+/*
+* Starts the next CPU that hasn't been started yet, which should set itself up as the
+* given structure (setting current_vas and platform_specific_data), and then call
+* cpu_ap_main. Returns false if there are no CPUs left to start.
+*/
+bool arch_start_next_cpu(struct cpu* cpu);
+
+/*
+* Interrupts another CPU so that it calls thread_received_reschedule_ipi.
+*/
+void arch_send_reschedule(struct cpu* cpu);
+
+/*
+* Every CPU has a timer which calls thread_received_timer_interrupt, with the bootstrap
+* CPU's calling thread_received_timer_interrupt_bsp first. They tick regularly, but this
+* makes the current CPU's next timer interrupt come after about the given number of
+* nanoseconds instead (it may come sooner if the timer can't wait that long). It goes
+* back to ticking after that, unless this gets called again. Interrupts must be off.
+*/
+void arch_set_next_timer(uint64_t ns);
+
+/*
+* Returns how many nanoseconds it has been since the bootstrap CPU's timer last called
+* thread_received_timer_interrupt_bsp, so that the time can be worked out in between
+* interrupts. Interrupts must be off.
+*/
+uint64_t arch_get_time_since_timer(void);
 
 void arch_initialise_devices_no_fs(void);
 void arch_initialise_devices_with_fs(void);
@@ -76,6 +109,7 @@ void arch_reboot(void);
 
 void arch_irq_spinlock_acquire(volatile size_t* lock);
 void arch_irq_spinlock_release(volatile size_t* lock);
+bool arch_irq_spinlock_try_acquire(volatile size_t* lock);
 
 /*
 * Guaranteed to be called with sequential indexes from 0. No index will be
@@ -87,7 +121,11 @@ void arch_irq_spinlock_release(volatile size_t* lock);
 */
 struct arch_memory_range* arch_get_memory(int index) warn_unused;
 
+/*
+* These flush the TLB of every CPU, and must not return until they are all done.
+*/
 void arch_flush_tlb(void);
+void arch_flush_tlb_entry(size_t virt_addr);
 
 /*
 * Needs only to set the 'data' field of the struct virtual_address_space*
@@ -96,12 +134,28 @@ void arch_vas_create(struct virtual_address_space* vas);
 void arch_vas_copy(struct virtual_address_space* in, struct virtual_address_space* out);
 
 
-void arch_vas_destroy(void* vas);
+void arch_vas_destroy(struct virtual_address_space* vas);
 void arch_vas_load(void* vas);
 void arch_vas_set_entry(struct virtual_address_space* vas_, size_t virt_addr, size_t phys_addr, int flags);
 void arch_vas_get_entry(struct virtual_address_space* vas_, size_t virt_addr, size_t* phys_addr_out, int* flags_out);
 
-int arch_exec(void* data, size_t data_size, size_t* entry_point, size_t* sbrk_point);
+/*
+* Like arch_vas_get_entry, but never allocates any paging structures. Returns false if the
+* address has nowhere to be mapped yet (in which case it is definitely not mapped).
+*/
+bool arch_vas_try_get_entry(struct virtual_address_space* vas_, size_t virt_addr, size_t* phys_addr_out, int* flags_out);
+
+/*
+* Returns the first address in [start, limit) that has a present page, or limit if there
+* isn't one. Only to be used on user addresses.
+*/
+size_t arch_find_next_present_page(struct virtual_address_space* vas, size_t start, size_t limit);
+
+/*
+* Loads a program into an image (see execcache.h) instead of straight into memory, so that
+* it can be shared by everything that runs it. Must fill in the entry and sbrk points.
+*/
+int arch_exec(void* data, size_t data_size, struct exec_image* image);
 
 void arch_set_forked_kernel_stack(struct thread* original, struct thread* forked);
 
@@ -120,7 +174,39 @@ size_t arch_prepare_stack(size_t addr);
 
 uint64_t arch_read_timestamp(void);
 
+/*
+* Returns whether arch_read_timestamp can be used to keep the time, i.e. it exists and
+* counts up at a steady rate. It still gets checked against the timer (see
+* thread/clock.c).
+*/
+bool arch_timestamp_is_usable(void);
+
+/*
+* Returns the number of seconds since 1970 (UTC), from a clock that keeps going while the
+* computer is off, or 0 if there isn't one. It is only read once, at boot.
+*/
+uint64_t arch_read_wall_clock(void);
+
+/*
+* Returns the code that goes in the vDSO's code page (see thread/vdso.c), and sets its
+* size. It runs in user mode at VDSO_CODE_ADDRESS, and its functions must be where
+* sys/vdso.h says they are.
+*/
+const void* arch_get_vdso_code(size_t* size);
+
 size_t arch_load_driver(void* data, size_t data_size, size_t relocation_point);
 int arch_start_driver(size_t driver, void* argument);
 
-size_t arch_find_page_replacement_virt_address(struct virtual_address_space* vas);
\ No newline at end of file
+size_t arch_find_page_replacement_virt_address(struct virtual_address_space* vas);
+
+/*
+* Returns the first page in [start, limit) that can be swapped out, or limit if there isn't one.
+*/
+size_t arch_find_page_replacement_virt_address_in_range(struct virtual_address_space* vas, size_t start, size_t limit);
+
+/*
+* Brings in the page containing a user address in the current address space, as if
+* it had been accessed and caused a page fault. Returns 0 if the access is now valid,
+* or EFAULT if it never could be.
+*/
+int arch_resolve_page_fault(size_t virt_addr, bool write);
\ No newline at end of file
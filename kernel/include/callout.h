@@ -0,0 +1,31 @@
+#pragma once
+
+/*
+* callout.h - Callouts
+*
+* Implemented in thread/callout.c
+*/
+
+#include <common.h>
+#include <timerwheel.h>
+
+/*
+* A function to call at a certain time. It doesn't need to be freed, and can be reused
+* once it has gone off or been cancelled.
+*/
+struct callout {
+    struct timer timer;
+    struct callout* next_due;
+    bool due;                           /* Has gone off, but hasn't been called yet */
+    bool running;                       /* Its function is being called right now */
+
+    void (*function)(void*);
+    void* argument;
+};
+
+void callout_system_init(void);
+void callout_init(struct callout* callout, void (*function)(void*), void* argument);
+void callout_schedule(struct callout* callout, uint64_t when);
+bool callout_cancel(struct callout* callout);
+void callout_run(uint64_t time);
+uint64_t callout_get_next_expiry(void);
@@ -0,0 +1,15 @@
+#pragma once
+
+/*
+* clock.h - Keeping the Time
+*
+* Implemented in thread/clock.c. The time since boot is read with get_time_since_boot
+* (see thread.h).
+*/
+
+#include <common.h>
+
+void clock_init(void);
+void clock_received_timer_interrupt(uint64_t delta);
+uint64_t clock_timestamp_to_ns(uint64_t ticks);
+uint64_t clock_get_wall_time(void);
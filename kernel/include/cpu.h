@@ -1,13 +1,15 @@
 #pragma once
 
+#include <common.h>
+
 struct virtual_address_space;
 struct thread;
 
 struct cpu {
     /*
     * These must be the first three entries in the struct, as they may be used
-    * by assembly code for thread switching. 
-    */ 
+    * by assembly code for thread switching.
+    */
     struct thread* current_thread;                  /* offset 0                     */
     struct virtual_address_space* current_vas;      /* offset sizeof(size_t)        */
     void* platform_specific_data;                   /* offset sizeof(size_t) * 2    */
@@ -16,18 +18,23 @@ struct cpu {
     * From now on, order doesn't matter.
     */
     int cpu_number;
-
+    uint64_t time_used_timestamp;                   /* When the running thread was last charged for its time */
 };
 
 /*
+* Every CPU sees its own struct cpu at the same address, which the platform provides
+* (see machine/percpu.h). Reading something through it can't be split up by the thread
+* moving to another CPU, so current_cpu->current_thread is always the running thread.
+*
 * We must never use the address of current_cpu as identification of which
 * CPU we are looking at (e.g. for storing the owner of a spinlock), as they
 * all share the same virtual address.
 *
-* Instead use cpu_number for identification. 
+* Instead use cpu_number for identification, or cpu_get() to get a CPU's actual
+* structure.
 */
-extern struct cpu* current_cpu;
-
+#include <machine/percpu.h>
+#define current_cpu ARCH_CURRENT_CPU
 
 /*
 * We initialise CPUs one at a time. This variable keeps track of how many have
@@ -38,6 +45,29 @@ extern struct cpu* current_cpu;
 int cpu_get_count(void);
 
 /*
-* Initialises all CPUs on the system.
+* Returns the structure for a CPU that has been initialised.
+*/
+struct cpu* cpu_get(int cpu_number);
+
+/*
+* Like current_cpu->cpu_number, but also works before the first CPU has been
+* initialised.
+*/
+int cpu_get_current_number(void);
+
+/*
+* Initialises the bootstrap CPU.
+*/
+void cpu_init(void);
+
+/*
+* Starts the rest of the CPUs on the system. Threads must be initialised first, as each
+* CPU needs its own idle thread.
+*/
+void cpu_start_others(void);
+
+/*
+* Called by each CPU started by cpu_start_others, once the platform-specific
+* initialisation is done. Never returns.
 */
-void cpu_init(void);
\ No newline at end of file
+void cpu_ap_main(void);
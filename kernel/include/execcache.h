@@ -0,0 +1,72 @@
+#pragma once
+
+/*
+* execcache.h - Executable Cache
+*
+* Implemented in mem/execcache.c
+*/
+
+#include <common.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+struct virtual_address_space;
+
+/*
+* A page of a loaded program. Pages that only contain zeros (e.g. the BSS) have no
+* physical page, and are allocated on access instead.
+*/
+struct exec_image_page {
+    size_t virt_addr;
+    size_t phys_addr;
+    int flags;
+};
+
+/*
+* The pages of a program that has been loaded (by arch_exec), which get shared between
+* everything that runs it.
+*/
+struct exec_image {
+    struct exec_image* next;
+
+    /*
+    * Which file this was loaded from, and what it looked like at the time.
+    */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+
+    size_t entry_point;
+    size_t sbrk_point;
+
+    struct exec_image_page* pages;
+    size_t num_pages;
+    size_t max_pages;
+
+    /*
+    * How many loads are using the image right now. It can't be reclaimed until this
+    * is zero.
+    */
+    int users;
+    bool cached;
+    bool reclaimed;
+    uint64_t last_used;
+};
+
+struct exec_cache_stats {
+    size_t hits;
+    size_t misses;
+    size_t images_reclaimed;
+    size_t pages_reclaimed;
+};
+
+void exec_cache_init(void);
+struct exec_image* exec_image_create(struct stat* st);
+void exec_image_add_segment(struct exec_image* image, size_t virt_addr, const void* data, size_t file_size, size_t mem_size, int flags);
+void exec_image_map(struct exec_image* image, struct virtual_address_space* vas);
+void exec_image_release(struct exec_image* image);
+struct exec_image* exec_cache_lookup(struct stat* st);
+void exec_cache_insert(struct exec_image* image);
+bool exec_cache_reclaim(void);
+void exec_cache_get_stats(struct exec_cache_stats* stats);
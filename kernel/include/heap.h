@@ -2,9 +2,17 @@
 
 #include <common.h>
 
+/*
+* Define HEAP_PROFILING to record kernel heap usage by call site. This costs an extra
+* word per allocation, and a global lock on each call to malloc and free.
+*/
+// #define HEAP_PROFILING
+
 void heap_init(void);
 void heap_reinit(void);
 
 void* malloc(size_t size) warn_unused;
 void* realloc(void* ptr, size_t size) warn_unused;
-void free(void* ptr);
\ No newline at end of file
+void free(void* ptr);
+
+void heap_profile_dump(int max_entries);
\ No newline at end of file
@@ -5,7 +5,67 @@
 */
 
 #include <common.h>
+#include <arch.h>
+
+/* 
+* This should be a power of 2, and above any reasonable
+* page size a machine might have. 
+* TODO: move to arch
+*/
+#define PHYS_MAX_KILOBYTES_OF_MEMORY	(1024 * 128)
+#define PHYS_MAX_PAGES					(PHYS_MAX_KILOBYTES_OF_MEMORY / ARCH_PAGE_SIZE * 1024)
+
+/*
+* What a physical page is being used for. Every allocated page has an owner, so that we
+* can see where memory is going.
+*/
+#define PHYS_OWNER_USER             0       /* Memory belonging to user programs */
+#define PHYS_OWNER_PAGE_TABLE       1       /* Page tables and page directories */
+#define PHYS_OWNER_KERNEL_HEAP      2
+#define PHYS_OWNER_KERNEL_STACK     3
+#define PHYS_OWNER_DRIVER           4       /* Driver images loaded with load_driver */
+#define PHYS_OWNER_CONTIGUOUS       5       /* From phys_allocate_contiguous, e.g. DMA buffers */
+#define PHYS_OWNER_KERNEL           6       /* Anything else the kernel needs */
+#define PHYS_OWNER_EXEC_CACHE       7       /* Pages of programs kept by the executable cache */
+#define PHYS_OWNER_VDSO             8       /* The vDSO's pages, shared by every program */
+#define PHYS_NUM_OWNERS             9
+
+struct phys_owner_stats {
+    size_t pages[PHYS_NUM_OWNERS];
+    size_t peak_pages[PHYS_NUM_OWNERS];
+};
+
+/*
+* Convert between physical addresses and their address in the kernel's direct map of physical
+* memory. Every page that can be allocated is in the direct map, so the kernel can get to it
+* without needing to map it in first.
+*/
+always_inline size_t phys_to_virt(size_t phys_addr) {
+    return ARCH_DIRECT_MAP_BASE + phys_addr;
+}
+
+always_inline size_t virt_to_phys(size_t virt_addr) {
+    return virt_addr - ARCH_DIRECT_MAP_BASE;
+}
 
 void phys_init(void);
-size_t phys_allocate_page(void) warn_unused;
-void phys_free_page(size_t phys_addr);
\ No newline at end of file
+size_t phys_allocate_page(int owner) warn_unused;
+void phys_free_page(size_t phys_addr);
+void phys_share_page(size_t phys_addr);
+int phys_get_share_count(size_t phys_addr);
+int phys_get_owner(size_t phys_addr);
+size_t phys_get_free_page_count(void);
+bool phys_page_exists(size_t phys_addr);
+
+struct phys_compaction_stats {
+    size_t attempts;
+    size_t successes;
+    size_t failures;
+    size_t pages_migrated;
+};
+
+int phys_allocate_contiguous(size_t num_pages, size_t alignment, size_t max_addr, size_t* phys_addr_out) warn_unused;
+void phys_free_contiguous(size_t phys_addr, size_t num_pages);
+void phys_get_compaction_stats(struct phys_compaction_stats* stats);
+void phys_get_owner_stats(struct phys_owner_stats* stats);
+const char* phys_get_owner_name(int owner);
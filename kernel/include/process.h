@@ -8,6 +8,11 @@ struct virtual_address_space;
 struct filedes_table;
 struct thread;
 
+/*
+* The most pages a process may have locked in memory with mlock() at once.
+*/
+#define PROCESS_MAX_LOCKED_PAGES    256
+
 struct process {
     struct adt_list* threads;
     int pid;
@@ -15,11 +20,13 @@ struct process {
     struct filedes_table* fdtable;
     struct spinlock lock;
     size_t sbrk;
+    size_t locked_pages;
 };
 
 void process_init(void);
 struct process* process_create(void);
 struct process* process_create_child(struct virtual_address_space* vas, struct filedes_table* fdtable);
+void process_set_memory_limits(struct process* process, size_t soft_limit, size_t hard_limit);
 int process_kill(struct process* process);
 void process_add_thread(struct process* process, struct thread* thread);
 struct thread* process_create_thread(struct process* process, void(*initial_address)(void*), void* initial_argument);
\ No newline at end of file
@@ -0,0 +1,22 @@
+#pragma once
+
+/*
+* rmap.h - Reverse Mapping
+*
+* Implemented in mem/rmap.c
+*/
+
+#include <common.h>
+
+struct virtual_address_space;
+
+struct rmap_mapping {
+    struct virtual_address_space* vas;
+    size_t virt_addr;
+};
+
+void rmap_init(void);
+void rmap_add(size_t phys_addr, struct virtual_address_space* vas, size_t virt_addr);
+void rmap_remove(size_t phys_addr, struct virtual_address_space* vas, size_t virt_addr);
+size_t rmap_get_mappings(size_t phys_addr, struct rmap_mapping* mappings, size_t max_mappings);
+void rmap_find_mapped_pages(void (*found)(size_t phys_addr));
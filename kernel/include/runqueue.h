@@ -0,0 +1,100 @@
+#pragma once
+
+/*
+* runqueue.h - Run Queues
+*
+* Implemented in thread/runqueue.c
+*/
+
+#include <common.h>
+
+struct thread;
+
+#define RUN_QUEUE_NUM_PRIORITIES    256
+#define RUN_QUEUE_BITMAP_WORDS      (RUN_QUEUE_NUM_PRIORITIES / 32)
+
+/*
+* How long threads get to run for. Real-time threads get a fixed timeslice, which is only
+* used to take turns with other threads of the same priority (and SCHED_FIFO threads don't
+* have one at all). Threads in the fair class should all get a turn within the target
+* latency, so their timeslices get shorter as more of them are runnable (down to the
+* minimum granularity).
+*/
+#define RT_TIMESLICE_NS             10000000
+#define FAIR_TARGET_LATENCY_NS      20000000
+#define FAIR_MIN_GRANULARITY_NS     4000000
+
+/*
+* A thread waking up only preempts a fair thread if it has had this much less time.
+*/
+#define FAIR_WAKEUP_GRANULARITY_NS  2000000
+
+/*
+* Fair threads that have been blocked get put this far behind everyone else, so they get
+* to run soon after waking up, but can't build up credit by sleeping for a long time.
+*/
+#define FAIR_SLEEPER_CREDIT_NS      (FAIR_TARGET_LATENCY_NS / 2)
+
+/*
+* The weight of a PRIORITY_NORMAL thread. A thread with twice the weight gets twice as
+* much time.
+*/
+#define FAIR_NORMAL_WEIGHT          1024
+
+/*
+* Why a thread is being added to a run queue.
+*/
+#define RUN_QUEUE_PREEMPTED         0       /* It was running, and can keep running */
+#define RUN_QUEUE_EXPIRED           1       /* It was running, and used up its timeslice (or yielded) */
+#define RUN_QUEUE_WOKEN             2       /* It is new, or was blocked */
+
+/*
+* A list of threads for each priority level, and a bitmap of which levels have threads
+* in them. Bit n of the summary is set if any bit in word n of the bitmap is set.
+*/
+struct priority_array {
+    struct thread* first[RUN_QUEUE_NUM_PRIORITIES];
+    struct thread* last[RUN_QUEUE_NUM_PRIORITIES];
+    uint32_t bitmap[RUN_QUEUE_BITMAP_WORDS];
+    uint32_t summary;
+};
+
+/*
+* Threads waiting for their turn on a CPU. There are three classes of thread, and a class
+* only runs if the ones before it have nothing to run:
+*
+*   - Real-time threads (priorities below PRIORITY_FAIR). The highest priority one always
+*     runs. Threads of the same priority take turns when their timeslice runs out, and a
+*     thread that gets preempted goes back to the front of its priority level.
+*
+*   - Fair threads, which are kept in a balanced tree sorted by their virtual runtime
+*     (the time they have used, scaled down by their weight). The one that has had the
+*     least time runs next.
+*
+*   - Idle threads.
+*/
+struct run_queue {
+    struct priority_array rt;
+
+    struct thread* fair_root;
+    uint64_t fair_weight;
+    uint64_t min_vruntime;
+
+    struct thread* first_idle;
+    struct thread* last_idle;
+
+    int num_waiting;                /* Not counting idle threads */
+};
+
+void run_queue_init(struct run_queue* queue);
+void run_queue_add(struct run_queue* queue, struct thread* thr, int reason);
+void run_queue_remove(struct run_queue* queue, struct thread* thr);
+struct thread* run_queue_pop(struct run_queue* queue);
+bool run_queue_is_empty(struct run_queue* queue);
+int run_queue_get_num_waiting(struct run_queue* queue);
+struct thread* run_queue_take_migratable(struct run_queue* queue);
+bool run_queue_should_preempt(struct thread* woken, struct thread* current);
+uint64_t run_queue_get_timeslice(struct run_queue* queue, struct thread* thr);
+uint64_t run_queue_get_min_vruntime(struct run_queue* queue);
+bool run_queue_is_fair_priority(int priority);
+int run_queue_get_weight(int priority);
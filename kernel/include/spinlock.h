@@ -19,6 +19,8 @@ void spinlock_init(struct spinlock* lock, const char* name);
 void spinlock_acquire(struct spinlock* lock);
 void spinlock_release(struct spinlock* lock);
 bool spinlock_is_held(struct spinlock* lock);
+bool spinlock_is_held_by_this_cpu(struct spinlock* lock);
+bool spinlock_try_acquire(struct spinlock* lock);
 
 /*
 * Don't use unless you *really* know what you're doing.
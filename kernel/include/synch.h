@@ -4,12 +4,20 @@
 #include <spinlock.h>
 #include <thread.h>
 
+/*
+* Waiting threads are kept in priority order. Semaphores with a max count of 1 are used
+* as mutexes, and remember which thread holds them so that it can inherit the priority
+* of threads waiting for it.
+*/
 struct semaphore {
     int max_count;
     int current_count;
 
     struct thread* first_waiting_thread;
     struct thread* last_waiting_thread;
+
+    struct thread* owner;
+    struct semaphore* next_held;        /* The owner's next held mutex */
 };
 
 struct semaphore* semaphore_create(int max_count);
@@ -18,6 +26,7 @@ void semaphore_acquire(struct semaphore* sem);
 void semaphore_release(struct semaphore* sem);
 void semaphore_set_count(struct semaphore* sem, int count);
 int semaphore_try_acquire(struct semaphore* sem);
+void semaphore_update_inherited_priority(struct thread* thr);
 
 
 struct rw_lock {
@@ -2,7 +2,7 @@
 
 #include <stddef.h>
 
-#define SYSCALL_TABLE_SIZE 16
+#define SYSCALL_TABLE_SIZE 32
 
 #include <syscallnum.h>
 
@@ -5,11 +5,21 @@
 */
 
 #include <common.h>
+#include <sys/schedstat.h>
+#include <timerwheel.h>
 
 struct process;
 struct signal_state;
+struct semaphore;
 
+/*
+* Priorities below PRIORITY_FAIR are real-time: the highest priority thread always runs
+* first. Threads from PRIORITY_FAIR up (except idle threads) share the CPU between them,
+* with the priority deciding how big a share each one gets. See thread/runqueue.c.
+*/
+#define PRIORITY_FAIR		100
 #define PRIORITY_NORMAL		128
+#define PRIORITY_BACKGROUND	200
 #define PRIORITY_IDLE		255
 
 enum thread_state {
@@ -64,18 +74,47 @@ struct thread
 	uint64_t time_used;					/* In system-specific units */
 	struct thread* next;				/* Used in the implementation of the ready/sleeping lists */
 	char* name; 
-	uint64_t sleep_expiry;
-	int priority;
+	struct timer sleep_timer;			/* Wakes it up if it is sleeping */
+	int priority;						/* What it gets scheduled with, which may be inherited */
+	int base_priority;					/* Set by thread_set_priority or thread_set_scheduler */
+	int policy;							/* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+	struct semaphore* blocked_on;		/* The mutex it is waiting for, if any */
+	struct semaphore* held_mutexes;		/* Mutexes it holds that can pass priorities on to it */
+	uint64_t vruntime;					/* Nanoseconds of runtime, scaled by weight (fair threads only) */
+	struct thread* fair_left;			/* Used by the run queue's fair tree */
+	struct thread* fair_right;
+	int fair_height;
+	int fair_weight;					/* The weight it had when added to the run queue */
+	uint64_t ready_since;				/* Timestamp of when it was added to the run queue */
+	bool waking;						/* Whether it was added to the run queue after blocking */
+	int last_cpu;						/* The CPU it last ran on, whose run queue it goes in */
+	bool pinned;						/* Never moved to another CPU */
+	bool on_cpu;						/* Running, or its stack is still in use by a switch away from it */
+	struct schedstat sched_stats;
 	void* argument;
 	size_t canary_position;
-	uint64_t timeslice_expiry;			/* Time since boot in nanoseconds. 0 means no preemption */
+	uint64_t timeslice_expiry;			/* Time since boot in nanoseconds. 0 means no preemption (or it has run out) */
     size_t kernel_stack_size;
     struct process* process;            /* The owning process, or NULL if it is a freestanding thread. */
 	struct signal_state* signals;
 };
 
+/*
+* Scheduling statistics for a CPU. Times are in nanoseconds.
+*/
+struct cpu_sched_stats {
+	uint64_t switches;					/* Times it switched to another thread */
+	uint64_t idle_ns;					/* Time spent running its idle thread */
+	uint64_t migrations;				/* Threads it took from busier CPUs while balancing */
+	uint64_t steals;					/* Threads it took from other CPUs when it had nothing to run */
+	uint64_t timer_interrupts;			/* Times its timer went off */
+	int num_waiting;					/* Threads in its run queue, not counting idle threads */
+};
+
 struct thread* thread_init(void);
+struct thread* thread_init_ap(void);
 struct thread* thread_create(void (*initial_address)(void*), void* argument, struct virtual_address_space* vas);
+struct thread* thread_create_pinned(void (*initial_address)(void*), void* argument, struct virtual_address_space* vas);
 void thread_schedule(void);
 void thread_block(enum thread_state reason);
 void thread_unblock(struct thread* thr);
@@ -84,12 +123,18 @@ void thread_nano_sleep(uint64_t amount);
 void thread_sleep(int seconds);
 void thread_yield(void);
 void thread_received_timer_interrupt_bsp(uint64_t delta);
-void thread_received_timer_interrupt_bsp(uint64_t delta);
+void thread_ensure_bsp_timer(uint64_t when);
 void thread_received_timer_interrupt(void);
+void thread_received_reschedule_ipi(void);
 void thread_postpone_switches(void);
 void thread_end_postpone_switches(void);
 void thread_terminate(void);
 int thread_set_priority(int priority);
+int thread_set_scheduler(int policy, int priority);
+void thread_get_scheduler(struct thread* thr, int* policy, int* priority);
+void thread_change_priority(struct thread* thr, int priority);
+void thread_get_schedstat(struct thread* thr, struct schedstat* stat);
+void thread_get_cpu_sched_stats(int cpu_number, struct cpu_sched_stats* stats);
 
 extern struct thread* terminated_thread_list;
 
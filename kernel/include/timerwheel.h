@@ -0,0 +1,52 @@
+#pragma once
+
+/*
+* timerwheel.h - Timer Wheels
+*
+* Implemented in thread/timerwheel.c
+*/
+
+#include <common.h>
+
+/*
+* Each level of the wheel has this many slots, and each slot on a level covers as much
+* time as all of the slots on the level below it. The lowest level's slots are each
+* 2^TIMER_WHEEL_UNIT_SHIFT nanoseconds (about a quarter of a millisecond), and the
+* levels together cover a bit over an hour. Timers further away than that get put as
+* far away as possible, and moved again when they get there.
+*/
+#define TIMER_WHEEL_LEVELS          4
+#define TIMER_WHEEL_SLOT_BITS       6
+#define TIMER_WHEEL_SLOTS           (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_UNIT_SHIFT      18
+
+struct timer {
+    struct timer* next;
+    struct timer* prev;
+    uint64_t expiry;                    /* In nanoseconds since boot, once slack is applied */
+    int level;
+    int slot;
+    bool pending;
+
+    void (*callback)(void*);
+    void* argument;
+};
+
+/*
+* The slots on each level have a list of timers, and a bitmap of which ones aren't
+* empty. All of the time before current (in units of the lowest level's slots) has
+* been dealt with.
+*/
+struct timer_wheel {
+    struct timer* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t bitmap[TIMER_WHEEL_LEVELS];
+    uint64_t current;
+    int num_pending;
+};
+
+void timer_wheel_init(struct timer_wheel* wheel, uint64_t time);
+void timer_init(struct timer* timer, void (*callback)(void*), void* argument);
+void timer_wheel_add(struct timer_wheel* wheel, struct timer* timer, uint64_t expiry, uint64_t slack);
+void timer_wheel_remove(struct timer_wheel* wheel, struct timer* timer);
+void timer_wheel_advance(struct timer_wheel* wheel, uint64_t time);
+uint64_t timer_wheel_get_next_expiry(struct timer_wheel* wheel);
@@ -0,0 +1,16 @@
+#pragma once
+
+/*
+* vdso.h - Virtual Dynamic Shared Object
+*
+* Implemented in thread/vdso.c. The layout of the pages is in sys/vdso.h.
+*/
+
+#include <common.h>
+
+struct virtual_address_space;
+struct vdso_data;
+
+void vdso_init(void);
+struct vdso_data* vdso_get_data(void);
+void vdso_map(struct virtual_address_space* vas);
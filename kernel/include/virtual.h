@@ -8,20 +8,71 @@
 
 #include <common.h>
 #include <spinlock.h>
+#include <sys/faultstat.h>
+
+struct memstat;
+
+/*
+* The most ranges of memory that can have (non-default) advice on how they will be accessed
+* at once.
+*/
+#define VAS_MAX_ADVICE_RANGES       8
+
+struct vas_advice_range
+{
+    size_t start;
+    size_t end;
+
+    /*
+    * One of MADV_RANDOM or MADV_SEQUENTIAL, or MADV_NORMAL if unused.
+    */
+    int advice;
+};
 
 struct virtual_address_space
 {
 	void* data;
 
-	/*
-	* Useful in implementing fork
-	*/
-	struct virtual_address_space* copied_from;
-
     /*
     * To prevent multiple threads from modifying us at the same time
     */
     struct spinlock lock;
+
+    /*
+    * The window of pages filled in by the last allocate on access fault, and how
+    * big the next one should be. See vas_get_fault_around_pages.
+    */
+    size_t fault_around_start;
+    size_t fault_around_end;
+    size_t fault_around_pages;
+
+    /*
+    * How the program said it will access parts of its memory (see madvise).
+    */
+    struct vas_advice_range advice[VAS_MAX_ADVICE_RANGES];
+
+    /*
+    * How much memory is being used, in pages. Resident pages are user pages in RAM
+    * (shared pages count towards everyone that uses them), and page table pages include
+    * the page directory.
+    */
+    size_t resident_pages;
+    size_t swapped_pages;
+    size_t page_table_pages;
+
+    /*
+    * Limits on the number of resident pages, or 0 if there is no limit. Going over the
+    * soft limit makes our pages the first to be swapped out when memory runs low. The
+    * hard limit can't be gone over at all - our own pages get swapped out instead.
+    */
+    size_t soft_limit_pages;
+    size_t hard_limit_pages;
+
+    /*
+    * Page faults, swapping and TLB flushes for this address space (see sys/faultstat.h).
+    * Protected by the fault statistics lock in mem/vas.c, not by the lock above.
+    */
+    struct faultstat fault_stats;
 };
 
 /*
@@ -34,15 +85,25 @@ struct virtual_address_space
 #define VAS_FLAG_PRESENT		    16
 #define VAS_FLAG_LOCKED			    32
 #define VAS_FLAG_ALLOCATE_ON_ACCESS 64
+#define VAS_FLAG_SWAPPED            128
+
+/*
+* The most pages that will be allocated in one allocate on access fault. Must be a power of 2.
+*/
+#define VAS_FAULT_AROUND_MAX_PAGES  16
 
 size_t virt_allocate_unbacked_krnl_region(size_t bytes) warn_unused;
 void virt_deallocate_unbacked_krnl_region(size_t virt_addr, size_t num_pages);
 void virt_init(void);
-size_t virt_allocate_backed_pages(size_t pages, int flags) warn_unused; 
+size_t virt_allocate_backed_pages(size_t pages, int flags, int owner) warn_unused; 
 void virt_free_backed_pages(size_t virt_addr, size_t num_pages);
 size_t virt_bytes_to_pages(size_t bytes);
 
+void vas_init(void);
+size_t vas_get_zero_page(void);
+struct virtual_address_space* vas_get_next_in_list(void);
 void vas_flush_tlb(void);
+void vas_flush_tlb_entry(struct virtual_address_space* vas, size_t virt_addr);
 struct virtual_address_space* vas_get_current_vas(void) warn_unused;
 struct virtual_address_space* vas_create(void) warn_unused;
 void vas_destroy(struct virtual_address_space* vas);
@@ -51,6 +112,19 @@ struct virtual_address_space* vas_copy(struct virtual_address_space* original) w
 void vas_map(struct virtual_address_space* vas, size_t phys_addr, size_t virt_addr, int flags);
 void vas_reflag(struct virtual_address_space* vas, size_t virt_addr, int flags);
 size_t vas_virtual_to_physical(struct virtual_address_space* vas, size_t virt_addr);
+size_t vas_get_fault_around_pages(struct virtual_address_space* vas, size_t virt_addr);
+int vas_advise(struct virtual_address_space* vas, size_t virt_addr, size_t pages, int advice);
+int vas_lock_pages(struct virtual_address_space* vas, size_t virt_addr, size_t pages, size_t max_new_locks, size_t* pages_locked_out);
+size_t vas_unlock_pages(struct virtual_address_space* vas, size_t virt_addr, size_t pages);
+bool vas_migrate_page(size_t old_phys);
+size_t vas_allocate_user_page(struct virtual_address_space* vas);
+void vas_set_memory_limits(struct virtual_address_space* vas, size_t soft_limit_pages, size_t hard_limit_pages);
+void vas_get_memstat(struct virtual_address_space* vas, struct memstat* stat);
+void vas_count_fault(struct virtual_address_space* vas, int type, uint64_t cycles, uint64_t tlb_flushes);
+void vas_count_swap(struct virtual_address_space* vas, bool swap_in);
+void vas_count_tlb_flush(void);
+uint64_t vas_get_tlb_flush_count(void);
+void vas_get_faultstat(struct virtual_address_space* vas, struct faultstat* stat);
 
 /*
 * Returns the physical address being unmapped.
@@ -60,5 +134,19 @@ size_t vas_unmap(struct virtual_address_space* vas, size_t virt_addr);
 void swapfile_init();
 size_t swapfile_write(uint8_t* data);
 void swapfile_read(uint8_t* data, size_t id);
+void swapfile_share(size_t id);
+void swapfile_free(size_t id);
+
+size_t vas_perform_page_replacement(void);
+
+struct merge_stats {
+    size_t passes;
+    size_t pages_scanned;
+    size_t pages_merged;
+    size_t zero_pages_merged;
+    size_t compare_failures;
+};
 
-size_t vas_perform_page_replacement(void);
\ No newline at end of file
+void merge_init(void);
+void merge_forget_vas(struct virtual_address_space* vas);
+void merge_get_stats(struct merge_stats* stats);
\ No newline at end of file
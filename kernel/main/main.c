@@ -2,6 +2,8 @@
 #include <arch.h>
 #include <physical.h>
 #include <virtual.h>
+#include <rmap.h>
+#include <execcache.h>
 #include <heap.h>
 #include <sys/stat.h>
 #include <string.h>
@@ -22,6 +24,7 @@
 #include <test.h>
 #include <termios.h>
 #include <thread.h>
+#include <vdso.h>
 #include <fs/demofs/demofs.h>
 
 void basic_shell(void* arg) {
@@ -157,13 +160,13 @@ void basic_shell(void* arg) {
 			continue;
 
 		} else if (!strcmp(buffer, "eat")) {
-			size_t v = virt_allocate_backed_pages(32, VAS_FLAG_WRITABLE);
+			size_t v = virt_allocate_backed_pages(32, VAS_FLAG_WRITABLE, PHYS_OWNER_KERNEL);
 			(void) v;
 			
             continue;
 
 		} else if (!strcmp(buffer, "feast")) {
-			size_t v = virt_allocate_backed_pages(256, VAS_FLAG_WRITABLE);
+			size_t v = virt_allocate_backed_pages(256, VAS_FLAG_WRITABLE, PHYS_OWNER_KERNEL);
 			(void) v;
 			
             continue;
@@ -189,6 +192,41 @@ void basic_shell(void* arg) {
 			kprintf("Memory used: %d%% (%d / %d KB)\n\n", percent, num_pages_used * 4, num_pages_total * 4);
 			continue;
 
+		} else if (!strcmp(buffer, "mem")) {
+			struct phys_owner_stats stats;
+			phys_get_owner_stats(&stats);
+			for (int i = 0; i < PHYS_NUM_OWNERS; ++i) {
+				kprintf("%s: %u KB (peak %u KB)\n", phys_get_owner_name(i), stats.pages[i] * 4, stats.peak_pages[i] * 4);
+			}
+			kprintf("\n");
+			continue;
+
+		} else if (!strcmp(buffer, "merge")) {
+			struct merge_stats stats;
+			merge_get_stats(&stats);
+			kprintf("Passes: %u, scanned: %u, merged: %u, merged with zero page: %u, compare failures: %u\n\n",
+				stats.passes, stats.pages_scanned, stats.pages_merged, stats.zero_pages_merged, stats.compare_failures);
+			continue;
+
+		} else if (!strcmp(buffer, "exec")) {
+			struct exec_cache_stats stats;
+			exec_cache_get_stats(&stats);
+			kprintf("Hits: %u, misses: %u, programs reclaimed: %u, pages reclaimed: %u\n\n",
+				stats.hits, stats.misses, stats.images_reclaimed, stats.pages_reclaimed);
+			continue;
+
+		} else if (!strcmp(buffer, "compact")) {
+			struct phys_compaction_stats stats;
+			phys_get_compaction_stats(&stats);
+			kprintf("Attempts: %u, succeeded: %u, failed: %u, pages moved: %u\n\n",
+				stats.attempts, stats.successes, stats.failures, stats.pages_migrated);
+			continue;
+
+		} else if (!strcmp(buffer, "heapprof")) {
+			heap_profile_dump(20);
+			kprintf("\n");
+			continue;
+
 		} else if (!strcmp(buffer, "gui")) {
             load_driver("sys:/clipdraw.sys", false);
             continue;
@@ -217,7 +255,12 @@ void kernel_main()
 	heap_init();
 	cpu_init();
     heap_reinit();
+    vas_init();
+    rmap_init();
+    exec_cache_init();
+    vdso_init();
     thread_init();  
+    cpu_start_others();
     process_init();
     vfs_init();
 	interface_init();
@@ -228,6 +271,7 @@ void kernel_main()
 	vfs_mount_filesystem("hd0", demofs_root_creator);
     vfs_add_virtual_mount_point("sys", "hd0:/System");
     swapfile_init();
+    merge_init();
     syscall_init();
 
     arch_initialise_devices_with_fs();
@@ -0,0 +1,301 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <execcache.h>
+#include <physical.h>
+#include <virtual.h>
+#include <arch.h>
+#include <assert.h>
+#include <string.h>
+#include <spinlock.h>
+#include <heap.h>
+
+/*
+* mem/execcache.c - Executable Cache
+*
+* Keeps the pages of programs that have been loaded, so that running the same program
+* again doesn't need to read and copy it again, and so everything running it shares the
+* same physical pages. Read-only pages are mapped read-only, and writable pages are
+* mapped copy on write, so each process still gets its own copy of any data it changes.
+*
+* The cache holds its own share of each page (see phys_share_page). When memory runs
+* low, programs that nothing is running anymore get dropped from the cache, which is
+* much cheaper than swapping something out.
+*
+* Programs are identified by the device, inode, size and modification time of the file,
+* rather than by the vnode itself, as opening a file twice can give two different vnodes.
+* Only regular files get cached.
+*/
+
+static struct spinlock exec_cache_lock;
+static struct exec_image* exec_cache_head = NULL;
+static uint64_t exec_cache_clock = 0;
+static struct exec_cache_stats exec_cache_stats;
+
+void exec_cache_init(void) {
+    spinlock_init(&exec_cache_lock, "exec cache lock");
+    memset(&exec_cache_stats, 0, sizeof(exec_cache_stats));
+}
+
+/*
+* Creates an empty image for a program being loaded from a file. It starts off with one
+* user (the caller).
+*/
+struct exec_image* exec_image_create(struct stat* st) {
+    struct exec_image* image = malloc(sizeof(struct exec_image));
+    memset(image, 0, sizeof(struct exec_image));
+
+    image->dev = st->st_dev;
+    image->ino = st->st_ino;
+    image->size = st->st_size;
+    image->mtime = st->st_mtime;
+    image->users = 1;
+
+    return image;
+}
+
+static bool exec_image_matches(struct exec_image* image, struct stat* st) {
+    return image->dev == st->st_dev && image->ino == st->st_ino && image->size == st->st_size && image->mtime == st->st_mtime;
+}
+
+/*
+* Finds the page in an image at a virtual address, adding it if it isn't there yet. If it
+* needs to hold data, it gets a physical page (filled with zeros).
+*/
+static struct exec_image_page* exec_image_get_page(struct exec_image* image, size_t virt_addr, bool needs_data) {
+    struct exec_image_page* page = NULL;
+
+    for (size_t i = 0; i < image->num_pages; ++i) {
+        if (image->pages[i].virt_addr == virt_addr) {
+            page = image->pages + i;
+            break;
+        }
+    }
+
+    if (page == NULL) {
+        if (image->num_pages == image->max_pages) {
+            image->max_pages = image->max_pages == 0 ? 16 : image->max_pages * 2;
+            image->pages = realloc(image->pages, sizeof(struct exec_image_page) * image->max_pages);
+        }
+
+        page = image->pages + image->num_pages++;
+        page->virt_addr = virt_addr;
+        page->phys_addr = 0;
+        page->flags = 0;
+    }
+
+    if (needs_data && page->phys_addr == 0) {
+        page->phys_addr = phys_allocate_page(PHYS_OWNER_EXEC_CACHE);
+        memset((void*) phys_to_virt(page->phys_addr), 0, ARCH_PAGE_SIZE);
+    }
+
+    return page;
+}
+
+/*
+* Adds a segment of a program to an image. The first file_size bytes come from data, and
+* the rest of the mem_size bytes are zeros. Flags can contain VAS_FLAG_WRITABLE and
+* VAS_FLAG_EXECUTABLE. The virtual address must be page aligned.
+*/
+void exec_image_add_segment(struct exec_image* image, size_t virt_addr, const void* data, size_t file_size, size_t mem_size, int flags) {
+    assert(virt_addr % ARCH_PAGE_SIZE == 0);
+    assert(file_size <= mem_size);
+
+    size_t total_pages = virt_bytes_to_pages(mem_size);
+
+    for (size_t i = 0; i < total_pages; ++i) {
+        size_t offset = i * ARCH_PAGE_SIZE;
+        struct exec_image_page* page = exec_image_get_page(image, virt_addr + offset, offset < file_size);
+        page->flags |= flags;
+
+        if (offset < file_size) {
+            size_t bytes = file_size - offset < ARCH_PAGE_SIZE ? file_size - offset : ARCH_PAGE_SIZE;
+            memcpy((void*) phys_to_virt(page->phys_addr), ((const uint8_t*) data) + offset, bytes);
+        }
+    }
+}
+
+/*
+* Maps a program into an address space. Pages with data are shared with the cache (and
+* copied when they are first written to), and the rest get allocated on access.
+*/
+void exec_image_map(struct exec_image* image, struct virtual_address_space* vas) {
+    for (size_t i = 0; i < image->num_pages; ++i) {
+        struct exec_image_page* page = image->pages + i;
+
+        if (page->phys_addr == 0) {
+            vas_reflag(vas, page->virt_addr, page->flags | VAS_FLAG_USER | VAS_FLAG_ALLOCATE_ON_ACCESS);
+            continue;
+        }
+
+        int flags = page->flags & ~VAS_FLAG_WRITABLE;
+        if (page->flags & VAS_FLAG_WRITABLE) {
+            flags |= VAS_FLAG_COPY_ON_WRITE;
+        }
+
+        phys_share_page(page->phys_addr);
+        vas_map(vas, page->phys_addr, page->virt_addr, flags | VAS_FLAG_USER);
+    }
+
+    vas_flush_tlb();
+}
+
+/*
+* Gives back the cache's share of each page in an image.
+*/
+static size_t exec_image_free_pages(struct exec_image* image) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < image->num_pages; ++i) {
+        if (image->pages[i].phys_addr != 0) {
+            phys_free_page(image->pages[i].phys_addr);
+            image->pages[i].phys_addr = 0;
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+static void exec_image_destroy(struct exec_image* image) {
+    exec_image_free_pages(image);
+    free(image->pages);
+    free(image);
+}
+
+/*
+* Must be called once the caller is done with an image from exec_image_create or
+* exec_cache_lookup. Images that didn't get put in the cache are destroyed.
+*/
+void exec_image_release(struct exec_image* image) {
+    spinlock_acquire(&exec_cache_lock);
+    assert(image->users > 0);
+    --image->users;
+    bool destroy = !image->cached && image->users == 0;
+    spinlock_release(&exec_cache_lock);
+
+    if (destroy) {
+        exec_image_destroy(image);
+    }
+}
+
+/*
+* Images that have been reclaimed are only taken out of the cache here, as the heap can't
+* be used while reclaiming (it happens when allocating a page, which can be in the middle
+* of handling a page fault).
+*/
+static void exec_cache_free_reclaimed(void) {
+    struct exec_image* reclaimed = NULL;
+
+    spinlock_acquire(&exec_cache_lock);
+    struct exec_image** prev = &exec_cache_head;
+    while (*prev != NULL) {
+        struct exec_image* image = *prev;
+        if (image->reclaimed) {
+            *prev = image->next;
+            image->next = reclaimed;
+            reclaimed = image;
+        } else {
+            prev = &image->next;
+        }
+    }
+    spinlock_release(&exec_cache_lock);
+
+    while (reclaimed != NULL) {
+        struct exec_image* next = reclaimed->next;
+        free(reclaimed->pages);
+        free(reclaimed);
+        reclaimed = next;
+    }
+}
+
+/*
+* Returns the cached image for a file, or NULL if it isn't in the cache. The image must
+* be given back with exec_image_release.
+*/
+struct exec_image* exec_cache_lookup(struct stat* st) {
+    exec_cache_free_reclaimed();
+
+    spinlock_acquire(&exec_cache_lock);
+
+    for (struct exec_image* image = exec_cache_head; image != NULL; image = image->next) {
+        if (!image->reclaimed && exec_image_matches(image, st)) {
+            ++image->users;
+            image->last_used = ++exec_cache_clock;
+            ++exec_cache_stats.hits;
+            spinlock_release(&exec_cache_lock);
+            return image;
+        }
+    }
+
+    ++exec_cache_stats.misses;
+    spinlock_release(&exec_cache_lock);
+    return NULL;
+}
+
+/*
+* Puts a newly loaded image into the cache. The caller still needs to release it.
+*/
+void exec_cache_insert(struct exec_image* image) {
+    spinlock_acquire(&exec_cache_lock);
+    assert(!image->cached);
+
+    image->cached = true;
+    image->last_used = ++exec_cache_clock;
+    image->next = exec_cache_head;
+    exec_cache_head = image;
+
+    spinlock_release(&exec_cache_lock);
+}
+
+/*
+* Whether dropping an image would free any memory, i.e. it has pages that only the cache
+* is using.
+*/
+static bool exec_image_is_unused(struct exec_image* image) {
+    size_t num_backed = 0;
+
+    for (size_t i = 0; i < image->num_pages; ++i) {
+        if (image->pages[i].phys_addr != 0) {
+            if (phys_get_share_count(image->pages[i].phys_addr) != 0) {
+                return false;
+            }
+            ++num_backed;
+        }
+    }
+
+    return num_backed != 0;
+}
+
+/*
+* Drops the least recently used program that nothing is running from the cache. Returns
+* true if this freed at least one page. Called when we run out of physical memory.
+*/
+bool exec_cache_reclaim(void) {
+    spinlock_acquire(&exec_cache_lock);
+
+    struct exec_image* victim = NULL;
+    for (struct exec_image* image = exec_cache_head; image != NULL; image = image->next) {
+        if (image->reclaimed || image->users != 0 || !exec_image_is_unused(image)) {
+            continue;
+        }
+        if (victim == NULL || image->last_used < victim->last_used) {
+            victim = image;
+        }
+    }
+
+    if (victim != NULL) {
+        victim->reclaimed = true;
+        exec_cache_stats.pages_reclaimed += exec_image_free_pages(victim);
+        ++exec_cache_stats.images_reclaimed;
+    }
+
+    spinlock_release(&exec_cache_lock);
+    return victim != NULL;
+}
+
+void exec_cache_get_stats(struct exec_cache_stats* stats) {
+    spinlock_acquire(&exec_cache_lock);
+    *stats = exec_cache_stats;
+    spinlock_release(&exec_cache_lock);
+}
@@ -5,11 +5,16 @@
 #include <arch.h>
 #include <panic.h>
 #include <spinlock.h>
+#include <cpu.h>
 #include <kprintf.h>
 #include <stddef.h>
 #include <assert.h>
 #include <string.h>
 
+#ifdef HEAP_PROFILING
+#include <machine/symbols.h>
+#endif
+
 /* 
 * heap.h - Kernel Heap
 * 
@@ -18,33 +23,88 @@
 * for application heaps (that should be implemented in a userspace library). 
 */
 
-// must fit into *virtual* memory
-#define MAX_HEAP_SIZE                   (1024 * 1024 * 256)
+/*
+* The heap is made of chunks of virtual memory, which are only allocated as the heap
+* runs out of space. Allocations larger than this get a chunk of their own.
+*/
+#define HEAP_CHUNK_SIZE                 (1024 * 256)
 
+#ifdef HEAP_PROFILING
+#define BLOCK_METADATA_BYTES            (sizeof(size_t) * 3)
+#define BLOCK_RETURN_OFFSET_IN_WORDS    2             // skip the size/allocated word and the profile entry
+#else
 #define BLOCK_METADATA_BYTES            (sizeof(size_t) * 2)
-#define BLOCK_MINIMUM_BYTES             (sizeof(size_t) * 4)
-
 #define BLOCK_RETURN_OFFSET_IN_WORDS    1             // skip the size/allocated word
+#endif
+
+#define BLOCK_MINIMUM_BYTES             (sizeof(size_t) * 4)
 
 #define BLOCK_SIZE_INDEX                0
+#define BLOCK_PROFILE_INDEX             1
 #define BLOCK_NEXT_INDEX                1
 #define BLOCK_PREV_INDEX                2
 
+#define BLOCK_CHUNK_SIZE_INDEX          1
+
 #define BLOCK_ALLOCATED                 1
+#define BLOCK_CHUNK_BOUNDARY            2
 
-#define GET_BLOCK_SIZE(blk)             ((blk[BLOCK_SIZE_INDEX] & ~BLOCK_ALLOCATED))
+#define GET_BLOCK_SIZE(blk)             ((blk[BLOCK_SIZE_INDEX] & ~(BLOCK_ALLOCATED | BLOCK_CHUNK_BOUNDARY)))
+#define GET_PREV_BLOCK_SIZE(blk)        ((blk[-1] & ~(BLOCK_ALLOCATED | BLOCK_CHUNK_BOUNDARY)))   // from the previous block's footer
 #define IS_BLOCK_ALLOCATED(blk)         ((blk[BLOCK_SIZE_INDEX] & BLOCK_ALLOCATED))
 #define IS_BLOCK_FREE(blk)              ((!IS_BLOCK_ALLOCATED(blk)))
+#define IS_CHUNK_BOUNDARY(blk)          ((blk[BLOCK_SIZE_INDEX] & BLOCK_CHUNK_BOUNDARY))
 
 /*
 * Block layout:
 *
-* word 0:   size of block in bytes, low bit set if allocated
+* word 0:   size of block in bytes, low bit set if allocated, bit 1 set if it is a
+*           chunk boundary
 * word 1:   (of a free block) next free block
 * word 2:   (of a free block) prev free block
 *
 * word n:   copy of word 0
+*
+* If HEAP_PROFILING is defined, word 1 of an allocated block holds the index of the
+* profile table entry for the call site that allocated it.
+*
+* Each chunk starts and ends with a minimum sized, allocated block marked as a chunk 
+* boundary, so we never try to coalesce with memory that doesn't belong to us. Word 1
+* of the starting boundary holds the size of the entire chunk.
+*/
+
+/*
+* Small allocations are served from per-CPU magazines: small stacks of blocks that
+* have already been allocated from the main heap, and so can be handed out (or taken
+* back) without touching the global heap_lock. Magazines are only refilled or drained
+* against the main heap in batches.
+*
+* The sizes below include the metadata, and must be in increasing order.
 */
+#define HEAP_NUM_SIZE_CLASSES           8
+#define HEAP_MAGAZINE_CAPACITY          16
+#define HEAP_MAGAZINE_BATCH             (HEAP_MAGAZINE_CAPACITY / 2)
+
+static const size_t size_class_bytes[HEAP_NUM_SIZE_CLASSES] = {
+    16, 24, 40, 56, 72, 104, 136, 264
+};
+
+struct heap_magazine {
+    size_t* blocks[HEAP_MAGAZINE_CAPACITY];
+    int count;
+};
+
+/*
+* Each CPU has its own cache, protected by its own lock. The lock is normally never 
+* contended - it only exists to keep interrupt handlers out, and to keep things correct
+* if a thread gets moved to another CPU between looking up the cache and locking it.
+*/
+struct heap_cpu_cache {
+    struct spinlock lock;
+    struct heap_magazine magazines[HEAP_NUM_SIZE_CLASSES];
+};
+
+static struct heap_cpu_cache heap_cpu_caches[ARCH_MAX_CPU_ALLOWED];
 
 size_t* block_head;
 
@@ -55,57 +115,116 @@ size_t bootstrap_heap_pos = 0;
 
 struct spinlock heap_lock;
 
+#ifdef HEAP_PROFILING
+static struct spinlock heap_profile_lock;
+#endif
+
 bool full_heap_initialised;
 
 void heap_init(void)
 {
 	spinlock_init(&heap_lock, "heap lock");	
     full_heap_initialised = false;
+
+#ifdef HEAP_PROFILING
+    spinlock_init(&heap_profile_lock, "heap profile lock");
+#endif
+
+    for (int i = 0; i < ARCH_MAX_CPU_ALLOWED; ++i) {
+        spinlock_init(&heap_cpu_caches[i].lock, "heap cpu cache lock");
+        for (int j = 0; j < HEAP_NUM_SIZE_CLASSES; ++j) {
+            heap_cpu_caches[i].magazines[j].count = 0;
+        }
+    }
 }	
 
-void heap_reinit(void) {
-    spinlock_acquire(&heap_lock);
+size_t heap_used = 0;
+size_t heap_total = 0;
 
-    size_t heap_address = virt_allocate_unbacked_krnl_region(MAX_HEAP_SIZE);
+static void make_block_root(size_t* new_root);
+static void remove_block_from_list(size_t* block);
 
-    for (size_t i = 0; i < MAX_HEAP_SIZE / ARCH_PAGE_SIZE; ++i) {
-        vas_reflag(vas_get_current_vas(), heap_address + i * ARCH_PAGE_SIZE, VAS_FLAG_ALLOCATE_ON_ACCESS | VAS_FLAG_LOCKED);
+/*
+* Adds a new chunk to the heap, big enough to hold a block of at least the given size
+* (including metadata). The pages only get physical memory when they are first used.
+* heap_lock must be held.
+*/
+static void heap_grow(size_t min_size_with_metadata) {
+    size_t chunk_size = min_size_with_metadata + BLOCK_MINIMUM_BYTES * 2;
+    if (chunk_size < HEAP_CHUNK_SIZE) {
+        chunk_size = HEAP_CHUNK_SIZE;
     }
+    chunk_size = virt_bytes_to_pages(chunk_size) * ARCH_PAGE_SIZE;
 
-    block_head = (size_t*) heap_address;
+    size_t chunk_address = virt_allocate_unbacked_krnl_region(chunk_size);
 
-    /*
-    * We want to put allocated blocks on either end of the memory range so we never try
-    * to coalesce with memory that doesn't belong to us.
-    */
-    block_head[BLOCK_SIZE_INDEX] = BLOCK_MINIMUM_BYTES | BLOCK_ALLOCATED;
-    block_head[BLOCK_MINIMUM_BYTES / sizeof(size_t) - 1] = block_head[BLOCK_SIZE_INDEX];
+    for (size_t i = 0; i < chunk_size / ARCH_PAGE_SIZE; ++i) {
+        vas_reflag(vas_get_current_vas(), chunk_address + i * ARCH_PAGE_SIZE, VAS_FLAG_ALLOCATE_ON_ACCESS | VAS_FLAG_LOCKED | VAS_FLAG_WRITABLE);
+    }
+
+    size_t* start_boundary = (size_t*) chunk_address;
+    start_boundary[BLOCK_SIZE_INDEX] = BLOCK_MINIMUM_BYTES | BLOCK_ALLOCATED | BLOCK_CHUNK_BOUNDARY;
+    start_boundary[BLOCK_CHUNK_SIZE_INDEX] = chunk_size;
+    start_boundary[BLOCK_MINIMUM_BYTES / sizeof(size_t) - 1] = start_boundary[BLOCK_SIZE_INDEX];
+
+    size_t* end_boundary = start_boundary + (chunk_size - BLOCK_MINIMUM_BYTES) / sizeof(size_t);
+    end_boundary[BLOCK_SIZE_INDEX] = BLOCK_MINIMUM_BYTES | BLOCK_ALLOCATED | BLOCK_CHUNK_BOUNDARY;
+    end_boundary[BLOCK_MINIMUM_BYTES / sizeof(size_t) - 1] = end_boundary[BLOCK_SIZE_INDEX];
+
+    size_t* main_memory_start = start_boundary + BLOCK_MINIMUM_BYTES / sizeof(size_t);
+    main_memory_start[BLOCK_SIZE_INDEX] = chunk_size - BLOCK_MINIMUM_BYTES * 2;
+    main_memory_start[(chunk_size - BLOCK_MINIMUM_BYTES * 2) / sizeof(size_t) - 1] = main_memory_start[BLOCK_SIZE_INDEX];
+    make_block_root(main_memory_start);
+
+    heap_total += chunk_size - BLOCK_MINIMUM_BYTES * 2;
+}
+
+/*
+* Gives a chunk back to the system if the given free block covers all of it, so long as
+* we would still have a reasonable amount of free space left over afterwards (so that 
+* we don't keep allocating and releasing the same chunk). heap_lock must be held.
+*/
+static void heap_try_shrink(size_t* block) {
+    size_t* next_block = block + GET_BLOCK_SIZE(block) / sizeof(size_t);
 
-    size_t* end_allocation_start = block_head + ((MAX_HEAP_SIZE - BLOCK_MINIMUM_BYTES) / sizeof(size_t));
-    end_allocation_start[BLOCK_SIZE_INDEX] = BLOCK_MINIMUM_BYTES | BLOCK_ALLOCATED;
-    end_allocation_start[BLOCK_MINIMUM_BYTES / sizeof(size_t) - 1] = end_allocation_start[BLOCK_SIZE_INDEX];
-    
     /*
-    * Now for the rest of memory.
+    * The word before the block is the previous block's copy of its size, so we can
+    * tell if it is a boundary without knowing how big it is. Boundaries are always the
+    * minimum size.
     */
-    size_t* main_memory_start = block_head + (BLOCK_MINIMUM_BYTES / sizeof(size_t));
-    main_memory_start[BLOCK_SIZE_INDEX] = MAX_HEAP_SIZE - BLOCK_MINIMUM_BYTES * 2;
-    main_memory_start[BLOCK_NEXT_INDEX] = 0;
-    main_memory_start[BLOCK_PREV_INDEX] = 0;
-    main_memory_start[(MAX_HEAP_SIZE - BLOCK_MINIMUM_BYTES * 2) / sizeof(size_t) - 1] = main_memory_start[BLOCK_SIZE_INDEX];
+    if (!(*(block - 1) & BLOCK_CHUNK_BOUNDARY) || !IS_CHUNK_BOUNDARY(next_block)) {
+        return;
+    }
 
-    block_head = main_memory_start;
+    size_t* prev_block = block - BLOCK_MINIMUM_BYTES / sizeof(size_t);
 
+    size_t size = GET_BLOCK_SIZE(block);
+    if (heap_total - heap_used - size < HEAP_CHUNK_SIZE) {
+        return;
+    }
+
+    size_t chunk_size = prev_block[BLOCK_CHUNK_SIZE_INDEX];
+    assert(chunk_size == size + BLOCK_MINIMUM_BYTES * 2);
+
+    remove_block_from_list(block);
+    heap_total -= size;
+
+    virt_free_backed_pages((size_t) prev_block, chunk_size / ARCH_PAGE_SIZE);
+}
+
+void heap_reinit(void) {
+    spinlock_acquire(&heap_lock);
+    block_head = NULL;
+    heap_grow(HEAP_CHUNK_SIZE);
     full_heap_initialised = true;
     spinlock_release(&heap_lock);
 }
 
-size_t heap_used = 0;
 
 /*
 * Finds a free block that is of a given size, or greater. The given size should include 
-* the metadata size. If no block can be found, it returns NULL (probably a good time for
-* a kernel panic).
+* the metadata size. If no block can be found, it returns NULL (and so the heap needs to
+* grow).
 */
 static size_t* find_free_block(size_t min_size_with_metadata) {
     size_t* current = block_head;
@@ -123,8 +242,6 @@ static size_t* find_free_block(size_t min_size_with_metadata) {
         current = (size_t*) current[BLOCK_NEXT_INDEX];
     }
 
-    panic("find_free_block: kernel heap exhausted");
-
     return NULL;
 }
 
@@ -152,29 +269,23 @@ static void set_block_size(size_t* block, size_t new_size, bool allocated) {
     block[new_size / sizeof(size_t) - 1] = block[BLOCK_SIZE_INDEX];
 }
 
-void* malloc(size_t size)
-{
-    assert(size > 0);
-
-    spinlock_acquire(&heap_lock);
-
-    /*
-    * All later calculations and function calls require the metadata size
-    * to be included. We must also round up to the word size.
-    */
-	size = (size + BLOCK_METADATA_BYTES + 3) & ~0x3;
-
-    if (!full_heap_initialised) {
-        size_t pos = bootstrap_heap_pos;
-        bootstrap_heap_pos += size;
-        spinlock_release(&heap_lock);
-        return (void*) (bootstrap_heap + pos);
-    }
+/*
+* Takes a block of at least the given size (which must include the metadata) off the
+* free list and marks it as allocated. heap_lock must be held.
+*/
+static size_t* allocate_block(size_t size) {
+    assert(spinlock_is_held(&heap_lock));
 
     /*
     * Find a block that will fit us. 
     */
     size_t* block = find_free_block(size);
+    if (block == NULL) {
+        heap_grow(size);
+        block = find_free_block(size);
+        assert(block != NULL);
+    }
+
     size_t block_size = GET_BLOCK_SIZE(block);
 
     size_t* prev_block = (size_t*) block[BLOCK_PREV_INDEX];
@@ -197,13 +308,10 @@ void* malloc(size_t size)
 
         } else {
             /* 
-            * We removed the head! If that was the only block, we need to 
-            * allocate another so we still have a head.
+            * We removed the head! If that was the only block, the list is now
+            * empty, and the heap will grow on the next allocation.
             */
             block_head = next_block;
-            if (block_head == NULL) {
-                panic("malloc: kernel heap exhausted");
-            }
         }
 
         if (next_block) {
@@ -251,11 +359,9 @@ void* malloc(size_t size)
         }
     }
 
-    heap_used += size;
-
-	spinlock_release(&heap_lock);
+    heap_used += GET_BLOCK_SIZE(block);
 
-    return (void*) (block + BLOCK_RETURN_OFFSET_IN_WORDS);
+    return block;
 }
 
 static void make_block_root(size_t* new_root) {
@@ -290,24 +396,23 @@ static void remove_block_from_list(size_t* block) {
     }
 }
 
-void free(void* ptr)
-{
-    /*
-    * Memory on the bootstrap heap cannot be freed.
-    */
-    if (ptr >= (void*) bootstrap_heap && ptr < (void*) (bootstrap_heap + bootstrap_heap_pos)) {
-        return;
-    }
+/*
+* Puts an allocated block back onto the free list, coalescing it with its neighbours
+* where possible. heap_lock must be held.
+*/
+static void release_block(size_t* block) {
+    assert(spinlock_is_held(&heap_lock));
 
-	size_t* block = ((size_t*) ptr) - BLOCK_RETURN_OFFSET_IN_WORDS;
     size_t size = GET_BLOCK_SIZE(block);
 
-    size_t* prev_block = block - (*(block - 1) & ~BLOCK_ALLOCATED) / sizeof(size_t);
+    size_t* prev_block = block - GET_PREV_BLOCK_SIZE(block) / sizeof(size_t);
     size_t* next_block = block + size / sizeof(size_t);
 
     bool coalesce_left = IS_BLOCK_FREE(prev_block); 
     bool coalesce_right = IS_BLOCK_FREE(next_block); 
 
+    size_t* merged_block;
+
     if (!coalesce_left && !coalesce_right) {
         /*
         * Case 1 - insert this block as the new root
@@ -315,6 +420,7 @@ void free(void* ptr)
 
         block[BLOCK_SIZE_INDEX] &= ~BLOCK_ALLOCATED;
         make_block_root(block);
+        merged_block = block;
 
     } else if (!coalesce_left && coalesce_right) {
         /* 
@@ -327,6 +433,7 @@ void free(void* ptr)
         remove_block_from_list(next_block);
         set_block_size(block, combined_size, false);
         make_block_root(block);
+        merged_block = block;
 
     } else if (coalesce_left && !coalesce_right) {
         /* 
@@ -339,6 +446,7 @@ void free(void* ptr)
         remove_block_from_list(prev_block);
         set_block_size(prev_block, combined_size, false);
         make_block_root(prev_block);
+        merged_block = prev_block;
 
     } else {
         /* 
@@ -352,9 +460,283 @@ void free(void* ptr)
         remove_block_from_list(next_block);
         set_block_size(prev_block, combined_size, false);
         make_block_root(prev_block);
+        merged_block = prev_block;
     }
 
     heap_used -= size;
+
+    heap_try_shrink(merged_block);
+}
+
+/*
+* Returns the size class an allocation of a given size (including metadata) should
+* come from, or -1 if it is too large to be cached.
+*/
+static int get_size_class_for_allocation(size_t size) {
+    for (int i = 0; i < HEAP_NUM_SIZE_CLASSES; ++i) {
+        if (size <= size_class_bytes[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+* Returns the size class a freed block can be cached in, or -1 if it shouldn't be cached.
+* Blocks can be slightly larger than their size class (when splitting would have left a
+* fragment that was too small), so we put it in the largest class it can satisfy.
+*/
+static int get_size_class_for_free(size_t block_size) {
+    for (int i = HEAP_NUM_SIZE_CLASSES - 1; i >= 0; --i) {
+        if (block_size >= size_class_bytes[i]) {
+            return block_size < size_class_bytes[i] + BLOCK_MINIMUM_BYTES ? i : -1;
+        }
+    }
+    return -1;
+}
+
+/*
+* We may be moved to a different CPU after looking up the cache, but this is okay, as
+* we lock the cache before we use it.
+*/
+static struct heap_cpu_cache* get_cpu_cache(void) {
+    return &heap_cpu_caches[current_cpu->cpu_number];
+}
+
+static size_t* allocate_from_magazine(int size_class) {
+    struct heap_cpu_cache* cache = get_cpu_cache();
+
+    spinlock_acquire(&cache->lock);
+    struct heap_magazine* magazine = &cache->magazines[size_class];
+
+    if (magazine->count == 0) {
+        spinlock_acquire(&heap_lock);
+        for (int i = 0; i < HEAP_MAGAZINE_BATCH; ++i) {
+            magazine->blocks[magazine->count++] = allocate_block(size_class_bytes[size_class]);
+        }
+        spinlock_release(&heap_lock);
+    }
+
+    size_t* block = magazine->blocks[--magazine->count];
+    spinlock_release(&cache->lock);
+
+    return block;
+}
+
+static void free_to_magazine(size_t* block, int size_class) {
+    struct heap_cpu_cache* cache = get_cpu_cache();
+
+    spinlock_acquire(&cache->lock);
+    struct heap_magazine* magazine = &cache->magazines[size_class];
+
+    if (magazine->count == HEAP_MAGAZINE_CAPACITY) {
+        /*
+        * Give the oldest half back to the main heap so they can be coalesced, and keep
+        * the most recently freed (and therefore most likely cached) blocks.
+        */
+        spinlock_acquire(&heap_lock);
+        for (int i = 0; i < HEAP_MAGAZINE_BATCH; ++i) {
+            release_block(magazine->blocks[i]);
+        }
+        spinlock_release(&heap_lock);
+
+        memmove(magazine->blocks, magazine->blocks + HEAP_MAGAZINE_BATCH, (HEAP_MAGAZINE_CAPACITY - HEAP_MAGAZINE_BATCH) * sizeof(size_t*));
+        magazine->count -= HEAP_MAGAZINE_BATCH;
+    }
+
+    magazine->blocks[magazine->count++] = block;
+    spinlock_release(&cache->lock);
+}
+
+#ifdef HEAP_PROFILING
+
+/*
+* Profiling keeps a small, fixed-size table of call sites, so that we never need to
+* allocate memory to record an allocation. If the table fills up, further call sites
+* get lumped together in entry 0.
+*/
+#define HEAP_PROFILE_TABLE_SIZE         512
+
+struct heap_profile_entry {
+    size_t call_site;
+    size_t live_bytes;
+    size_t live_allocations;
+    size_t total_bytes;
+    size_t total_allocations;
+    size_t total_frees;
+};
+
+static struct heap_profile_entry heap_profile_table[HEAP_PROFILE_TABLE_SIZE];
+
+static size_t get_profile_entry(size_t call_site) {
+    size_t index = (call_site >> 2) % (HEAP_PROFILE_TABLE_SIZE - 1) + 1;
+
+    for (int i = 1; i < HEAP_PROFILE_TABLE_SIZE; ++i) {
+        struct heap_profile_entry* entry = heap_profile_table + index;
+        if (entry->call_site == call_site) {
+            return index;
+        }
+        if (entry->call_site == 0) {
+            entry->call_site = call_site;
+            return index;
+        }
+
+        index = index + 1 == HEAP_PROFILE_TABLE_SIZE ? 1 : index + 1;
+    }
+
+    return 0;
+}
+
+static void profile_allocation(size_t* block, size_t call_site) {
+    spinlock_acquire(&heap_profile_lock);
+    size_t index = get_profile_entry(call_site);
+    struct heap_profile_entry* entry = heap_profile_table + index;
+    entry->live_bytes += GET_BLOCK_SIZE(block);
+    entry->live_allocations++;
+    entry->total_bytes += GET_BLOCK_SIZE(block);
+    entry->total_allocations++;
+    spinlock_release(&heap_profile_lock);
+
+    block[BLOCK_PROFILE_INDEX] = index;
+}
+
+static void profile_free(size_t* block) {
+    spinlock_acquire(&heap_profile_lock);
+    struct heap_profile_entry* entry = heap_profile_table + block[BLOCK_PROFILE_INDEX];
+    entry->live_bytes -= GET_BLOCK_SIZE(block);
+    entry->live_allocations--;
+    entry->total_frees++;
+    spinlock_release(&heap_profile_lock);
+}
+
+/*
+* Prints the call sites which currently have the most live bytes allocated.
+*/
+void heap_profile_dump(int max_entries) {
+    /*
+    * Symbol lookup allocates memory (and may need to read from disk the first time), 
+    * so work from a copy of the table.
+    */
+    struct heap_profile_entry* snapshot = malloc(sizeof(heap_profile_table));
+    spinlock_acquire(&heap_profile_lock);
+    memcpy(snapshot, heap_profile_table, sizeof(heap_profile_table));
+    spinlock_release(&heap_profile_lock);
+
+    kprintf("live bytes / live allocs / total allocs / total frees: call site\n");
+
+    for (int i = 0; i < max_entries; ++i) {
+        int best = -1;
+        for (int j = 0; j < HEAP_PROFILE_TABLE_SIZE; ++j) {
+            if (snapshot[j].live_bytes != 0 && (best == -1 || snapshot[j].live_bytes > snapshot[best].live_bytes)) {
+                best = j;
+            }
+        }
+
+        if (best == -1) {
+            break;
+        }
+
+        struct heap_profile_entry* entry = snapshot + best;
+        kprintf("%u / %u / %u / %u: ", entry->live_bytes, entry->live_allocations, entry->total_allocations, entry->total_frees);
+
+        size_t offset;
+        const char* name = best == 0 ? NULL : ksymbol_get_name_from_address(entry->call_site, &offset);
+        if (best == 0) {
+            kprintf("(other)\n");
+        } else if (name == NULL) {
+            kprintf("0x%X\n", entry->call_site);
+        } else {
+            kprintf("%s+0x%X\n", name, offset);
+        }
+
+        entry->live_bytes = 0;
+    }
+
+    free(snapshot);
+}
+
+#else
+
+void heap_profile_dump(int max_entries) {
+    (void) max_entries;
+    kprintf("The kernel was not built with HEAP_PROFILING.\n");
+}
+
+#endif
+
+/*
+* Does the work of malloc. With HEAP_PROFILING, the allocation is charged to the call site
+* given, so that functions like realloc can pass on who called them.
+*/
+static void* malloc_for_call_site(size_t size, size_t call_site)
+{
+    assert(size > 0);
+
+    /*
+    * All later calculations and function calls require the metadata size
+    * to be included. We must also round up to the word size.
+    */
+	size = (size + BLOCK_METADATA_BYTES + 3) & ~0x3;
+
+    size_t* block;
+    int size_class = get_size_class_for_allocation(size);
+
+    if (full_heap_initialised && size_class != -1) {
+        block = allocate_from_magazine(size_class);
+
+    } else {
+        spinlock_acquire(&heap_lock);
+
+        if (!full_heap_initialised) {
+            size_t pos = bootstrap_heap_pos;
+            bootstrap_heap_pos += size;
+            spinlock_release(&heap_lock);
+            return (void*) (bootstrap_heap + pos);
+        }
+
+        block = allocate_block(size);
+        spinlock_release(&heap_lock);
+    }
+
+#ifdef HEAP_PROFILING
+    profile_allocation(block, call_site);
+#else
+    (void) call_site;
+#endif
+
+    return (void*) (block + BLOCK_RETURN_OFFSET_IN_WORDS);
+}
+
+void* malloc(size_t size)
+{
+    return malloc_for_call_site(size, (size_t) __builtin_return_address(0));
+}
+
+void free(void* ptr)
+{
+    /*
+    * Memory on the bootstrap heap cannot be freed.
+    */
+    if (ptr >= (void*) bootstrap_heap && ptr < (void*) (bootstrap_heap + bootstrap_heap_pos)) {
+        return;
+    }
+
+	size_t* block = ((size_t*) ptr) - BLOCK_RETURN_OFFSET_IN_WORDS;
+    assert(IS_BLOCK_ALLOCATED(block));
+
+#ifdef HEAP_PROFILING
+    profile_free(block);
+#endif
+
+    int size_class = get_size_class_for_free(GET_BLOCK_SIZE(block));
+    if (size_class != -1) {
+        free_to_magazine(block, size_class);
+        return;
+    }
+
+    spinlock_acquire(&heap_lock);
+    release_block(block);
+    spinlock_release(&heap_lock);
 }
 
 
@@ -362,7 +744,7 @@ void* realloc(void* ptr, size_t size) {
     /* 
     * TODO: this is REALLY BAD, but it might work for now...
     */
-    void* new_ptr = malloc(size);
+    void* new_ptr = malloc_for_call_site(size, (size_t) __builtin_return_address(0));
     memcpy(new_ptr, ptr, size);
     free(ptr);
     return new_ptr;
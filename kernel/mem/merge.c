@@ -0,0 +1,322 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <physical.h>
+#include <virtual.h>
+#include <arch.h>
+#include <assert.h>
+#include <string.h>
+#include <spinlock.h>
+#include <heap.h>
+#include <thread.h>
+#include <rmap.h>
+
+/*
+* mem/merge.c - Same Page Merging
+*
+* Running several copies of the same program leaves many user pages with identical
+* contents (e.g. the code, tables that were initialised but never changed, or the
+* 0xDEADBEEF fill). A low priority thread slowly walks every address space, and when
+* it finds two pages with the same contents, it maps both to one of them as copy on
+* write and frees the other. If either gets written to, the normal copy on write
+* path will give it its own page again.
+*
+* Pages are found by hashing their contents. The hash table only remembers the most
+* recent page with each hash, and pages can change at any time, so a matching hash
+* is only a hint - the pages are compared in full before being merged.
+*/
+
+/*
+* Limits how much time we spend on this. At most MERGE_PAGES_PER_PASS pages are
+* looked at every MERGE_PASS_INTERVAL_NS nanoseconds.
+*/
+#define MERGE_PAGES_PER_PASS        64
+#define MERGE_PASS_INTERVAL_NS      250000000ULL
+
+#define MERGE_TABLE_SIZE            1024
+
+struct merge_candidate {
+    struct virtual_address_space* vas;
+    size_t virt_addr;
+    size_t phys_addr;
+    uint32_t hash;
+};
+
+static struct merge_candidate* merge_table;
+static struct spinlock merge_lock;
+static struct merge_stats merge_stats;
+
+/*
+* Where we are up to in our scan.
+*/
+static struct virtual_address_space* scan_vas = NULL;
+static size_t scan_addr = 0;
+
+static uint32_t zero_page_hash;
+
+static uint32_t merge_hash_page(const uint32_t* data) {
+    uint32_t hash = 2166136261U;
+
+    for (size_t i = 0; i < ARCH_PAGE_SIZE / sizeof(uint32_t); ++i) {
+        hash ^= data[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+/*
+* Private user pages that we are allowed to merge with others.
+*/
+static bool merge_is_candidate(size_t phys, int flags) {
+    int required = VAS_FLAG_PRESENT | VAS_FLAG_USER | VAS_FLAG_WRITABLE;
+    return (flags & required) == required && !(flags & VAS_FLAG_LOCKED) && phys != vas_get_zero_page();
+}
+
+/*
+* Pages already in the hash table can also be pages that have already been merged
+* (or were already shared due to a fork).
+*/
+static bool merge_is_target(size_t phys, int flags) {
+    if ((flags & VAS_FLAG_PRESENT) && (flags & VAS_FLAG_COPY_ON_WRITE) && phys != vas_get_zero_page()) {
+        return true;
+    }
+
+    return merge_is_candidate(phys, flags);
+}
+
+static void merge_remember(struct merge_candidate* entry, struct virtual_address_space* vas, size_t virt_addr, size_t phys_addr, uint32_t hash) {
+    entry->vas = vas;
+    entry->virt_addr = virt_addr;
+    entry->phys_addr = phys_addr;
+    entry->hash = hash;
+}
+
+/*
+* Tries to merge the page mapped at virt_addr in vas (physically at phys) with the page
+* in the table entry. Both address spaces must be locked.
+*/
+static void merge_with_candidate(struct merge_candidate* entry, struct virtual_address_space* vas, size_t virt_addr, size_t phys, int flags) {
+    size_t target_phys;
+    int target_flags;
+    if (!arch_vas_try_get_entry(entry->vas, entry->virt_addr, &target_phys, &target_flags) || target_phys != entry->phys_addr || !merge_is_target(target_phys, target_flags)) {
+        /*
+        * It's changed since we last saw it.
+        */
+        merge_remember(entry, vas, virt_addr, phys, entry->hash);
+        return;
+    }
+
+    /*
+    * Stop both pages from being written to before comparing them, otherwise they could
+    * change after we compare them, but before we merge them.
+    */
+    int shared_flags = (flags & ~VAS_FLAG_WRITABLE) | VAS_FLAG_COPY_ON_WRITE;
+    int target_shared_flags = (target_flags & ~VAS_FLAG_WRITABLE) | VAS_FLAG_COPY_ON_WRITE;
+    arch_vas_set_entry(vas, virt_addr, phys, shared_flags);
+    arch_vas_set_entry(entry->vas, entry->virt_addr, target_phys, target_shared_flags);
+    vas_flush_tlb();
+
+    if (memcmp((const void*) phys_to_virt(phys), (const void*) phys_to_virt(target_phys), ARCH_PAGE_SIZE) != 0) {
+        /*
+        * The hashes collided, or one of them was changed since it was hashed. Put them
+        * back the way they were, and remember the newer one instead.
+        */
+        arch_vas_set_entry(vas, virt_addr, phys, flags);
+        arch_vas_set_entry(entry->vas, entry->virt_addr, target_phys, target_flags);
+        vas_flush_tlb();
+
+        merge_remember(entry, vas, virt_addr, phys, entry->hash);
+        ++merge_stats.compare_failures;
+        return;
+    }
+
+    arch_vas_set_entry(vas, virt_addr, target_phys, shared_flags);
+    vas_flush_tlb();
+
+    rmap_remove(phys, vas, virt_addr);
+    rmap_add(target_phys, vas, virt_addr);
+    phys_share_page(target_phys);
+    phys_free_page(phys);
+    ++merge_stats.pages_merged;
+}
+
+/*
+* Replaces a page that only contains zeros with the zero page.
+*/
+static bool merge_try_zero_page(struct virtual_address_space* vas, size_t virt_addr, size_t phys, int flags) {
+    const uint32_t* data = (const uint32_t*) phys_to_virt(phys);
+
+    for (size_t i = 0; i < ARCH_PAGE_SIZE / sizeof(uint32_t); ++i) {
+        if (data[i] != 0) {
+            return false;
+        }
+    }
+
+    /*
+    * Nothing can write to the page while we hold the lock, so this is safe (unlike
+    * with two real pages).
+    */
+    arch_vas_set_entry(vas, virt_addr, vas_get_zero_page(), (flags & ~VAS_FLAG_WRITABLE) | VAS_FLAG_COPY_ON_WRITE);
+    vas_flush_tlb();
+
+    rmap_remove(phys, vas, virt_addr);
+    phys_free_page(phys);
+    ++merge_stats.zero_pages_merged;
+    return true;
+}
+
+/*
+* Looks at the next present page in the current address space being scanned, and merges it
+* if we've seen one like it before. Returns false if there are no address spaces to look at.
+*/
+static bool merge_scan_next_page(void) {
+    if (scan_vas == NULL) {
+        scan_vas = vas_get_next_in_list();
+        scan_addr = ARCH_USER_AREA_BASE;
+
+        if (scan_vas == NULL) {
+            return false;
+        }
+    }
+
+    struct virtual_address_space* vas = scan_vas;
+    spinlock_acquire(&vas->lock);
+
+    size_t virt_addr = arch_find_next_present_page(vas, scan_addr, ARCH_USER_AREA_LIMIT);
+    if (virt_addr >= ARCH_USER_AREA_LIMIT) {
+        /*
+        * Move onto the next address space next time.
+        */
+        spinlock_release(&vas->lock);
+        scan_vas = NULL;
+        return true;
+    }
+
+    scan_addr = virt_addr + ARCH_PAGE_SIZE;
+    ++merge_stats.pages_scanned;
+
+    size_t phys;
+    int flags;
+    if (!arch_vas_try_get_entry(vas, virt_addr, &phys, &flags) || !merge_is_candidate(phys, flags)) {
+        spinlock_release(&vas->lock);
+        return true;
+    }
+
+    uint32_t hash = merge_hash_page((const uint32_t*) phys_to_virt(phys));
+
+    if (hash == zero_page_hash && merge_try_zero_page(vas, virt_addr, phys, flags)) {
+        spinlock_release(&vas->lock);
+        return true;
+    }
+
+    struct merge_candidate* entry = merge_table + hash % MERGE_TABLE_SIZE;
+
+    if (entry->vas == NULL || entry->hash != hash || (entry->vas == vas && entry->virt_addr == virt_addr)) {
+        merge_remember(entry, vas, virt_addr, phys, hash);
+        spinlock_release(&vas->lock);
+        return true;
+    }
+
+    struct virtual_address_space* entry_vas = entry->vas;
+    if (entry_vas == vas) {
+        merge_with_candidate(entry, vas, virt_addr, phys, flags);
+        spinlock_release(&vas->lock);
+        return true;
+    }
+
+    /*
+    * Two address spaces always get locked in order of their address, so that nothing
+    * else locking both of them can be waiting for us while we wait for it. If ours comes
+    * second, we have to let go of it first, and so the page could have changed in the
+    * meantime. The other address space can't be destroyed while we hold the merge lock
+    * (see merge_forget_vas).
+    */
+    if ((size_t) entry_vas > (size_t) vas) {
+        spinlock_acquire(&entry_vas->lock);
+
+    } else {
+        spinlock_release(&vas->lock);
+        spinlock_acquire(&entry_vas->lock);
+        spinlock_acquire(&vas->lock);
+
+        size_t new_phys;
+        int new_flags;
+        if (!arch_vas_try_get_entry(vas, virt_addr, &new_phys, &new_flags) || new_phys != phys || new_flags != flags) {
+            spinlock_release(&vas->lock);
+            spinlock_release(&entry_vas->lock);
+            return true;
+        }
+    }
+
+    merge_with_candidate(entry, vas, virt_addr, phys, flags);
+
+    spinlock_release(&vas->lock);
+    spinlock_release(&entry_vas->lock);
+    return true;
+}
+
+static void merge_thread(void* arg) {
+    (void) arg;
+
+    thread_set_priority(PRIORITY_BACKGROUND);
+
+    while (true) {
+        thread_nano_sleep(MERGE_PASS_INTERVAL_NS);
+
+        /*
+        * The lock is only held for one page at a time, so address spaces can still be
+        * destroyed in between.
+        */
+        for (int i = 0; i < MERGE_PAGES_PER_PASS; ++i) {
+            spinlock_acquire(&merge_lock);
+            bool more = merge_scan_next_page();
+            spinlock_release(&merge_lock);
+
+            if (!more) {
+                break;
+            }
+        }
+
+        spinlock_acquire(&merge_lock);
+        ++merge_stats.passes;
+        spinlock_release(&merge_lock);
+    }
+}
+
+/*
+* Must be called before an address space is destroyed, so we stop looking at it.
+*/
+void merge_forget_vas(struct virtual_address_space* vas) {
+    spinlock_acquire(&merge_lock);
+
+    if (scan_vas == vas) {
+        scan_vas = NULL;
+    }
+
+    for (int i = 0; i < MERGE_TABLE_SIZE; ++i) {
+        if (merge_table[i].vas == vas) {
+            merge_table[i].vas = NULL;
+        }
+    }
+
+    spinlock_release(&merge_lock);
+}
+
+void merge_get_stats(struct merge_stats* stats) {
+    spinlock_acquire(&merge_lock);
+    *stats = merge_stats;
+    spinlock_release(&merge_lock);
+}
+
+void merge_init(void) {
+    spinlock_init(&merge_lock, "page merge lock");
+
+    merge_table = malloc(sizeof(struct merge_candidate) * MERGE_TABLE_SIZE);
+    memset(merge_table, 0, sizeof(struct merge_candidate) * MERGE_TABLE_SIZE);
+    memset(&merge_stats, 0, sizeof(merge_stats));
+
+    zero_page_hash = merge_hash_page((const uint32_t*) phys_to_virt(vas_get_zero_page()));
+
+    thread_create(merge_thread, NULL, vas_get_current_vas());
+}
@@ -12,6 +12,9 @@
 #include <virtual.h>
 #include <bitarray.h>
 #include <thread.h>
+#include <errno.h>
+#include <rmap.h>
+#include <execcache.h>
 
 /*
 * mem/physical.c - Physical Memory Manager
@@ -25,17 +28,20 @@
 * will use a fixed sized array to keep track of what pages have been
 * allocated. As we only allocate and free one page at at time, a simple
 * bitmap structure where each bit corresponds to a page is sufficient.
+*
+* Some things (e.g. DMA buffers) do need physically contiguous memory. Free pages
+* tend to end up scattered once the system has been running for a while, so if
+* there isn't a long enough run of free pages, we make one by moving user pages
+* out of the way (compaction).
 */
 
-/* 
-* This should be a power of 2, and above any reasonable
-* page size a machine might have. 
-* TODO: move to arch
-*/
-#define MAX_KILOBYTES_OF_MEMORY (1024 * 128)
-#define MAX_PAGES				(MAX_KILOBYTES_OF_MEMORY / ARCH_PAGE_SIZE * 1024)
+#define MAX_PAGES				PHYS_MAX_PAGES
 #define ALLOCATION_BITMAP_SIZE	(MAX_PAGES / 8)
 
+#if PHYS_MAX_KILOBYTES_OF_MEMORY > (ARCH_DIRECT_MAP_LIMIT - ARCH_DIRECT_MAP_BASE) / 1024
+#error "the direct map isn't big enough for all of the physical memory we can use"
+#endif
+
 /*
 * The allocation bitmap. Each bit represents a page according to the formula:
 * 
@@ -49,6 +55,47 @@ uint8_t page_allocation_bitmap[ALLOCATION_BITMAP_SIZE];
 
 struct spinlock phys_lock;
 
+/*
+* The number of extra mappings of each page, for pages that are shared between
+* address spaces (e.g. after a fork, or when identical pages get merged). A page
+* only actually gets freed once this is back to 0.
+*/
+static uint16_t page_share_count[MAX_PAGES];
+
+/*
+* Which pages actually exist (i.e. were free when we started). The allocation bitmap
+* can't tell the difference between a page that has been allocated and one that
+* isn't there.
+*/
+static uint8_t page_usable_bitmap[ALLOCATION_BITMAP_SIZE];
+
+/*
+* The owner of each allocated page (one of PHYS_OWNER_...), and how many pages each owner
+* has now, and has ever had at once.
+*/
+static uint8_t page_owner[MAX_PAGES];
+static struct phys_owner_stats owner_stats;
+
+/*
+* Compaction only runs if doing so won't cause any page replacements. Otherwise we'd
+* need to be able to write to disk while holding locks, and the pages being evicted
+* could be the ones we're trying to move.
+*/
+#define COMPACTION_MIN_FREE_PAGES	64
+#define COMPACTION_ATTEMPTS			3
+
+/*
+* Used while compacting, and protected by the compaction lock. The movable bitmap
+* has a bit set for each user page that might be able to be moved elsewhere (i.e. it
+* is in the reverse map), and the claimed bitmap has a bit set for each page in the
+* range being compacted that now belongs to us (either because it was free, or because
+* its contents have been moved out).
+*/
+static struct spinlock compaction_lock;
+static uint8_t page_movable_bitmap[ALLOCATION_BITMAP_SIZE];
+static uint8_t page_claimed_bitmap[ALLOCATION_BITMAP_SIZE];
+static struct phys_compaction_stats compaction_stats;
+
 static void phys_mark_as_free(size_t page_num)
 {
 	assert(page_num < MAX_PAGES);
@@ -76,6 +123,34 @@ static bool phys_is_page_free(size_t page_num)
 int num_pages_used = 0;
 int num_pages_total = 0;
 
+static void phys_add_to_owner(size_t page_num, int owner)
+{
+	assert(owner >= 0 && owner < PHYS_NUM_OWNERS);
+	assert(spinlock_is_held(&phys_lock));
+
+	page_owner[page_num] = owner;
+	if (++owner_stats.pages[owner] > owner_stats.peak_pages[owner]) {
+		owner_stats.peak_pages[owner] = owner_stats.pages[owner];
+	}
+}
+
+static void phys_remove_from_owner(size_t page_num)
+{
+	assert(spinlock_is_held(&phys_lock));
+	--owner_stats.pages[page_owner[page_num]];
+}
+
+/*
+* Gives an allocated page to a different owner.
+*/
+static void phys_change_owner(size_t page_num, int owner)
+{
+	spinlock_acquire(&phys_lock);
+	phys_remove_from_owner(page_num);
+	phys_add_to_owner(page_num, owner);
+	spinlock_release(&phys_lock);
+}
+
 uint32_t bitmap_checksum = 0;
 
 static uint32_t phys_compute_current_checksum() {
@@ -99,6 +174,7 @@ static void phys_verify_checksum() {
 void phys_init(void)
 {
 	spinlock_init(&phys_lock, "physical memory lock");
+	spinlock_init(&compaction_lock, "compaction lock");
 	spinlock_acquire(&phys_lock);
 
 	/*
@@ -126,6 +202,7 @@ void phys_init(void)
 
 			while (first_page < last_page && first_page < MAX_PAGES) {
                 kprintf("can use 0x%X\n", first_page * ARCH_PAGE_SIZE);
+				bitarray_set(page_usable_bitmap, first_page);
 				phys_mark_as_free(first_page++);
 				++num_pages_total;
 			}
@@ -148,7 +225,7 @@ void phys_init(void)
 *     allocate a page with any thread lists in an inconsistent state, as then the semaphore
 *     acquire will corrupt it).
 */
-size_t phys_allocate_page(void)
+size_t phys_allocate_page(int owner)
 {
 	spinlock_acquire(&phys_lock);
 	phys_verify_checksum();
@@ -172,6 +249,7 @@ size_t phys_allocate_page(void)
 
 		if (phys_is_page_free(page_num)) {
 			phys_mark_as_used(page_num);
+			phys_add_to_owner(page_num, owner);
 			phys_set_new_checksum();
 			spinlock_release(&phys_lock);
 			return page_num * ARCH_PAGE_SIZE;
@@ -180,11 +258,23 @@ size_t phys_allocate_page(void)
 	phys_set_new_checksum();
 	spinlock_release(&phys_lock);
 
+	/*
+	* No pages left. Dropping a program from the executable cache doesn't need anything to
+	* be written to disk, so try that first.
+	*/
+	if (exec_cache_reclaim()) {
+		spinlock_acquire(&phys_lock);
+		--num_pages_used;
+		spinlock_release(&phys_lock);
+		return phys_allocate_page(owner);
+	}
+
 	kprintf("PAGE REPLACEMENT ***********\n");
 	/*
 	* No pages left. Stick one on the disk.
 	*/
     size_t ret = vas_perform_page_replacement();
+	phys_change_owner(ret / ARCH_PAGE_SIZE, owner);
 
 	phys_verify_checksum();
 
@@ -193,17 +283,361 @@ size_t phys_allocate_page(void)
 	return ret;
 }
 
+/*
+* Returns the number of pages which can be allocated without causing a page replacement.
+*/
+size_t phys_get_free_page_count(void)
+{
+	spinlock_acquire(&phys_lock);
+	size_t count = num_pages_total - num_pages_used;
+	spinlock_release(&phys_lock);
+	return count;
+}
+
+/*
+* Returns whether a page of physical memory exists and is usable as RAM (whether or not it
+* is allocated). This doesn't change after phys_init, so no locking is needed.
+*/
+bool phys_page_exists(size_t phys_addr)
+{
+	size_t page_num = phys_addr / ARCH_PAGE_SIZE;
+	return page_num < MAX_PAGES && bitarray_is_set(page_usable_bitmap, page_num);
+}
+
+/*
+* Records that another mapping of a page has been made. The page will then need an
+* extra call to phys_free_page before it actually gets freed.
+*/
+void phys_share_page(size_t phys_addr)
+{
+	spinlock_acquire(&phys_lock);
+
+	size_t page_num = phys_addr / ARCH_PAGE_SIZE;
+	assert(page_num < MAX_PAGES);
+	assert(!phys_is_page_free(page_num));
+	assert(page_share_count[page_num] != UINT16_MAX);
+
+	++page_share_count[page_num];
+	spinlock_release(&phys_lock);
+}
+
+/*
+* Returns the number of mappings of a page other than the first one.
+*/
+int phys_get_share_count(size_t phys_addr)
+{
+	spinlock_acquire(&phys_lock);
+
+	size_t page_num = phys_addr / ARCH_PAGE_SIZE;
+	assert(page_num < MAX_PAGES);
+	int count = page_share_count[page_num];
+	
+	spinlock_release(&phys_lock);
+	return count;
+}
+
+/*
+* Returns which PHYS_OWNER_... an allocated page was allocated for.
+*/
+int phys_get_owner(size_t phys_addr)
+{
+	spinlock_acquire(&phys_lock);
+
+	size_t page_num = phys_addr / ARCH_PAGE_SIZE;
+	assert(page_num < MAX_PAGES);
+	int owner = page_owner[page_num];
+
+	spinlock_release(&phys_lock);
+	return owner;
+}
+
 void phys_free_page(size_t phys_addr)
 {
 	spinlock_acquire(&phys_lock);
 	phys_verify_checksum();
 
-	--num_pages_used;
-
 	size_t page_num = phys_addr / ARCH_PAGE_SIZE;
+
+	/*
+	* Someone else still has it mapped.
+	*/
+	if (page_share_count[page_num] > 0) {
+		--page_share_count[page_num];
+		spinlock_release(&phys_lock);
+		return;
+	}
+
+	--num_pages_used;
 	
-	assert(phys_is_page_free(page_num));
+	assert(!phys_is_page_free(page_num));
+	phys_remove_from_owner(page_num);
 	phys_mark_as_free(page_num);
 	phys_set_new_checksum();
 	spinlock_release(&phys_lock);
-}
\ No newline at end of file
+}
+
+/*
+* Finds the first run of num_pages free pages, starting on a multiple of align_pages, and
+* ending at or before max_page. Returns the first page in the run, or MAX_PAGES if there
+* isn't one.
+*/
+static size_t phys_find_free_run(size_t num_pages, size_t align_pages, size_t max_page)
+{
+	assert(spinlock_is_held(&phys_lock));
+
+	for (size_t start = 0; start + num_pages <= max_page; start += align_pages) {
+		size_t i;
+		for (i = 0; i < num_pages; ++i) {
+			if (!phys_is_page_free(start + i)) {
+				break;
+			}
+		}
+
+		if (i == num_pages) {
+			return start;
+		}
+
+		/*
+		* Skip past the page that isn't free, as any run containing it won't work either.
+		*/
+		start = (start + i) / align_pages * align_pages;
+	}
+
+	return MAX_PAGES;
+}
+
+static void phys_found_movable_page(size_t phys_addr)
+{
+	assert(spinlock_is_held(&compaction_lock));
+
+	/*
+	* The executable cache and the vDSO keep track of their pages by their physical
+	* address, so they can't be moved.
+	*/
+	spinlock_acquire(&phys_lock);
+	int owner = page_owner[phys_addr / ARCH_PAGE_SIZE];
+	spinlock_release(&phys_lock);
+
+	if (owner != PHYS_OWNER_EXEC_CACHE && owner != PHYS_OWNER_VDSO) {
+		bitarray_set(page_movable_bitmap, phys_addr / ARCH_PAGE_SIZE);
+	}
+}
+
+/*
+* Chooses the range that needs the fewest pages moved out of it to make it free. Every
+* page in it must either be free, or a user page that can be moved. Returns the first
+* page in the range, or MAX_PAGES if there isn't one.
+*/
+static size_t phys_choose_compaction_range(size_t num_pages, size_t align_pages, size_t max_page)
+{
+	assert(spinlock_is_held(&compaction_lock));
+	assert(spinlock_is_held(&phys_lock));
+
+	size_t best_start = MAX_PAGES;
+	size_t best_moves = num_pages + 1;
+
+	for (size_t start = 0; start + num_pages <= max_page; start += align_pages) {
+		size_t moves = 0;
+		size_t i;
+		for (i = 0; i < num_pages; ++i) {
+			size_t page = start + i;
+			if (!bitarray_is_set(page_usable_bitmap, page) || (!phys_is_page_free(page) && !bitarray_is_set(page_movable_bitmap, page))) {
+				break;
+			}
+			if (!phys_is_page_free(page)) {
+				++moves;
+			}
+		}
+
+		if (i == num_pages && moves < best_moves) {
+			best_start = start;
+			best_moves = moves;
+		}
+	}
+
+	return best_start;
+}
+
+/*
+* Tries to free up num_pages in a row by moving user pages out of the way. If it works,
+* the pages are allocated and the first one is returned. Otherwise, MAX_PAGES is returned,
+* and any pages that couldn't be moved won't be tried again until the movable bitmap is
+* rebuilt. The compaction lock must be held, but no address spaces may be locked.
+*/
+static size_t phys_compact(size_t num_pages, size_t align_pages, size_t max_page)
+{
+	assert(spinlock_is_held(&compaction_lock));
+
+	if (phys_get_free_page_count() < num_pages + COMPACTION_MIN_FREE_PAGES) {
+		return MAX_PAGES;
+	}
+
+	++compaction_stats.attempts;
+	memset(page_claimed_bitmap, 0, sizeof(page_claimed_bitmap));
+
+	/*
+	* Take all of the free pages in the range straight away, so they can't be used as
+	* somewhere to move the other pages to.
+	*/
+	spinlock_acquire(&phys_lock);
+	size_t start = phys_choose_compaction_range(num_pages, align_pages, max_page);
+	if (start == MAX_PAGES) {
+		spinlock_release(&phys_lock);
+		++compaction_stats.failures;
+		return MAX_PAGES;
+	}
+
+	for (size_t i = start; i < start + num_pages; ++i) {
+		if (phys_is_page_free(i)) {
+			phys_mark_as_used(i);
+			phys_add_to_owner(i, PHYS_OWNER_CONTIGUOUS);
+			bitarray_set(page_claimed_bitmap, i);
+			++num_pages_used;
+		}
+	}
+	phys_set_new_checksum();
+	spinlock_release(&phys_lock);
+
+	/*
+	* Some pages may have changed since we looked for movable pages (e.g. if they got
+	* locked, or freed and then used by the kernel), in which case we need to give back
+	* what we have.
+	*/
+	bool success = true;
+	for (size_t i = start; i < start + num_pages; ++i) {
+		if (bitarray_is_set(page_claimed_bitmap, i)) {
+			continue;
+		}
+
+		if (vas_migrate_page(i * ARCH_PAGE_SIZE)) {
+			phys_change_owner(i, PHYS_OWNER_CONTIGUOUS);
+			bitarray_set(page_claimed_bitmap, i);
+			++compaction_stats.pages_migrated;
+
+		} else {
+			bitarray_clear(page_movable_bitmap, i);
+			success = false;
+			break;
+		}
+	}
+
+	if (!success) {
+		for (size_t i = start; i < start + num_pages; ++i) {
+			if (bitarray_is_set(page_claimed_bitmap, i)) {
+				phys_free_page(i * ARCH_PAGE_SIZE);
+			}
+		}
+		++compaction_stats.failures;
+		return MAX_PAGES;
+	}
+
+	++compaction_stats.successes;
+	return start;
+}
+
+/*
+* Looks for num_pages free pages in a row, and allocates them if found. Returns the first
+* page, or MAX_PAGES if there is no such run.
+*/
+static size_t phys_allocate_free_run(size_t num_pages, size_t align_pages, size_t max_page)
+{
+	spinlock_acquire(&phys_lock);
+	phys_verify_checksum();
+
+	size_t start = phys_find_free_run(num_pages, align_pages, max_page);
+	if (start != MAX_PAGES) {
+		for (size_t i = start; i < start + num_pages; ++i) {
+			phys_mark_as_used(i);
+			phys_add_to_owner(i, PHYS_OWNER_CONTIGUOUS);
+		}
+		num_pages_used += num_pages;
+		phys_set_new_checksum();
+	}
+
+	spinlock_release(&phys_lock);
+	return start;
+}
+
+/*
+* Allocates num_pages pages of physically contiguous memory, starting at a multiple of
+* alignment, and ending at or below max_addr. Memory will be compacted if there is no
+* such range free. Must not be called with any address space locked.
+*
+* Returns 0 on success, or ENOMEM if there is no way to get the memory.
+*/
+int phys_allocate_contiguous(size_t num_pages, size_t alignment, size_t max_addr, size_t* phys_addr_out)
+{
+	assert(num_pages > 0);
+	assert(alignment % ARCH_PAGE_SIZE == 0);
+	assert(phys_addr_out != NULL);
+
+	size_t align_pages = alignment < ARCH_PAGE_SIZE ? 1 : alignment / ARCH_PAGE_SIZE;
+	size_t max_page = max_addr / ARCH_PAGE_SIZE;
+	if (max_page > MAX_PAGES) {
+		max_page = MAX_PAGES;
+	}
+
+	size_t start = phys_allocate_free_run(num_pages, align_pages, max_page);
+	if (start != MAX_PAGES) {
+		*phys_addr_out = start * ARCH_PAGE_SIZE;
+		return 0;
+	}
+
+	/*
+	* Anything mapped by a user address space can be moved.
+	*/
+	spinlock_acquire(&compaction_lock);
+	memset(page_movable_bitmap, 0, sizeof(page_movable_bitmap));
+	rmap_find_mapped_pages(phys_found_movable_page);
+
+	for (int i = 0; i < COMPACTION_ATTEMPTS && start == MAX_PAGES; ++i) {
+		start = phys_compact(num_pages, align_pages, max_page);
+
+		/*
+		* Something else might have freed up a range in the meantime.
+		*/
+		if (start == MAX_PAGES) {
+			start = phys_allocate_free_run(num_pages, align_pages, max_page);
+		}
+	}
+
+	spinlock_release(&compaction_lock);
+
+	if (start == MAX_PAGES) {
+		return ENOMEM;
+	}
+
+	*phys_addr_out = start * ARCH_PAGE_SIZE;
+	return 0;
+}
+
+void phys_free_contiguous(size_t phys_addr, size_t num_pages)
+{
+	for (size_t i = 0; i < num_pages; ++i) {
+		phys_free_page(phys_addr + i * ARCH_PAGE_SIZE);
+	}
+}
+
+void phys_get_compaction_stats(struct phys_compaction_stats* stats)
+{
+	spinlock_acquire(&compaction_lock);
+	*stats = compaction_stats;
+	spinlock_release(&compaction_lock);
+}
+
+void phys_get_owner_stats(struct phys_owner_stats* stats)
+{
+	spinlock_acquire(&phys_lock);
+	*stats = owner_stats;
+	spinlock_release(&phys_lock);
+}
+
+const char* phys_get_owner_name(int owner)
+{
+	static const char* names[PHYS_NUM_OWNERS] = {
+		"user", "page tables", "kernel heap", "kernel stacks", "drivers", "contiguous", "other kernel", "executable cache", "vdso"
+	};
+
+	assert(owner >= 0 && owner < PHYS_NUM_OWNERS);
+	return names[owner];
+}
@@ -0,0 +1,231 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <rmap.h>
+#include <physical.h>
+#include <virtual.h>
+#include <arch.h>
+#include <assert.h>
+#include <string.h>
+#include <spinlock.h>
+#include <panic.h>
+#include <heap.h>
+
+/*
+* mem/rmap.c - Reverse Mapping
+*
+* Keeps track of which address spaces (and where in them) each physical page is mapped,
+* so that things that start with a physical page (e.g. moving pages during compaction)
+* can find and update every page table entry that points to it.
+*
+* Each physical page has a linked list of the places it is mapped. Most pages are only
+* mapped once, and pages are shared by at most a few address spaces, so the lists are
+* short. The list entries come from a pool in kernel memory that gets mapped in one page
+* at a time as it is needed, instead of coming from the heap. This is because mappings
+* get added while handling page faults, with the address space locked, and growing the
+* heap needs the address space lock.
+*
+* Only user memory is tracked, and the zero page isn't either, as it is mapped almost
+* everywhere and never moves.
+*/
+
+#define RMAP_POOL_SIZE      0x400000
+#define RMAP_MAX_ENTRIES    (RMAP_POOL_SIZE / sizeof(struct rmap_entry))
+
+/*
+* Entry 0 is never used, so that an index of 0 can mean 'none'.
+*/
+#define RMAP_NONE           0
+
+struct rmap_entry {
+    struct virtual_address_space* vas;
+    size_t virt_addr;
+    uint32_t next;
+};
+
+static struct spinlock rmap_lock;
+
+/*
+* The index of the first entry for each physical page.
+*/
+static uint32_t* rmap_heads;
+
+static struct rmap_entry* rmap_pool;
+static size_t rmap_pool_bytes_mapped;
+static uint32_t rmap_next_unused;
+static uint32_t rmap_free_list;
+
+void rmap_init(void)
+{
+    spinlock_init(&rmap_lock, "rmap lock");
+
+    rmap_heads = malloc(sizeof(uint32_t) * PHYS_MAX_PAGES);
+    memset(rmap_heads, 0, sizeof(uint32_t) * PHYS_MAX_PAGES);
+
+    rmap_pool = (struct rmap_entry*) virt_allocate_unbacked_krnl_region(RMAP_POOL_SIZE);
+    rmap_pool_bytes_mapped = 0;
+    rmap_next_unused = 1;
+    rmap_free_list = RMAP_NONE;
+}
+
+static bool rmap_is_tracked(size_t phys_addr, size_t virt_addr)
+{
+    return virt_addr >= ARCH_USER_AREA_BASE && virt_addr < ARCH_USER_AREA_LIMIT && phys_addr != vas_get_zero_page();
+}
+
+/*
+* Maps in another page of the pool. The lock must be held, but it gets released while
+* the page is being allocated, as allocating it could cause a page replacement, which
+* will remove a mapping.
+*/
+static void rmap_grow_pool(void)
+{
+    assert(spinlock_is_held(&rmap_lock));
+
+    if (rmap_pool_bytes_mapped >= RMAP_POOL_SIZE) {
+        panic("out of reverse mapping entries");
+    }
+
+    spinlock_release(&rmap_lock);
+    size_t phys_addr = phys_allocate_page(PHYS_OWNER_KERNEL);
+    spinlock_acquire(&rmap_lock);
+
+    /*
+    * The kernel page tables are shared, so the current address space can be used without
+    * locking it.
+    */
+    size_t virt_addr = ((size_t) rmap_pool) + rmap_pool_bytes_mapped;
+    arch_vas_set_entry(vas_get_current_vas(), virt_addr, phys_addr, VAS_FLAG_PRESENT | VAS_FLAG_WRITABLE | VAS_FLAG_LOCKED);
+    arch_flush_tlb_entry(virt_addr);
+
+    rmap_pool_bytes_mapped += ARCH_PAGE_SIZE;
+}
+
+static uint32_t rmap_allocate_entry(void)
+{
+    assert(spinlock_is_held(&rmap_lock));
+
+    if (rmap_free_list != RMAP_NONE) {
+        uint32_t index = rmap_free_list;
+        rmap_free_list = rmap_pool[index].next;
+        return index;
+    }
+
+    /*
+    * Entries can cross page boundaries, so the entry must fit entirely within what is
+    * mapped. (Another page may get mapped in while the lock is released, hence the loop.)
+    */
+    while ((rmap_next_unused + 1) * sizeof(struct rmap_entry) > rmap_pool_bytes_mapped) {
+        rmap_grow_pool();
+    }
+
+    return rmap_next_unused++;
+}
+
+/*
+* Records that a physical page has been mapped at virt_addr in an address space. Pages
+* that aren't tracked (see above) are ignored. This also keeps the address space's count
+* of resident pages, so the address space must be locked.
+*/
+void rmap_add(size_t phys_addr, struct virtual_address_space* vas, size_t virt_addr)
+{
+    if (!rmap_is_tracked(phys_addr, virt_addr)) {
+        return;
+    }
+
+    size_t page_num = phys_addr / ARCH_PAGE_SIZE;
+    assert(page_num < PHYS_MAX_PAGES);
+
+    spinlock_acquire(&rmap_lock);
+
+    uint32_t index = rmap_allocate_entry();
+    rmap_pool[index].vas = vas;
+    rmap_pool[index].virt_addr = virt_addr & ~(ARCH_PAGE_SIZE - 1);
+    rmap_pool[index].next = rmap_heads[page_num];
+    rmap_heads[page_num] = index;
+
+    ++vas->resident_pages;
+
+    spinlock_release(&rmap_lock);
+}
+
+/*
+* Records that a physical page is no longer mapped at virt_addr in an address space. It
+* must have been added with rmap_add.
+*/
+void rmap_remove(size_t phys_addr, struct virtual_address_space* vas, size_t virt_addr)
+{
+    if (!rmap_is_tracked(phys_addr, virt_addr)) {
+        return;
+    }
+
+    size_t page_num = phys_addr / ARCH_PAGE_SIZE;
+    assert(page_num < PHYS_MAX_PAGES);
+
+    virt_addr &= ~(ARCH_PAGE_SIZE - 1);
+
+    spinlock_acquire(&rmap_lock);
+
+    uint32_t* prev_next = rmap_heads + page_num;
+    while (*prev_next != RMAP_NONE) {
+        uint32_t index = *prev_next;
+        struct rmap_entry* entry = rmap_pool + index;
+
+        if (entry->vas == vas && entry->virt_addr == virt_addr) {
+            *prev_next = entry->next;
+            entry->next = rmap_free_list;
+            rmap_free_list = index;
+
+            --vas->resident_pages;
+
+            spinlock_release(&rmap_lock);
+            return;
+        }
+
+        prev_next = &entry->next;
+    }
+
+    panic("removing a reverse mapping that doesn't exist");
+}
+
+/*
+* Fills in up to max_mappings of the places a physical page is mapped, and returns how
+* many places there are in total. The address spaces are not locked, so the mappings can
+* change as soon as this returns.
+*/
+size_t rmap_get_mappings(size_t phys_addr, struct rmap_mapping* mappings, size_t max_mappings)
+{
+    size_t page_num = phys_addr / ARCH_PAGE_SIZE;
+    assert(page_num < PHYS_MAX_PAGES);
+
+    spinlock_acquire(&rmap_lock);
+
+    size_t count = 0;
+    for (uint32_t index = rmap_heads[page_num]; index != RMAP_NONE; index = rmap_pool[index].next) {
+        if (count < max_mappings) {
+            mappings[count].vas = rmap_pool[index].vas;
+            mappings[count].virt_addr = rmap_pool[index].virt_addr;
+        }
+        ++count;
+    }
+
+    spinlock_release(&rmap_lock);
+    return count;
+}
+
+/*
+* Calls found() with every physical page that has at least one mapping. The reverse map is
+* locked while this happens, so found() must not use it.
+*/
+void rmap_find_mapped_pages(void (*found)(size_t phys_addr))
+{
+    spinlock_acquire(&rmap_lock);
+
+    for (size_t i = 0; i < PHYS_MAX_PAGES; ++i) {
+        if (rmap_heads[i] != RMAP_NONE) {
+            found(i * ARCH_PAGE_SIZE);
+        }
+    }
+
+    spinlock_release(&rmap_lock);
+}
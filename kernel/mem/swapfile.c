@@ -10,6 +10,7 @@
 #include <panic.h>
 #include <uio.h>
 #include <bitarray.h>
+#include <assert.h>
 
 #define SWAPFILE_MAX_SIZE_BYTES (1024 * 1024 * 16)
 #define SWAPFILE_MAX_PAGES      (SWAPFILE_MAX_SIZE_BYTES / ARCH_PAGE_SIZE)
@@ -21,6 +22,13 @@ static struct open_file* swapfile_drive;
 static uint8_t* swapfile_usage_bitmap;
 static struct spinlock swapfile_lock;
 
+/*
+* A page on the disk can be used by more than one address space once a process forks. This
+* counts how many more there are than the first, and the page only gets given back once
+* the last of them frees it (like phys_share_page).
+*/
+static uint16_t* swapfile_share_count;
+
 void swapfile_init() {
     swapfile_initial_sector = 1440 * 2;
     swapfile_sector_size = 512;
@@ -34,6 +42,9 @@ void swapfile_init() {
     swapfile_usage_bitmap = malloc(SWAPFILE_MAX_PAGES / 8);
     memset(swapfile_usage_bitmap, 0, SWAPFILE_MAX_PAGES / 8);
 
+    swapfile_share_count = malloc(SWAPFILE_MAX_PAGES * sizeof(uint16_t));
+    memset(swapfile_share_count, 0, SWAPFILE_MAX_PAGES * sizeof(uint16_t));
+
     spinlock_init(&swapfile_lock, "swapfile lock");
 }
 
@@ -73,7 +84,9 @@ size_t swapfile_write(uint8_t* data) {
 
 
 /*
-* Reloads a page from the disk and saves it into RAM at a given location.
+* Reloads a page from the disk and saves it into RAM at a given location. The page stays
+* on the disk, as someone else might still be using it, so it needs to be freed with
+* swapfile_free afterwards.
 */
 void swapfile_read(uint8_t* data, size_t id) {
     if (id >= SWAPFILE_MAX_PAGES) {
@@ -86,6 +99,39 @@ void swapfile_read(uint8_t* data, size_t id) {
     if (status != 0) {
         panic("swapfile: failed to read");
     }
+}
 
-    bitarray_clear(swapfile_usage_bitmap, id);
+/*
+* Lets another address space use a page on the disk, so that it isn't given back until
+* both have freed it.
+*/
+void swapfile_share(size_t id) {
+    if (id >= SWAPFILE_MAX_PAGES) {
+        panic("swapfile: bad id");
+    }
+
+    spinlock_acquire(&swapfile_lock);
+    assert(bitarray_is_set(swapfile_usage_bitmap, id));
+    assert(swapfile_share_count[id] != UINT16_MAX);
+    ++swapfile_share_count[id];
+    spinlock_release(&swapfile_lock);
 }
+
+
+/*
+* Gives up a use of a page on the disk. Once nothing is using it, the space gets given back.
+*/
+void swapfile_free(size_t id) {
+    if (id >= SWAPFILE_MAX_PAGES) {
+        panic("swapfile: bad id");
+    }
+
+    spinlock_acquire(&swapfile_lock);
+    assert(bitarray_is_set(swapfile_usage_bitmap, id));
+    if (swapfile_share_count[id] > 0) {
+        --swapfile_share_count[id];
+    } else {
+        bitarray_clear(swapfile_usage_bitmap, id);
+    }
+    spinlock_release(&swapfile_lock);
+}
\ No newline at end of file
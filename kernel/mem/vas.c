@@ -12,6 +12,11 @@
 #include <panic.h>
 #include <kprintf.h>
 #include <heap.h>
+#include <adt.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <rmap.h>
+#include <sys/memstat.h>
 
 /*
 * mem/vas.c - Virtual Address Spaces
@@ -21,12 +26,619 @@
 *
 */
 
+/*
+* A single page of zeros, shared (read-only) by every address space. Reading from
+* a page that is yet to be allocated maps this page in, so it only needs a real page
+* of its own if it actually gets written to.
+*/
+static size_t zero_page_phys = 0;
+
+/*
+* Every address space other than the kernel's, so that background tasks (e.g. page merging)
+* can find them.
+*/
+static struct adt_list* vas_list;
+static struct spinlock vas_list_lock;
+
+/*
+* Page fault statistics for the whole system. The lock also protects the statistics in
+* each address space. TLB flushes happen before vas_init, but that's okay, as a zeroed
+* spinlock is usable.
+*/
+static struct faultstat system_fault_stats;
+static struct spinlock fault_stats_lock;
+
+/*
+* Must be called after the heap is usable, but before any user address spaces are
+* created. The zero page must exist before the first page fault, as we can't allocate
+* it from inside the fault handler while the address space is locked.
+*/
+void vas_init(void)
+{
+    vas_list = adt_list_create();
+    spinlock_init(&vas_list_lock, "vas list lock");
+    spinlock_init(&fault_stats_lock, "fault stats lock");
+
+    size_t zero_page_virt = virt_allocate_backed_pages(1, VAS_FLAG_WRITABLE | VAS_FLAG_LOCKED, PHYS_OWNER_KERNEL);
+    memset((void*) zero_page_virt, 0, ARCH_PAGE_SIZE);
+    zero_page_phys = vas_virtual_to_physical(vas_get_current_vas(), zero_page_virt);
+
+    /*
+    * Nothing should ever write to it again.
+    */
+    vas_reflag(vas_get_current_vas(), zero_page_virt, VAS_FLAG_PRESENT | VAS_FLAG_LOCKED);
+    vas_flush_tlb();
+}
+
+/*
+* Returns the physical address of the shared zero page.
+*/
+size_t vas_get_zero_page(void)
+{
+    assert(zero_page_phys != 0);
+    return zero_page_phys;
+}
+
+static void vas_add_to_list(struct virtual_address_space* vas)
+{
+    spinlock_acquire(&vas_list_lock);
+    adt_list_add_back(vas_list, vas);
+    spinlock_release(&vas_list_lock);
+}
+
+/*
+* Returns the next address space in a round-robin over all (non-kernel) address spaces,
+* or NULL if there aren't any. The caller is responsible for making sure it doesn't get
+* destroyed while it is being used (see merge_forget_vas).
+*/
+struct virtual_address_space* vas_get_next_in_list(void)
+{
+    spinlock_acquire(&vas_list_lock);
+    struct virtual_address_space* vas = adt_list_size(vas_list) == 0 ? NULL : adt_list_circulate(vas_list);
+    spinlock_release(&vas_list_lock);
+    return vas;
+}
+
+/*
+* The most places a page can be mapped for it to be moved by vas_migrate_page.
+*/
+#define VAS_MIGRATE_MAX_MAPPINGS    16
+
+/*
+* Moves the contents of a user page to a new physical page, and updates every mapping of
+* it to point there instead. Returns true if this worked, in which case nothing uses the
+* old physical page anymore, and the caller is responsible for it. Otherwise, nothing is
+* done to the page (although some of its mappings may have been moved). No address spaces
+* may be locked, and there must be enough free memory that this won't cause a page
+* replacement.
+*/
+bool vas_migrate_page(size_t old_phys)
+{
+    struct rmap_mapping mappings[VAS_MIGRATE_MAX_MAPPINGS];
+
+    /*
+    * Address spaces can't be destroyed while we hold the list lock (see vas_destroy), so
+    * the address spaces in the reverse map stay valid.
+    */
+    spinlock_acquire(&vas_list_lock);
+
+    size_t num_mappings = rmap_get_mappings(old_phys, mappings, VAS_MIGRATE_MAX_MAPPINGS);
+    if (num_mappings == 0 || num_mappings > VAS_MIGRATE_MAX_MAPPINGS) {
+        spinlock_release(&vas_list_lock);
+        return false;
+    }
+
+    size_t new_phys = phys_allocate_page(PHYS_OWNER_USER);
+    const void* src = (const void*) phys_to_virt(old_phys);
+    void* dest = (void*) phys_to_virt(new_phys);
+
+    size_t moved = 0;
+    bool unused = false;
+
+    for (size_t i = 0; i < num_mappings && !unused; ++i) {
+        struct virtual_address_space* vas = mappings[i].vas;
+        size_t virt_addr = mappings[i].virt_addr;
+
+        spinlock_acquire(&vas->lock);
+
+        size_t phys;
+        int flags;
+        if (!arch_vas_try_get_entry(vas, virt_addr, &phys, &flags) || phys != old_phys || !(flags & VAS_FLAG_PRESENT)) {
+            /*
+            * It's already been unmapped.
+            */
+            spinlock_release(&vas->lock);
+            continue;
+        }
+
+        if (flags & VAS_FLAG_LOCKED) {
+            spinlock_release(&vas->lock);
+            break;
+        }
+
+        /*
+        * Stop it from being written to while we copy it. Shared pages are copy on write
+        * and so aren't writable anyway, but one of their other mappings might have become
+        * the only one and had its own copy on write fault since we made the copy. So check
+        * the contents are the same before moving any mapping after the first.
+        */
+        arch_vas_set_entry(vas, virt_addr, old_phys, flags & ~VAS_FLAG_WRITABLE);
+        vas_flush_tlb_entry(vas, virt_addr);
+
+        if (moved == 0) {
+            memcpy(dest, src, ARCH_PAGE_SIZE);
+
+        } else if (memcmp(dest, src, ARCH_PAGE_SIZE) != 0) {
+            arch_vas_set_entry(vas, virt_addr, old_phys, flags);
+            vas_flush_tlb_entry(vas, virt_addr);
+            spinlock_release(&vas->lock);
+            break;
+        }
+
+        arch_vas_set_entry(vas, virt_addr, new_phys, flags);
+        vas_flush_tlb_entry(vas, virt_addr);
+
+        rmap_remove(old_phys, vas, virt_addr);
+        rmap_add(new_phys, vas, virt_addr);
+
+        /*
+        * Move the share over to the new page. The last mapping doesn't have a share to
+        * give back, and once it's gone, nothing else can map the old page.
+        */
+        if (moved != 0) {
+            phys_share_page(new_phys);
+        }
+        if (phys_get_share_count(old_phys) > 0) {
+            phys_free_page(old_phys);
+        } else {
+            unused = true;
+        }
+
+        ++moved;
+        spinlock_release(&vas->lock);
+    }
+
+    if (moved == 0) {
+        phys_free_page(new_phys);
+    }
+
+    spinlock_release(&vas_list_lock);
+    return unused;
+}
+
+/*
+* Fault-around is only done if there are at least this many free pages, so that it doesn't
+* cause page replacements of its own.
+*/
+#define FAULT_AROUND_MIN_FREE_PAGES 256
+
+/*
+* Resets the memory use of a new address space. This has to happen before it gets any
+* pages or page tables.
+*/
+static void vas_init_accounting(struct virtual_address_space* vas)
+{
+    vas->resident_pages = 0;
+    vas->swapped_pages = 0;
+    vas->page_table_pages = 0;
+    vas->soft_limit_pages = 0;
+    vas->hard_limit_pages = 0;
+    memset(&vas->fault_stats, 0, sizeof(struct faultstat));
+}
+
+static void vas_init_fault_around(struct virtual_address_space* vas)
+{
+    vas->fault_around_start = 0;
+    vas->fault_around_end = 0;
+    vas->fault_around_pages = 1;
+
+    for (int i = 0; i < VAS_MAX_ADVICE_RANGES; ++i) {
+        vas->advice[i].advice = MADV_NORMAL;
+    }
+}
+
+/*
+* Returns the advice given for the page containing an address.
+*/
+static int vas_get_advice(struct virtual_address_space* vas, size_t virt_addr)
+{
+    for (int i = 0; i < VAS_MAX_ADVICE_RANGES; ++i) {
+        struct vas_advice_range* range = vas->advice + i;
+        if (range->advice != MADV_NORMAL && virt_addr >= range->start && virt_addr < range->end) {
+            return range->advice;
+        }
+    }
+
+    return MADV_NORMAL;
+}
+
+static struct vas_advice_range* vas_get_free_advice_range(struct virtual_address_space* vas)
+{
+    for (int i = 0; i < VAS_MAX_ADVICE_RANGES; ++i) {
+        if (vas->advice[i].advice == MADV_NORMAL) {
+            return vas->advice + i;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+* Sets the advice for [start, end), replacing any existing advice for that range.
+* The address space must be locked.
+*/
+static int vas_set_advice(struct virtual_address_space* vas, size_t start, size_t end, int advice)
+{
+    assert(spinlock_is_held(&vas->lock));
+
+    /*
+    * Make sure we'll have enough room before changing anything. The worst case is
+    * splitting one range in two, and then adding the new one.
+    */
+    int free_ranges = 0;
+    for (int i = 0; i < VAS_MAX_ADVICE_RANGES; ++i) {
+        free_ranges += vas->advice[i].advice == MADV_NORMAL;
+    }
+    if (free_ranges < 2) {
+        return ENOMEM;
+    }
+
+    for (int i = 0; i < VAS_MAX_ADVICE_RANGES; ++i) {
+        struct vas_advice_range* range = vas->advice + i;
+
+        if (range->advice == MADV_NORMAL || range->end <= start || range->start >= end) {
+            continue;
+        }
+
+        if (range->start < start && range->end > end) {
+            struct vas_advice_range* split = vas_get_free_advice_range(vas);
+            split->start = end;
+            split->end = range->end;
+            split->advice = range->advice;
+            range->end = start;
+
+        } else if (range->start < start) {
+            range->end = start;
+
+        } else if (range->end > end) {
+            range->start = end;
+
+        } else {
+            range->advice = MADV_NORMAL;
+        }
+    }
+
+    if (advice != MADV_NORMAL) {
+        struct vas_advice_range* range = vas_get_free_advice_range(vas);
+        range->start = start;
+        range->end = end;
+        range->advice = advice;
+    }
+
+    return 0;
+}
+
+/*
+* Checks that every page in a range has been mapped (or at least will be mapped on access),
+* and returns the number of them that are locked.
+*/
+static int vas_check_range(struct virtual_address_space* vas, size_t virt_addr, size_t pages, size_t* locked_pages_out)
+{
+    size_t locked_pages = 0;
+
+    spinlock_acquire(&vas->lock);
+
+    for (size_t i = 0; i < pages; ++i) {
+        size_t phys;
+        int flags;
+        if (!arch_vas_try_get_entry(vas, virt_addr + i * ARCH_PAGE_SIZE, &phys, &flags) || !(flags & (VAS_FLAG_PRESENT | VAS_FLAG_ALLOCATE_ON_ACCESS | VAS_FLAG_SWAPPED))) {
+            spinlock_release(&vas->lock);
+            return ENOMEM;
+        }
+
+        if (flags & VAS_FLAG_LOCKED) {
+            ++locked_pages;
+        }
+    }
+
+    spinlock_release(&vas->lock);
+
+    *locked_pages_out = locked_pages;
+    return 0;
+}
+
+/*
+* Checks whether a page is anonymous memory that the program can write to, and so can be
+* discarded. Read-only pages, and pages still shared with the executable cache, came from
+* a file, and can't just be replaced with zeros. The address space must be locked.
+*/
+static bool vas_can_discard_page(struct virtual_address_space* vas, size_t virt_addr)
+{
+    size_t phys;
+    int flags;
+    arch_vas_get_entry(vas, virt_addr, &phys, &flags);
+
+    if (!(flags & (VAS_FLAG_WRITABLE | VAS_FLAG_COPY_ON_WRITE))) {
+        return false;
+    }
+
+    if ((flags & VAS_FLAG_PRESENT) && (flags & VAS_FLAG_COPY_ON_WRITE) && phys != zero_page_phys) {
+        return phys_get_owner(phys) != PHYS_OWNER_EXEC_CACHE;
+    }
+
+    return true;
+}
+
+/*
+* Gives a page's memory (or space in the swapfile) back, so the next access will see
+* a fresh page of zeros. Pages shared with another address space only lose this one's
+* share. The address space must be locked.
+*/
+static void vas_discard_page(struct virtual_address_space* vas, size_t virt_addr)
+{
+    size_t phys;
+    int flags;
+    arch_vas_get_entry(vas, virt_addr, &phys, &flags);
+    assert(!(flags & VAS_FLAG_LOCKED));
+
+    if (flags & VAS_FLAG_ALLOCATE_ON_ACCESS) {
+        return;
+    }
+
+    if (flags & VAS_FLAG_PRESENT) {
+        if (phys != zero_page_phys) {
+            rmap_remove(phys, vas, virt_addr);
+            phys_free_page(phys);
+        }
+
+    } else if (flags & VAS_FLAG_SWAPPED) {
+        /*
+        * This only gives up our share of it, as a forked process might still use it.
+        */
+        swapfile_free(phys / ARCH_PAGE_SIZE);
+        --vas->swapped_pages;
+    }
+
+    /*
+    * Copy on write pages were writable before they were shared.
+    */
+    int new_flags = (flags & (VAS_FLAG_USER | VAS_FLAG_WRITABLE)) | VAS_FLAG_ALLOCATE_ON_ACCESS;
+    if (flags & VAS_FLAG_COPY_ON_WRITE) {
+        new_flags |= VAS_FLAG_WRITABLE;
+    }
+
+    arch_vas_set_entry(vas, virt_addr, 0, new_flags);
+}
+
+/*
+* Acts on advice from a program on how it will use a range of its memory (see madvise).
+* Only works on the current address space.
+*/
+int vas_advise(struct virtual_address_space* vas, size_t virt_addr, size_t pages, int advice)
+{
+    assert(vas == vas_get_current_vas());
+    assert(virt_addr % ARCH_PAGE_SIZE == 0);
+
+    size_t locked_pages;
+    int status = vas_check_range(vas, virt_addr, pages, &locked_pages);
+    if (status != 0) {
+        return status;
+    }
+
+    switch (advice) {
+    case MADV_NORMAL:
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+        spinlock_acquire(&vas->lock);
+        status = vas_set_advice(vas, virt_addr, virt_addr + pages * ARCH_PAGE_SIZE, advice);
+        spinlock_release(&vas->lock);
+        return status;
+
+    case MADV_WILLNEED:
+        /*
+        * Bring anything on disk back in now, instead of waiting for it to be accessed.
+        */
+        for (size_t i = 0; i < pages; ++i) {
+            size_t phys;
+            int flags;
+
+            spinlock_acquire(&vas->lock);
+            arch_vas_get_entry(vas, virt_addr + i * ARCH_PAGE_SIZE, &phys, &flags);
+            spinlock_release(&vas->lock);
+
+            if (flags & VAS_FLAG_SWAPPED) {
+                arch_resolve_page_fault(virt_addr + i * ARCH_PAGE_SIZE, false);
+            }
+        }
+        return 0;
+
+    case MADV_DONTNEED:
+        /*
+        * Locked pages have to stay in memory.
+        */
+        if (locked_pages != 0) {
+            return EINVAL;
+        }
+
+        spinlock_acquire(&vas->lock);
+        for (size_t i = 0; i < pages; ++i) {
+            if (!vas_can_discard_page(vas, virt_addr + i * ARCH_PAGE_SIZE)) {
+                spinlock_release(&vas->lock);
+                return EINVAL;
+            }
+        }
+        for (size_t i = 0; i < pages; ++i) {
+            vas_discard_page(vas, virt_addr + i * ARCH_PAGE_SIZE);
+        }
+        vas_flush_tlb();
+        spinlock_release(&vas->lock);
+        return 0;
+
+    default:
+        return EINVAL;
+    }
+}
+
+/*
+* Brings in and locks every page in a range, so that it can't be swapped out. Fails without
+* changing anything if it would need to lock more than max_new_locks pages. Returns the number
+* of pages that weren't already locked. Only works on the current address space.
+*/
+int vas_lock_pages(struct virtual_address_space* vas, size_t virt_addr, size_t pages, size_t max_new_locks, size_t* pages_locked_out)
+{
+    assert(vas == vas_get_current_vas());
+    assert(virt_addr % ARCH_PAGE_SIZE == 0);
+
+    size_t locked_pages;
+    int status = vas_check_range(vas, virt_addr, pages, &locked_pages);
+    if (status != 0) {
+        return status;
+    }
+
+    if (pages - locked_pages > max_new_locks) {
+        return ENOMEM;
+    }
+
+    size_t pages_locked = 0;
+
+    for (size_t i = 0; i < pages; ++i) {
+        size_t page = virt_addr + i * ARCH_PAGE_SIZE;
+
+        while (true) {
+            size_t phys;
+            int flags;
+
+            spinlock_acquire(&vas->lock);
+            arch_vas_get_entry(vas, page, &phys, &flags);
+
+            /*
+            * Writable pages need a page of their own (and not a shared one), otherwise
+            * writing to them would still need a page to be allocated.
+            */
+            bool shared = (flags & VAS_FLAG_COPY_ON_WRITE) || phys == zero_page_phys;
+            if ((flags & VAS_FLAG_PRESENT) && !shared) {
+                if (!(flags & VAS_FLAG_LOCKED)) {
+                    arch_vas_set_entry(vas, page, phys, flags | VAS_FLAG_LOCKED);
+                    ++pages_locked;
+                }
+                spinlock_release(&vas->lock);
+                break;
+            }
+
+            spinlock_release(&vas->lock);
+
+            bool write = (flags & (VAS_FLAG_WRITABLE | VAS_FLAG_COPY_ON_WRITE)) != 0;
+            if (arch_resolve_page_fault(page, write) != 0 || (!write && (flags & VAS_FLAG_PRESENT))) {
+                /*
+                * Read-only pages can just stay shared.
+                */
+                spinlock_acquire(&vas->lock);
+                arch_vas_get_entry(vas, page, &phys, &flags);
+                if ((flags & VAS_FLAG_PRESENT) && !(flags & VAS_FLAG_LOCKED)) {
+                    arch_vas_set_entry(vas, page, phys, flags | VAS_FLAG_LOCKED);
+                    ++pages_locked;
+                }
+                spinlock_release(&vas->lock);
+                break;
+            }
+        }
+    }
+
+    *pages_locked_out = pages_locked;
+    return 0;
+}
+
+/*
+* Allows the pages in a range to be swapped out again, and returns how many pages were
+* unlocked.
+*/
+size_t vas_unlock_pages(struct virtual_address_space* vas, size_t virt_addr, size_t pages)
+{
+    assert(virt_addr % ARCH_PAGE_SIZE == 0);
+
+    size_t pages_unlocked = 0;
+
+    spinlock_acquire(&vas->lock);
+
+    for (size_t i = 0; i < pages; ++i) {
+        size_t phys;
+        int flags;
+        size_t page = virt_addr + i * ARCH_PAGE_SIZE;
+
+        if (arch_vas_try_get_entry(vas, page, &phys, &flags) && (flags & VAS_FLAG_PRESENT) && (flags & VAS_FLAG_LOCKED)) {
+            arch_vas_set_entry(vas, page, phys, flags & ~VAS_FLAG_LOCKED);
+            ++pages_unlocked;
+        }
+    }
+
+    spinlock_release(&vas->lock);
+    return pages_unlocked;
+}
+
+/*
+* Decides how many pages to fill in on an allocate on access fault, and records the
+* window that will be used. The window is aligned to its size, and contains the fault.
+*
+* If a fault lands just after (or just before, for stacks) the previous window, memory
+* is probably being accessed sequentially, and so the window is doubled. Otherwise it
+* is halved, so random access doesn't end up allocating pages that will never be used.
+*
+* The address space must be locked.
+*/
+size_t vas_get_fault_around_pages(struct virtual_address_space* vas, size_t virt_addr)
+{
+    assert(spinlock_is_held(&vas->lock));
+
+    size_t pages = vas->fault_around_pages == 0 ? 1 : vas->fault_around_pages;
+    size_t window_size = pages * ARCH_PAGE_SIZE;
+
+    bool after_window = virt_addr >= vas->fault_around_end && virt_addr - vas->fault_around_end < window_size;
+    bool before_window = virt_addr < vas->fault_around_start && vas->fault_around_start - virt_addr <= window_size;
+
+    if (after_window || before_window) {
+        pages = pages >= VAS_FAULT_AROUND_MAX_PAGES ? VAS_FAULT_AROUND_MAX_PAGES : pages * 2;
+    } else if (pages > 1) {
+        pages /= 2;
+    }
+
+    vas->fault_around_pages = pages;
+
+    /*
+    * Programs can tell us how they'll access their memory, which beats guessing.
+    */
+    int advice = vas_get_advice(vas, virt_addr);
+    if (advice == MADV_RANDOM) {
+        pages = 1;
+    } else if (advice == MADV_SEQUENTIAL) {
+        pages = VAS_FAULT_AROUND_MAX_PAGES;
+    }
+
+    if (phys_get_free_page_count() < FAULT_AROUND_MIN_FREE_PAGES) {
+        pages = 1;
+    }
+
+    /*
+    * Filling in the window would just swap out more of our own pages.
+    */
+    if (vas->hard_limit_pages != 0 && vas->resident_pages + pages > vas->hard_limit_pages) {
+        pages = 1;
+    }
+
+    window_size = pages * ARCH_PAGE_SIZE;
+    vas->fault_around_start = virt_addr & ~(window_size - 1);
+    vas->fault_around_end = vas->fault_around_start + window_size;
+
+    return pages;
+}
+
 struct virtual_address_space* vas_create(void)
 {
 	struct virtual_address_space* vas = (struct virtual_address_space*) malloc(sizeof(struct virtual_address_space));
-    vas->copied_from = NULL;
     spinlock_init(&vas->lock, "per-vas lock");
+    vas_init_fault_around(vas);
+    vas_init_accounting(vas);
     arch_vas_create(vas);
+    vas_add_to_list(vas);
 	return vas;
 }
 
@@ -43,6 +655,24 @@ void vas_flush_tlb(void) {
 	arch_flush_tlb();
 }
 
+/*
+* Like vas_flush_tlb, but only for a single page. Nothing needs to be done if no CPU has
+* the address space loaded, as it will be flushed when it next gets loaded.
+*/
+void vas_flush_tlb_entry(struct virtual_address_space* vas, size_t virt_addr) {
+    if (vas == vas_get_current_vas()) {
+        arch_flush_tlb_entry(virt_addr);
+        return;
+    }
+
+    for (int i = 0; i < cpu_get_count(); ++i) {
+        if (cpu_get(i)->current_vas == vas) {
+            arch_flush_tlb_entry(virt_addr);
+            return;
+        }
+    }
+}
+
 /*
 * Free a virtual address space.
 */
@@ -50,7 +680,11 @@ void vas_destroy(struct virtual_address_space* vas)
 {
 	assert(vas);
 
-    spinlock_acquire(&vas->lock);
+    spinlock_acquire(&vas_list_lock);
+    adt_list_remove_element(vas_list, vas);
+    spinlock_release(&vas_list_lock);
+
+    merge_forget_vas(vas);
 
 	/*
 	* We cannot destroy the address space we are currently using, otherwise the 
@@ -61,8 +695,17 @@ void vas_destroy(struct virtual_address_space* vas)
 		panic("attempting to destroy the current address space");
 	}
 
-	arch_vas_destroy(vas->data);
+    /*
+    * Someone may have found us in the reverse map before we were taken out of the list
+    * (e.g. vas_migrate_page). They hold the list lock while using us, so once we have it,
+    * they're done.
+    */
+    spinlock_acquire(&vas_list_lock);
+    spinlock_acquire(&vas->lock);
+	arch_vas_destroy(vas);
     spinlock_release(&vas->lock);
+    spinlock_release(&vas_list_lock);
+
 	free(vas);
 }
 
@@ -91,14 +734,23 @@ struct virtual_address_space* vas_copy(struct virtual_address_space* original)
 
 	struct virtual_address_space* copy = (struct virtual_address_space*) malloc(sizeof(struct virtual_address_space));
     spinlock_init(&copy->lock, "per-vas lock");
+    vas_init_fault_around(copy);
+    vas_init_accounting(copy);
 
     spinlock_acquire(&original->lock);
 
+    /*
+    * Limits get inherited, but the memory use is counted as the pages get copied.
+    */
+    copy->soft_limit_pages = original->soft_limit_pages;
+    copy->hard_limit_pages = original->hard_limit_pages;
+
 	arch_vas_copy(original, copy);
-    copy->copied_from = original;
 
     spinlock_release(&original->lock);
 
+    vas_add_to_list(copy);
+
 	return copy;
 }
 
@@ -116,7 +768,16 @@ void vas_map(struct virtual_address_space* vas, size_t phys_addr, size_t virt_ad
     assert((flags & ~(VAS_FLAG_WRITABLE | VAS_FLAG_EXECUTABLE | VAS_FLAG_USER | VAS_FLAG_COPY_ON_WRITE | VAS_FLAG_PRESENT | VAS_FLAG_LOCKED | VAS_FLAG_ALLOCATE_ON_ACCESS)) == 0);
     
     spinlock_acquire(&vas->lock);
+
+    size_t old_phys_addr;
+    int old_flags;
+    if (arch_vas_try_get_entry(vas, virt_addr, &old_phys_addr, &old_flags) && (old_flags & VAS_FLAG_PRESENT)) {
+        rmap_remove(old_phys_addr, vas, virt_addr);
+    }
+
     arch_vas_set_entry(vas, virt_addr, phys_addr, flags | VAS_FLAG_USER);
+    rmap_add(phys_addr, vas, virt_addr);
+
     spinlock_release(&vas->lock);
 }
 
@@ -163,7 +824,8 @@ size_t vas_virtual_to_physical(struct virtual_address_space* vas, size_t virt_ad
 /*
 * Unmap a page of virtual memory, and therefore making it so that virtual address can
 * no longer be accessed. Returns the old physical address that was mapped, or 0 if none
-* was mapped.
+* was mapped. Shared (copy on write) pages are returned like any other, as phys_free_page
+* will only free them once no one else is using them.
 */
 size_t vas_unmap(struct virtual_address_space* vas, size_t virt_addr)
 {
@@ -172,21 +834,35 @@ size_t vas_unmap(struct virtual_address_space* vas, size_t virt_addr)
 	
     spinlock_acquire(&vas->lock);
 
-    /*
-    * TODO: how does this go with pages on disk? or ALLOCATE_ON_WRITE, etc.??
-    */
-
     int old_flags;
 	size_t old_phys_addr;
 	arch_vas_get_entry(vas, virt_addr, &old_phys_addr, &old_flags);
 	arch_vas_set_entry(vas, virt_addr, 0, 0);
 
+    if (old_flags & VAS_FLAG_PRESENT) {
+        rmap_remove(old_phys_addr, vas, virt_addr);
+    } else if ((old_flags & VAS_FLAG_SWAPPED) && virt_addr >= ARCH_USER_AREA_BASE && virt_addr < ARCH_USER_AREA_LIMIT) {
+        --vas->swapped_pages;
+    }
+
     spinlock_release(&vas->lock);
 
+    /*
+    * Pages on disk don't need their space in the swapfile anymore, unless a forked process
+    * is still using it (swapfile_free only gives up our share).
+    */
+    if (old_flags & VAS_FLAG_SWAPPED) {
+        swapfile_free(old_phys_addr / ARCH_PAGE_SIZE);
+        return 0;
+    }
+
 	assert(old_phys_addr % ARCH_PAGE_SIZE == 0);
 
-    if (old_flags & VAS_FLAG_COPY_ON_WRITE) {
-        panic("TODO: how should vas_unmap work on VAS_FLAG_COPY_ON_WRITE");
+    /*
+    * The zero page is shared by everyone, so it must never be given back.
+    */
+    if ((old_flags & VAS_FLAG_PRESENT) && old_phys_addr == zero_page_phys) {
+        return 0;
     }
 
     if (!(old_flags & VAS_FLAG_PRESENT) || (old_flags & VAS_FLAG_ALLOCATE_ON_ACCESS)) {
@@ -198,73 +874,305 @@ size_t vas_unmap(struct virtual_address_space* vas, size_t virt_addr)
 
 
 /*
-* Performs a page replacement, and returns the newly freed physical address.
+* Chooses a page to swap out. Memory the program said it would access sequentially goes
+* first, as it has most likely already been used. If user_only is set, kernel pages won't
+* be chosen, and ARCH_USER_AREA_LIMIT is returned if there is nothing that can be swapped out.
 */
-size_t vas_perform_page_replacement(void) {
-    struct virtual_address_space* vas = vas_get_current_vas();
+static size_t vas_find_page_replacement_virt_address(struct virtual_address_space* vas, bool user_only) {
+    for (int i = 0; i < VAS_MAX_ADVICE_RANGES; ++i) {
+        struct vas_advice_range* range = vas->advice + i;
+
+        if (range->advice == MADV_SEQUENTIAL) {
+            size_t virt_addr = arch_find_page_replacement_virt_address_in_range(vas, range->start, range->end);
+            if (virt_addr < range->end) {
+                return virt_addr;
+            }
+        }
+    }
+
+    if (user_only) {
+        return arch_find_page_replacement_virt_address_in_range(vas, ARCH_USER_AREA_BASE, ARCH_USER_AREA_LIMIT);
+    }
+    return arch_find_page_replacement_virt_address(vas);
+}
+
+/*
+* Writes a page out to the swapfile, and returns the physical page it used. The address space
+* must be locked.
+*/
+static size_t vas_swap_out_page(struct virtual_address_space* vas, size_t virt_addr) {
+    assert(spinlock_is_held(&vas->lock));
+
+    kprintfnv("EVICTING: 0x%X\n", virt_addr);
 
     /*
-    * Somewhere in the page fault handling code, we need nested spinlocks. This is because
-    * handling a page fault may require memory to be allocated, and thus the VAS would already
-    * be locked. This is where we will use them. We will not lock again if we are already
-    * locked, hence the use of spinlock_acquire_if_unlocked.
+    * Lock the page so nothing else tries to swap it out while it is being written.
     */
-
-    bool needs_unlocking = spinlock_acquire_if_unlocked(&vas->lock);
+    int old_flags;
+    size_t phys_addr;
+    arch_vas_get_entry(vas, virt_addr, &phys_addr, &old_flags);
+	arch_vas_set_entry(vas, virt_addr, phys_addr, old_flags | VAS_FLAG_LOCKED);
+    vas_flush_tlb_entry(vas, virt_addr);
 
     /*
-    * Find our next victim.
+    * Save our page onto the disk. This goes through the direct map, as the address space might
+    * not be the current one, and the swapfile clears the page once it has been written out.
     */
-    size_t unlucky_addr = arch_find_page_replacement_virt_address(vas);
-    kprintfnv("EVICTING: 0x%X\n", unlucky_addr);
+    size_t id = swapfile_write((uint8_t*) phys_to_virt(phys_addr));
+    kprintfnv("written -> id = 0x%X\n", id);
 
     /*
-    * We need to release our lock in order to write to the disk, so lock the page 
-    * so nothing happens to it.
+    * Unmap the page, and then write the swapfile id to the page entry.
     */
-    int old_flags;
-    size_t phys_addr;
-    arch_vas_get_entry(vas, unlucky_addr, &phys_addr, &old_flags);
-    kprintfnv("phys_addr: 0x%X\n", phys_addr);
-	arch_vas_set_entry(vas, unlucky_addr, phys_addr, old_flags | VAS_FLAG_LOCKED);
-    kprintfnv("phys_addr: 0x%X\n", phys_addr);
+    arch_vas_set_entry(vas, virt_addr, id * ARCH_PAGE_SIZE, (old_flags & ~(VAS_FLAG_LOCKED | VAS_FLAG_PRESENT)) | VAS_FLAG_SWAPPED);
+    vas_flush_tlb_entry(vas, virt_addr);
+    rmap_remove(phys_addr, vas, virt_addr);
+    vas_count_swap(vas, false);
+
+    if (virt_addr >= ARCH_USER_AREA_BASE && virt_addr < ARCH_USER_AREA_LIMIT) {
+        ++vas->swapped_pages;
+    }
+
+    return phys_addr;
+}
+
+/*
+* Returns whether an address space has any user pages that can be swapped out.
+*/
+static bool vas_can_swap_out(struct virtual_address_space* vas) {
+    return vas_find_page_replacement_virt_address(vas, true) != ARCH_USER_AREA_LIMIT;
+}
+
+/*
+* Locks an address space while the list lock is held. This can't wait for another CPU, as
+* it might be waiting for the list lock itself. Other address spaces are skipped if they
+* are locked at all, as they are in the middle of being changed, but this CPU might already
+* hold the current one's lock. Returns false if it couldn't be locked, otherwise sets
+* needs_unlocking to whether it has to be released afterwards.
+*/
+static bool vas_try_lock_for_replacement(struct virtual_address_space* vas, bool* needs_unlocking) {
+    if (vas == vas_get_current_vas() && spinlock_is_held_by_this_cpu(&vas->lock)) {
+        *needs_unlocking = false;
+        return true;
+    }
+
+    *needs_unlocking = spinlock_try_acquire(&vas->lock);
+    return *needs_unlocking;
+}
+
+/*
+* Chooses who to take a page from when memory runs low. Whoever is furthest over their soft
+* limit goes first. Otherwise it comes from the current address space, unless it has no user
+* pages to give, in which case whoever has the most in memory goes. The list lock must be
+* held. The chosen address space gets returned locked (see vas_try_lock_for_replacement),
+* or NULL is returned if not even the current one could be locked.
+*/
+static struct virtual_address_space* vas_choose_replacement_vas(bool* needs_unlocking_out) {
+    assert(spinlock_is_held(&vas_list_lock));
+
+    struct virtual_address_space* current = vas_get_current_vas();
+    struct virtual_address_space* over_limit = NULL;
+    struct virtual_address_space* largest = NULL;
+    size_t most_over_limit = 0;
+    size_t most_resident = 0;
+    bool needs_unlocking;
+
+    adt_list_reset(vas_list);
+    while (adt_list_has_next(vas_list)) {
+        struct virtual_address_space* vas = adt_list_get_next(vas_list);
+        if (!vas_try_lock_for_replacement(vas, &needs_unlocking)) {
+            continue;
+        }
+
+        bool over = vas->soft_limit_pages != 0 && vas->resident_pages > vas->soft_limit_pages;
+        if ((over || vas->resident_pages > most_resident) && vas_can_swap_out(vas)) {
+            if (over && vas->resident_pages - vas->soft_limit_pages > most_over_limit) {
+                most_over_limit = vas->resident_pages - vas->soft_limit_pages;
+                over_limit = vas;
+            }
+            if (vas->resident_pages > most_resident) {
+                most_resident = vas->resident_pages;
+                largest = vas;
+            }
+        }
+        if (needs_unlocking) {
+            spinlock_release(&vas->lock);
+        }
+    }
 
     /*
-    * We don't need to be (spin)locked any longer, as we are only writing out the page, which is
-    * already marked as locked.
+    * Things could have been locked since we looked at them, in which case we move on to
+    * the next choice.
     */
-    if (needs_unlocking) {
-        //spinlock_release(&vas->lock);
+    if (over_limit != NULL && vas_try_lock_for_replacement(over_limit, needs_unlocking_out)) {
+        return over_limit;
     }
+    if (!vas_try_lock_for_replacement(current, needs_unlocking_out)) {
+        return NULL;
+    }
+    if (largest != NULL && largest != current && !vas_can_swap_out(current)) {
+        if (*needs_unlocking_out) {
+            spinlock_release(&current->lock);
+        }
+        if (vas_try_lock_for_replacement(largest, needs_unlocking_out)) {
+            return largest;
+        }
+        if (!vas_try_lock_for_replacement(current, needs_unlocking_out)) {
+            return NULL;
+        }
+    }
+    return current;
+}
 
+/*
+* Performs a page replacement, and returns the newly freed physical address.
+*/
+size_t vas_perform_page_replacement(void) {
     /*
-    * Save our page onto the disk.
+    * The list lock stops the address space we choose from being destroyed. If we already
+    * hold it, the list might be in the middle of being changed, so only the current
+    * address space can be used.
     */
-    kprintfnv("about to write: 0x%X\n", unlucky_addr);
-    size_t id = swapfile_write((uint8_t*) unlucky_addr);
-    kprintfnv("written -> id = 0x%X\n", id);
+    bool needs_list_unlocking = spinlock_acquire_if_unlocked(&vas_list_lock);
+    bool needs_unlocking = false;
+    struct virtual_address_space* vas = needs_list_unlocking ? vas_choose_replacement_vas(&needs_unlocking) : NULL;
 
     /*
-    * Reading/writing to page tables again requires us to lock.
+    * Somewhere in the page fault handling code, we need nested spinlocks. This is because
+    * handling a page fault may require memory to be allocated, and thus the VAS would already
+    * be locked. This is where we will use them. We will not lock again if we are already
+    * locked, hence the use of spinlock_acquire_if_unlocked. If another CPU has the current
+    * address space locked, we wait for it without the list lock, as it might need that.
     */
-    //needs_unlocking = spinlock_acquire_if_unlocked(&vas->lock);
+    if (vas == NULL) {
+        if (needs_list_unlocking) {
+            spinlock_release(&vas_list_lock);
+            needs_list_unlocking = false;
+        }
+
+        vas = vas_get_current_vas();
+        needs_unlocking = spinlock_acquire_if_unlocked(&vas->lock);
+    }
 
     /*
-    * Unmap the page, and then write the swapfile id to the page entry.
-    * (Don't override the value of phys_addr, as we need to return it, so use a dummy variable.)
+    * Find our next victim. Only user pages are taken from other address spaces.
     */
-    arch_vas_set_entry(vas, unlucky_addr, id * ARCH_PAGE_SIZE, old_flags & ~(VAS_FLAG_LOCKED | VAS_FLAG_PRESENT));
-    kprintfnv("set\n");
+    bool user_only = vas != vas_get_current_vas();
+    size_t unlucky_addr = vas_find_page_replacement_virt_address(vas, user_only);
+    if (user_only && unlucky_addr == ARCH_USER_AREA_LIMIT) {
+        panic("out of memory");
+    }
 
-    size_t dummy;
-    // TODO: what the heck does reading this at this point do???
-    arch_vas_get_entry(vas, unlucky_addr, &dummy, &old_flags);
-    kprintfnv("got\n");
+    size_t phys_addr = vas_swap_out_page(vas, unlucky_addr);
 
     if (needs_unlocking) {
         spinlock_release(&vas->lock);
     }
+    if (needs_list_unlocking) {
+        spinlock_release(&vas_list_lock);
+    }
 
-    kprintfnv("repl done\n");
     return phys_addr;
-}
\ No newline at end of file
+}
+
+/*
+* Allocates a physical page for a user page in an address space. If the address space is
+* at its hard limit, one of its own pages gets swapped out to make room instead.
+*/
+size_t vas_allocate_user_page(struct virtual_address_space* vas) {
+    if (vas->hard_limit_pages != 0 && vas->resident_pages >= vas->hard_limit_pages) {
+        bool needs_unlocking = spinlock_acquire_if_unlocked(&vas->lock);
+
+        size_t phys_addr = 0;
+        size_t virt_addr = vas_find_page_replacement_virt_address(vas, true);
+        if (virt_addr != ARCH_USER_AREA_LIMIT) {
+            phys_addr = vas_swap_out_page(vas, virt_addr);
+        }
+
+        if (needs_unlocking) {
+            spinlock_release(&vas->lock);
+        }
+        if (phys_addr != 0) {
+            return phys_addr;
+        }
+    }
+
+    return phys_allocate_page(PHYS_OWNER_USER);
+}
+
+/*
+* Sets the limits on how many pages an address space can have in memory (0 means no limit).
+*/
+void vas_set_memory_limits(struct virtual_address_space* vas, size_t soft_limit_pages, size_t hard_limit_pages) {
+    spinlock_acquire(&vas->lock);
+    vas->soft_limit_pages = soft_limit_pages;
+    vas->hard_limit_pages = hard_limit_pages;
+    spinlock_release(&vas->lock);
+}
+
+/*
+* Reports how much memory an address space is using.
+*/
+void vas_get_memstat(struct virtual_address_space* vas, struct memstat* stat) {
+    spinlock_acquire(&vas->lock);
+    stat->resident = vas->resident_pages * ARCH_PAGE_SIZE;
+    stat->swapped = vas->swapped_pages * ARCH_PAGE_SIZE;
+    stat->page_tables = vas->page_table_pages * ARCH_PAGE_SIZE;
+    stat->soft_limit = vas->soft_limit_pages * ARCH_PAGE_SIZE;
+    stat->hard_limit = vas->hard_limit_pages * ARCH_PAGE_SIZE;
+    spinlock_release(&vas->lock);
+}
+
+/*
+* Records a page fault of one of the FAULT_ types in sys/faultstat.h, which took cycles
+* timestamp ticks to handle and did tlb_flushes TLB flushes.
+*/
+void vas_count_fault(struct virtual_address_space* vas, int type, uint64_t cycles, uint64_t tlb_flushes) {
+    assert(type >= 0 && type < FAULT_NUM_TYPES);
+
+    spinlock_acquire(&fault_stats_lock);
+    ++vas->fault_stats.faults[type];
+    vas->fault_stats.cycles[type] += cycles;
+    vas->fault_stats.tlb_flushes += tlb_flushes;
+    ++system_fault_stats.faults[type];
+    system_fault_stats.cycles[type] += cycles;
+    spinlock_release(&fault_stats_lock);
+}
+
+/*
+* Records a page of an address space being read back from, or written out to, the swapfile.
+*/
+void vas_count_swap(struct virtual_address_space* vas, bool swap_in) {
+    spinlock_acquire(&fault_stats_lock);
+    if (swap_in) {
+        ++vas->fault_stats.swap_ins;
+        ++system_fault_stats.swap_ins;
+    } else {
+        ++vas->fault_stats.swap_outs;
+        ++system_fault_stats.swap_outs;
+    }
+    spinlock_release(&fault_stats_lock);
+}
+
+void vas_count_tlb_flush(void) {
+    spinlock_acquire(&fault_stats_lock);
+    ++system_fault_stats.tlb_flushes;
+    spinlock_release(&fault_stats_lock);
+}
+
+uint64_t vas_get_tlb_flush_count(void) {
+    spinlock_acquire(&fault_stats_lock);
+    uint64_t count = system_fault_stats.tlb_flushes;
+    spinlock_release(&fault_stats_lock);
+    return count;
+}
+
+/*
+* Gets the page fault statistics for an address space, or for the whole system if vas
+* is NULL.
+*/
+void vas_get_faultstat(struct virtual_address_space* vas, struct faultstat* stat) {
+    spinlock_acquire(&fault_stats_lock);
+    *stat = vas == NULL ? system_fault_stats : vas->fault_stats;
+    spinlock_release(&fault_stats_lock);
+}
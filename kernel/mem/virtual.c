@@ -25,11 +25,26 @@ struct spinlock virt_lock;
 
 /*
 * Each CPU can in theory have different mappings in virtual memory for the
-* kernel. However, for simplicity, we will never reallocate kernel virtual
+* kernel. However, for simplicity, all CPUs share the same kernel virtual
 * memory addresses. This makes it much easier to share kernel data, etc.
 */
 size_t kernel_sbrk = ARCH_KRNL_SBRK_BASE;
 
+/*
+* Regions below kernel_sbrk that have been given back, so they can be reused. These are
+* kept in a fixed-size table (as the heap is built on top of us). If the table is full,
+* the region is just lost.
+*/
+#define MAX_FREE_KRNL_REGIONS 64
+
+struct krnl_region {
+	size_t address;
+	size_t num_pages;
+};
+
+struct krnl_region free_krnl_regions[MAX_FREE_KRNL_REGIONS];
+int num_free_krnl_regions = 0;
+
 /*
 * This function is called once on the bootstrap CPU, and should not call any
 * functions from arch. Then each CPU will
@@ -54,34 +69,86 @@ size_t virt_bytes_to_pages(size_t bytes) {
 * don't conflict with each other, and are between ARCH_KRNL_SBRK_BASE and
 * ARCH_KRNL_SBRK_LIMIT. 
 *
-* The current implementation is very simple and does not allow freeing.
+* Regions that have been freed are reused (first fit), otherwise the allocation
+* comes from the top, sbrk() style.
 */ 
 size_t virt_allocate_unbacked_krnl_region(size_t bytes)
 {
 	assert(bytes != 0);
 
+	size_t num_pages = virt_bytes_to_pages(bytes);
+
 	spinlock_acquire(&virt_lock);
 
-	if (kernel_sbrk >= ARCH_KRNL_SBRK_LIMIT) {
+	for (int i = 0; i < num_free_krnl_regions; ++i) {
+		struct krnl_region* region = free_krnl_regions + i;
+
+		if (region->num_pages >= num_pages) {
+			size_t address = region->address;
+			region->address += num_pages * ARCH_PAGE_SIZE;
+			region->num_pages -= num_pages;
+
+			if (region->num_pages == 0) {
+				*region = free_krnl_regions[--num_free_krnl_regions];
+			}
+
+			spinlock_release(&virt_lock);
+			return address;
+		}
+	}
+
+	if (kernel_sbrk + num_pages * ARCH_PAGE_SIZE > ARCH_KRNL_SBRK_LIMIT) {
 		panic("kernel sbrk limit reached");
 	}
 
 	size_t old_sbrk = kernel_sbrk;
-	kernel_sbrk += virt_bytes_to_pages(bytes) * ARCH_PAGE_SIZE;
+	kernel_sbrk += num_pages * ARCH_PAGE_SIZE;
 
 	spinlock_release(&virt_lock);
 
 	return old_sbrk;
 }
 
+/*
+* Gives back a region of kernel virtual memory. Nothing may be mapped there any more.
+*/
 void virt_deallocate_unbacked_krnl_region(size_t virt_addr, size_t num_pages)
 {
+	assert(virt_addr % ARCH_PAGE_SIZE == 0);
+
+	spinlock_acquire(&virt_lock);
+
+	size_t end_addr = virt_addr + num_pages * ARCH_PAGE_SIZE;
+
 	/*
-	* Do nothing for now, as we just use a sbrk() style allocation that doesn't
-    * allow for freeing.
+	* Merge with any neighbouring free regions.
 	*/
-	(void) virt_addr;
-    (void) num_pages;
+	for (int i = 0; i < num_free_krnl_regions; ++i) {
+		struct krnl_region* region = free_krnl_regions + i;
+		size_t region_end = region->address + region->num_pages * ARCH_PAGE_SIZE;
+
+		if (region_end == virt_addr || region->address == end_addr) {
+			if (region_end == virt_addr) {
+				virt_addr = region->address;
+			} else {
+				end_addr = region_end;
+			}
+
+			*region = free_krnl_regions[--num_free_krnl_regions];
+			i = -1;
+		}
+	}
+
+	if (end_addr == kernel_sbrk) {
+		kernel_sbrk = virt_addr;
+
+	} else if (num_free_krnl_regions < MAX_FREE_KRNL_REGIONS) {
+		free_krnl_regions[num_free_krnl_regions].address = virt_addr;
+		free_krnl_regions[num_free_krnl_regions].num_pages = (end_addr - virt_addr) / ARCH_PAGE_SIZE;
+		++num_free_krnl_regions;
+	}
+
+	spinlock_release(&virt_lock);
 }
 
 
@@ -89,13 +156,13 @@ void virt_deallocate_unbacked_krnl_region(size_t virt_addr, size_t num_pages)
 * Map physical memory to a region of physical memory. Any higher-level memory
 * functions (such as the heap) should be built on top of this.
 */
-size_t virt_allocate_backed_pages(size_t pages, int flags) {
+size_t virt_allocate_backed_pages(size_t pages, int flags, int owner) {
 	assert(pages != 0);
 	
 	size_t virt_addr = virt_allocate_unbacked_krnl_region(pages * ARCH_PAGE_SIZE);
 
 	for (size_t i = 0; i < pages; ++i) {
-        size_t p = phys_allocate_page();
+        size_t p = phys_allocate_page(owner);
     	kprintfnv("got p=0x%X \n", p);
 
         struct virtual_address_space* v = vas_get_current_vas();
@@ -122,6 +189,7 @@ void virt_free_backed_pages(size_t virt_addr, size_t num_pages) {
             phys_free_page(physical);
         }
     }
-	
+
+	vas_flush_tlb();
 	virt_deallocate_unbacked_krnl_region(virt_addr, num_pages);
 }
\ No newline at end of file
@@ -0,0 +1,37 @@
+#include <stddef.h>
+#include <errno.h>
+#include <thread.h>
+#include <clock.h>
+#include <uio.h>
+#include <time.h>
+
+/*
+* Gets the current time from one of the clocks.
+*
+* Inputs: 
+*         A                 the clock, either CLOCK_REALTIME or CLOCK_MONOTONIC
+*         B                 the pointer to the timespec struct to fill
+*         C                 not used
+*         D                 not used
+* Output:
+*         0                 on success
+*         EINVAL            if the clock doesn't exist
+*         EFAULT            if the struct can't be written to
+*/
+int sys_clock_gettime(size_t args[4]) {
+    uint64_t time;
+    if (args[0] == CLOCK_REALTIME) {
+        time = clock_get_wall_time();
+    } else if (args[0] == CLOCK_MONOTONIC) {
+        time = get_time_since_boot();
+    } else {
+        return EINVAL;
+    }
+
+    struct timespec tp;
+    tp.tv_sec = time / 1000000000ULL;
+    tp.tv_nsec = time % 1000000000ULL;
+
+    struct uio io = uio_construct_write_to_usermode((void*) args[1], sizeof(struct timespec), 0);
+    return uio_move(&tp, &io, sizeof(struct timespec));
+}
@@ -0,0 +1,31 @@
+#include <stddef.h>
+#include <errno.h>
+#include <virtual.h>
+#include <uio.h>
+#include <sys/faultstat.h>
+
+/*
+* Reports page fault, swapping and TLB flush statistics, either for the calling process
+* or for the whole system.
+*
+* Inputs: 
+*         A                 the pointer to the faultstat struct to fill
+*         B                 FAULTSTAT_PROCESS or FAULTSTAT_SYSTEM
+*         C                 not used
+*         D                 not used
+* Output:
+*         0                 on success
+*         EINVAL            if B is invalid
+*         EFAULT            if the struct can't be written to
+*/
+int sys_faultstat(size_t args[4]) {
+    if (args[1] != FAULTSTAT_PROCESS && args[1] != FAULTSTAT_SYSTEM) {
+        return EINVAL;
+    }
+
+    struct faultstat stat;
+    vas_get_faultstat(args[1] == FAULTSTAT_SYSTEM ? NULL : vas_get_current_vas(), &stat);
+
+    struct uio io = uio_construct_write_to_usermode((void*) args[0], sizeof(struct faultstat), 0);
+    return uio_move(&stat, &io, sizeof(struct faultstat));
+}
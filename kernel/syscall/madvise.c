@@ -0,0 +1,31 @@
+#include <stddef.h>
+#include <errno.h>
+#include <arch.h>
+#include <virtual.h>
+#include <sys/mman.h>
+
+/*
+* Tells the kernel how a range of memory is going to be used, so it can manage it better.
+* See sys/mman.h for the possible advice.
+*
+* Inputs: 
+*         A                 the start of the range, which must be page aligned
+*         B                 the length of the range in bytes
+*         C                 the advice
+*         D                 not used
+* Output:
+*         0                 on success
+*         EINVAL            if the range or advice is invalid, or MADV_DONTNEED is used on locked pages
+*                           or on pages that aren't anonymous and writable (e.g. a program's code)
+*         ENOMEM            if part of the range isn't mapped, or if too many ranges have advice
+*/
+int sys_madvise(size_t args[4]) {
+    size_t start = args[0];
+    size_t length = args[1];
+
+    if (start % ARCH_PAGE_SIZE != 0 || start < ARCH_USER_AREA_BASE || length > ARCH_USER_AREA_LIMIT - start) {
+        return EINVAL;
+    }
+
+    return vas_advise(vas_get_current_vas(), start, virt_bytes_to_pages(length), args[2]);
+}
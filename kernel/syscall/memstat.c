@@ -0,0 +1,25 @@
+#include <stddef.h>
+#include <errno.h>
+#include <virtual.h>
+#include <uio.h>
+#include <sys/memstat.h>
+
+/*
+* Reports how much memory the calling process is using, and its memory limits.
+*
+* Inputs: 
+*         A                 the pointer to the memstat struct to fill
+*         B                 not used
+*         C                 not used
+*         D                 not used
+* Output:
+*         0                 on success
+*         EFAULT            if the struct can't be written to
+*/
+int sys_memstat(size_t args[4]) {
+    struct memstat stat;
+    vas_get_memstat(vas_get_current_vas(), &stat);
+
+    struct uio io = uio_construct_write_to_usermode((void*) args[0], sizeof(struct memstat), 0);
+    return uio_move(&stat, &io, sizeof(struct memstat));
+}
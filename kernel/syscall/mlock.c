@@ -0,0 +1,82 @@
+#include <stddef.h>
+#include <errno.h>
+#include <arch.h>
+#include <cpu.h>
+#include <thread.h>
+#include <process.h>
+#include <virtual.h>
+
+/*
+* Works out which pages a range of memory covers. The start gets rounded down to a page.
+*/
+static int get_page_range(size_t start, size_t length, size_t* first_page_out, size_t* num_pages_out) {
+    if (start < ARCH_USER_AREA_BASE || length > ARCH_USER_AREA_LIMIT - start) {
+        return EINVAL;
+    }
+
+    size_t first_page = start & ~(ARCH_PAGE_SIZE - 1);
+    *first_page_out = first_page;
+    *num_pages_out = virt_bytes_to_pages(start + length - first_page);
+    return 0;
+}
+
+/*
+* Brings a range of memory into RAM, and keeps it there until it is unlocked. Each process
+* can only lock PROCESS_MAX_LOCKED_PAGES pages at once.
+*
+* Inputs: 
+*         A                 the start of the range
+*         B                 the length of the range in bytes
+*         C                 not used
+*         D                 not used
+* Output:
+*         0                 on success
+*         EINVAL            if the range is not in user memory
+*         ENOMEM            if part of the range isn't mapped, or it would exceed the limit
+*/
+int sys_mlock(size_t args[4]) {
+    size_t first_page;
+    size_t num_pages;
+    int status = get_page_range(args[0], args[1], &first_page, &num_pages);
+    if (status != 0) {
+        return status;
+    }
+
+    struct process* process = current_cpu->current_thread->process;
+
+    size_t pages_locked;
+    status = vas_lock_pages(vas_get_current_vas(), first_page, num_pages, PROCESS_MAX_LOCKED_PAGES - process->locked_pages, &pages_locked);
+    if (status != 0) {
+        return status;
+    }
+
+    process->locked_pages += pages_locked;
+    return 0;
+}
+
+/*
+* Allows a range of memory locked with mlock to be swapped out again.
+*
+* Inputs: 
+*         A                 the start of the range
+*         B                 the length of the range in bytes
+*         C                 not used
+*         D                 not used
+* Output:
+*         0                 on success
+*         EINVAL            if the range is not in user memory
+*/
+int sys_munlock(size_t args[4]) {
+    size_t first_page;
+    size_t num_pages;
+    int status = get_page_range(args[0], args[1], &first_page, &num_pages);
+    if (status != 0) {
+        return status;
+    }
+
+    struct process* process = current_cpu->current_thread->process;
+    size_t pages_unlocked = vas_unlock_pages(vas_get_current_vas(), first_page, num_pages);
+
+    process->locked_pages = pages_unlocked > process->locked_pages ? 0 : process->locked_pages - pages_unlocked;
+    return 0;
+}
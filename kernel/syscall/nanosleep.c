@@ -0,0 +1,36 @@
+#include <stddef.h>
+#include <errno.h>
+#include <thread.h>
+#include <uio.h>
+#include <time.h>
+
+/*
+* Puts the calling thread to sleep for at least the given amount of time. Sleeps can't
+* be interrupted, so the remaining time is never written back.
+*
+* Inputs: 
+*         A                 the pointer to the timespec struct with the time to sleep for
+*         B                 not used
+*         C                 not used
+*         D                 not used
+* Output:
+*         0                 on success
+*         EINVAL            if the number of nanoseconds is out of range
+*         EFAULT            if the struct can't be read
+*/
+int sys_nanosleep(size_t args[4]) {
+    struct timespec req;
+
+    struct uio io = uio_construct_read_from_usermode((void*) args[0], sizeof(struct timespec), 0);
+    int result = uio_move(&req, &io, sizeof(struct timespec));
+    if (result != 0) {
+        return result;
+    }
+
+    if (req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+        return EINVAL;
+    }
+
+    thread_nano_sleep(req.tv_sec * 1000000000ULL + req.tv_nsec);
+    return 0;
+}
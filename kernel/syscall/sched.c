@@ -0,0 +1,83 @@
+#include <stddef.h>
+#include <errno.h>
+#include <thread.h>
+#include <process.h>
+#include <cpu.h>
+#include <uio.h>
+#include <sched.h>
+
+/*
+* Only the calling thread can be changed, which can be given as either 0 or its own
+* process ID.
+*/
+static bool sched_is_own_pid(size_t pid) {
+    return pid == 0 || (current_cpu->current_thread->process != NULL && pid == (size_t) current_cpu->current_thread->process->pid);
+}
+
+/*
+* Sets the scheduling policy and priority of the calling thread.
+*
+* Inputs: 
+*         A                 the process ID, or 0 for the calling thread
+*         B                 SCHED_OTHER, SCHED_FIFO or SCHED_RR
+*         C                 the pointer to the sched_param struct to read the priority from
+*         D                 not used
+* Output:
+*         0                 on success
+*         ESRCH             if A isn't the calling process
+*         EINVAL            if the policy or priority is invalid
+*         EFAULT            if the struct can't be read
+*/
+int sys_sched_setscheduler(size_t args[4]) {
+    if (!sched_is_own_pid(args[0])) {
+        return ESRCH;
+    }
+
+    struct sched_param param;
+
+    struct uio io = uio_construct_read_from_usermode((void*) args[2], sizeof(struct sched_param), 0);
+    int result = uio_move(&param, &io, sizeof(struct sched_param));
+    if (result != 0) {
+        return result;
+    }
+
+    return thread_set_scheduler(args[1], param.sched_priority);
+}
+
+/*
+* Gets the scheduling policy and priority of the calling thread.
+*
+* Inputs: 
+*         A                 the process ID, or 0 for the calling thread
+*         B                 the pointer to an int to write the policy to, or NULL
+*         C                 the pointer to the sched_param struct to write the priority to, or NULL
+*         D                 not used
+* Output:
+*         0                 on success
+*         ESRCH             if A isn't the calling process
+*         EFAULT            if the results can't be written
+*/
+int sys_sched_getscheduler(size_t args[4]) {
+    if (!sched_is_own_pid(args[0])) {
+        return ESRCH;
+    }
+
+    int policy;
+    struct sched_param param;
+    thread_get_scheduler(current_cpu->current_thread, &policy, &param.sched_priority);
+
+    if (args[1] != 0) {
+        struct uio io = uio_construct_write_to_usermode((void*) args[1], sizeof(int), 0);
+        int result = uio_move(&policy, &io, sizeof(int));
+        if (result != 0) {
+            return result;
+        }
+    }
+
+    if (args[2] != 0) {
+        struct uio io = uio_construct_write_to_usermode((void*) args[2], sizeof(struct sched_param), 0);
+        return uio_move(&param, &io, sizeof(struct sched_param));
+    }
+
+    return 0;
+}
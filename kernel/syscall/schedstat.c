@@ -0,0 +1,26 @@
+#include <stddef.h>
+#include <errno.h>
+#include <thread.h>
+#include <cpu.h>
+#include <uio.h>
+#include <sys/schedstat.h>
+
+/*
+* Reports scheduling statistics for the calling thread.
+*
+* Inputs: 
+*         A                 the pointer to the schedstat struct to fill
+*         B                 not used
+*         C                 not used
+*         D                 not used
+* Output:
+*         0                 on success
+*         EFAULT            if the struct can't be written to
+*/
+int sys_schedstat(size_t args[4]) {
+    struct schedstat stat;
+    thread_get_schedstat(current_cpu->current_thread, &stat);
+
+    struct uio io = uio_construct_write_to_usermode((void*) args[0], sizeof(struct schedstat), 0);
+    return uio_move(&stat, &io, sizeof(struct schedstat));
+}
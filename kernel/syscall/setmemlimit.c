@@ -0,0 +1,31 @@
+#include <stddef.h>
+#include <errno.h>
+#include <thread.h>
+#include <cpu.h>
+#include <process.h>
+
+/*
+* Sets how much memory the calling process can keep in RAM. Going over the soft limit makes
+* its memory the first to be swapped out, and once it reaches the hard limit, its own pages
+* get swapped out to make room for new ones.
+*
+* Inputs: 
+*         A                 the soft limit in bytes, or 0 for no limit
+*         B                 the hard limit in bytes, or 0 for no limit
+*         C                 not used
+*         D                 not used
+* Output:
+*         0                 on success
+*         EINVAL            if the soft limit is above the hard limit
+*/
+int sys_setmemlimit(size_t args[4]) {
+    size_t soft_limit = args[0];
+    size_t hard_limit = args[1];
+
+    if (hard_limit != 0 && soft_limit > hard_limit) {
+        return EINVAL;
+    }
+
+    process_set_memory_limits(current_cpu->current_thread->process, soft_limit, hard_limit);
+    return 0;
+}
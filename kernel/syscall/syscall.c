@@ -21,6 +21,17 @@ int sys_dup2(size_t args[4]);
 int sys_dup3(size_t args[4]);
 int sys_tcgetattr(size_t args[4]);
 int sys_tcsetattr(size_t args[4]);
+int sys_madvise(size_t args[4]);
+int sys_mlock(size_t args[4]);
+int sys_munlock(size_t args[4]);
+int sys_memstat(size_t args[4]);
+int sys_faultstat(size_t args[4]);
+int sys_nanosleep(size_t args[4]);
+int sys_schedstat(size_t args[4]);
+int sys_sched_setscheduler(size_t args[4]);
+int sys_sched_getscheduler(size_t args[4]);
+int sys_clock_gettime(size_t args[4]);
+int sys_setmemlimit(size_t args[4]);
 
 void syscall_init(void) {
     memset(syscall_table, 0, sizeof(syscall_table));
@@ -39,6 +50,17 @@ void syscall_init(void) {
     syscall_table[SYSCALL_DUP3] = sys_dup3;
     syscall_table[SYSCALL_TCGETATTR] = sys_tcgetattr;
     syscall_table[SYSCALL_TCSETATTR] = sys_tcsetattr;
+    syscall_table[SYSCALL_MADVISE] = sys_madvise;
+    syscall_table[SYSCALL_MLOCK] = sys_mlock;
+    syscall_table[SYSCALL_MUNLOCK] = sys_munlock;
+    syscall_table[SYSCALL_MEMSTAT] = sys_memstat;
+    syscall_table[SYSCALL_FAULTSTAT] = sys_faultstat;
+    syscall_table[SYSCALL_NANOSLEEP] = sys_nanosleep;
+    syscall_table[SYSCALL_SCHEDSTAT] = sys_schedstat;
+    syscall_table[SYSCALL_SCHED_SETSCHEDULER] = sys_sched_setscheduler;
+    syscall_table[SYSCALL_SCHED_GETSCHEDULER] = sys_sched_getscheduler;
+    syscall_table[SYSCALL_CLOCK_GETTIME] = sys_clock_gettime;
+    syscall_table[SYSCALL_SETMEMLIMIT] = sys_setmemlimit;
 }
 
 /*
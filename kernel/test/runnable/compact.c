@@ -0,0 +1,85 @@
+#include <physical.h>
+#include <virtual.h>
+#include <arch.h>
+#include <heap.h>
+#include <kprintf.h>
+
+#define CONTIGUOUS_PAGES    16
+
+static size_t map_test_page(size_t window, size_t phys_addr) {
+    vas_map(vas_get_current_vas(), phys_addr, window, VAS_FLAG_WRITABLE | VAS_FLAG_LOCKED);
+    arch_flush_tlb_entry(window);
+    return window;
+}
+
+static void unmap_test_page(size_t window) {
+    vas_unmap(vas_get_current_vas(), window);
+    arch_flush_tlb_entry(window);
+}
+
+/*
+* Leaves every second page of memory in use by a user address space, and then asks for
+* some contiguous memory. This should cause those pages to be moved out of the way, without
+* their contents changing.
+*/
+void test_compact(void) {
+    struct phys_compaction_stats before;
+    phys_get_compaction_stats(&before);
+
+    size_t max_pages = phys_get_free_page_count();
+    size_t* pages = malloc(sizeof(size_t) * max_pages);
+    size_t window = virt_allocate_unbacked_krnl_region(ARCH_PAGE_SIZE);
+    struct virtual_address_space* vas = vas_create();
+
+    size_t num_pages = 0;
+    while (num_pages < max_pages && phys_get_free_page_count() > 16) {
+        pages[num_pages++] = phys_allocate_page(PHYS_OWNER_USER);
+    }
+
+    for (size_t i = 1; i < num_pages; i += 2) {
+        phys_free_page(pages[i]);
+    }
+
+    for (size_t i = 0; i < num_pages; i += 2) {
+        size_t* data = (size_t*) map_test_page(window, pages[i]);
+        data[0] = i;
+        data[ARCH_PAGE_SIZE / sizeof(size_t) - 1] = ~i;
+        unmap_test_page(window);
+        vas_map(vas, pages[i], ARCH_USER_AREA_BASE + i * ARCH_PAGE_SIZE, VAS_FLAG_WRITABLE | VAS_FLAG_USER);
+    }
+
+    size_t contiguous;
+    if (phys_allocate_contiguous(CONTIGUOUS_PAGES, CONTIGUOUS_PAGES * ARCH_PAGE_SIZE, ~((size_t) 0), &contiguous) != 0) {
+        kprintf("Bad: couldn't allocate contiguous memory.\n");
+        contiguous = 0;
+    }
+
+    bool good = contiguous != 0 && contiguous % (CONTIGUOUS_PAGES * ARCH_PAGE_SIZE) == 0;
+
+    for (size_t i = 0; i < num_pages; i += 2) {
+        size_t virt_addr = ARCH_USER_AREA_BASE + i * ARCH_PAGE_SIZE;
+        size_t phys_addr = vas_virtual_to_physical(vas, virt_addr);
+        if (phys_addr >= contiguous && phys_addr < contiguous + CONTIGUOUS_PAGES * ARCH_PAGE_SIZE) {
+            good = false;
+        }
+
+        size_t* data = (size_t*) map_test_page(window, phys_addr);
+        if (data[0] != i || data[ARCH_PAGE_SIZE / sizeof(size_t) - 1] != ~i) {
+            good = false;
+        }
+
+        unmap_test_page(window);
+        phys_free_page(vas_unmap(vas, virt_addr));
+    }
+
+    if (contiguous != 0) {
+        phys_free_contiguous(contiguous, CONTIGUOUS_PAGES);
+    }
+    virt_deallocate_unbacked_krnl_region(window, 1);
+    vas_destroy(vas);
+    free(pages);
+
+    struct phys_compaction_stats after;
+    phys_get_compaction_stats(&after);
+    kprintf("%s (%u pages moved)\n", good ? "Good." : "Bad: a page was moved incorrectly.", after.pages_migrated - before.pages_migrated);
+}
@@ -4,6 +4,7 @@
 #include <heap.h>
 #include <string.h>
 #include <kprintf.h>
+#include <assert.h>
 
 /*
 * Tests that your malloc and free implementation work, and actually do free memory.
@@ -18,11 +19,45 @@ void test_heap(void) {
         free(addr);
     }
 
+    /*
+    * Small sizes go through the per-CPU magazines, so make sure that holding
+    * onto lots of them (forcing refills), and then freeing them all (forcing drains)
+    * works.
+    */
+    for (int i = 0; i < 500; ++i) {
+        void* addrs[64];
+        for (int j = 0; j < 64; ++j) {
+            addrs[j] = malloc(1 + (i + j * 7) % 300);
+            memset(addrs[j], j, 1 + (i + j * 7) % 300);
+        }
+        for (int j = 0; j < 64; ++j) {
+            free(addrs[(j * 13) % 64]);
+        }
+    }
+
     for (int i = 0; i < 5000; ++i) {
         void* addr = malloc(123456);
         memset(addr, i, 123456);
         free(addr);
     }
 
+    /*
+    * Free large blocks that come straight after bigger than minimum sized ones, filled
+    * with something that looks like a chunk boundary, to check that they aren't taken
+    * for the start of a chunk when seeing if the chunk can be given back.
+    */
+    for (int i = 0; i < 200; ++i) {
+        uint8_t* neighbour = malloc(4000 + i * 8);
+        uint8_t* block = malloc(200000);
+        memset(neighbour, 0xFF, 4000 + i * 8);
+        memset(block, i, 200000);
+        free(block);
+
+        for (int j = 0; j < 4000 + i * 8; ++j) {
+            assert(neighbour[j] == 0xFF);
+        }
+        free(neighbour);
+    }
+
     kprintf("Good.\n");
 }
\ No newline at end of file
@@ -0,0 +1,46 @@
+#include <physical.h>
+#include <virtual.h>
+#include <arch.h>
+#include <kprintf.h>
+#include <sys/memstat.h>
+
+#define LIMIT_PAGES     16
+#define TOTAL_PAGES     64
+
+/*
+* Gives an address space a hard limit, and then gives it more pages than that. Its own pages
+* should get swapped out to make room, so it never has more than the limit in memory.
+*/
+void test_memlimit(void) {
+    struct virtual_address_space* vas = vas_create();
+    vas_set_memory_limits(vas, 0, LIMIT_PAGES);
+
+    bool good = true;
+    size_t most_resident = 0;
+    size_t last_swapped = 0;
+
+    for (size_t i = 0; i < TOTAL_PAGES; ++i) {
+        size_t phys_addr = vas_allocate_user_page(vas);
+        size_t* data = (size_t*) phys_to_virt(phys_addr);
+        data[0] = i;
+        vas_map(vas, phys_addr, ARCH_USER_AREA_BASE + i * ARCH_PAGE_SIZE, VAS_FLAG_WRITABLE | VAS_FLAG_USER);
+
+        struct memstat stat;
+        vas_get_memstat(vas, &stat);
+        if (stat.resident > LIMIT_PAGES * ARCH_PAGE_SIZE || stat.swapped < last_swapped) {
+            good = false;
+        }
+        if (stat.resident > most_resident) {
+            most_resident = stat.resident;
+        }
+        last_swapped = stat.swapped;
+    }
+
+    if (last_swapped < (TOTAL_PAGES - LIMIT_PAGES) * ARCH_PAGE_SIZE) {
+        good = false;
+    }
+
+    vas_destroy(vas);
+
+    kprintf("%s (at most %u KB resident, %u KB swapped)\n", good ? "Good." : "Bad: the hard limit was gone over.", most_resident / 1024, last_swapped / 1024);
+}
@@ -0,0 +1,92 @@
+#include <thread.h>
+#include <cpu.h>
+#include <heap.h>
+#include <virtual.h>
+#include <kprintf.h>
+
+/*
+* Runs one busy thread on its own, and then several per CPU at once, to see how well the
+* work gets spread across the CPUs. The threads sleep between each round of work, so they
+* keep getting woken up and placed on a CPU again. Run it under qemu -smp to see the load
+* balancing and work stealing.
+*/
+
+#define THREADS_PER_CPU     4
+#define WORK_ROUNDS         20
+#define WORK_ITERATIONS     2000000
+#define SLEEP_NS            1000000
+#define POLL_NS             10000000
+
+static volatile int threads_done;
+
+static void sched_worker(void* arg) {
+    (void) arg;
+
+    for (int i = 0; i < WORK_ROUNDS; ++i) {
+        for (volatile int j = 0; j < WORK_ITERATIONS; ++j) {
+            ;
+        }
+        thread_nano_sleep(SLEEP_NS);
+    }
+
+    __atomic_fetch_add(&threads_done, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+* Returns how long it took for all of the threads to finish, in nanoseconds.
+*/
+static uint64_t run_workers(int num_threads) {
+    threads_done = 0;
+    uint64_t start = get_time_since_boot();
+
+    for (int i = 0; i < num_threads; ++i) {
+        thread_create(sched_worker, NULL, vas_get_current_vas());
+    }
+    while (threads_done < num_threads) {
+        thread_nano_sleep(POLL_NS);
+    }
+
+    return get_time_since_boot() - start;
+}
+
+void test_sched(void) {
+    int num_cpus = cpu_get_count();
+    int num_threads = num_cpus * THREADS_PER_CPU;
+
+    struct cpu_sched_stats* before = malloc(sizeof(struct cpu_sched_stats) * num_cpus);
+    struct cpu_sched_stats* after = malloc(sizeof(struct cpu_sched_stats) * num_cpus);
+
+    uint64_t single = run_workers(1);
+
+    for (int i = 0; i < num_cpus; ++i) {
+        thread_get_cpu_sched_stats(i, &before[i]);
+    }
+
+    uint64_t all = run_workers(num_threads);
+
+    for (int i = 0; i < num_cpus; ++i) {
+        thread_get_cpu_sched_stats(i, &after[i]);
+    }
+
+    /*
+    * With perfect scaling, running all of the threads takes as long as running
+    * THREADS_PER_CPU of them one after the other.
+    */
+    int speedup = (int) (single * num_threads * 100 / all);
+
+    kprintf("%d CPUs, %d threads\n", num_cpus, num_threads);
+    kprintf("one thread took %d ms, all of them took %d ms\n", (int) (single / 1000000), (int) (all / 1000000));
+    kprintf("speedup: %d.%d%d (best is %d)\n", speedup / 100, speedup / 10 % 10, speedup % 10, num_cpus);
+
+    for (int i = 0; i < num_cpus; ++i) {
+        kprintf("cpu %d: %d switches, %d migrations, %d steals, %d%% idle\n", i,
+            (int) (after[i].switches - before[i].switches),
+            (int) (after[i].migrations - before[i].migrations),
+            (int) (after[i].steals - before[i].steals),
+            (int) ((after[i].idle_ns - before[i].idle_ns) * 100 / all)
+        );
+    }
+
+    free(before);
+    free(after);
+}
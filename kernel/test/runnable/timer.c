@@ -0,0 +1,108 @@
+#include <thread.h>
+#include <cpu.h>
+#include <heap.h>
+#include <kprintf.h>
+#include <callout.h>
+#include <assert.h>
+
+/*
+* Checks that CPUs stop ticking when they have nothing to do, and how close to the
+* requested time short sleeps wake up. Fair threads can be woken up to SLEEP_SLACK_NS
+* late (see thread.c), but real-time threads should be woken up well within a
+* millisecond. Also measures how long it takes to read the time, and the smallest step
+* it goes up by, and checks that callouts go off on time and can be cancelled.
+*/
+
+#define IDLE_SECONDS        2
+#define NUM_SLEEPS          100
+#define SLEEP_NS            300000
+#define NUM_TIME_READS      100000
+#define CALLOUT_NS          5000000
+
+static uint64_t count_timer_interrupts(void) {
+    uint64_t total = 0;
+    for (int i = 0; i < cpu_get_count(); ++i) {
+        struct cpu_sched_stats stats;
+        thread_get_cpu_sched_stats(i, &stats);
+        total += stats.timer_interrupts;
+    }
+    return total;
+}
+
+static void measure_sleeps(const char* name) {
+    uint64_t total_late = 0;
+    uint64_t max_late = 0;
+
+    for (int i = 0; i < NUM_SLEEPS; ++i) {
+        uint64_t start = get_time_since_boot();
+        thread_nano_sleep(SLEEP_NS);
+        uint64_t late = get_time_since_boot() - start - SLEEP_NS;
+
+        total_late += late;
+        max_late = late > max_late ? late : max_late;
+    }
+
+    kprintf("%s: %d us sleeps were %d us late on average, %d us at most\n", name, SLEEP_NS / 1000,
+        (int) (total_late / NUM_SLEEPS / 1000), (int) (max_late / 1000));
+}
+
+static void measure_time_reads(void) {
+    uint64_t smallest_step = UINT64_MAX;
+    uint64_t start = get_time_since_boot();
+    uint64_t previous = start;
+
+    for (int i = 0; i < NUM_TIME_READS; ++i) {
+        uint64_t time = get_time_since_boot();
+        if (time != previous && time - previous < smallest_step) {
+            smallest_step = time - previous;
+        }
+        previous = time;
+    }
+
+    kprintf("reading the time takes %d ns, and it goes up by at least %d ns\n",
+        (int) ((previous - start) / NUM_TIME_READS), (int) smallest_step);
+}
+
+static void record_callout(void* arg) {
+    *((volatile uint64_t*) arg) = get_time_since_boot();
+}
+
+static void check_callouts(void) {
+    volatile uint64_t fired = 0;
+    volatile uint64_t cancelled = 0;
+    struct callout callout;
+    struct callout cancelled_callout;
+    callout_init(&callout, record_callout, (void*) &fired);
+    callout_init(&cancelled_callout, record_callout, (void*) &cancelled);
+
+    uint64_t start = get_time_since_boot();
+    callout_schedule(&cancelled_callout, start + CALLOUT_NS / 2);
+    callout_schedule(&callout, start + CALLOUT_NS * 100);
+    callout_schedule(&callout, start + CALLOUT_NS);
+    bool cancelled_in_time = callout_cancel(&cancelled_callout);
+
+    thread_nano_sleep(CALLOUT_NS * 4);
+    bool cancelled_too_late = callout_cancel(&callout);
+
+    assert(cancelled_in_time && !cancelled_too_late && fired != 0 && cancelled == 0);
+    (void) cancelled_in_time;
+    (void) cancelled_too_late;
+
+    kprintf("a %d us callout was %d us late\n", CALLOUT_NS / 1000, (int) ((fired - start - CALLOUT_NS) / 1000));
+}
+
+void test_timer(void) {
+    measure_time_reads();
+
+    uint64_t before = count_timer_interrupts();
+    thread_sleep(IDLE_SECONDS);
+    uint64_t after = count_timer_interrupts();
+
+    kprintf("%d CPUs had %d timer interrupts per second while idle\n", cpu_get_count(), (int) ((after - before) / IDLE_SECONDS));
+
+    check_callouts();
+    measure_sleeps("fair");
+    thread_set_priority(PRIORITY_FAIR - 1);
+    measure_sleeps("real-time");
+    thread_set_priority(PRIORITY_NORMAL);
+}
@@ -12,11 +12,19 @@ struct runnable_test {
 void test_stack_canary(void);
 void test_sleep(void);
 void test_heap(void);
+void test_compact(void);
+void test_sched(void);
+void test_timer(void);
+void test_memlimit(void);
 
 struct runnable_test tests[] = {
     {.name = "canary", .test = test_stack_canary},
     {.name = "sleep", .test = test_sleep},
     {.name = "heap", .test = test_heap},
+    {.name = "compact", .test = test_compact},
+    {.name = "sched", .test = test_sched},
+    {.name = "timer", .test = test_timer},
+    {.name = "memlimit", .test = test_memlimit},
 };
 
 void test_run(const char* name) {    
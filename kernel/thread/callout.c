@@ -0,0 +1,186 @@
+#include <callout.h>
+#include <timerwheel.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <cpu.h>
+#include <string.h>
+
+/*
+* thread/callout.c - Callouts
+*
+* Lets the kernel call a function at a certain time, without needing a thread to sleep
+* until then. Callouts get called from the bootstrap CPU's timer interrupt, so they must
+* be quick, and can't block. They are kept on a timer wheel (see thread/timerwheel.c),
+* which the bootstrap CPU's timer takes into account (see thread_update_timer).
+*/
+
+/*
+* How late a callout can be, so that ones due at around the same time all get called
+* together.
+*/
+#define CALLOUT_SLACK_NS    1000000
+
+/*
+* Callouts which haven't gone off yet are on the wheel, and ones that have gone off but
+* haven't been called yet are on the due list, in the order they went off. The lock must
+* be held while accessing, and while setting a callout's running flag. The CPU that calls
+* them is remembered so that a callout can cancel itself (see callout_cancel).
+*/
+static struct timer_wheel callout_wheel;
+static struct callout* due_head = NULL;
+static struct callout* due_tail = NULL;
+static struct spinlock callout_lock;
+static int callout_cpu = -1;
+
+void callout_system_init(void) {
+    spinlock_init(&callout_lock, "callout lock");
+    timer_wheel_init(&callout_wheel, get_time_since_boot());
+}
+
+/*
+* Called by the wheel when a callout goes off. Its function gets called once the wheel
+* has finished moving forward (see callout_run).
+*/
+static void callout_expired(void* arg) {
+    struct callout* callout = arg;
+    callout->due = true;
+    callout->next_due = NULL;
+
+    if (due_tail == NULL) {
+        due_head = callout;
+    } else {
+        due_tail->next_due = callout;
+    }
+    due_tail = callout;
+}
+
+/*
+* Sets up a callout which isn't scheduled yet. When it goes off, the function gets called
+* with the argument.
+*/
+void callout_init(struct callout* callout, void (*function)(void*), void* argument) {
+    memset(callout, 0, sizeof(struct callout));
+    timer_init(&callout->timer, callout_expired, callout);
+    callout->function = function;
+    callout->argument = argument;
+}
+
+/*
+* Takes a callout off the wheel or the due list. Returns true if it was on either of
+* them. The lock must be held.
+*/
+static bool callout_remove(struct callout* callout) {
+    if (callout->timer.pending) {
+        timer_wheel_remove(&callout_wheel, &callout->timer);
+        return true;
+    }
+
+    if (!callout->due) {
+        return false;
+    }
+
+    struct callout* prev = NULL;
+    struct callout* iter = due_head;
+    while (iter != callout) {
+        prev = iter;
+        iter = iter->next_due;
+    }
+
+    if (prev == NULL) {
+        due_head = callout->next_due;
+    } else {
+        prev->next_due = callout->next_due;
+    }
+    if (due_tail == callout) {
+        due_tail = prev;
+    }
+
+    callout->due = false;
+    callout->next_due = NULL;
+    return true;
+}
+
+/*
+* Makes a callout go off at the given time (in nanoseconds since boot), or shortly after.
+* If it was already scheduled, it gets moved. The scheduler lock must not be held.
+*/
+void callout_schedule(struct callout* callout, uint64_t when) {
+    spinlock_acquire(&callout_lock);
+    callout_remove(callout);
+    timer_wheel_add(&callout_wheel, &callout->timer, when, CALLOUT_SLACK_NS);
+    uint64_t expiry = callout->timer.expiry;
+    spinlock_release(&callout_lock);
+
+    thread_ensure_bsp_timer(expiry);
+}
+
+/*
+* Stops a callout from going off. Returns true if it was scheduled, or false if it wasn't
+* (including if it has already been called). If its function is being called right now,
+* this waits for it to return, so that once this returns, the function isn't running and
+* won't be called until the callout is scheduled again. A callout's own function can cancel
+* it, in which case it doesn't wait for itself. The scheduler lock must not be held.
+*/
+bool callout_cancel(struct callout* callout) {
+    spinlock_acquire(&callout_lock);
+    bool removed = callout_remove(callout);
+
+    /*
+    * The lock gets let go of while waiting, so that interrupts can happen, and so that the
+    * function can schedule callouts.
+    */
+    while (callout->running && callout_cpu != cpu_get_current_number()) {
+        spinlock_release(&callout_lock);
+        spinlock_acquire(&callout_lock);
+    }
+
+    spinlock_release(&callout_lock);
+    return removed;
+}
+
+/*
+* Calls the callouts which are due by the given time (in nanoseconds since boot). This
+* is called from the bootstrap CPU's timer interrupt. The lock isn't held while they are
+* called, so they can schedule callouts, including themselves.
+*/
+void callout_run(uint64_t time) {
+    spinlock_acquire(&callout_lock);
+    timer_wheel_advance(&callout_wheel, time);
+
+    while (due_head != NULL) {
+        struct callout* callout = due_head;
+        due_head = callout->next_due;
+        if (due_head == NULL) {
+            due_tail = NULL;
+        }
+
+        callout->due = false;
+        callout->next_due = NULL;
+
+        callout->running = true;
+        callout_cpu = cpu_get_current_number();
+
+        void (*function)(void*) = callout->function;
+        void* argument = callout->argument;
+
+        spinlock_release(&callout_lock);
+        function(argument);
+        spinlock_acquire(&callout_lock);
+
+        callout->running = false;
+    }
+
+    callout_cpu = -1;
+    spinlock_release(&callout_lock);
+}
+
+/*
+* Returns the earliest time (in nanoseconds since boot) that callout_run might need to
+* be called, or UINT64_MAX if nothing is scheduled.
+*/
+uint64_t callout_get_next_expiry(void) {
+    spinlock_acquire(&callout_lock);
+    uint64_t expiry = timer_wheel_get_next_expiry(&callout_wheel);
+    spinlock_release(&callout_lock);
+    return expiry;
+}
@@ -93,6 +93,13 @@ void cleaner_thread_task(void* arg) {
 
             assert(thread->state == THREAD_STATE_TERMINATED);
 
+            /*
+            * The CPU it was on might still be switching away from it, using its stack.
+            */
+            while (__atomic_load_n(&thread->on_cpu, __ATOMIC_ACQUIRE)) {
+                ;
+            }
+
             cleanup_thread(thread);
         }
 
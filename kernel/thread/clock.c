@@ -0,0 +1,288 @@
+#include <clock.h>
+#include <thread.h>
+#include <arch.h>
+#include <spinlock.h>
+#include <kprintf.h>
+#include <vdso.h>
+#include <sys/vdso.h>
+
+/*
+* thread/clock.c - Keeping the Time
+*
+* The time since boot gets added up from the bootstrap CPU's timer interrupts, and in
+* between them, from how far the timer is through its current interval. That needs a
+* lock, and the timer to be read, which is slow. So once the timestamp (see
+* arch_read_timestamp) has been measured against the timer, the time gets worked out
+* from it instead. Each timer interrupt on the bootstrap CPU moves the point the
+* timestamp is counted from forward, and readers just check that it didn't move while
+* they were looking at it, so they never need to take a lock.
+*
+* The timer keeps getting compared with the timestamp, and if they stop agreeing, the
+* time goes back to coming from the timer.
+*
+* The base is also copied into the vDSO (see thread/vdso.c), so that programs can work
+* out the time the same way.
+*/
+
+/*
+* How long the timestamp is measured for, how often it is compared against the timer
+* after that, and how far apart they can get (as a fraction, 1 / 2^shift).
+*/
+#define TIMESTAMP_CALIBRATION_NS    100000000
+#define WATCHDOG_INTERVAL_NS        500000000
+#define WATCHDOG_TOLERANCE_SHIFT    5
+
+/*
+* The number of fractional bits in clock_multiplier.
+*/
+#define CLOCK_SHIFT                 24
+
+/*
+* Number of nanoseconds passed since boot, as of the last timer interrupt on the bootstrap
+* CPU, and the last time that was given out from it by get_time_since_boot. The lock must
+* be held while accessing.
+*/
+static uint64_t time_since_boot;
+static uint64_t last_time_read;
+static struct spinlock time_since_boot_lock;
+
+/*
+* The time at a certain timestamp, and how many nanoseconds each timestamp tick is. Only
+* the bootstrap CPU's timer interrupt changes them, and it makes the sequence odd while
+* it does.
+*/
+static uint32_t clock_sequence = 0;
+static bool clock_use_timestamp = false;
+static uint64_t clock_base_timestamp;
+static uint64_t clock_base_time;
+static uint64_t clock_multiplier;
+
+/*
+* Used to compare the timestamp with the timer, while the time comes from the timestamp.
+*/
+static uint64_t watchdog_start_time;
+static uint64_t watchdog_start_clock;
+
+/*
+* Thread runtimes are also measured with the timestamp. It is only 32 bits so that it
+* can be read without a lock. Until it has been measured, ticks are treated as
+* nanoseconds.
+*/
+static uint32_t timestamp_ticks_per_ms = 0;
+static uint64_t calibration_start_timestamp = 0;
+static uint64_t calibration_start_time = 0;
+
+/*
+* The wall clock time at boot, in nanoseconds since 1970.
+*/
+static uint64_t boot_wall_time;
+
+/*
+* Where the base gets copied to in the vDSO.
+*/
+static struct vdso_data* vdso_data;
+
+/*
+* Converts a difference between two timestamps from arch_read_timestamp to nanoseconds.
+*/
+uint64_t clock_timestamp_to_ns(uint64_t ticks) {
+    uint32_t ticks_per_ms = timestamp_ticks_per_ms;
+    if (ticks_per_ms == 0) {
+        return ticks;
+    }
+    return (ticks / ticks_per_ms) * 1000000 + (ticks % ticks_per_ms) * 1000000 / ticks_per_ms;
+}
+
+static void clock_begin_update(void) {
+    __atomic_store_n(&clock_sequence, clock_sequence + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&vdso_data->sequence, clock_sequence, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+* Copies the base into the vDSO before letting readers at it again.
+*/
+static void clock_end_update(void) {
+    vdso_data->use_timestamp = clock_use_timestamp;
+    vdso_data->base_timestamp = clock_base_timestamp;
+    vdso_data->base_time = clock_base_time;
+    vdso_data->multiplier = clock_multiplier;
+    vdso_data->shift = CLOCK_SHIFT;
+    vdso_data->boot_wall_time = boot_wall_time;
+
+    __atomic_store_n(&clock_sequence, clock_sequence + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&vdso_data->sequence, clock_sequence, __ATOMIC_RELEASE);
+}
+
+void clock_init(void) {
+    spinlock_init(&time_since_boot_lock, "time since boot lock");
+    boot_wall_time = arch_read_wall_clock() * 1000000000ULL;
+
+    vdso_data = vdso_get_data();
+    clock_begin_update();
+    clock_end_update();
+}
+
+/*
+* Works out the time at a timestamp, from the current base.
+*/
+static uint64_t clock_time_at(uint64_t timestamp, uint64_t base_timestamp, uint64_t base_time, uint64_t multiplier) {
+    /*
+    * Other CPUs' timestamps might be a little behind this one's.
+    */
+    if (timestamp < base_timestamp) {
+        return base_time;
+    }
+    return base_time + (((timestamp - base_timestamp) * multiplier) >> CLOCK_SHIFT);
+}
+
+/*
+* Gets the time from the timer, for when the timestamp can't be used.
+*/
+static uint64_t clock_get_time_from_timer(void) {
+    spinlock_acquire(&time_since_boot_lock);
+    uint64_t time = time_since_boot + arch_get_time_since_timer();
+
+    /*
+    * If the timer goes off just before it is read, it starts counting the next interval
+    * before its interrupt adds the last one on, and so the time could go backwards.
+    */
+    if (time < last_time_read) {
+        time = last_time_read;
+    } else {
+        last_time_read = time;
+    }
+
+    spinlock_release(&time_since_boot_lock);
+    return time;
+}
+
+/*
+* Returns the number of nanoseconds since the system was booted.
+*/
+uint64_t get_time_since_boot(void) {
+    while (true) {
+        uint32_t sequence = __atomic_load_n(&clock_sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1) {
+            continue;
+        }
+
+        if (!clock_use_timestamp) {
+            return clock_get_time_from_timer();
+        }
+
+        uint64_t base_timestamp = clock_base_timestamp;
+        uint64_t base_time = clock_base_time;
+        uint64_t multiplier = clock_multiplier;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&clock_sequence, __ATOMIC_RELAXED) == sequence) {
+            return clock_time_at(arch_read_timestamp(), base_timestamp, base_time, multiplier);
+        }
+    }
+}
+
+/*
+* Returns the number of nanoseconds since 1970 (UTC).
+*/
+uint64_t clock_get_wall_time(void) {
+    return boot_wall_time + get_time_since_boot();
+}
+
+/*
+* Measures how fast the timestamp goes, and starts using it for the time if it can be.
+* The lock must be held.
+*/
+static void clock_calibrate(uint64_t timestamp) {
+    if (timestamp_ticks_per_ms != 0) {
+        return;
+    }
+
+    if (calibration_start_timestamp == 0) {
+        calibration_start_timestamp = timestamp;
+        calibration_start_time = time_since_boot;
+        return;
+    }
+
+    uint64_t elapsed = time_since_boot - calibration_start_time;
+    if (elapsed < TIMESTAMP_CALIBRATION_NS) {
+        return;
+    }
+
+    uint64_t ticks = timestamp - calibration_start_timestamp;
+    uint64_t ticks_per_ms = ticks / (elapsed / 1000000);
+    timestamp_ticks_per_ms = ticks_per_ms == 0 ? 1 : (ticks_per_ms > 0xFFFFFFFFU ? 0xFFFFFFFFU : ticks_per_ms);
+
+    if (ticks == 0 || !arch_timestamp_is_usable()) {
+        return;
+    }
+
+    clock_begin_update();
+    clock_base_timestamp = timestamp;
+    clock_base_time = time_since_boot > last_time_read ? time_since_boot : last_time_read;
+    clock_multiplier = (elapsed << CLOCK_SHIFT) / ticks;
+    clock_use_timestamp = true;
+    clock_end_update();
+
+    watchdog_start_time = time_since_boot;
+    watchdog_start_clock = clock_base_time;
+}
+
+/*
+* Goes back to getting the time from the timer if it has stopped agreeing with the
+* timestamp. The lock must be held.
+*/
+static void clock_check_timestamp(uint64_t now) {
+    uint64_t expected = time_since_boot - watchdog_start_time;
+    if (expected < WATCHDOG_INTERVAL_NS) {
+        return;
+    }
+
+    uint64_t measured = now - watchdog_start_clock;
+    uint64_t difference = measured > expected ? measured - expected : expected - measured;
+
+    if (difference > expected >> WATCHDOG_TOLERANCE_SHIFT) {
+        kprintf("clock: timestamp is unreliable, using the timer instead\n");
+
+        clock_begin_update();
+        clock_use_timestamp = false;
+        time_since_boot = now;
+        last_time_read = now;
+        clock_end_update();
+
+    } else {
+        watchdog_start_time = time_since_boot;
+        watchdog_start_clock = now;
+    }
+}
+
+/*
+* Called from the bootstrap CPU's timer interrupt, with how long it has been since the
+* last one.
+*/
+void clock_received_timer_interrupt(uint64_t delta) {
+    uint64_t timestamp = arch_read_timestamp();
+
+    spinlock_acquire(&time_since_boot_lock);
+    time_since_boot += delta;
+
+    if (!clock_use_timestamp) {
+        clock_calibrate(timestamp);
+
+    } else {
+        /*
+        * Move the base up to now, so that the difference from it never gets big enough
+        * to overflow when it is scaled.
+        */
+        uint64_t now = clock_time_at(timestamp, clock_base_timestamp, clock_base_time, clock_multiplier);
+
+        clock_begin_update();
+        clock_base_timestamp = timestamp;
+        clock_base_time = now;
+        clock_end_update();
+
+        clock_check_timestamp(now);
+    }
+
+    spinlock_release(&time_since_boot_lock);
+}
@@ -30,8 +30,9 @@ static void idle_function(void* arg) {
 }
 
 /*
-* Starts the idle thread. Must be called per-CPU so every CPU can run an idle thread.
+* Starts the idle thread. Must be called per-CPU so every CPU can run an idle thread,
+* and it never gets moved to another CPU.
 */
 void idle_thread_init() {
-    thread_create(idle_function, NULL, current_cpu->current_vas);
+    thread_create_pinned(idle_function, NULL, current_cpu->current_vas);
 }
\ No newline at end of file
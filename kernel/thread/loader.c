@@ -5,10 +5,18 @@
 #include <fcntl.h>
 #include <string.h>
 #include <virtual.h>
+#include <physical.h>
 #include <vnode.h>
 #include <sys/stat.h>
 #include <kprintf.h>
+#include <execcache.h>
+#include <vdso.h>
 
+/*
+* Loads a program into the current address space, along with the vDSO. Programs are only
+* read from the file the first time they are run, after that their pages come from the
+* executable cache.
+*/
 int load_program(const char* filename, size_t* entry_point, size_t* sbrk_point) {
     struct open_file* file;
     int ret = vfs_open(filename, O_RDONLY, 0, &file);
@@ -22,23 +30,44 @@ int load_program(const char* filename, size_t* entry_point, size_t* sbrk_point)
         vfs_close(file);
         return ret;
     }
-    
-    uint8_t* buffer = malloc(st.st_size);
-    memset(buffer, 0, st.st_size);
 
-    struct uio uio = uio_construct_kernel_read(buffer, st.st_size, 0);
-    ret = vfs_read(file, &uio);
-    if (ret != 0) {
+    struct exec_image* image = S_ISREG(st.st_mode) ? exec_cache_lookup(&st) : NULL;
+
+    if (image == NULL) {
+        uint8_t* buffer = malloc(st.st_size);
+        memset(buffer, 0, st.st_size);
+
+        struct uio uio = uio_construct_kernel_read(buffer, st.st_size, 0);
+        ret = vfs_read(file, &uio);
+        if (ret != 0) {
+            free(buffer);
+            vfs_close(file);
+            return ret;
+        }
+
+        image = exec_image_create(&st);
+        ret = arch_exec(buffer, st.st_size, image);
         free(buffer);
-        vfs_close(file);
-        return ret;
+
+        if (ret != 0) {
+            exec_image_release(image);
+            vfs_close(file);
+            return ret;
+        }
+
+        if (S_ISREG(st.st_mode)) {
+            exec_cache_insert(image);
+        }
     }
 
-    int result = arch_exec(buffer, st.st_size, entry_point, sbrk_point);
+    exec_image_map(image, vas_get_current_vas());
+    vdso_map(vas_get_current_vas());
+    *entry_point = image->entry_point;
+    *sbrk_point = image->sbrk_point;
 
-    free(buffer);
+    exec_image_release(image);
     vfs_close(file);
-    return result;
+    return 0;
 }
 
 int load_driver(const char* filename, bool lock_in_memory) {
@@ -70,7 +99,7 @@ int load_driver(const char* filename, bool lock_in_memory) {
         return ret;
     }
 
-    size_t relocation_point = virt_allocate_backed_pages(virt_bytes_to_pages(st.st_size), (lock_in_memory ? VAS_FLAG_LOCKED : 0));
+    size_t relocation_point = virt_allocate_backed_pages(virt_bytes_to_pages(st.st_size), VAS_FLAG_WRITABLE | (lock_in_memory ? VAS_FLAG_LOCKED : 0), PHYS_OWNER_DRIVER);
     size_t driver_addr = arch_load_driver(buffer, st.st_size, relocation_point);
     
     free(buffer);
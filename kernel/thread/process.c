@@ -17,6 +17,7 @@ struct process* process_create_child(struct virtual_address_space* vas, struct f
     process->threads = adt_list_create();
     process->vas = vas;
     process->fdtable = filedes_table_copy(fdtable);
+    process->locked_pages = 0;
 
     spinlock_acquire(&pid_spinlock);
     process->pid = next_pid++;
@@ -31,6 +32,16 @@ struct process* process_create(void) {
     return process_create_child(vas_create(), filedes_table_create());
 }
 
+/*
+* Sets how much memory a process can keep in RAM, in bytes (0 means no limit). Going over the
+* soft limit makes the process' memory the first to be swapped out, and the hard limit can't
+* be gone over. A process can change its own limits with setmemlimit.
+*/
+void process_set_memory_limits(struct process* process, size_t soft_limit, size_t hard_limit) {
+    assert(process);
+    vas_set_memory_limits(process->vas, virt_bytes_to_pages(soft_limit), virt_bytes_to_pages(hard_limit));
+}
+
 
 /*
 * Destroys all threads in the process and then deletes it.
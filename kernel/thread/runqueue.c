@@ -0,0 +1,476 @@
+#include <runqueue.h>
+#include <thread.h>
+#include <assert.h>
+#include <string.h>
+#include <sched.h>
+
+/*
+* thread/runqueue.c - Run Queues
+*
+* Keeps the threads that are ready to run. Real-time threads are kept in a list for each
+* priority level, and the highest priority level with threads in it can
+* be found in constant time by scanning the bitmaps. Fair threads are kept in an AVL tree
+* sorted by virtual runtime, so adding one or picking the next one takes logarithmic time.
+*
+* Each CPU has its own run queue, which has its own lock (see thread/thread.c). That must
+* be held while using it.
+*/
+
+/*
+* Weights for fair threads, going up in steps of 4 priority levels from PRIORITY_FAIR.
+* Each step gives about 25% less time than the one before. PRIORITY_NORMAL has a weight
+* of FAIR_NORMAL_WEIGHT.
+*/
+static const int fair_weights[] = {
+    /* 100 */   9548,   7620,   6100,   4904,   3906,   3121,   2501,
+    /* 128 */   1024,
+    /* 132 */   820,    655,    526,    423,    335,    272,    215,    172,
+    /* 164 */   137,    110,    87,     70,     56,     45,     36,     29,
+    /* 196 */   23,     18,     15,
+};
+
+#define NUM_FAIR_WEIGHTS (sizeof(fair_weights) / sizeof(fair_weights[0]))
+
+bool run_queue_is_fair_priority(int priority) {
+    return priority >= PRIORITY_FAIR && priority != PRIORITY_IDLE;
+}
+
+int run_queue_get_weight(int priority) {
+    assert(run_queue_is_fair_priority(priority));
+
+    size_t index = (priority - PRIORITY_FAIR) / 4;
+    return index < NUM_FAIR_WEIGHTS ? fair_weights[index] : fair_weights[NUM_FAIR_WEIGHTS - 1];
+}
+
+/*
+* Adds a thread to the back of its priority level, or to the front if at_front is set.
+*/
+static void priority_array_add(struct priority_array* array, struct thread* thr, int priority, bool at_front) {
+    thr->next = NULL;
+
+    if (array->first[priority] == NULL) {
+        array->first[priority] = thr;
+        array->last[priority] = thr;
+        array->bitmap[priority / 32] |= 1U << (priority % 32);
+        array->summary |= 1U << (priority / 32);
+
+    } else if (at_front) {
+        thr->next = array->first[priority];
+        array->first[priority] = thr;
+
+    } else {
+        array->last[priority]->next = thr;
+        array->last[priority] = thr;
+    }
+}
+
+/*
+* Returns the highest priority (i.e. lowest number) level with threads in it, or
+* RUN_QUEUE_NUM_PRIORITIES if there aren't any threads.
+*/
+static int priority_array_get_best(struct priority_array* array) {
+    if (array->summary == 0) {
+        return RUN_QUEUE_NUM_PRIORITIES;
+    }
+
+    int word = __builtin_ctz(array->summary);
+    return word * 32 + __builtin_ctz(array->bitmap[word]);
+}
+
+static struct thread* priority_array_pop(struct priority_array* array, int priority) {
+    struct thread* thr = array->first[priority];
+    assert(thr != NULL);
+
+    array->first[priority] = thr->next;
+
+    if (array->first[priority] == NULL) {
+        array->last[priority] = NULL;
+        array->bitmap[priority / 32] &= ~(1U << (priority % 32));
+        if (array->bitmap[priority / 32] == 0) {
+            array->summary &= ~(1U << (priority / 32));
+        }
+    }
+
+    thr->next = NULL;
+    return thr;
+}
+
+static void priority_array_remove(struct priority_array* array, struct thread* thr, int priority) {
+    if (array->first[priority] == thr) {
+        priority_array_pop(array, priority);
+        return;
+    }
+
+    struct thread* prev = array->first[priority];
+    while (prev->next != thr) {
+        prev = prev->next;
+        assert(prev != NULL);
+    }
+
+    prev->next = thr->next;
+    if (array->last[priority] == thr) {
+        array->last[priority] = prev;
+    }
+    thr->next = NULL;
+}
+
+/*
+* The fair tree. Threads are sorted by virtual runtime, and then by thread ID so that no
+* two threads are equal.
+*/
+static bool fair_is_before(struct thread* a, struct thread* b) {
+    return a->vruntime < b->vruntime || (a->vruntime == b->vruntime && a->thread_id < b->thread_id);
+}
+
+static int fair_height(struct thread* node) {
+    return node == NULL ? 0 : node->fair_height;
+}
+
+static void fair_update_height(struct thread* node) {
+    int left = fair_height(node->fair_left);
+    int right = fair_height(node->fair_right);
+    node->fair_height = 1 + (left > right ? left : right);
+}
+
+static struct thread* fair_rotate_right(struct thread* node) {
+    struct thread* left = node->fair_left;
+    node->fair_left = left->fair_right;
+    left->fair_right = node;
+    fair_update_height(node);
+    fair_update_height(left);
+    return left;
+}
+
+static struct thread* fair_rotate_left(struct thread* node) {
+    struct thread* right = node->fair_right;
+    node->fair_right = right->fair_left;
+    right->fair_left = node;
+    fair_update_height(node);
+    fair_update_height(right);
+    return right;
+}
+
+/*
+* Fixes up a subtree after one of its children has changed height by at most one, and
+* returns its new root.
+*/
+static struct thread* fair_rebalance(struct thread* node) {
+    fair_update_height(node);
+    int balance = fair_height(node->fair_left) - fair_height(node->fair_right);
+
+    if (balance > 1) {
+        if (fair_height(node->fair_left->fair_left) < fair_height(node->fair_left->fair_right)) {
+            node->fair_left = fair_rotate_left(node->fair_left);
+        }
+        return fair_rotate_right(node);
+    }
+
+    if (balance < -1) {
+        if (fair_height(node->fair_right->fair_right) < fair_height(node->fair_right->fair_left)) {
+            node->fair_right = fair_rotate_right(node->fair_right);
+        }
+        return fair_rotate_left(node);
+    }
+
+    return node;
+}
+
+static struct thread* fair_insert(struct thread* root, struct thread* thr) {
+    if (root == NULL) {
+        thr->fair_left = NULL;
+        thr->fair_right = NULL;
+        thr->fair_height = 1;
+        return thr;
+    }
+
+    if (fair_is_before(thr, root)) {
+        root->fair_left = fair_insert(root->fair_left, thr);
+    } else {
+        root->fair_right = fair_insert(root->fair_right, thr);
+    }
+
+    return fair_rebalance(root);
+}
+
+static struct thread* fair_remove_first(struct thread* root, struct thread** first_out) {
+    if (root->fair_left == NULL) {
+        *first_out = root;
+        return root->fair_right;
+    }
+
+    root->fair_left = fair_remove_first(root->fair_left, first_out);
+    return fair_rebalance(root);
+}
+
+/*
+* Removes a thread from the tree. Its virtual runtime must not have changed since it was
+* added.
+*/
+static struct thread* fair_remove_thread(struct thread* root, struct thread* thr) {
+    assert(root != NULL);
+
+    if (root == thr) {
+        if (root->fair_left == NULL) {
+            return root->fair_right;
+        }
+        if (root->fair_right == NULL) {
+            return root->fair_left;
+        }
+
+        struct thread* successor;
+        struct thread* right = fair_remove_first(root->fair_right, &successor);
+        successor->fair_left = root->fair_left;
+        successor->fair_right = right;
+        return fair_rebalance(successor);
+    }
+
+    if (fair_is_before(thr, root)) {
+        root->fair_left = fair_remove_thread(root->fair_left, thr);
+    } else {
+        root->fair_right = fair_remove_thread(root->fair_right, thr);
+    }
+
+    return fair_rebalance(root);
+}
+
+static void fair_add(struct run_queue* queue, struct thread* thr, int reason) {
+    /*
+    * Don't let threads build up credit by sleeping, or new threads start from nothing.
+    */
+    if (reason == RUN_QUEUE_WOKEN && thr->vruntime + FAIR_SLEEPER_CREDIT_NS < queue->min_vruntime) {
+        thr->vruntime = queue->min_vruntime - FAIR_SLEEPER_CREDIT_NS;
+    }
+
+    thr->fair_weight = run_queue_get_weight(thr->priority);
+    queue->fair_weight += thr->fair_weight;
+    queue->fair_root = fair_insert(queue->fair_root, thr);
+}
+
+static struct thread* fair_pop(struct run_queue* queue) {
+    struct thread* thr;
+    queue->fair_root = fair_remove_first(queue->fair_root, &thr);
+    queue->fair_weight -= thr->fair_weight;
+
+    if (thr->vruntime > queue->min_vruntime) {
+        queue->min_vruntime = thr->vruntime;
+    }
+
+    thr->fair_left = NULL;
+    thr->fair_right = NULL;
+    return thr;
+}
+
+void run_queue_init(struct run_queue* queue) {
+    memset(queue, 0, sizeof(struct run_queue));
+}
+
+/*
+* Adds a thread to the run queue. The reason is one of RUN_QUEUE_PREEMPTED,
+* RUN_QUEUE_EXPIRED or RUN_QUEUE_WOKEN.
+*/
+void run_queue_add(struct run_queue* queue, struct thread* thr, int reason) {
+    int priority = thr->priority;
+    assert(priority >= 0 && priority < RUN_QUEUE_NUM_PRIORITIES);
+
+    if (priority != PRIORITY_IDLE) {
+        queue->num_waiting++;
+    }
+
+    if (priority == PRIORITY_IDLE) {
+        thr->next = NULL;
+        if (queue->first_idle == NULL) {
+            queue->first_idle = thr;
+        } else {
+            queue->last_idle->next = thr;
+        }
+        queue->last_idle = thr;
+
+    } else if (run_queue_is_fair_priority(priority)) {
+        fair_add(queue, thr, reason);
+
+    } else {
+        priority_array_add(&queue->rt, thr, priority, reason == RUN_QUEUE_PREEMPTED);
+    }
+}
+
+/*
+* Takes a thread back out of the run queue, e.g. so that its priority can be changed.
+*/
+void run_queue_remove(struct run_queue* queue, struct thread* thr) {
+    int priority = thr->priority;
+
+    if (priority != PRIORITY_IDLE) {
+        queue->num_waiting--;
+    }
+
+    if (priority == PRIORITY_IDLE) {
+        struct thread* prev = NULL;
+        struct thread* iter = queue->first_idle;
+        while (iter != thr) {
+            assert(iter != NULL);
+            prev = iter;
+            iter = iter->next;
+        }
+
+        if (prev == NULL) {
+            queue->first_idle = thr->next;
+        } else {
+            prev->next = thr->next;
+        }
+        if (queue->last_idle == thr) {
+            queue->last_idle = prev;
+        }
+        thr->next = NULL;
+
+    } else if (run_queue_is_fair_priority(priority)) {
+        queue->fair_root = fair_remove_thread(queue->fair_root, thr);
+        queue->fair_weight -= thr->fair_weight;
+        thr->fair_left = NULL;
+        thr->fair_right = NULL;
+
+    } else {
+        priority_array_remove(&queue->rt, thr, priority);
+    }
+}
+
+/*
+* Removes and returns the thread that should run next, or NULL if there are no threads.
+*/
+struct thread* run_queue_pop(struct run_queue* queue) {
+    int priority = priority_array_get_best(&queue->rt);
+    if (priority != RUN_QUEUE_NUM_PRIORITIES) {
+        queue->num_waiting--;
+        return priority_array_pop(&queue->rt, priority);
+    }
+
+    if (queue->fair_root != NULL) {
+        queue->num_waiting--;
+        return fair_pop(queue);
+    }
+
+    struct thread* thr = queue->first_idle;
+    if (thr != NULL) {
+        queue->first_idle = thr->next;
+        if (queue->first_idle == NULL) {
+            queue->last_idle = NULL;
+        }
+        thr->next = NULL;
+    }
+    return thr;
+}
+
+/*
+* Returns true if there are no threads at all waiting (not even idle ones).
+*/
+bool run_queue_is_empty(struct run_queue* queue) {
+    return queue->rt.summary == 0 && queue->fair_root == NULL && queue->first_idle == NULL;
+}
+
+/*
+* Returns the number of threads waiting, not counting idle threads.
+*/
+int run_queue_get_num_waiting(struct run_queue* queue) {
+    return queue->num_waiting;
+}
+
+/*
+* Finds the fair thread furthest back in the tree that isn't pinned to its CPU.
+*/
+static struct thread* fair_find_migratable(struct thread* node) {
+    if (node == NULL) {
+        return NULL;
+    }
+
+    struct thread* found = fair_find_migratable(node->fair_right);
+    if (found == NULL && !node->pinned) {
+        found = node;
+    }
+    if (found == NULL) {
+        found = fair_find_migratable(node->fair_left);
+    }
+    return found;
+}
+
+/*
+* Removes and returns a thread that can be moved to another CPU's run queue, or NULL if
+* there isn't one. Idle threads and pinned threads are never taken. Real-time threads are
+* taken first (most important first), as they are being held up by something at least
+* as important. Otherwise it is the fair thread that would have run last, as it is the
+* least likely to still have anything in the cache.
+*/
+struct thread* run_queue_take_migratable(struct run_queue* queue) {
+    struct thread* thr = NULL;
+
+    for (int priority = 0; priority < PRIORITY_FAIR && thr == NULL; ++priority) {
+        if (!(queue->rt.bitmap[priority / 32] & (1U << (priority % 32)))) {
+            continue;
+        }
+        for (struct thread* iter = queue->rt.first[priority]; iter != NULL; iter = iter->next) {
+            if (!iter->pinned) {
+                thr = iter;
+                break;
+            }
+        }
+    }
+
+    if (thr == NULL) {
+        thr = fair_find_migratable(queue->fair_root);
+    }
+
+    if (thr != NULL) {
+        run_queue_remove(queue, thr);
+    }
+    return thr;
+}
+
+/*
+* Returns the order the classes run in.
+*/
+static int run_queue_get_class(int priority) {
+    if (priority == PRIORITY_IDLE) {
+        return 2;
+    }
+    return run_queue_is_fair_priority(priority) ? 1 : 0;
+}
+
+/*
+* Whether a thread that has just been added should get to run instead of the current
+* thread straight away. Both threads' virtual runtimes must be up to date.
+*/
+bool run_queue_should_preempt(struct thread* woken, struct thread* current) {
+    int woken_class = run_queue_get_class(woken->priority);
+    int current_class = run_queue_get_class(current->priority);
+
+    if (woken_class != current_class) {
+        return woken_class < current_class;
+    }
+    if (run_queue_is_fair_priority(woken->priority)) {
+        return woken->vruntime + FAIR_WAKEUP_GRANULARITY_NS < current->vruntime;
+    }
+    return woken->priority < current->priority;
+}
+
+/*
+* Returns how long a thread that is about to run (and so isn't in the queue) should run
+* for, in nanoseconds. Zero means it can run until it blocks, yields, or something more
+* important needs to run.
+*/
+uint64_t run_queue_get_timeslice(struct run_queue* queue, struct thread* thr) {
+    if (thr->priority == PRIORITY_IDLE) {
+        return RT_TIMESLICE_NS;
+    }
+    if (!run_queue_is_fair_priority(thr->priority)) {
+        return thr->policy == SCHED_FIFO ? 0 : RT_TIMESLICE_NS;
+    }
+
+    uint64_t weight = run_queue_get_weight(thr->priority);
+    uint64_t timeslice = FAIR_TARGET_LATENCY_NS * weight / (queue->fair_weight + weight);
+    return timeslice < FAIR_MIN_GRANULARITY_NS ? FAIR_MIN_GRANULARITY_NS : timeslice;
+}
+
+/*
+* The virtual runtime new threads should start with.
+*/
+uint64_t run_queue_get_min_vruntime(struct run_queue* queue) {
+    return queue->min_vruntime;
+}
@@ -42,14 +42,38 @@ void spinlock_init(struct spinlock* lock, const char* name)
 	lock->name[63] = 0;
 }
 
+/*
+* Checks whether this CPU is the one holding a lock. Interrupts are disabled while a
+* spinlock is held, so the thread that holds it can't move to another CPU.
+*/
+bool spinlock_is_held_by_this_cpu(struct spinlock* lock)
+{
+	return spinlock_is_held(lock) && lock->cpu_number == cpu_get_current_number();
+}
+
 /*
 * Acquires a spinlock. If the lock is already held, it will keep trying (spinning)
 * until it can acquire the lock.
 */
 void spinlock_acquire(struct spinlock* lock)
 {   
-	assert_with_message(!spinlock_is_held(lock), lock->name);
+	assert_with_message(!spinlock_is_held_by_this_cpu(lock), lock->name);
 	arch_irq_spinlock_acquire(&lock->lock);
+	lock->cpu_number = cpu_get_current_number();
+}
+
+/*
+* Acquires a spinlock if nothing else holds it, without waiting. Returns true if it was
+* acquired, or false if it is held (including by this CPU).
+*/
+bool spinlock_try_acquire(struct spinlock* lock)
+{
+	if (spinlock_is_held_by_this_cpu(lock) || !arch_irq_spinlock_try_acquire(&lock->lock)) {
+		return false;
+	}
+
+	lock->cpu_number = cpu_get_current_number();
+	return true;
 }
 
 /*
@@ -58,12 +82,13 @@ void spinlock_acquire(struct spinlock* lock)
 void spinlock_release(struct spinlock* lock)
 {	       
     assert_with_message(spinlock_is_held(lock), lock->name);
+	lock->cpu_number = -1;
 	arch_irq_spinlock_release(&lock->lock);
 }
 
 
 /*
-* Will acquire the lock if it is unlocked, or do nothing if the lock is already held.
+* Will acquire the lock unless this CPU already holds it, in which case it does nothing.
 * Returns true we acquired the lock, or false if it was already locked.
 *
 * This is a dangerous function - it allows for spinlocks to be nested. It should
@@ -72,11 +97,10 @@ void spinlock_release(struct spinlock* lock)
 */
 bool spinlock_acquire_if_unlocked(struct spinlock* lock) {
     /*
-    * TODO: THIS IS NOT ATOMIC, as the lock can change state in between spinlock_is_held() and spinlock_acquire
-    *       (i.e. make an arch_ function which somehow atomically does it)
-    *        it is okay for this code to be slow, it only should occur on certain low memory page faults
+    * Only this CPU can change whether this CPU holds the lock, so it can't change
+    * between the check and acquiring it. (If another CPU holds it, we wait for it).
     */
-    if (!spinlock_is_held(lock)) {
+    if (!spinlock_is_held_by_this_cpu(lock)) {
         spinlock_acquire(lock);
 		return true;
     }
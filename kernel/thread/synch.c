@@ -14,8 +14,16 @@
 * Provides higher-level synchronisation primitives built on top of spinlocks.
 * They interact with the scheduler so threads may block instead of spinning
 * while waiting.
+*
+* Semaphores used as mutexes (with a max count of 1) use priority inheritance: while a
+* thread is waiting for a mutex, the thread holding it runs with the waiting thread's
+* priority if that is higher. Otherwise a low priority holder could be kept off the CPU
+* by medium priority threads, leaving a high priority thread waiting indefinitely. This
+* passes along chains of mutexes (up to MAX_INHERITANCE_DEPTH long).
 */
 
+#define MAX_INHERITANCE_DEPTH   8
+
 /*
 * Allocates and initialises a semaphore.
 */
@@ -27,10 +35,126 @@ struct semaphore* semaphore_create(int max_count) {
     sem->max_count = max_count;
     sem->first_waiting_thread = NULL;
     sem->last_waiting_thread = NULL;
+    sem->owner = NULL;
+    sem->next_held = NULL;
     
     return sem;
 }
 
+static bool semaphore_is_mutex(struct semaphore* sem) {
+    return sem->max_count == 1;
+}
+
+/*
+* Adds a thread to a semaphore's waiting list, behind any threads with the same or a
+* higher priority. The scheduler lock must be held.
+*/
+static void semaphore_add_waiting_thread(struct semaphore* sem, struct thread* thr) {
+    thr->next = NULL;
+
+    if (sem->first_waiting_thread == NULL) {
+        sem->first_waiting_thread = thr;
+        sem->last_waiting_thread = thr;
+
+    } else if (thr->priority < sem->first_waiting_thread->priority) {
+        thr->next = sem->first_waiting_thread;
+        sem->first_waiting_thread = thr;
+
+    } else {
+        struct thread* prev = sem->first_waiting_thread;
+        while (prev->next != NULL && prev->next->priority <= thr->priority) {
+            prev = prev->next;
+        }
+
+        thr->next = prev->next;
+        prev->next = thr;
+        if (thr->next == NULL) {
+            sem->last_waiting_thread = thr;
+        }
+    }
+}
+
+static void semaphore_remove_waiting_thread(struct semaphore* sem, struct thread* thr) {
+    struct thread* prev = NULL;
+    struct thread* iter = sem->first_waiting_thread;
+    while (iter != thr) {
+        assert(iter != NULL);
+        prev = iter;
+        iter = iter->next;
+    }
+
+    if (prev == NULL) {
+        sem->first_waiting_thread = thr->next;
+    } else {
+        prev->next = thr->next;
+    }
+    if (sem->last_waiting_thread == thr) {
+        sem->last_waiting_thread = prev;
+    }
+    thr->next = NULL;
+}
+
+static void semaphore_set_owner(struct semaphore* sem, struct thread* thr) {
+    sem->owner = thr;
+    sem->next_held = thr->held_mutexes;
+    thr->held_mutexes = sem;
+}
+
+static void semaphore_clear_owner(struct semaphore* sem) {
+    struct semaphore** prev = &sem->owner->held_mutexes;
+    while (*prev != sem) {
+        assert(*prev != NULL);
+        prev = &(*prev)->next_held;
+    }
+
+    *prev = sem->next_held;
+    sem->next_held = NULL;
+    sem->owner = NULL;
+}
+
+/*
+* The priority a thread should run with: its own, or that of the most important thread
+* waiting on a mutex it holds.
+*/
+static int semaphore_get_inherited_priority(struct thread* thr) {
+    int priority = thr->base_priority;
+
+    for (struct semaphore* sem = thr->held_mutexes; sem != NULL; sem = sem->next_held) {
+        if (sem->first_waiting_thread != NULL && sem->first_waiting_thread->priority < priority) {
+            priority = sem->first_waiting_thread->priority;
+        }
+    }
+
+    return priority;
+}
+
+/*
+* Recalculates the priority of a thread after its base priority or the threads waiting
+* on its mutexes have changed. If it is waiting on a mutex itself, the change is passed
+* on to that mutex's owner. The scheduler lock must be held.
+*/
+void semaphore_update_inherited_priority(struct thread* thr) {
+    assert(spinlock_is_held(&scheduler_lock));
+
+    for (int depth = 0; thr != NULL && depth < MAX_INHERITANCE_DEPTH; ++depth) {
+        int priority = semaphore_get_inherited_priority(thr);
+        if (priority == thr->priority) {
+            return;
+        }
+
+        thread_change_priority(thr, priority);
+
+        struct semaphore* sem = thr->blocked_on;
+        if (sem == NULL) {
+            return;
+        }
+
+        semaphore_remove_waiting_thread(sem, thr);
+        semaphore_add_waiting_thread(sem, thr);
+        thr = sem->owner;
+    }
+}
+
 /*
 * Cleans up and frees a semaphore.
 */
@@ -59,23 +183,27 @@ void semaphore_acquire(struct semaphore* sem) {
         * Available to acquire right now.
         */
         sem->current_count++;
+        if (semaphore_is_mutex(sem)) {
+            semaphore_set_owner(sem, current_cpu->current_thread);
+        }
 
     } else {
         thread_postpone_switches();
 
         /*
-        * Add the current thread to the waiting list, then block.
+        * Add the current thread to the waiting list, then block. If it is a mutex, the
+        * owner might need to run at our priority to get out of our way.
         */
-        current_cpu->current_thread->next = NULL;
+        semaphore_add_waiting_thread(sem, current_cpu->current_thread);
 
-        if (sem->first_waiting_thread == NULL) {
-            sem->first_waiting_thread = current_cpu->current_thread;
-        } else {
-            sem->last_waiting_thread->next = current_cpu->current_thread;
+        if (semaphore_is_mutex(sem)) {
+            current_cpu->current_thread->blocked_on = sem;
+            semaphore_update_inherited_priority(sem->owner);
         }
 
-        sem->last_waiting_thread = current_cpu->current_thread;
-
+        /*
+        * Whoever releases the semaphore makes us the owner before waking us up.
+        */
         thread_block(THREAD_STATE_UNINTERRUPTIBLE);
         thread_end_postpone_switches();
 
@@ -99,6 +227,9 @@ int semaphore_try_acquire(struct semaphore* sem) {
         * Available to acquire right now.
         */
         sem->current_count++;
+        if (semaphore_is_mutex(sem)) {
+            semaphore_set_owner(sem, current_cpu->current_thread);
+        }
         spinlock_release(&scheduler_lock);
         return 0;
 
@@ -119,14 +250,31 @@ void semaphore_release(struct semaphore* sem) {
     spinlock_acquire(&scheduler_lock);
     thread_postpone_switches();
 
+    /*
+    * Whoever held a mutex no longer inherits anything from the threads waiting on it.
+    * (This isn't always the current thread, e.g. the last reader to leave a rw_lock
+    * releases the mutex the first reader acquired.)
+    */
+    struct thread* previous_owner = sem->owner;
+    if (previous_owner != NULL) {
+        semaphore_clear_owner(sem);
+        semaphore_update_inherited_priority(previous_owner);
+    }
+
     if (sem->first_waiting_thread != NULL) {
         /*
-        * Wake up the first waiting thread. No need to decrease the count,
-        * as the thread being woken up would have acquired the semaphore.
+        * Wake up the first (i.e. highest priority) waiting thread. No need to decrease
+        * the count, as the thread being woken up would have acquired the semaphore.
         */
         struct thread* thread = sem->first_waiting_thread;
-        sem->first_waiting_thread = thread->next;
-        thread->next = NULL;
+        semaphore_remove_waiting_thread(sem, thread);
+
+        if (semaphore_is_mutex(sem)) {
+            thread->blocked_on = NULL;
+            semaphore_set_owner(sem, thread);
+            semaphore_update_inherited_priority(thread);
+        }
+
         thread_unblock(thread);
 
     } else {
@@ -14,6 +14,13 @@
 #include <filedes.h>
 #include <machine/config.h>
 #include <signal.h>
+#include <runqueue.h>
+#include <string.h>
+#include <synch.h>
+#include <sched.h>
+#include <timerwheel.h>
+#include <clock.h>
+#include <callout.h>
 
 /*
 * thread/thread.c - Threads
@@ -44,26 +51,68 @@
 #define USER_STACK_MAX_SIZE (virt_bytes_to_pages(4 * 1024 * 1024) * ARCH_PAGE_SIZE)
 
 /*
-* The scheduler lock must be held whenever calling thread_schedule(), and also must
-* be held when doing things such as blocking and unblocking threads, as well as accessing
-* the global 'next thread ID'.
+* The scheduler lock must be held when blocking and unblocking threads, as it protects
+* the lists they wait on (e.g. in thread/synch.c and the sleep wheel), as well as the
+* global 'next thread ID'. Switching threads doesn't need it (see thread_schedule). The
+* run queues have locks of their own (see below), which get acquired after this one.
 */
 struct spinlock scheduler_lock;
 
 static int next_thread_id = 1;
 
 /*
-* A linked list storing which threads are currently waiting for their turn on a CPU,
-* and are not currently running or locked. The scheduler lock must be held while accessing.
+* Each CPU has its own run queue of threads which are waiting for their turn on it, and
+* are not currently running or locked. Threads go back to the CPU they last ran on, so
+* that they can use what they left in its cache. They get moved to other CPUs by load
+* balancing (see thread_balance) and by CPUs with nothing to do (see thread_steal).
+*
+* Each run queue has a lock, which must be held while accessing it. It also protects the
+* threads in the queue, including which CPU they belong to. Moving a thread to another CPU
+* needs both CPUs' locks, which always get acquired in order of CPU number (see
+* thread_lock_queues), and doesn't need the scheduler lock.
+*
+* A CPU holds its run queue lock while it switches threads, and the thread it switches
+* to lets go of it (see thread_finish_switch). So a thread that was just put back in the
+* run queue can't be taken by another CPU while its stack is still in use. Threads that
+* blocked aren't in a run queue, so they have on_cpu set until the switch away from them
+* is done, and nothing runs (or frees) them until it is cleared.
+*
+* The rest only gets changed by the CPU it belongs to, and other CPUs only read it.
+*/
+struct cpu_scheduler {
+    struct spinlock lock;
+    struct run_queue queue;
+    struct thread* switched_from;           /* The thread it is switching away from, if it is */
+    bool running_idle;                      /* Whether it is running its idle thread */
+    uint64_t next_balance;                  /* Time since boot of the next call to thread_balance */
+    uint64_t timer_deadline;                /* What the timer was last set to, or 0 if it is ticking */
+    struct cpu_sched_stats stats;
+};
+
+static struct cpu_scheduler* schedulers[ARCH_MAX_CPU_ALLOWED];
+
+/*
+* How often each CPU checks whether another one is busier than it, and how many more
+* threads the other CPU must have for one to be moved. Idle CPUs check less often, so
+* that they don't keep getting woken up (they also check when they first go idle, see
+* thread_steal).
 */
-static struct thread* first_ready_thread = NULL;
-static struct thread* last_ready_thread = NULL;
+#define BALANCE_INTERVAL_NS         10000000
+#define IDLE_BALANCE_INTERVAL_NS    100000000
+#define BALANCE_THRESHOLD           2
 
 /*
-* A linked list storing threads which are blocked due to a timer.
-* Scheduler lock must be held while accessing.
+* The timers of threads which are sleeping (see thread_nano_sleep_until). The scheduler
+* lock must be held while accessing.
 */
-static struct thread* sleeping_thread_list = NULL;
+static struct timer_wheel sleep_wheel;
+
+/*
+* How late a sleeping thread can be woken up, so that threads that are due to wake up at
+* around the same time all get woken up together. Real-time threads get woken up as soon
+* as possible.
+*/
+#define SLEEP_SLACK_NS      500000
 
 struct thread* terminated_thread_list = NULL;
 
@@ -77,18 +126,13 @@ struct thread* terminated_thread_list = NULL;
 * called while postponing is active, postpone_switches will be set instead of performing
 * an actual schedule.
 *
-* The postpone_lock be held when accessing these variables.
+* The postpone_lock be held when accessing these variables. Only the CPU holding it has
+* its switches postponed.
 */
 static bool have_postponed_switch = false;
 static bool postpone_switches = false;
 static struct spinlock postpone_lock;
 
-/*
-* Number of nanoseconds passed since boot. The lock must be held while accessing.
-*/
-static uint64_t time_since_boot;
-static struct spinlock time_since_boot_lock;
-
 
 /*
 * Kernel stack overflow normally results in a total system crash/reboot because 
@@ -156,7 +200,7 @@ static void thread_stack_canary_create(size_t canary_base) {
 static size_t thread_create_kernel_stack(int size, size_t* canary_position) {
     int num_pages = virt_bytes_to_pages(size) + NUM_CANARY_PAGES;
     
-    size_t stack_bottom = virt_allocate_backed_pages(num_pages, VAS_FLAG_WRITABLE | VAS_FLAG_LOCKED);
+    size_t stack_bottom = virt_allocate_backed_pages(num_pages, VAS_FLAG_WRITABLE | VAS_FLAG_LOCKED, PHYS_OWNER_KERNEL_STACK);
     size_t stack_top = stack_bottom + num_pages * ARCH_PAGE_SIZE;
 
 #ifdef ARCH_STACK_GROWS_DOWNWARD
@@ -243,6 +287,20 @@ void thread_execute_in_usermode(void* ignored_arg) {
     thread_terminate();
 }
 
+/*
+* Called by a thread as soon as it has been switched to, whether it is just starting or
+* is coming back from thread_schedule. It lets go of the run queue lock the switch was
+* done with, and lets other CPUs run the thread that was switched away from.
+*/
+static void thread_finish_switch(void) {
+    struct cpu_scheduler* sched = schedulers[current_cpu->cpu_number];
+    struct thread* prev = sched->switched_from;
+    sched->switched_from = NULL;
+
+    __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+    spinlock_release(&sched->lock);
+}
+
 /*
 * Runs whenever a thread is scheduled for the first time. The implementation of 
 * arch_prepare_stack should use the address of this function. 
@@ -250,9 +308,9 @@ void thread_execute_in_usermode(void* ignored_arg) {
 void thread_startup_handler(void) {
     /*
     * To get here, someone must have called thread_schedule(), and therefore
-    * the lock must have been held.
+    * the run queue lock must have been held.
     */
-    spinlock_release(&scheduler_lock);
+    thread_finish_switch();
 
     /* Anything else you might want to do should be done here... */
 
@@ -264,56 +322,333 @@ void thread_startup_handler(void) {
 }
 
 
+static struct run_queue* thread_get_run_queue(int cpu_number) {
+    return &schedulers[cpu_number]->queue;
+}
+
+/*
+* Acquires the run queue locks of two CPUs, which can be the same one. The lower numbered
+* CPU's lock always gets acquired first, so that two CPUs moving threads between each other
+* can't each end up waiting for the other.
+*/
+static void thread_lock_queues(int first_cpu, int second_cpu) {
+    if (first_cpu == second_cpu) {
+        spinlock_acquire(&schedulers[first_cpu]->lock);
+        return;
+    }
+
+    int low = first_cpu < second_cpu ? first_cpu : second_cpu;
+    int high = first_cpu < second_cpu ? second_cpu : first_cpu;
+    spinlock_acquire(&schedulers[low]->lock);
+    spinlock_acquire(&schedulers[high]->lock);
+}
+
+static void thread_unlock_queues(int first_cpu, int second_cpu) {
+    spinlock_release(&schedulers[first_cpu]->lock);
+    if (first_cpu != second_cpu) {
+        spinlock_release(&schedulers[second_cpu]->lock);
+    }
+}
+
 /*
-* Adds a thread to the list of threads that are waiting for their turn on a CPU.
-* This allows it to be scheduled.
+* Adds a thread to the run queue of the CPU it belongs to (see thread_set_cpu), so that it
+* can be scheduled. The reason is one of RUN_QUEUE_PREEMPTED, RUN_QUEUE_EXPIRED or
+* RUN_QUEUE_WOKEN (see runqueue.h). The run queue's lock must be held.
 */
-static void thread_add_to_ready_list(struct thread* thr, bool add_to_front) {
+static void thread_add_to_ready_list(struct thread* thr, int reason) {
     assert(thr);
-    assert(spinlock_is_held(&scheduler_lock));
+    assert(spinlock_is_held(&schedulers[thr->last_cpu]->lock));
 
-    thr->next = NULL;
     thr->state = THREAD_STATE_READY;
+    thr->ready_since = arch_read_timestamp();
+    thr->waking = reason == RUN_QUEUE_WOKEN;
+    run_queue_add(thread_get_run_queue(thr->last_cpu), thr, reason);
+}
 
-    if (first_ready_thread == NULL) {
-        assert(last_ready_thread == NULL);
-        
-        /*
-        * If there is not currently an entry in the list, we must set both the
-        * first and last pointers.
-        */
-        first_ready_thread = thr;
-        last_ready_thread = thr;
+/*
+* Makes a thread that isn't in a run queue belong to another CPU. Fair threads keep the
+* same place relative to the other threads in the run queue, as each run queue measures
+* virtual runtime from its own minimum. Both CPUs' run queue locks must be held.
+*/
+static void thread_set_cpu(struct thread* thr, int cpu_number) {
+    uint64_t old_min = run_queue_get_min_vruntime(thread_get_run_queue(thr->last_cpu));
+    uint64_t new_min = run_queue_get_min_vruntime(thread_get_run_queue(cpu_number));
 
+    if (thr->vruntime >= old_min) {
+        thr->vruntime = thr->vruntime - old_min + new_min;
     } else {
-        assert(last_ready_thread != NULL);
-        assert(last_ready_thread->next == NULL);
+        uint64_t behind = old_min - thr->vruntime;
+        thr->vruntime = behind > new_min ? 0 : new_min - behind;
+    }
+
+    thr->last_cpu = cpu_number;
+}
+
+/*
+* The number of threads a CPU has to run, not counting idle threads. This is read without
+* the run queue's lock, so it might already be out of date, which is fine for choosing
+* where threads should go.
+*/
+static int thread_get_load(int cpu_number) {
+    struct cpu_scheduler* sched = schedulers[cpu_number];
+    int load = run_queue_get_num_waiting(&sched->queue);
+    return sched->running_idle ? load : load + 1;
+}
+
+static bool thread_cpu_is_idle(int cpu_number) {
+    return thread_get_load(cpu_number) == 0 && cpu_get(cpu_number)->current_thread != NULL;
+}
+
+/*
+* Picks the CPU a thread that is becoming ready should run on. It goes back to the CPU it
+* last ran on, unless it would have to wait there and another CPU has nothing to do. The
+* scheduler lock must be held.
+*/
+static int thread_select_cpu(struct thread* thr) {
+    int last_cpu = thr->last_cpu;
+    if (thr->pinned || thread_cpu_is_idle(last_cpu) || run_queue_should_preempt(thr, cpu_get(last_cpu)->current_thread)) {
+        return last_cpu;
+    }
+
+    for (int i = 0; i < cpu_get_count(); ++i) {
+        if (thread_cpu_is_idle(i)) {
+            return i;
+        }
+    }
+
+    return last_cpu;
+}
+
+/*
+* Sets the current CPU's timer to go off when it is next needed, instead of on every
+* tick. That is when the running thread's timeslice runs out (if anything is waiting to
+* take over from it), when it next balances, and on the bootstrap CPU, when the next
+* sleeping thread is due to wake up or the next callout is due. The thread given is the one that is about to run.
+* Interrupts must be off (e.g. by holding a lock).
+*/
+static void thread_update_timer(struct thread* next) {
+    struct cpu_scheduler* sched = schedulers[current_cpu->cpu_number];
+    uint64_t deadline = sched->next_balance;
+
+    uint64_t expiry = next->timeslice_expiry;
+    if (run_queue_get_num_waiting(&sched->queue) != 0 && expiry != 0 && expiry < deadline) {
+        deadline = expiry;
+    }
 
+    if (current_cpu->cpu_number == 0) {
         /*
-        * By adding a thread to the front we can guarantee it runs next,
-        * useful for preemption.
+        * The sleep wheel needs the scheduler lock. This can get called while switching
+        * with the run queue lock held, when it can't be waited for, so if another CPU has
+        * it, the timer just goes off soon to look again.
         */
-        if (add_to_front) {
-            thr->next = first_ready_thread;
-            first_ready_thread = thr;
+        uint64_t wake;
+        if (spinlock_is_held_by_this_cpu(&scheduler_lock)) {
+            wake = timer_wheel_get_next_expiry(&sleep_wheel);
+
+        } else if (spinlock_try_acquire(&scheduler_lock)) {
+            wake = timer_wheel_get_next_expiry(&sleep_wheel);
+            spinlock_release(&scheduler_lock);
 
         } else {
-            last_ready_thread->next = thr;
-            last_ready_thread = thr;
+            wake = get_time_since_boot() + ((uint64_t) 1 << TIMER_WHEEL_UNIT_SHIFT);
         }
+
+        uint64_t callout = callout_get_next_expiry();
+        deadline = wake < deadline ? wake : deadline;
+        deadline = callout < deadline ? callout : deadline;
+    }
+
+    if (deadline == sched->timer_deadline) {
+        return;
     }
+
+    sched->timer_deadline = deadline;
+
+    uint64_t time = get_time_since_boot();
+    arch_set_next_timer(deadline > time ? deadline - time : 0);
 }
 
+/*
+* Makes sure the bootstrap CPU's timer goes off by the given time (in nanoseconds since
+* boot), as it has something to do then (e.g. a callout). The scheduler lock must not be
+* held.
+*/
+void thread_ensure_bsp_timer(uint64_t when) {
+    spinlock_acquire(&scheduler_lock);
+
+    if (current_cpu->cpu_number == 0) {
+        thread_update_timer(current_cpu->current_thread);
+
+    } else {
+        uint64_t deadline = schedulers[0]->timer_deadline;
+        if (deadline != 0 && when < deadline) {
+            arch_send_reschedule(cpu_get(0));
+        }
+    }
+
+    spinlock_release(&scheduler_lock);
+}
 
 /*
-* Allocates and initialises a thread structure for the initial kernel thread
-* on each CPU. Also initialises an idle thread for the CPU.
+* Called when a thread was just added to a CPU's run queue. If it is another CPU, it
+* gets made to reschedule if the thread should run straight away, or if it is the only
+* one waiting there (as then its timer might not be set to go off at the end of the
+* running thread's timeslice). The current CPU just updates its timer. The scheduler
+* lock must be held, but not the run queue's lock.
 */
-struct thread* thread_init(void) {
-    spinlock_init(&scheduler_lock, "big scheduler lock");
-    spinlock_init(&postpone_lock, "postpone thread switch lock");
-    spinlock_init(&time_since_boot_lock, "time since boot lock");
+static void thread_kick_cpu(struct thread* thr) {
+    int cpu_number = thr->last_cpu;
+    if (cpu_number == current_cpu->cpu_number) {
+        thread_update_timer(current_cpu->current_thread);
+        return;
+    }
+
+    struct cpu* cpu = cpu_get(cpu_number);
+    struct cpu_scheduler* sched = schedulers[cpu_number];
+
+    spinlock_acquire(&sched->lock);
+    bool kick = sched->running_idle || run_queue_should_preempt(thr, cpu->current_thread) || run_queue_get_num_waiting(&sched->queue) == 1;
+    spinlock_release(&sched->lock);
+
+    if (kick) {
+        arch_send_reschedule(cpu);
+    }
+}
+
+/*
+* Picks a CPU for a thread that has just been created, starts it level with the other
+* threads there, and adds it to that CPU's run queue. The scheduler lock must be held.
+*/
+static void thread_place_new_thread(struct thread* thr) {
+    int this_cpu = current_cpu->cpu_number;
+    thr->last_cpu = this_cpu;
+
+    spinlock_acquire(&schedulers[this_cpu]->lock);
+    thr->vruntime = run_queue_get_min_vruntime(thread_get_run_queue(this_cpu));
+    spinlock_release(&schedulers[this_cpu]->lock);
+
+    int cpu_number = thread_select_cpu(thr);
+    thread_lock_queues(this_cpu, cpu_number);
+    thread_set_cpu(thr, cpu_number);
+    thread_add_to_ready_list(thr, RUN_QUEUE_WOKEN);
+    thread_unlock_queues(this_cpu, cpu_number);
+}
+
+/*
+* Moves a waiting thread from another CPU's run queue to the current CPU's one, and
+* returns it, or NULL if none of them can be moved. Both run queue locks must be held.
+*/
+static struct thread* thread_move_waiting(int cpu_number) {
+    int this_cpu = current_cpu->cpu_number;
+
+    struct thread* thr = run_queue_take_migratable(thread_get_run_queue(cpu_number));
+    if (thr != NULL) {
+        thread_set_cpu(thr, this_cpu);
+        thr->sched_stats.migrations++;
+        run_queue_add(thread_get_run_queue(this_cpu), thr, RUN_QUEUE_EXPIRED);
+    }
+
+    return thr;
+}
+
+/*
+* Moves a waiting thread from another CPU's run queue to the current CPU's one. Returns
+* whether one was moved, and if so, whether it should run instead of the current thread.
+* Only the two run queue locks get used, so the scheduler lock doesn't need to be held.
+* The thread can't be looked at once they have been released, as without the scheduler
+* lock, it could have run and exited by then.
+*/
+static bool thread_pull(int cpu_number, bool* should_preempt) {
+    int this_cpu = current_cpu->cpu_number;
+    thread_lock_queues(cpu_number, this_cpu);
+
+    struct thread* thr = thread_move_waiting(cpu_number);
+    if (thr != NULL) {
+        *should_preempt = run_queue_should_preempt(thr, current_cpu->current_thread);
+    }
+
+    thread_unlock_queues(cpu_number, this_cpu);
+    return thr != NULL;
+}
+
+/*
+* Returns the CPU (other than the current one) with the most threads to run, or -1 if
+* none of them have any.
+*/
+static int thread_find_busiest_cpu(void) {
+    int busiest = -1;
+    int busiest_load = 0;
+
+    for (int i = 0; i < cpu_get_count(); ++i) {
+        int load = thread_get_load(i);
+        if (i != current_cpu->cpu_number && load > busiest_load) {
+            busiest = i;
+            busiest_load = load;
+        }
+    }
+
+    return busiest;
+}
+
+/*
+* Takes a thread from the busiest CPU, for when the current CPU has nothing else to run.
+* The current CPU's run queue lock must be held. The other CPU's lock can only be waited
+* for if it comes after ours (see thread_lock_queues), otherwise this gives up if it is
+* held, and the thread gets picked up by balancing instead.
+*/
+static void thread_steal(void) {
+    int busiest = thread_find_busiest_cpu();
+    if (busiest == -1) {
+        return;
+    }
+
+    struct spinlock* lock = &schedulers[busiest]->lock;
+    if (busiest > current_cpu->cpu_number) {
+        spinlock_acquire(lock);
+    } else if (!spinlock_try_acquire(lock)) {
+        return;
+    }
+
+    if (thread_move_waiting(busiest) != NULL) {
+        schedulers[current_cpu->cpu_number]->stats.steals++;
+    }
+
+    spinlock_release(lock);
+}
+
+/*
+* Called when a thread that was in the run queue starts running.
+*/
+static void thread_update_wait_time(struct thread* thr) {
+    uint64_t waited = clock_timestamp_to_ns(arch_read_timestamp() - thr->ready_since);
+    thr->sched_stats.wait_ns += waited;
+
+    if (thr->waking) {
+        thr->waking = false;
+        thr->sched_stats.wakeups++;
+        thr->sched_stats.wakeup_latency_ns += waited;
+        if (waited > thr->sched_stats.max_wakeup_latency_ns) {
+            thr->sched_stats.max_wakeup_latency_ns = waited;
+        }
+    }
+}
+
+
+/*
+* Called by the sleep wheel when a thread has finished sleeping. The scheduler lock is
+* held.
+*/
+static void thread_sleep_expired(void* arg) {
+    struct thread* thr = arg;
+    assert(thr->state == THREAD_STATE_SLEEPING);
+    thread_unblock(thr);
+}
 
+/*
+* Allocates and initialises a thread structure for the initial kernel thread
+* on a CPU, and makes it the current thread.
+*/
+static struct thread* thread_create_boot_thread(void) {
     struct thread* thr = malloc(sizeof(struct thread));
 
     /*
@@ -340,23 +675,74 @@ struct thread* thread_init(void) {
     thr->next = NULL;
     thr->name = "Kernel";
     thr->priority = PRIORITY_NORMAL;
-    thr->sleep_expiry = 0;
+    thr->base_priority = PRIORITY_NORMAL;
+    thr->policy = SCHED_OTHER;
+    thr->blocked_on = NULL;
+    thr->held_mutexes = NULL;
+    thr->vruntime = 0;
+    thr->waking = false;
+    thr->last_cpu = current_cpu->cpu_number;
+    thr->pinned = false;
+    thr->on_cpu = true;
     thr->timeslice_expiry = 1;
     thr->process = NULL;
     thr->argument = NULL;
+    memset(&thr->sched_stats, 0, sizeof(struct schedstat));
+    timer_init(&thr->sleep_timer, thread_sleep_expired, thr);
     thr->signals = signal_create_state();
 
     spinlock_acquire(&scheduler_lock);
     thr->thread_id = next_thread_id++;
     current_cpu->current_thread = thr;
+    current_cpu->time_used_timestamp = arch_read_timestamp();
     spinlock_release(&scheduler_lock);
 
+    return thr;
+}
+
+/*
+* Sets up the run queue for the current CPU. Must be done before it is counted by
+* cpu_get_count(), as other CPUs look at the run queues of every CPU that is.
+*/
+static void thread_init_scheduler(void) {
+    struct cpu_scheduler* sched = malloc(sizeof(struct cpu_scheduler));
+    memset(sched, 0, sizeof(struct cpu_scheduler));
+    spinlock_init(&sched->lock, "run queue lock");
+    run_queue_init(&sched->queue);
+    schedulers[current_cpu->cpu_number] = sched;
+}
+
+/*
+* Initialises the scheduler, and the initial kernel thread and idle thread for
+* the bootstrap CPU.
+*/
+struct thread* thread_init(void) {
+    spinlock_init(&scheduler_lock, "big scheduler lock");
+    spinlock_init(&postpone_lock, "postpone thread switch lock");
+
+    clock_init();
+    callout_system_init();
+    thread_init_scheduler();
+    timer_wheel_init(&sleep_wheel, get_time_since_boot());
+    struct thread* thr = thread_create_boot_thread();
+
     idle_thread_init();
     cleaner_thread_init();
 
     return thr;
 }
 
+/*
+* Initialises the initial kernel thread and idle thread for any other CPU. Must
+* be run on that CPU.
+*/
+struct thread* thread_init_ap(void) {
+    thread_init_scheduler();
+    struct thread* thr = thread_create_boot_thread();
+    idle_thread_init();
+    return thr;
+}
+
 int thread_fork(void) {
     struct thread* thr = malloc(sizeof(struct thread));
 
@@ -374,6 +760,22 @@ int thread_fork(void) {
 
     thr->next = NULL;
     thr->time_used = 0;
+    memset(&thr->sched_stats, 0, sizeof(struct schedstat));
+
+    /*
+    * The new thread doesn't hold any of the parent's mutexes, so doesn't inherit
+    * anything from them.
+    */
+    thr->priority = thr->base_priority;
+    thr->blocked_on = NULL;
+    thr->held_mutexes = NULL;
+    thr->pinned = false;
+    timer_init(&thr->sleep_timer, thread_sleep_expired, thr);
+
+    /*
+    * Stops another CPU from running the new thread until its stack has been copied.
+    */
+    thr->on_cpu = true;
 
     /*
     * The thread being forked is running, but the new one is obviously not.
@@ -405,7 +807,8 @@ int thread_fork(void) {
     * Must be done before both threads start executing.
     */
     spinlock_acquire(&scheduler_lock);
-    thread_add_to_ready_list(thr, false);
+    thread_place_new_thread(thr);
+    thread_kick_cpu(thr);
 
     /*
     * Copy the stack data and set the stack pointer to the correct position in the new stack.
@@ -420,14 +823,17 @@ int thread_fork(void) {
     size_t retv = current_cpu->current_thread == parent_thread ? 0 : 1;
     
     /*
-    * Both threads release the lock - which is correct. The parent thread will always
-    * run first (as the lock is held), and release the lock. Then a task switch (may)
-    * occur. When the child eventually switches in, the lock needs to be released because
-    * task switching acquires the lock. (Remember, the child never switched out because it
-    * was just created - it didn't go through thread_switch which would normally unlock,
-    * hence it is necessary to unlock here).
+    * The parent thread will always get here first, and lets the child run now that its
+    * stack is ready. When the child eventually switches in, it needs to finish the
+    * switch, as it didn't come through thread_schedule which would normally do it.
+    * (Remember, the child never switched out because it was just created).
     */
-    spinlock_release(&scheduler_lock);
+    if (retv == 0) {
+        __atomic_store_n(&thr->on_cpu, false, __ATOMIC_RELEASE);
+        spinlock_release(&scheduler_lock);
+    } else {
+        thread_finish_switch();
+    }
 
     /*
     * The x86 implementation doesn't save some registers, so we don't have access to
@@ -441,7 +847,7 @@ int thread_fork(void) {
 * Allocates and initialises a thread structure for new threads and adds it
 * to the ready list.
 */
-struct thread* thread_create(void (*initial_address)(void*), void* argument, struct virtual_address_space* vas) {    
+static struct thread* thread_create_internal(void (*initial_address)(void*), void* argument, struct virtual_address_space* vas, bool pinned) {
     struct thread* thr = malloc(sizeof(struct thread));
 
     thr->state = THREAD_STATE_READY;
@@ -451,10 +857,17 @@ struct thread* thread_create(void (*initial_address)(void*), void* argument, str
     thr->next = NULL;
     thr->name = "Kernel Thread";
     thr->priority = PRIORITY_NORMAL;
-    thr->sleep_expiry = 0;
+    thr->base_priority = PRIORITY_NORMAL;
+    thr->policy = SCHED_OTHER;
+    thr->blocked_on = NULL;
+    thr->held_mutexes = NULL;
+    thr->pinned = pinned;
+    thr->on_cpu = false;
     thr->timeslice_expiry = 1;
     thr->process = NULL;
     thr->signals = signal_create_state();
+    memset(&thr->sched_stats, 0, sizeof(struct schedstat));
+    timer_init(&thr->sleep_timer, thread_sleep_expired, thr);
 
     /*
     * If we switch to usermode, we reassign the stack pointer to a new usermode
@@ -471,32 +884,56 @@ struct thread* thread_create(void (*initial_address)(void*), void* argument, str
     spinlock_acquire(&scheduler_lock);
 
     thr->thread_id = next_thread_id++;
-    thread_add_to_ready_list(thr, false);
+    thread_place_new_thread(thr);
+    thread_kick_cpu(thr);
 
     spinlock_release(&scheduler_lock);
 
     return thr;
 }
 
-static void thread_update_time_used(void) {
-    static uint64_t prev = 0;
+struct thread* thread_create(void (*initial_address)(void*), void* argument, struct virtual_address_space* vas) {
+    return thread_create_internal(initial_address, argument, vas, false);
+}
 
+/*
+* Like thread_create, but the thread only ever runs on the current CPU.
+*/
+struct thread* thread_create_pinned(void (*initial_address)(void*), void* argument, struct virtual_address_space* vas) {
+    return thread_create_internal(initial_address, argument, vas, true);
+}
+
+/*
+* Charges the current thread for the time it has been running. Fair threads also have
+* it added to their virtual runtime, scaled so that threads with a higher weight use it
+* up more slowly. Interrupts must be off (e.g. by holding a lock).
+*/
+static void thread_update_time_used(void) {
     /*
-    * It's okay for prev to be zero the first time this is called, it just means
-    * the first thread has the boot time added (which is correct, as it was the thread
-    * runnning during the boot process).
+    * Each CPU keeps track of when it last did this, which starts off as when its
+    * first thread was created.
     */
-
     uint64_t current = arch_read_timestamp();
-    uint64_t elapsed = current - prev;
-    prev = current;
+    uint64_t elapsed = current - current_cpu->time_used_timestamp;
+    current_cpu->time_used_timestamp = current;
+
+    struct thread* thr = current_cpu->current_thread;
+    uint64_t elapsed_ns = clock_timestamp_to_ns(elapsed);
 
-    current_cpu->current_thread->time_used += elapsed;
+    thr->time_used += elapsed;
+    thr->sched_stats.runtime_ns += elapsed_ns;
+
+    if (run_queue_is_fair_priority(thr->priority)) {
+        thr->vruntime += elapsed_ns * FAIR_NORMAL_WEIGHT / run_queue_get_weight(thr->priority);
+    } else if (thr->priority == PRIORITY_IDLE) {
+        schedulers[current_cpu->cpu_number]->stats.idle_ns += elapsed_ns;
+    }
 }
 
 
 /*
-* Blocks the currently held thread. The scheduler lock must already be held.
+* Blocks the currently held thread. The scheduler lock must already be held. It is let go
+* of while the thread is switched out, and is held again when this returns.
 */
 void thread_block(enum thread_state reason) {    
     assert(spinlock_is_held(&scheduler_lock));
@@ -518,14 +955,47 @@ void thread_unblock(struct thread* thr) {
     
     /*
     * We sometimes want to preempt the currently running thread, i.e. switch to the
-    * newly unblocked thread before the current one's timeslice expires. We implement
-    * this by putting the unblocked thread on the front of the ready list and then scheduling.
+    * newly unblocked thread before the current one's timeslice expires.
     * 
-    * We preempt lower priority threads, and when there are no other threads (which means it
-    * is likely that the currently executing thread would have been executing for a while).
+    * We preempt threads that the woken thread should run before (see runqueue.c), and
+    * when there are no other threads (which means it is likely that the currently
+    * executing thread would have been executing for a while). The woken thread gets
+    * added first, as that is what gives it the virtual runtime it will run with.
+    *
+    * If the thread goes on another CPU, that CPU gets interrupted instead if it should
+    * run straight away.
+    */
+    int this_cpu = current_cpu->cpu_number;
+    struct cpu_scheduler* sched = schedulers[this_cpu];
+
+    spinlock_acquire(&sched->lock);
+    bool was_empty = run_queue_is_empty(&sched->queue);
+    spinlock_release(&sched->lock);
+
+    int old_cpu = thr->last_cpu;
+    int cpu_number = thread_select_cpu(thr);
+
+    thread_lock_queues(old_cpu, cpu_number);
+    if (cpu_number != old_cpu) {
+        thread_set_cpu(thr, cpu_number);
+        thr->sched_stats.migrations++;
+    }
+    thread_add_to_ready_list(thr, RUN_QUEUE_WOKEN);
+    thread_unlock_queues(old_cpu, cpu_number);
+
+    if (cpu_number != this_cpu) {
+        thread_kick_cpu(thr);
+        return;
+    }
+
+    /*
+    * Another CPU could have taken it already, in which case it isn't ours to run.
     */
-    bool preempt = thr->priority < current_cpu->current_thread->priority || first_ready_thread == NULL;
-    thread_add_to_ready_list(thr, preempt);
+    thread_update_time_used();
+    spinlock_acquire(&sched->lock);
+    bool preempt = thr->last_cpu == this_cpu && (was_empty || run_queue_should_preempt(thr, current_cpu->current_thread));
+    spinlock_release(&sched->lock);
+
     if (preempt) {
         thread_schedule();
     }
@@ -562,8 +1032,6 @@ void thread_end_postpone_switches(void) {
         
         spinlock_release(&postpone_lock);
 
-        assert(spinlock_is_held(&scheduler_lock));
-
         thread_schedule();
 
     } else {
@@ -572,31 +1040,44 @@ void thread_end_postpone_switches(void) {
 }
 
 /*
-* Sets the timeslice for a thread which has been newly switched in, or resets
-* the timeslice for a thread which is 'having another turn'.
+* Sets the timeslice for a thread which is about to be switched in, or resets
+* the timeslice for a thread which is 'having another turn'. The current CPU's run
+* queue lock must be held.
 */
-static void thread_reset_timeslice(void) {
-    spinlock_acquire(&time_since_boot_lock);
-
-    /* 25 ms timeslice */
-    current_cpu->current_thread->timeslice_expiry = time_since_boot + 25000000;
+static void thread_reset_timeslice(struct thread* thr) {
+    uint64_t timeslice = run_queue_get_timeslice(thread_get_run_queue(current_cpu->cpu_number), thr);
 
-    spinlock_release(&time_since_boot_lock);
+    /*
+    * Threads without a timeslice are given one that never runs out (as zero means that
+    * it has run out).
+    */
+    thr->timeslice_expiry = timeslice == 0 ? UINT64_MAX : get_time_since_boot() + timeslice;
 }
 
 /*
 * Selects which thread should run next and runs it. If postponing is enabled, after
 * calling thread_postpone_switches(), this function will not actually switch, but
 * instead just indicate a thread switch is required.
+*
+* The current CPU's run queue lock is held across the switch, and the thread being
+* switched to lets go of it (see thread_finish_switch). The scheduler lock doesn't need
+* to be held, but if it is (e.g. when blocking), it is let go of while this thread is
+* switched out, and is held again when this returns.
 */
 void thread_schedule(void) {
     /*
-    * The lock is required to be held. The reason why we don't acquire and release
-    * the lock within this function is that certain operations (such as blocking)
-    * require that we call this function with the lock already held, thereby causing
-    * a deadlock.
+    * Until the run queue lock is held, this thread could be preempted and moved to
+    * another CPU, so check it's still on the same one once it is.
     */
-    assert(spinlock_is_held(&scheduler_lock));
+    struct cpu_scheduler* sched;
+    while (true) {
+        sched = schedulers[current_cpu->cpu_number];
+        spinlock_acquire(&sched->lock);
+        if (sched == schedulers[current_cpu->cpu_number]) {
+            break;
+        }
+        spinlock_release(&sched->lock);
+    }
 
     /* We must either have been running or blocked. */
     assert(current_cpu->current_thread->state != THREAD_STATE_READY);
@@ -610,99 +1091,99 @@ void thread_schedule(void) {
     thread_stack_check_canary(current_cpu->current_thread->canary_position);
 #endif
 
-    if (spinlock_is_held(&postpone_lock) && postpone_switches) {
+    if (spinlock_is_held_by_this_cpu(&postpone_lock) && postpone_switches) {
         have_postponed_switch = true;
+        spinlock_release(&sched->lock);
         return;
     }
 
+    struct thread* current = current_cpu->current_thread;
+
     /*
-    * This is only NULL if there are no other threads to switch to.
-    * Hence this check increases our efficiency by not switching back to ourselves
-    * if we're already running.
+    * Rather than running the idle thread, see if another CPU has something waiting.
     */
-    if (first_ready_thread != NULL) {
-        assert(last_ready_thread != NULL);
-        assert(first_ready_thread->state == THREAD_STATE_READY);
- 
-        struct thread* thr = first_ready_thread;
-        first_ready_thread = first_ready_thread->next;
-        if (first_ready_thread == NULL) {
-            last_ready_thread = NULL;
-        }
+    bool still_running = current->state == THREAD_STATE_RUNNING;
+    if (run_queue_get_num_waiting(&sched->queue) == 0 && (!still_running || current->priority == PRIORITY_IDLE)) {
+        thread_steal();
+    }
 
-        if (thr->priority == PRIORITY_IDLE) {
-            /*
-            * We don't want to schedule an idle thread if we don't have to. If there
-            * is a thread that is ready to run, use that instead. If not, check if it
-            * is okay for the current thread to continue running.
-            */
-
-            if (first_ready_thread != NULL) {
-                /*
-                * Switch to the next thread which is ready.
-                */
-                thread_add_to_ready_list(thr, false);
-                thr = first_ready_thread;
-                first_ready_thread = first_ready_thread->next;
-                if (first_ready_thread == NULL) {
-                    last_ready_thread = NULL;
-                }
-
-            } else if (current_cpu->current_thread->state == THREAD_STATE_RUNNING) {
-                /* 
-                * Current thread hasn't blocked, so allow it to continue.
-                */
-                thread_reset_timeslice();
-                thread_add_to_ready_list(thr, false);
-                return;
-
-            } else {
-                /* 
-                * No choice but to run the idle thread.
-                */
-                assert(thr != NULL);
-            }
-        }
+    /*
+    * If the current thread is still running (i.e. it did not block), then it goes back
+    * in the run queue to compete with everything else. If it used up its whole timeslice
+    * (see thread_received_timer_interrupt), it counts as expired.
+    */
+    if (still_running) {
+        thread_add_to_ready_list(current, current->timeslice_expiry == 0 ? RUN_QUEUE_EXPIRED : RUN_QUEUE_PREEMPTED);
+    }
 
-        /*
-        * If the current thread is still running (i.e. it did not block),
-        * then re-add to the list for next time. If it did block, we have to
-        * put it somewhere else.
-        */    
-        if (current_cpu->current_thread->state == THREAD_STATE_RUNNING) {
-            thread_add_to_ready_list(current_cpu->current_thread, false);
+    /*
+    * This is only NULL if there are no threads at all to switch to. If we get ourselves
+    * back, there's nothing more important to run, so we can just keep going.
+    */
+    struct thread* thr = run_queue_pop(&sched->queue);
+    struct thread* next = thr == NULL ? current : thr;
+
+    /*
+    * This is done before switching, as threads which are just starting won't come back
+    * here.
+    */
+    thread_reset_timeslice(next);
+    sched->running_idle = next->priority == PRIORITY_IDLE;
+    thread_update_timer(next);
+
+    if (thr == NULL || thr == current) {
+        if (thr == current) {
+            thr->state = THREAD_STATE_RUNNING;
+            thread_update_wait_time(thr);
         }
 
-        thr->state = THREAD_STATE_RUNNING;
+        spinlock_release(&sched->lock);
+        return;
+    }
+
+    assert(thr->last_cpu == current_cpu->cpu_number);
 
-        /*
-        * We load the VAS beforehand, as threads which are just starting will not
-        * execute anything after arch_switch_thread (they will go to their entry point
-        * when arch_switch_thread returns).
-        */
-        vas_load(thr->vas);
-        arch_switch_thread(thr);
+    thr->state = THREAD_STATE_RUNNING;
+    thr->sched_stats.switches++;
+    sched->stats.switches++;
+    thread_update_wait_time(thr);
+
+    /*
+    * If it blocked on another CPU and was woken up onto this one, that CPU might still be
+    * switching away from it.
+    */
+    while (__atomic_load_n(&thr->on_cpu, __ATOMIC_ACQUIRE)) {
+        ;
     }
+    thr->on_cpu = true;
+    sched->switched_from = current;
 
-    thread_reset_timeslice();
-}
- 
-/*
-* Returns the number of nanoseconds since the system was booted.
-*/
-uint64_t get_time_since_boot(void) {
     /*
-    * A lock is needed in case we get interrupted halfway through reading
-    * the global variable, as reading it may not be atomic (e.g. on 32-bit
-    * systems it likely takes at least 2 reads - if we get interrupted
-    * by the timer halfway through could lead to corrupted times.
+    * Whatever runs next might need the scheduler lock, so it can't stay held while we're
+    * switched out.
     */
-    spinlock_acquire(&time_since_boot_lock);
-    uint64_t time = time_since_boot;
-    spinlock_release(&time_since_boot_lock);
-    return time;
-}
+    bool held_scheduler_lock = spinlock_is_held_by_this_cpu(&scheduler_lock);
+    if (held_scheduler_lock) {
+        spinlock_release(&scheduler_lock);
+    }
+
+    /*
+    * We load the VAS beforehand, as threads which are just starting will not
+    * execute anything after arch_switch_thread (they will go to their entry point
+    * when arch_switch_thread returns).
+    */
+    vas_load(thr->vas);
+    arch_switch_thread(thr);
 
+    /*
+    * Some other thread has now switched back to us.
+    */
+    thread_finish_switch();
+    if (held_scheduler_lock) {
+        spinlock_acquire(&scheduler_lock);
+    }
+}
+ 
 /*
 * Blocks a thread until at least a certain number of nanoseconds since the system
 * was booted has passed.
@@ -717,18 +1198,26 @@ void thread_nano_sleep_until(uint64_t when) {
     */
     if (when < get_time_since_boot()) {
         spinlock_release(&scheduler_lock);
+        return;
     }
 
-    current_cpu->current_thread->sleep_expiry = when;
+    struct thread* thr = current_cpu->current_thread;
+    bool real_time = thr->priority < PRIORITY_FAIR;
+    timer_wheel_add(&sleep_wheel, &thr->sleep_timer, when, real_time ? 0 : SLEEP_SLACK_NS);
 
-    /* Add to the sleeping thread list */
-    current_cpu->current_thread->next = sleeping_thread_list;
-    sleeping_thread_list = current_cpu->current_thread;
+    /*
+    * The bootstrap CPU wakes up sleeping threads, so it might need to set its timer to go
+    * off sooner. If this is the bootstrap CPU, that happens when it blocks.
+    */
+    uint64_t deadline = schedulers[0]->timer_deadline;
+    if (current_cpu->cpu_number != 0 && deadline != 0 && thr->sleep_timer.expiry < deadline) {
+        arch_send_reschedule(cpu_get(0));
+    }
 
     /*
     * The lock still needs to be held when we block it, in case
-    * we get interrupted in between modifying the linked list as 
-    * we've done and setting the thread state correctly.
+    * we get interrupted in between adding the timer as we've
+    * done and setting the thread state correctly.
     */
     thread_block(THREAD_STATE_SLEEPING);
     spinlock_release(&scheduler_lock);
@@ -743,9 +1232,12 @@ void thread_sleep(int seconds) {
 }
 
 void thread_yield(void) {
-    spinlock_acquire(&scheduler_lock);
+    /*
+    * Giving up the rest of the timeslice puts real-time threads behind others of the
+    * same priority.
+    */
+    current_cpu->current_thread->timeslice_expiry = 0;
     thread_schedule();
-    spinlock_release(&scheduler_lock);
 }
 
 
@@ -795,13 +1287,33 @@ void thread_terminate(void) {
 
 
 /*
-* Called when the BSP (bootstrap processor) receives its timer interrupt.
-* This function is responsible for incrementing the global time variable.
+* Called when the BSP (bootstrap processor) receives its timer interrupt, with how long
+* it has been since the last one. This keeps the time (see thread/clock.c), and calls
+* any callouts that are due (see thread/callout.c).
 */
 void thread_received_timer_interrupt_bsp(uint64_t delta) {
-    spinlock_acquire(&time_since_boot_lock);
-    time_since_boot += delta;
-    spinlock_release(&time_since_boot_lock);
+    clock_received_timer_interrupt(delta);
+    callout_run(get_time_since_boot());
+}
+
+/*
+* Takes a thread from the busiest CPU if it has a lot more to do than the current one.
+* Returns true if it was moved here and should run instead of the current thread. This
+* only needs the run queue locks, so the scheduler lock doesn't need to be held. (The
+* current thread's virtual runtime is only brought up to date when it next gets switched
+* out, but that is close enough here.)
+*/
+static bool thread_balance(void) {
+    int busiest = thread_find_busiest_cpu();
+    if (busiest == -1 || thread_get_load(busiest) < thread_get_load(current_cpu->cpu_number) + BALANCE_THRESHOLD) {
+        return false;
+    }
+
+    bool preempt = false;
+    if (thread_pull(busiest, &preempt)) {
+        schedulers[current_cpu->cpu_number]->stats.migrations++;
+    }
+    return preempt;
 }
 
 /*
@@ -810,81 +1322,245 @@ void thread_received_timer_interrupt_bsp(uint64_t delta) {
 * be called first to update the global time.
 */
 void thread_received_timer_interrupt(void) {
-    spinlock_acquire(&scheduler_lock);
     if (current_cpu->current_thread == NULL) {
-        spinlock_release(&scheduler_lock);
         return;
     }
 
-    thread_postpone_switches();
+    struct cpu_scheduler* sched = schedulers[current_cpu->cpu_number];
+    uint64_t time = get_time_since_boot();
+    bool bootstrap = current_cpu->cpu_number == 0;
 
-    spinlock_acquire(&time_since_boot_lock);
+    /*
+    * Whatever the timer was set to do has happened, so it is ticking again until it gets
+    * set again (see thread_update_timer).
+    */
+    sched->timer_deadline = 0;
+    sched->stats.timer_interrupts++;
 
-    struct thread* current = NULL;
+    /* 
+    * Zero is a special value meaning not to preempt. The timeslice of the running thread
+    * is only changed by this CPU, so it can be looked at without the lock.
+    */
+    uint64_t expiry = current_cpu->current_thread->timeslice_expiry;
+    bool expired = expiry != 0 && expiry <= time;
 
     /*
-    * Move everything from the sleeping list to a temporary list.
+    * Balancing only needs the run queue locks.
     */
-    current = sleeping_thread_list;
-    sleeping_thread_list = NULL;
+    bool preempt = false;
+    if (time >= sched->next_balance) {
+        sched->next_balance = time + (sched->running_idle ? IDLE_BALANCE_INTERVAL_NS : BALANCE_INTERVAL_NS);
+        preempt = thread_balance();
+    }
 
     /*
-    * Then for each thread, either wake it up or add it back to the
-    * sleeping list (which we just emptied).
+    * Only the bootstrap CPU wakes up sleeping threads, so it is the only one that needs
+    * the scheduler lock. Switches are postponed so that one switch covers both the
+    * threads it wakes up and the running thread's timeslice running out.
     */
-    while (current != NULL) {
+    if (bootstrap) {
+        spinlock_acquire(&scheduler_lock);
+        thread_postpone_switches();
+
         /*
-        * Unblocking a thread changes the next pointer to NULL
-        * (it needs to add it to the back of the list), and so we
-        * must keep the next pointer stored.
+        * Wake up any sleeping threads whose time is up. This only looks at the ones that
+        * are due.
         */
-        struct thread* next = current->next;
+        timer_wheel_advance(&sleep_wheel, time);
+    }
 
-        if (current->sleep_expiry <= time_since_boot) {
-            thread_unblock(current);
-        
-        } else {
-            current->next = sleeping_thread_list;
-            sleeping_thread_list = current;
+    if (expired) {
+        /*
+        * Prevent any more preemption until the timeslice is reset.
+        */
+        current_cpu->current_thread->timeslice_expiry = 0;
+    }
+
+    /*
+    * If the thread that was moved here has been taken by another CPU since, this just
+    * picks what to run from what is left. Scheduling sets the timer again for whatever
+    * runs next.
+    */
+    if (preempt || expired) {
+        thread_schedule();
+    } else {
+        thread_update_timer(current_cpu->current_thread);
+    }
+
+    if (bootstrap) {
+        thread_end_postpone_switches();
+        spinlock_release(&scheduler_lock);
+    }
+}
+
+/*
+* Called when another CPU wants this one to reschedule, as it has woken up a thread that
+* should run here (see thread_unblock).
+*/
+void thread_received_reschedule_ipi(void) {
+    if (current_cpu->current_thread != NULL) {
+        thread_schedule();
+    }
+}
+
+/*
+* Changes the priority a thread is scheduled with, without changing its base priority.
+* This is used for priority inheritance (see thread/synch.c). If the thread is waiting
+* in the run queue, it gets moved to where it now belongs. The scheduler lock must be held.
+*/
+void thread_change_priority(struct thread* thr, int priority) {
+    assert(spinlock_is_held(&scheduler_lock));
+
+    if (thr->priority == priority) {
+        return;
+    }
+
+    /*
+    * A waiting thread can be moved to another CPU without the scheduler lock, so check
+    * it's still on the same one once its run queue is locked.
+    */
+    struct cpu_scheduler* sched;
+    while (true) {
+        sched = schedulers[thr->last_cpu];
+        spinlock_acquire(&sched->lock);
+        if (sched == schedulers[thr->last_cpu]) {
+            break;
         }
+        spinlock_release(&sched->lock);
+    }
 
-        current = next;
+    struct run_queue* queue = &sched->queue;
+    bool queued = thr->state == THREAD_STATE_READY;
+    if (queued) {
+        run_queue_remove(queue, thr);
     }
 
-    /* 
-    * Zero is a special value meaning not to preempt.
+    /*
+    * The time used so far gets charged at the old weight. Threads joining the fair class
+    * start level with everything else in it.
     */
-    if (current_cpu->current_thread != NULL) {
-        if (current_cpu->current_thread->timeslice_expiry != 0) {
-            if (current_cpu->current_thread->timeslice_expiry < time_since_boot) {
-                /*
-                * Prevent any more preemption until the timeslice is reset.
-                */
-                current_cpu->current_thread->timeslice_expiry = 0;
-                thread_schedule();
-            }
+    if (thr == current_cpu->current_thread) {
+        thread_update_time_used();
+    }
+    if (!run_queue_is_fair_priority(thr->priority) && run_queue_is_fair_priority(priority)) {
+        uint64_t min_vruntime = run_queue_get_min_vruntime(queue);
+        if (thr->vruntime < min_vruntime) {
+            thr->vruntime = min_vruntime;
         }
     }
 
-    spinlock_release(&time_since_boot_lock);
+    thr->priority = priority;
+
+    if (queued) {
+        run_queue_add(queue, thr, RUN_QUEUE_PREEMPTED);
+    }
+
+    spinlock_release(&sched->lock);
+
+    /*
+    * A boosted thread waiting on another CPU might now need to run there straight away.
+    */
+    if (queued && thr->last_cpu != current_cpu->cpu_number) {
+        thread_kick_cpu(thr);
+    }
+}
+
+/*
+* Sets the base priority and policy of the current thread, and lets something else run
+* if it is now more important.
+*/
+static void thread_set_base_priority(int policy, int priority) {
+    spinlock_acquire(&scheduler_lock);
+    struct thread* thr = current_cpu->current_thread;
+
+    thr->policy = policy;
+    thr->base_priority = priority;
+    semaphore_update_inherited_priority(thr);
+    thread_schedule();
 
-    thread_end_postpone_switches();
     spinlock_release(&scheduler_lock);
 }
 
 /*
-* Sets the priority of the current thread. A lower number indicates a 
-* higher priority. PRIORITY_IDLE is the lowest priority and is treated specially,
-* as they will not be scheduled unless there is anything else to run.
+* Sets the priority of the current thread. A lower number indicates a higher priority.
+* Below PRIORITY_FAIR, the highest priority thread that is ready always runs first (they
+* use SCHED_RR). From PRIORITY_FAIR up, the priority sets how much of a share of the CPU
+* the thread gets (see thread/runqueue.c). PRIORITY_IDLE is the lowest priority and is
+* treated specially, as they will not be scheduled unless there is anything else to run.
 */
 int thread_set_priority(int priority) {
     if (priority < 0 || priority > 255) {
         return EINVAL;
     }
 
+    thread_set_base_priority(priority < PRIORITY_FAIR ? SCHED_RR : SCHED_OTHER, priority);
+    return 0;
+}
+
+/*
+* Sets the policy of the current thread, using the priorities from sched.h. Real-time
+* priorities map onto the priorities below PRIORITY_FAIR, with SCHED_RT_PRIORITY_MAX
+* being the most important. Threads going back to SCHED_OTHER keep their priority if it
+* was already in the fair class, otherwise they get PRIORITY_NORMAL.
+*/
+int thread_set_scheduler(int policy, int priority) {
+    if (policy == SCHED_FIFO || policy == SCHED_RR) {
+        if (priority < SCHED_RT_PRIORITY_MIN || priority > SCHED_RT_PRIORITY_MAX) {
+            return EINVAL;
+        }
+
+        thread_set_base_priority(policy, PRIORITY_FAIR - priority);
+        return 0;
+    }
+
+    if (policy == SCHED_OTHER) {
+        if (priority != 0) {
+            return EINVAL;
+        }
+
+        int base = current_cpu->current_thread->base_priority;
+        thread_set_base_priority(SCHED_OTHER, base >= PRIORITY_FAIR ? base : PRIORITY_NORMAL);
+        return 0;
+    }
+
+    return EINVAL;
+}
+
+/*
+* Gets the policy and priority of a thread, in terms of sched.h.
+*/
+void thread_get_scheduler(struct thread* thr, int* policy, int* priority) {
     spinlock_acquire(&scheduler_lock);
-    current_cpu->current_thread->priority = priority;
+    *policy = thr->policy;
+    *priority = thr->policy == SCHED_OTHER ? 0 : PRIORITY_FAIR - thr->base_priority;
     spinlock_release(&scheduler_lock);
+}
 
-    return 0;
-}
\ No newline at end of file
+/*
+* Gets the scheduling statistics of a thread (see sys/schedstat.h).
+*/
+void thread_get_schedstat(struct thread* thr, struct schedstat* stat) {
+    spinlock_acquire(&scheduler_lock);
+    if (thr == current_cpu->current_thread) {
+        thread_update_time_used();
+    }
+    *stat = thr->sched_stats;
+    stat->vruntime_ns = thr->vruntime;
+    spinlock_release(&scheduler_lock);
+}
+
+/*
+* Gets the scheduling statistics of a CPU.
+*/
+void thread_get_cpu_sched_stats(int cpu_number, struct cpu_sched_stats* stats) {
+    spinlock_acquire(&scheduler_lock);
+    if (cpu_number == current_cpu->cpu_number) {
+        thread_update_time_used();
+    }
+    spinlock_acquire(&schedulers[cpu_number]->lock);
+    *stats = schedulers[cpu_number]->stats;
+    stats->num_waiting = run_queue_get_num_waiting(thread_get_run_queue(cpu_number));
+    spinlock_release(&schedulers[cpu_number]->lock);
+
+    spinlock_release(&scheduler_lock);
+}
@@ -0,0 +1,253 @@
+#include <timerwheel.h>
+#include <assert.h>
+#include <string.h>
+
+/*
+* thread/timerwheel.c - Timer Wheels
+*
+* Keeps track of things that need to happen at a certain time. Adding and removing a
+* timer takes constant time, and moving time forward only looks at the timers that are
+* due, apart from every so often when a slot on a higher level gets spread out over the
+* level below it.
+*
+* The caller must make sure that only one thing uses a wheel at a time.
+*/
+
+#define SLOT_MASK   (TIMER_WHEEL_SLOTS - 1)
+#define UNIT_NS     ((uint64_t) 1 << TIMER_WHEEL_UNIT_SHIFT)
+
+/*
+* The furthest away (in units) a timer can be put.
+*/
+#define MAX_DELTA   (((uint64_t) 1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS)) - 1)
+
+/*
+* Converts a time to units of the lowest level's slots, rounding up so that timers never
+* go off early.
+*/
+static uint64_t timer_wheel_to_units(uint64_t time) {
+    return (time + UNIT_NS - 1) >> TIMER_WHEEL_UNIT_SHIFT;
+}
+
+/*
+* Picks the time between expiry and expiry + slack with the most trailing zero bits. Other
+* timers with slack around the same time will probably pick it too, and so they can all
+* go off at once.
+*/
+static uint64_t timer_apply_slack(uint64_t expiry, uint64_t slack) {
+    if (slack == 0) {
+        return expiry;
+    }
+
+    uint64_t limit = expiry + slack;
+    int bit = 63 - __builtin_clzll(expiry ^ limit);
+    return limit & ~(((uint64_t) 1 << bit) - 1);
+}
+
+/*
+* Puts a timer in the slot it belongs in, based on how far away it is.
+*/
+static void timer_wheel_insert(struct timer_wheel* wheel, struct timer* timer) {
+    uint64_t expiry = timer_wheel_to_units(timer->expiry);
+    if (expiry < wheel->current) {
+        expiry = wheel->current;
+    }
+
+    uint64_t delta = expiry - wheel->current;
+    if (delta > MAX_DELTA) {
+        expiry = wheel->current + MAX_DELTA;
+        delta = MAX_DELTA;
+    }
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (uint64_t) 1 << ((level + 1) * TIMER_WHEEL_SLOT_BITS)) {
+        ++level;
+    }
+
+    int slot = (expiry >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK;
+
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = wheel->slots[level][slot];
+    if (timer->next != NULL) {
+        timer->next->prev = timer;
+    }
+    wheel->slots[level][slot] = timer;
+    wheel->bitmap[level] |= (uint64_t) 1 << slot;
+}
+
+static void timer_wheel_unlink(struct timer_wheel* wheel, struct timer* timer) {
+    if (timer->prev == NULL) {
+        wheel->slots[timer->level][timer->slot] = timer->next;
+    } else {
+        timer->prev->next = timer->next;
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+
+    if (wheel->slots[timer->level][timer->slot] == NULL) {
+        wheel->bitmap[timer->level] &= ~((uint64_t) 1 << timer->slot);
+    }
+
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/*
+* Spreads the timers in a slot out over the levels below it, now that the time it
+* covers has come around.
+*/
+static void timer_wheel_cascade(struct timer_wheel* wheel, int level, int slot) {
+    struct timer* timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->bitmap[level] &= ~((uint64_t) 1 << slot);
+
+    while (timer != NULL) {
+        struct timer* next = timer->next;
+        timer_wheel_insert(wheel, timer);
+        timer = next;
+    }
+}
+
+/*
+* Sets up an empty wheel, with nothing before the given time (in nanoseconds since boot).
+*/
+void timer_wheel_init(struct timer_wheel* wheel, uint64_t time) {
+    memset(wheel, 0, sizeof(struct timer_wheel));
+    wheel->current = time >> TIMER_WHEEL_UNIT_SHIFT;
+}
+
+/*
+* Sets up a timer that isn't on a wheel yet. When it goes off, the callback gets called
+* with the argument.
+*/
+void timer_init(struct timer* timer, void (*callback)(void*), void* argument) {
+    memset(timer, 0, sizeof(struct timer));
+    timer->callback = callback;
+    timer->argument = argument;
+}
+
+/*
+* Makes a timer go off at some point between expiry and expiry + slack (in nanoseconds
+* since boot). It must not already be on a wheel.
+*/
+void timer_wheel_add(struct timer_wheel* wheel, struct timer* timer, uint64_t expiry, uint64_t slack) {
+    assert(!timer->pending);
+
+    timer->expiry = timer_apply_slack(expiry, slack);
+    timer->pending = true;
+    wheel->num_pending++;
+    timer_wheel_insert(wheel, timer);
+}
+
+/*
+* Stops a timer from going off. Does nothing if it isn't on the wheel (e.g. if it has
+* already gone off).
+*/
+void timer_wheel_remove(struct timer_wheel* wheel, struct timer* timer) {
+    if (!timer->pending) {
+        return;
+    }
+
+    timer_wheel_unlink(wheel, timer);
+    timer->pending = false;
+    wheel->num_pending--;
+}
+
+/*
+* Moves time forward to the given time (in nanoseconds since boot), calling the callback
+* of each timer that is now due. Callbacks can add and remove timers, including the one
+* that went off.
+*/
+void timer_wheel_advance(struct timer_wheel* wheel, uint64_t time) {
+    uint64_t target = (time >> TIMER_WHEEL_UNIT_SHIFT) + 1;
+
+    while (wheel->current < target) {
+        if (wheel->num_pending == 0) {
+            wheel->current = target;
+            return;
+        }
+
+        uint64_t current = wheel->current;
+        int slot = current & SLOT_MASK;
+
+        /*
+        * When the lowest level wraps around, the next slot of the level above it gets
+        * spread out over it, and so on up the levels.
+        */
+        if (slot == 0) {
+            for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+                int upper_slot = (current >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK;
+                timer_wheel_cascade(wheel, level, upper_slot);
+                if (upper_slot != 0) {
+                    break;
+                }
+            }
+        }
+
+        struct timer* timer;
+        while ((timer = wheel->slots[0][slot]) != NULL) {
+            timer_wheel_unlink(wheel, timer);
+            timer->pending = false;
+            wheel->num_pending--;
+            timer->callback(timer->argument);
+        }
+
+        /*
+        * Skip over empty slots on the lowest level, but stop where it wraps around, as
+        * something might need to be cascaded there.
+        */
+        uint64_t next = current + 1;
+        if ((next & SLOT_MASK) != 0) {
+            uint64_t later = wheel->bitmap[0] >> (next & SLOT_MASK);
+            next = later == 0 ? (next | SLOT_MASK) + 1 : next + __builtin_ctzll(later);
+        }
+
+        wheel->current = next < target ? next : target;
+    }
+}
+
+/*
+* Returns the earliest time (in nanoseconds since boot) that moving time forward might
+* make a timer go off, or UINT64_MAX if there aren't any timers. For timers on the higher
+* levels, this is when they get spread out over the levels below, so it can be earlier
+* than when they go off.
+*/
+uint64_t timer_wheel_get_next_expiry(struct timer_wheel* wheel) {
+    if (wheel->num_pending == 0) {
+        return UINT64_MAX;
+    }
+
+    uint64_t next = UINT64_MAX;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        uint64_t bitmap = wheel->bitmap[level];
+        if (bitmap == 0) {
+            continue;
+        }
+
+        /*
+        * Rotate the bitmap so that each bit is how many slots ahead of the current one it
+        * is. On the higher levels, the current slot has already been spread out unless we
+        * are right at the start of it, so anything in it is a whole turn of the wheel away.
+        */
+        int shift = level * TIMER_WHEEL_SLOT_BITS;
+        uint64_t position = wheel->current >> shift;
+        int index = position & SLOT_MASK;
+        uint64_t ahead = index == 0 ? bitmap : (bitmap >> index) | (bitmap << (TIMER_WHEEL_SLOTS - index));
+
+        if ((wheel->current & (((uint64_t) 1 << shift) - 1)) != 0) {
+            ahead &= ~(uint64_t) 1;
+        }
+
+        uint64_t slots = ahead == 0 ? TIMER_WHEEL_SLOTS : __builtin_ctzll(ahead);
+        uint64_t time = ((position + slots) << shift) << TIMER_WHEEL_UNIT_SHIFT;
+        if (time < next) {
+            next = time;
+        }
+    }
+
+    return next;
+}
@@ -0,0 +1,62 @@
+#include <stddef.h>
+#include <vdso.h>
+#include <arch.h>
+#include <physical.h>
+#include <virtual.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/vdso.h>
+
+/*
+* thread/vdso.c - Virtual Dynamic Shared Object
+*
+* Every program gets a page of data, and a page of code that reads it, mapped in at a
+* fixed address (see sys/vdso.h). The kernel keeps the data up to date (e.g. the clock
+* does, see thread/clock.c), so programs can read the time without a system call. Every
+* program shares the same two pages, mapped read-only.
+*
+* The pages never move. They are always shared, so they never get swapped out, being
+* read-only they never get merged, and compaction leaves vDSO pages alone.
+*/
+
+_Static_assert(VDSO_DATA_ADDRESS >= ARCH_USER_STACK_LIMIT && VDSO_CODE_ADDRESS + ARCH_PAGE_SIZE <= ARCH_USER_AREA_LIMIT, "vDSO must be in the user area");
+_Static_assert(offsetof(struct vdso_data, base_timestamp) == 8 && offsetof(struct vdso_data, multiplier) == 24, "vDSO code relies on the layout");
+_Static_assert(offsetof(struct vdso_data, shift) == 32 && sizeof(struct vdso_data) <= ARCH_PAGE_SIZE, "vDSO code relies on the layout");
+
+static size_t vdso_data_phys;
+static size_t vdso_code_phys;
+
+void vdso_init(void) {
+    vdso_data_phys = phys_allocate_page(PHYS_OWNER_VDSO);
+    vdso_code_phys = phys_allocate_page(PHYS_OWNER_VDSO);
+
+    size_t code_size;
+    const void* code = arch_get_vdso_code(&code_size);
+    assert(code_size <= ARCH_PAGE_SIZE);
+
+    memset((void*) phys_to_virt(vdso_code_phys), 0, ARCH_PAGE_SIZE);
+    memcpy((void*) phys_to_virt(vdso_code_phys), code, code_size);
+
+    memset((void*) phys_to_virt(vdso_data_phys), 0, ARCH_PAGE_SIZE);
+    vdso_get_data()->page_size = ARCH_PAGE_SIZE;
+}
+
+/*
+* Returns where the kernel can change the data page.
+*/
+struct vdso_data* vdso_get_data(void) {
+    return (struct vdso_data*) phys_to_virt(vdso_data_phys);
+}
+
+/*
+* Maps the pages into a program's address space.
+*/
+void vdso_map(struct virtual_address_space* vas) {
+    phys_share_page(vdso_data_phys);
+    vas_map(vas, vdso_data_phys, VDSO_DATA_ADDRESS, VAS_FLAG_USER);
+
+    phys_share_page(vdso_code_phys);
+    vas_map(vas, vdso_code_phys, VDSO_CODE_ADDRESS, VAS_FLAG_USER | VAS_FLAG_EXECUTABLE);
+
+    vas_flush_tlb();
+}
@@ -115,6 +115,28 @@ int adt_hashmap_size(struct adt_hashmap* map) {
     return map->size;
 }
 
+/*
+* Calls a function on every key/value pair in the map, in no particular order. The
+* callback must not modify the map.
+*/
+void adt_hashmap_for_each(struct adt_hashmap* map, void (*callback)(void* key, void* value, void* context), void* context) {
+    for (int i = 0; i < map->num_buckets; ++i) {
+        struct adt_list* list = map->buckets[i];
+        if (list == NULL) {
+            continue;
+        }
+
+        adt_list_reset(list);
+        while (adt_list_has_next(list)) {
+            struct node* item = adt_list_get_next(list);
+
+            if (item != NULL) {
+                callback(item->key, item->value, context);
+            }
+        }
+    }
+}
+
 uint32_t adt_hashmap_null_terminated_string_hash_function(void* arg) {
     char* string = (char*) arg;
 
@@ -1,24 +1,88 @@
 #include <cpu.h>
 #include <arch.h>
-
-static int cpu_count = 0;
+#include <heap.h>
+#include <string.h>
+#include <thread.h>
+#include <spinlock.h>
+#include <assert.h>
+#include <machine/config.h>
 
 /*
-* The virtual memory manager (arch_virt_init) is responsible for initialising this.
-*/ 
-struct cpu* current_cpu;
+* util/cpu.c - CPUs
+*
+* Keeps track of the CPUs on the system, and starts them up one at a time.
+*/
+
+static volatile int cpu_count = 0;
+static struct cpu* cpus[ARCH_MAX_CPU_ALLOWED];
 
 int cpu_get_count(void) {
     return cpu_count;
 }
 
+struct cpu* cpu_get(int cpu_number) {
+    assert(cpu_number >= 0 && cpu_number < cpu_count);
+    return cpus[cpu_number];
+}
+
+int cpu_get_current_number(void) {
+    /*
+    * The bootstrap CPU is only counted once it is fully initialised, but it is the
+    * only one running before then.
+    */
+    return cpu_count == 0 ? 0 : current_cpu->cpu_number;
+}
+
+/*
+* Allocates the structure for the next CPU to be initialised.
+*/
+static struct cpu* cpu_allocate(void) {
+    struct cpu* cpu = malloc(sizeof(struct cpu));
+    memset(cpu, 0, sizeof(struct cpu));
+    cpu->cpu_number = cpu_count;
+    cpus[cpu_count] = cpu;
+    return cpu;
+}
+
 void cpu_init(void) {
-    arch_cpu_initialise_bootstrap();
+    arch_cpu_initialise_bootstrap(cpu_allocate());
     cpu_count++;
 
-    // TODO: other CPUs
-    // arch_next_cpu_initialise();
-    // cpu_count++;
-	
-    arch_all_cpus_are_done();
-}
\ No newline at end of file
+    arch_bootstrap_cpu_is_done();
+}
+
+void cpu_start_others(void) {
+    while (cpu_count < ARCH_MAX_CPU_ALLOWED) {
+        struct cpu* cpu = cpu_allocate();
+
+        if (!arch_start_next_cpu(cpu)) {
+            cpus[cpu->cpu_number] = NULL;
+            free(cpu);
+            break;
+        }
+
+        /*
+        * Only one CPU can be started at a time, as they use cpu_get_count() to work
+        * out their number.
+        */
+        while (cpu_count == cpu->cpu_number) {
+            arch_stall_processor();
+        }
+    }
+}
+
+void cpu_ap_main(void) {
+    thread_init_ap();
+    cpu_count++;
+    arch_enable_interrupts();
+
+    /*
+    * As with the bootstrap CPU, we're on a stack that isn't used by anything else, so
+    * the idle thread (and everything else) will take over from here.
+    */
+    while (1) {
+        spinlock_acquire(&scheduler_lock);
+        thread_block(THREAD_STATE_UNINTERRUPTIBLE);
+        spinlock_release(&scheduler_lock);
+    }
+}
@@ -38,7 +38,7 @@ static int validate_copy(const void* user_addr, size_t size, bool write) {
     * being accessed.
     */
     size_t initial_page = initial_address / ARCH_PAGE_SIZE;
-    size_t pages = (size + ARCH_PAGE_SIZE - 1) / ARCH_PAGE_SIZE;
+    size_t pages = size == 0 ? 0 : (final_address - 1) / ARCH_PAGE_SIZE - initial_page + 1;
 
     for (size_t i = 0; i < pages; ++i) {
         size_t page = initial_page + i;
@@ -48,25 +48,20 @@ static int validate_copy(const void* user_addr, size_t size, bool write) {
 
         arch_vas_get_entry(vas_get_current_vas(), page * ARCH_PAGE_SIZE, &phys, &flags);
 
-        if (!(flags & VAS_FLAG_PRESENT)) {
-            // need to check if on the disk or not, or COW, etc.
-            //
-            // the easiest way might be to set a flag + struct telling the page fault handler to come
-            // back here on the next page fault (clear the flag after we're done), and then we can just
-            // touch the page and let the pf handler load it in if needed.
-
-            // do some kind of lock...
-            // setjmp...
-            // tell the pf handler about the setjmp struct
-            // touch the memory
-            // check if the pf handler said "now that's bad" (i.e. read a flag)
-            // stop telling the pf handler about the setjmp struct
-            // unlock...
-            // if "now that's bad", return EINVAL
-
-            return ENOSYS;
+        /*
+        * The page might not be there yet (e.g. it's on disk, or yet to be allocated), or it
+        * might be copy on write. Either way, let the page fault handler sort it out before we
+        * touch it, as if usermode had accessed it itself.
+        */
+        if (!(flags & VAS_FLAG_PRESENT) || (write && (flags & VAS_FLAG_COPY_ON_WRITE))) {
+            int status = arch_resolve_page_fault(page * ARCH_PAGE_SIZE, write);
+            if (status != 0) {
+                return EINVAL;
+            }
+
+            arch_vas_get_entry(vas_get_current_vas(), page * ARCH_PAGE_SIZE, &phys, &flags);
         }
-        
+
         /*
         * If it is kernel-only memory, we can't allow usermode to access it. 
         */
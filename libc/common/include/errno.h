@@ -41,6 +41,7 @@
 #define ENFILE          25          // Too many open files in system
 #define EPIPE           26          // Broken pipe
 #define ESPIPE          27          // Illegal seek
+#define ESRCH           28          // No such process
 
 #ifndef COMPILE_KERNEL
 
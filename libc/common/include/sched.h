@@ -0,0 +1,34 @@
+#pragma once
+
+#include <sys/types.h>
+
+/*
+* Scheduling policies. SCHED_FIFO and SCHED_RR threads are real-time: they always run
+* before SCHED_OTHER threads, and the highest priority one always runs first. SCHED_FIFO
+* threads run until they block or yield, while SCHED_RR threads take turns with other
+* threads of the same priority.
+*/
+#define SCHED_OTHER         0
+#define SCHED_FIFO          1
+#define SCHED_RR            2
+
+/*
+* Real-time priorities. Higher numbers are more important. SCHED_OTHER threads must use
+* a priority of 0.
+*/
+#define SCHED_RT_PRIORITY_MIN   1
+#define SCHED_RT_PRIORITY_MAX   99
+
+struct sched_param {
+    int sched_priority;
+};
+
+#ifndef COMPILE_KERNEL
+int sched_setscheduler(pid_t pid, int policy, const struct sched_param* param);
+int sched_getscheduler(pid_t pid);
+int sched_getparam(pid_t pid, struct sched_param* param);
+int sched_get_priority_min(int policy);
+int sched_get_priority_max(int policy);
+int sched_yield(void);
+int sched_getcpu(void);
+#endif
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+* The types of page fault.
+*/
+#define FAULT_ALLOCATE_ON_ACCESS    0       /* The first access to memory that hasn't been allocated yet */
+#define FAULT_COPY_ON_WRITE         1       /* Writing to memory that is shared with another process */
+#define FAULT_SWAP_IN               2       /* Accessing memory that was swapped out to disk */
+#define FAULT_OTHER                 3       /* Anything else, including invalid accesses */
+#define FAULT_NUM_TYPES             4
+
+/*
+* Whose page faults to report.
+*/
+#define FAULTSTAT_PROCESS           0
+#define FAULTSTAT_SYSTEM            1
+
+struct faultstat {
+    uint64_t faults[FAULT_NUM_TYPES];
+    uint64_t cycles[FAULT_NUM_TYPES];   /* Time spent handling each type, in CPU timestamp ticks */
+    uint64_t swap_ins;
+    uint64_t swap_outs;                 /* For a process, the pages of its that were swapped out */
+    uint64_t tlb_flushes;               /* For a process, only those done while handling its page faults */
+};
+
+#ifndef COMPILE_KERNEL
+int faultstat(struct faultstat* stat, int which);
+#endif
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+* How much memory a process is using, in bytes. Limits are 0 if there is no limit. Pages
+* shared with another process (e.g. after forking) count towards both.
+*/
+struct memstat {
+    size_t resident;        /* User memory in RAM */
+    size_t swapped;         /* User memory that has been swapped out to disk */
+    size_t page_tables;     /* Memory used for the process' page tables */
+    size_t soft_limit;      /* Above this, the process' memory is swapped out first */
+    size_t hard_limit;      /* The most user memory the process can have in RAM */
+};
+
+#ifndef COMPILE_KERNEL
+int memstat(struct memstat* stat);
+int setmemlimit(size_t soft_limit, size_t hard_limit);
+#endif
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+* Advice for madvise()
+*/
+#define MADV_NORMAL         0       /* No special treatment */
+#define MADV_RANDOM         1       /* Expect random access, so don't bring in neighbouring pages */
+#define MADV_SEQUENTIAL     2       /* Expect sequential access, so bring in pages ahead of time */
+#define MADV_WILLNEED       3       /* Bring in any pages that are on disk now */
+#define MADV_DONTNEED       4       /* Discard the (writable, anonymous) pages - they will be zero the next time they are used */
+
+#ifndef COMPILE_KERNEL
+int madvise(void* addr, size_t length, int advice);
+int mlock(const void* addr, size_t length);
+int munlock(const void* addr, size_t length);
+#endif
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+* Scheduling statistics for a thread. Times are in nanoseconds.
+*/
+struct schedstat {
+    uint64_t runtime_ns;                /* Time spent running */
+    uint64_t wait_ns;                   /* Time spent ready to run, but waiting for a turn */
+    uint64_t vruntime_ns;               /* Runtime scaled by the thread's weight (fair threads only) */
+    uint64_t switches;                  /* Times it was switched in */
+    uint64_t wakeups;                   /* Times it was woken up after blocking or sleeping */
+    uint64_t wakeup_latency_ns;         /* Total time from being woken up to actually running */
+    uint64_t max_wakeup_latency_ns;
+    uint64_t migrations;                /* Times it was moved to another CPU */
+};
+
+#ifndef COMPILE_KERNEL
+int schedstat(struct schedstat* stat);
+#endif
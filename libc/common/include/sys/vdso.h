@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+* The kernel maps a page of data, and a page of code that reads it, into every program at
+* these addresses. The kernel keeps the data up to date, so that things like the time can
+* be found without a system call.
+*/
+#define VDSO_DATA_ADDRESS       0xBFFFE000
+#define VDSO_CODE_ADDRESS       0xBFFFF000
+
+/*
+* The functions in the code page start at these addresses, and use the normal C calling
+* convention.
+*
+* uint64_t get_time_since_boot(void)
+*       Returns the number of nanoseconds since boot, or 0 if the time can only be got
+*       with a system call (e.g. if the timestamp counter can't be used).
+*
+* int get_cpu(void)
+*       Returns the number of the CPU it ran on (which could have changed by the time it
+*       returns).
+*/
+#define VDSO_GET_TIME_SINCE_BOOT    (VDSO_CODE_ADDRESS + 0x00)
+#define VDSO_GET_CPU                (VDSO_CODE_ADDRESS + 0x08)
+
+/*
+* The layout of the data page. The sequence is odd while the kernel is changing the clock
+* fields, and so they must be read again if it was odd, or if it changes while they are
+* being read. The time since boot is then:
+*
+*     base_time + (((timestamp - base_timestamp) * multiplier) >> shift)
+*
+* The code page relies on these offsets.
+*/
+struct vdso_data {
+    uint32_t sequence;                  /* offset 0  */
+    uint32_t use_timestamp;             /* offset 4  */
+    uint64_t base_timestamp;            /* offset 8  */
+    uint64_t base_time;                 /* offset 16 */
+    uint64_t multiplier;                /* offset 24 */
+    uint32_t shift;                     /* offset 32 */
+    uint32_t page_size;                 /* offset 36 */
+    uint64_t boot_wall_time;            /* offset 40, nanoseconds since 1970 (UTC) */
+};
@@ -14,7 +14,18 @@ enum SyscallNumber {
     SYSCALL_DUP2,
     SYSCALL_DUP3,
     SYSCALL_TCGETATTR,
-    SYSCALL_TCSETATTR
+    SYSCALL_TCSETATTR,
+    SYSCALL_MADVISE,
+    SYSCALL_MLOCK,
+    SYSCALL_MUNLOCK,
+    SYSCALL_MEMSTAT,
+    SYSCALL_FAULTSTAT,
+    SYSCALL_NANOSLEEP,
+    SYSCALL_SCHEDSTAT,
+    SYSCALL_SCHED_SETSCHEDULER,
+    SYSCALL_SCHED_GETSCHEDULER,
+    SYSCALL_CLOCK_GETTIME,
+    SYSCALL_SETMEMLIMIT
 };
 
 #ifndef COMPILE_KERNEL
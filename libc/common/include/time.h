@@ -0,0 +1,20 @@
+#pragma once
+
+#include <sys/types.h>
+
+struct timespec {
+    time_t tv_sec;
+    long tv_nsec;
+};
+
+/*
+* CLOCK_REALTIME is the time since 1970 (UTC), and CLOCK_MONOTONIC is the time since
+* boot, which never goes backwards.
+*/
+#define CLOCK_REALTIME      0
+#define CLOCK_MONOTONIC     1
+
+#ifndef COMPILE_KERNEL
+int nanosleep(const struct timespec* req, struct timespec* rem);
+int clock_gettime(clockid_t clock_id, struct timespec* tp);
+#endif
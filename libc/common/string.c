@@ -210,6 +210,8 @@ char* strerror(int err)
         return "Broken pipe";
     case ESPIPE:
         return "Invalid seek";
+    case ESRCH:
+        return "No such process";
 	default:
 		return "Unknown error";
 	}
@@ -0,0 +1,14 @@
+#include <sys/faultstat.h>
+#include <errno.h>
+#include <syscallnum.h>
+
+int faultstat(struct faultstat* stat, int which) {
+    int result = _system_call(SYSCALL_FAULTSTAT, (size_t) stat, which, 0, 0);
+
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+
+    return 0;
+}
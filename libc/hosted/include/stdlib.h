@@ -11,6 +11,7 @@ _Noreturn void exit(int status);
 void* malloc(size_t size);
 void free(void *ptr);
 void* calloc(size_t nmemb, size_t size);
+void* realloc(void* ptr, size_t size);
 
 int rand(void);
 void srand(unsigned int seed);
\ No newline at end of file
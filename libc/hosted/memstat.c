@@ -0,0 +1,14 @@
+#include <sys/memstat.h>
+#include <errno.h>
+#include <syscallnum.h>
+
+int memstat(struct memstat* stat) {
+    int result = _system_call(SYSCALL_MEMSTAT, (size_t) stat, 0, 0, 0);
+
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,36 @@
+#include <sys/mman.h>
+#include <errno.h>
+#include <syscallnum.h>
+
+int madvise(void* addr, size_t length, int advice) {
+    int result = _system_call(SYSCALL_MADVISE, (size_t) addr, length, advice, 0);
+
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+
+    return 0;
+}
+
+int mlock(const void* addr, size_t length) {
+    int result = _system_call(SYSCALL_MLOCK, (size_t) addr, length, 0, 0);
+
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+
+    return 0;
+}
+
+int munlock(const void* addr, size_t length) {
+    int result = _system_call(SYSCALL_MUNLOCK, (size_t) addr, length, 0, 0);
+
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include <sched.h>
+#include <errno.h>
+#include <syscallnum.h>
+#include <sys/vdso.h>
+
+int sched_setscheduler(pid_t pid, int policy, const struct sched_param* param) {
+    int result = _system_call(SYSCALL_SCHED_SETSCHEDULER, pid, policy, (size_t) param, 0);
+
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+
+    return 0;
+}
+
+int sched_getscheduler(pid_t pid) {
+    int policy;
+    int result = _system_call(SYSCALL_SCHED_GETSCHEDULER, pid, (size_t) &policy, 0, 0);
+
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+
+    return policy;
+}
+
+int sched_getparam(pid_t pid, struct sched_param* param) {
+    int result = _system_call(SYSCALL_SCHED_GETSCHEDULER, pid, 0, (size_t) param, 0);
+
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+
+    return 0;
+}
+
+int sched_get_priority_min(int policy) {
+    if (policy == SCHED_FIFO || policy == SCHED_RR) {
+        return SCHED_RT_PRIORITY_MIN;
+    }
+    if (policy == SCHED_OTHER) {
+        return 0;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+int sched_get_priority_max(int policy) {
+    if (policy == SCHED_FIFO || policy == SCHED_RR) {
+        return SCHED_RT_PRIORITY_MAX;
+    }
+    if (policy == SCHED_OTHER) {
+        return 0;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+int sched_yield(void) {
+    _system_call(SYSCALL_YIELD, 0, 0, 0, 0);
+    return 0;
+}
+
+/*
+* Comes from the vDSO, so it doesn't need a system call.
+*/
+int sched_getcpu(void) {
+    int (*get_cpu)(void) = (int (*)(void)) VDSO_GET_CPU;
+    return get_cpu();
+}
@@ -0,0 +1,14 @@
+#include <sys/schedstat.h>
+#include <errno.h>
+#include <syscallnum.h>
+
+int schedstat(struct schedstat* stat) {
+    int result = _system_call(SYSCALL_SCHEDSTAT, (size_t) stat, 0, 0, 0);
+
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,14 @@
+#include <sys/memstat.h>
+#include <errno.h>
+#include <syscallnum.h>
+
+int setmemlimit(size_t soft_limit, size_t hard_limit) {
+    int result = _system_call(SYSCALL_SETMEMLIMIT, soft_limit, hard_limit, 0, 0);
+
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+
+    return 0;
+}
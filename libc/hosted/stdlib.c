@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <sys/mman.h>
 
 uint64_t rand_seed = 1;
 
@@ -32,44 +33,500 @@ _Noreturn void exit(int status) {
     }
 }
 
-void* malloc(size_t size) {
-    // TODO: use an actual allocator
+/*
+* Memory allocation
+*
+* Memory is taken from the system in segments, which are SEGMENT_SIZE bytes long and
+* aligned to SEGMENT_SIZE, so the segment a pointer belongs to can be found by rounding
+* the pointer down. Each segment starts with a header saying what it is used for:
+*
+*   - small segments hold objects of a single size class (up to SMALL_MAX_SIZE bytes).
+*     Freed objects go onto a free list for their size class.
+*
+*   - medium segments are split into blocks with boundary tags, so neighbouring free
+*     blocks can be coalesced. Once a medium segment is entirely free, it is given back
+*     to the pool of free segments.
+*
+*   - large allocations get one or more segments to themselves, and go back to the pool
+*     of free segments when they are freed.
+*
+* Free segments at the top of the heap are given back to the system if it supports
+* shrinking the system break, otherwise they are kept for reuse (but the memory in
+* them is still given back with madvise).
+*/
 
-    if (size == 0) {
-        errno = ENOMEM;
-        while (1) {
-            ;
-        }
+#define SEGMENT_SIZE            (64 * 1024)
+#define ALIGNMENT               16
+#define SMALL_MAX_SIZE          256
+#define NUM_SMALL_CLASSES       (SMALL_MAX_SIZE / ALIGNMENT)
+#define MEDIUM_MAX_SIZE         (SEGMENT_SIZE / 4)
+
+#define SEGMENT_SMALL           1
+#define SEGMENT_MEDIUM          2
+#define SEGMENT_LARGE           3
+#define SEGMENT_FREE            4
+
+#define SEGMENT_HEADER_SIZE     32
+#define PAGE_SIZE               4096
+
+struct segment {
+    int type;
+    int size_class;             /* small segments */
+    size_t num_segments;        /* large and free segments */
+    struct segment* next;       /* free segments */
+    size_t carve_offset;        /* small segments: where the next never-used object is */
+    size_t reserved[2];
+
+    /*
+    * Medium segments use this as an allocated boundary tag for the first block, so it
+    * doesn't try to coalesce backwards out of the segment. Must be the last word.
+    */
+    size_t boundary_tag;
+};
+
+_Static_assert(sizeof(struct segment) == SEGMENT_HEADER_SIZE, "segment header is the wrong size");
+
+/*
+* Medium block layout (all sizes are in bytes, and a multiple of ALIGNMENT):
+*
+* word 0:   size of the block, low bit set if allocated
+* word 2:   (of a free block) next free block
+* word 3:   (of a free block) prev free block
+* ...
+* word n:   copy of word 0
+*
+* The data starts after the first ALIGNMENT bytes.
+*/
+#define MEDIUM_HEADER_SIZE      ALIGNMENT
+#define MEDIUM_ALLOCATED        1
+#define MEDIUM_NEXT_INDEX       2
+#define MEDIUM_PREV_INDEX       3
+#define MEDIUM_MINIMUM_SIZE     (ALIGNMENT * 2)
+#define MEDIUM_SENTINEL_SIZE    ALIGNMENT
+#define MEDIUM_FREE_SPACE       (SEGMENT_SIZE - SEGMENT_HEADER_SIZE - MEDIUM_SENTINEL_SIZE)
+
+#define GET_MEDIUM_SIZE(blk)    ((blk)[0] & ~MEDIUM_ALLOCATED)
+#define IS_MEDIUM_FREE(blk)     (!((blk)[0] & MEDIUM_ALLOCATED))
+
+static void* small_free_lists[NUM_SMALL_CLASSES];
+static struct segment* small_carving_segments[NUM_SMALL_CLASSES];
+static size_t* medium_free_list = NULL;
+static struct segment* free_segments = NULL;    /* sorted by address */
+static size_t heap_top = 0;
+static bool can_shrink_heap = true;             /* cleared if the system can't shrink the break */
+
+static int change_system_break(size_t bytes, bool shrink, size_t* prev_break, size_t* new_break) {
+    return _system_call(SYSCALL_SBRK, bytes, shrink, (size_t) prev_break, (size_t) new_break);
+}
+
+/*
+* Lets the system have the memory in a free segment back (apart from its header, which we
+* still need), without giving up the address range. It will be full of zeros the next time
+* it is used. Not being able to do this is harmless, so errors are ignored.
+*/
+static void release_segment_memory(struct segment* seg) {
+    _system_call(SYSCALL_MADVISE, (size_t) seg + PAGE_SIZE, seg->num_segments * SEGMENT_SIZE - PAGE_SIZE, MADV_DONTNEED, 0);
+}
+
+/*
+* Gets new, segment aligned memory from the system.
+*/
+static struct segment* grow_heap(size_t num_segments) {
+    size_t prev_break;
+    size_t current_break;
+
+    if (change_system_break(0, false, &prev_break, &current_break) != 0) {
         return NULL;
     }
 
-    static size_t recent_sbrk = 0;
-    static size_t allocation_position = 0;
+    size_t start = (current_break + SEGMENT_SIZE - 1) & ~(SEGMENT_SIZE - 1);
+    size_t bytes_needed = start - current_break + num_segments * SEGMENT_SIZE;
 
-    size = size + (16 - (size % 16)) % 16;
+    if (num_segments > (SIZE_MAX - SEGMENT_SIZE) / SEGMENT_SIZE || change_system_break(bytes_needed, false, &prev_break, &current_break) != 0) {
+        return NULL;
+    }
 
-    if (allocation_position == 0 || allocation_position + size >= recent_sbrk) {
-        size_t prev_sbrk, current_sbrk;
-        int result = _system_call(SYSCALL_SBRK, (size_t) size * 2, 0, (size_t) &prev_sbrk, (size_t) &current_sbrk);
-        if (result != 0) {
-            errno = result;
+    heap_top = start + num_segments * SEGMENT_SIZE;
+    return (struct segment*) start;
+}
+
+/*
+* Gives free segments at the very top of the heap back to the system. If the system
+* can't shrink the break, they just stay in the free list, and this stops trying.
+*/
+static void trim_heap(void) {
+    struct segment* prev = NULL;
+    struct segment* last = free_segments;
+
+    if (last == NULL || !can_shrink_heap) {
+        return;
+    }
+
+    while (last->next != NULL) {
+        prev = last;
+        last = last->next;
+    }
+
+    size_t bytes = last->num_segments * SEGMENT_SIZE;
+    if ((size_t) last + bytes != heap_top) {
+        return;
+    }
+
+    size_t prev_break;
+    size_t current_break;
+    if (change_system_break(0, false, &prev_break, &current_break) != 0 || current_break != heap_top) {
+        return;
+    }
+
+    int status = change_system_break(bytes, true, &prev_break, &current_break);
+    if (status != 0) {
+        if (status == ENOSYS) {
+            can_shrink_heap = false;
+        }
+        return;
+    }
+
+    heap_top = current_break;
+    if (prev == NULL) {
+        free_segments = NULL;
+    } else {
+        prev->next = NULL;
+    }
+}
+
+static struct segment* allocate_segments(size_t num_segments, int type) {
+    struct segment* prev = NULL;
+    struct segment* seg = free_segments;
+
+    while (seg != NULL && seg->num_segments < num_segments) {
+        prev = seg;
+        seg = seg->next;
+    }
+
+    if (seg == NULL) {
+        seg = grow_heap(num_segments);
+        if (seg == NULL) {
             return NULL;
         }
 
-        allocation_position = prev_sbrk;
-        recent_sbrk = current_sbrk;
+    } else {
+        struct segment* replacement = seg->next;
+
+        if (seg->num_segments > num_segments) {
+            replacement = (struct segment*) ((size_t) seg + num_segments * SEGMENT_SIZE);
+            replacement->type = SEGMENT_FREE;
+            replacement->num_segments = seg->num_segments - num_segments;
+            replacement->next = seg->next;
+        }
+
+        if (prev == NULL) {
+            free_segments = replacement;
+        } else {
+            prev->next = replacement;
+        }
+    }
+
+    seg->type = type;
+    seg->num_segments = num_segments;
+    seg->next = NULL;
+    return seg;
+}
+
+static void free_segment(struct segment* seg) {
+    seg->type = SEGMENT_FREE;
+
+    struct segment* prev = NULL;
+    struct segment* next = free_segments;
+    while (next != NULL && next < seg) {
+        prev = next;
+        next = next->next;
+    }
+
+    seg->next = next;
+    if (next != NULL && (size_t) seg + seg->num_segments * SEGMENT_SIZE == (size_t) next) {
+        seg->num_segments += next->num_segments;
+        seg->next = next->next;
+    }
+
+    if (prev == NULL) {
+        free_segments = seg;
+
+    } else if ((size_t) prev + prev->num_segments * SEGMENT_SIZE == (size_t) seg) {
+        prev->num_segments += seg->num_segments;
+        prev->next = seg->next;
+        seg = prev;
+
+    } else {
+        prev->next = seg;
+    }
+
+    trim_heap();
+
+    /*
+    * If it couldn't be given back entirely, at least give back the memory.
+    */
+    if ((size_t) seg < heap_top) {
+        release_segment_memory(seg);
+    }
+}
+
+static struct segment* get_segment(void* ptr) {
+    return (struct segment*) (((size_t) ptr) & ~(SEGMENT_SIZE - 1));
+}
+
+static void* allocate_small(size_t size) {
+    int size_class = (size - 1) / ALIGNMENT;
+    size_t object_size = (size_class + 1) * ALIGNMENT;
+
+    void* object = small_free_lists[size_class];
+    if (object != NULL) {
+        small_free_lists[size_class] = *((void**) object);
+        return object;
+    }
+
+    struct segment* seg = small_carving_segments[size_class];
+    if (seg == NULL || seg->carve_offset + object_size > SEGMENT_SIZE) {
+        seg = allocate_segments(1, SEGMENT_SMALL);
+        if (seg == NULL) {
+            return NULL;
+        }
+        seg->size_class = size_class;
+        seg->carve_offset = SEGMENT_HEADER_SIZE;
+        small_carving_segments[size_class] = seg;
+    }
+
+    object = (void*) ((size_t) seg + seg->carve_offset);
+    seg->carve_offset += object_size;
+    return object;
+}
+
+static void free_small(struct segment* seg, void* ptr) {
+    *((void**) ptr) = small_free_lists[seg->size_class];
+    small_free_lists[seg->size_class] = ptr;
+}
+
+static void set_medium_size(size_t* block, size_t size, bool allocated) {
+    block[0] = size | (allocated ? MEDIUM_ALLOCATED : 0);
+    block[size / sizeof(size_t) - 1] = block[0];
+}
+
+static void add_medium_to_free_list(size_t* block) {
+    block[MEDIUM_NEXT_INDEX] = (size_t) medium_free_list;
+    block[MEDIUM_PREV_INDEX] = 0;
+    if (medium_free_list != NULL) {
+        medium_free_list[MEDIUM_PREV_INDEX] = (size_t) block;
+    }
+    medium_free_list = block;
+}
+
+static void remove_medium_from_free_list(size_t* block) {
+    size_t* next = (size_t*) block[MEDIUM_NEXT_INDEX];
+    size_t* prev = (size_t*) block[MEDIUM_PREV_INDEX];
+
+    if (prev == NULL) {
+        medium_free_list = next;
+    } else {
+        prev[MEDIUM_NEXT_INDEX] = (size_t) next;
     }
-    
-    size_t result = allocation_position;
-    allocation_position += size;
 
-    return (void*) result;
+    if (next != NULL) {
+        next[MEDIUM_PREV_INDEX] = (size_t) prev;
+    }
+}
+
+/*
+* Takes the first part of a free block for an allocation, putting any leftover
+* space back on the free list. The block must already be off the free list.
+*/
+static void split_medium(size_t* block, size_t size) {
+    size_t block_size = GET_MEDIUM_SIZE(block);
+
+    if (block_size - size >= MEDIUM_MINIMUM_SIZE) {
+        size_t* leftover = block + size / sizeof(size_t);
+        set_medium_size(leftover, block_size - size, false);
+        add_medium_to_free_list(leftover);
+        block_size = size;
+    }
+
+    set_medium_size(block, block_size, true);
+}
+
+static size_t get_medium_block_size(size_t size) {
+    return (size + MEDIUM_HEADER_SIZE + sizeof(size_t) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+static void* allocate_medium(size_t size) {
+    size = get_medium_block_size(size);
+
+    size_t* block = medium_free_list;
+    while (block != NULL && GET_MEDIUM_SIZE(block) < size) {
+        block = (size_t*) block[MEDIUM_NEXT_INDEX];
+    }
+
+    if (block == NULL) {
+        struct segment* seg = allocate_segments(1, SEGMENT_MEDIUM);
+        if (seg == NULL) {
+            return NULL;
+        }
+
+        seg->boundary_tag = SEGMENT_HEADER_SIZE | MEDIUM_ALLOCATED;
+
+        size_t* end_sentinel = (size_t*) ((size_t) seg + SEGMENT_SIZE - MEDIUM_SENTINEL_SIZE);
+        set_medium_size(end_sentinel, MEDIUM_SENTINEL_SIZE, true);
+
+        block = (size_t*) ((size_t) seg + SEGMENT_HEADER_SIZE);
+        set_medium_size(block, MEDIUM_FREE_SPACE, false);
+
+    } else {
+        remove_medium_from_free_list(block);
+    }
+
+    split_medium(block, size);
+    return (void*) ((size_t) block + MEDIUM_HEADER_SIZE);
 }
 
-void free(void *ptr) {
-    (void) ptr;
+static void free_medium(void* ptr) {
+    size_t* block = (size_t*) ((size_t) ptr - MEDIUM_HEADER_SIZE);
+    size_t size = GET_MEDIUM_SIZE(block);
+
+    size_t* next = block + size / sizeof(size_t);
+    if (IS_MEDIUM_FREE(next)) {
+        remove_medium_from_free_list(next);
+        size += GET_MEDIUM_SIZE(next);
+    }
+
+    size_t prev_size = *(block - 1) & ~MEDIUM_ALLOCATED;
+    if (!(*(block - 1) & MEDIUM_ALLOCATED)) {
+        block -= prev_size / sizeof(size_t);
+        remove_medium_from_free_list(block);
+        size += prev_size;
+    }
+
+    if (size == MEDIUM_FREE_SPACE) {
+        free_segment(get_segment(block));
+        return;
+    }
+
+    set_medium_size(block, size, false);
+    add_medium_to_free_list(block);
+}
+
+static void* allocate_large(size_t size) {
+    if (size > SIZE_MAX - SEGMENT_SIZE * 2) {
+        return NULL;
+    }
+
+    size_t num_segments = (size + SEGMENT_HEADER_SIZE + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+    struct segment* seg = allocate_segments(num_segments, SEGMENT_LARGE);
+    if (seg == NULL) {
+        return NULL;
+    }
+
+    return (void*) ((size_t) seg + SEGMENT_HEADER_SIZE);
+}
+
+/*
+* Returns the number of bytes that can actually be used in an allocation.
+*/
+static size_t get_usable_size(void* ptr) {
+    struct segment* seg = get_segment(ptr);
+
+    if (seg->type == SEGMENT_SMALL) {
+        return (seg->size_class + 1) * ALIGNMENT;
+
+    } else if (seg->type == SEGMENT_MEDIUM) {
+        size_t* block = (size_t*) ((size_t) ptr - MEDIUM_HEADER_SIZE);
+        return GET_MEDIUM_SIZE(block) - MEDIUM_HEADER_SIZE - sizeof(size_t);
+
+    } else {
+        return seg->num_segments * SEGMENT_SIZE - SEGMENT_HEADER_SIZE;
+    }
+}
+
+void* malloc(size_t size) {
+    void* ptr;
+
+    /*
+    * A zero sized allocation still needs to return a unique pointer.
+    */
+    if (size == 0) {
+        size = 1;
+    }
+
+    if (size <= SMALL_MAX_SIZE) {
+        ptr = allocate_small(size);
+
+    } else if (size <= MEDIUM_MAX_SIZE) {
+        ptr = allocate_medium(size);
+
+    } else {
+        ptr = allocate_large(size);
+    }
+
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+
+    return ptr;
+}
+
+void free(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    struct segment* seg = get_segment(ptr);
+
+    if (seg->type == SEGMENT_SMALL) {
+        free_small(seg, ptr);
+
+    } else if (seg->type == SEGMENT_MEDIUM) {
+        free_medium(ptr);
+
+    } else if (seg->type == SEGMENT_LARGE) {
+        free_segment(seg);
+    }
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    size_t old_size = get_usable_size(ptr);
+    if (size <= old_size && (size > SMALL_MAX_SIZE || get_segment(ptr)->type == SEGMENT_SMALL)) {
+        return ptr;
+    }
+
+    /*
+    * Try to grow a medium block in place, by taking space from the block after it.
+    */
+    if (get_segment(ptr)->type == SEGMENT_MEDIUM && size <= MEDIUM_MAX_SIZE) {
+        size_t* block = (size_t*) ((size_t) ptr - MEDIUM_HEADER_SIZE);
+        size_t* next = block + GET_MEDIUM_SIZE(block) / sizeof(size_t);
+        size_t needed = get_medium_block_size(size);
+
+        if (IS_MEDIUM_FREE(next) && GET_MEDIUM_SIZE(block) + GET_MEDIUM_SIZE(next) >= needed) {
+            remove_medium_from_free_list(next);
+            set_medium_size(block, GET_MEDIUM_SIZE(block) + GET_MEDIUM_SIZE(next), false);
+            split_medium(block, needed);
+            return ptr;
+        }
+    }
+
+    void* new_ptr = malloc(size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
 
-    // TODO: implement
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    free(ptr);
+    return new_ptr;
 }
 
 void* calloc(size_t nmemb, size_t size) {
@@ -0,0 +1,49 @@
+#include <time.h>
+#include <errno.h>
+#include <syscallnum.h>
+#include <sys/vdso.h>
+
+int nanosleep(const struct timespec* req, struct timespec* rem) {
+    /*
+    * Sleeps can't be interrupted, so there is never any time remaining.
+    */
+    (void) rem;
+
+    int result = _system_call(SYSCALL_NANOSLEEP, (size_t) req, 0, 0, 0);
+
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+* The vDSO can usually work out the time without a system call.
+*/
+int clock_gettime(clockid_t clock_id, struct timespec* tp) {
+    if (clock_id == CLOCK_REALTIME || clock_id == CLOCK_MONOTONIC) {
+        uint64_t (*get_time_since_boot)(void) = (uint64_t (*)(void)) VDSO_GET_TIME_SINCE_BOOT;
+        uint64_t time = get_time_since_boot();
+
+        if (time != 0) {
+            if (clock_id == CLOCK_REALTIME) {
+                time += ((const struct vdso_data*) VDSO_DATA_ADDRESS)->boot_wall_time;
+            }
+
+            tp->tv_sec = time / 1000000000ULL;
+            tp->tv_nsec = time % 1000000000ULL;
+            return 0;
+        }
+    }
+
+    int result = _system_call(SYSCALL_CLOCK_GETTIME, clock_id, (size_t) tp, 0, 0);
+
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+
+    return 0;
+}